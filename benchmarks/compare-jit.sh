@@ -0,0 +1,45 @@
+# Fails when a benchmark runs slower with the jit, its default, than with
+# --no-jit. Each one runs a few times both ways, taking turns so both see the
+# same load on the machine, and the best times count. A little noise is
+# allowed.
+# Run with: sh compare-jit.sh
+
+interpreter=${interpreter:-../bin/element}
+runs=7
+tolerance=1.05
+
+elapsed()
+{
+	start=$(date +%s%N)
+	$interpreter "$@" > /dev/null
+	end=$(date +%s%N)
+
+	echo $(( (end - start) / 1000000 ))
+}
+
+failed=0
+
+for file in $(ls *.element)
+do
+	jit=""
+	interpreted=""
+
+	for run in $(seq $runs)
+	do
+		time=$(elapsed $file)
+		if [ -z "$jit" ] || [ $time -lt $jit ]; then jit=$time; fi
+
+		time=$(elapsed --no-jit $file)
+		if [ -z "$interpreted" ] || [ $time -lt $interpreted ]; then interpreted=$time; fi
+	done
+
+	echo "$file: $jit ms with the jit, $interpreted ms without"
+
+	if awk "BEGIN { exit !($jit > $interpreted * $tolerance) }"
+	then
+		echo "    slower with the jit"
+		failed=1
+	fi
+done
+
+exit $failed
@@ -28,6 +28,7 @@ VariableNode::VariableNode(int variableType, const SourceCoords& coords)
 
 , semanticType(SMT_Global)
 , firstOccurrence(false)
+, isAssigned(false)
 , index(-1)
 {}
 
@@ -38,6 +39,7 @@ VariableNode::VariableNode(const std::string& name, const SourceCoords& coords)
 
 , semanticType(SMT_Global)
 , firstOccurrence(false)
+, isAssigned(false)
 , index(-1)
 {}
 
@@ -106,6 +108,7 @@ FunctionNode::FunctionNode(const NamedParameters& namedParameters,
 , body(body)
 
 , localVariablesCount(0)
+, usesArguments(false)
 {}
 
 FunctionNode::~FunctionNode()
@@ -73,10 +73,12 @@ struct VariableNode : public Node
 		SMT_Native,			// global variable that is defined in C/C++
 		SMT_FreeVariable,	// unbound variable that will be determined by the closure
 		SMT_LocalBoxed,		// a free variable will later be bound to this local variable
+		SMT_FreeValue,		// free variable copied into the closure, it never changes after that
 	};
 
 	SemanticType	semanticType;
 	bool			firstOccurrence;
+	bool			isAssigned; // the target of an assignment
 	int				index;
 };
 
@@ -143,6 +145,7 @@ struct FunctionNode : public Node
 
 	// Semantic information ////////////////////////////////////////////////////
 	int localVariablesCount;
+	bool usesArguments; // the body refers to $$ or $N
 	std::vector<VariableNode*> referencedVariables;
 
 	// These are the indices of the variables from the enclosing function scope
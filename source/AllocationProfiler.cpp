@@ -0,0 +1,185 @@
+#include "AllocationProfiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include "VirtualMachine.h"
+
+namespace element
+{
+
+AllocationProfiler::AllocationProfiler(VirtualMachine& vm)
+: mVirtualMachine(vm)
+, mRunning(false)
+, mSampleInterval(1)
+, mBytesUntilSample(1)
+, mTotalBytes(0)
+{
+}
+
+AllocationProfiler::~AllocationProfiler()
+{
+	Stop();
+}
+
+void AllocationProfiler::Start(unsigned sampleInterval)
+{
+	mSampleInterval = std::max(sampleInterval, 1u);
+	mBytesUntilSample = mSampleInterval > 1 ? NextSampleDistance() : 1;
+	mRunning = true;
+
+	mVirtualMachine.GetMemoryManager().SetAllocationHook(OnAllocation, this);
+}
+
+void AllocationProfiler::Stop()
+{
+	if( ! mRunning )
+		return;
+
+	mRunning = false;
+
+	mVirtualMachine.GetMemoryManager().SetAllocationHook(nullptr, nullptr);
+}
+
+bool AllocationProfiler::IsRunning() const
+{
+	return mRunning;
+}
+
+void AllocationProfiler::Reset()
+{
+	mSites.clear();
+	mTotalBytes = 0;
+}
+
+std::vector<AllocationProfiler::SiteStats> AllocationProfiler::GetSites() const
+{
+	std::vector<SiteStats> sites;
+
+	for( const auto& kvp : mSites )
+	{
+		const SiteKey& key = kvp.first;
+
+		sites.push_back({std::get<0>(key), std::get<1>(key), std::get<3>(key),
+						 kvp.second.function, kvp.second.bytes, kvp.second.count});
+	}
+
+	std::stable_sort(sites.begin(), sites.end(), [](const SiteStats& a, const SiteStats& b)
+	{
+		return a.bytes > b.bytes;
+	});
+
+	return sites;
+}
+
+std::string AllocationProfiler::GetReport(unsigned maxLines) const
+{
+	std::vector<SiteStats> sites = GetSites();
+
+	if( maxLines > 0 && sites.size() > maxLines )
+		sites.resize(maxLines);
+
+	std::stringstream ss;
+
+	ss << "allocation profile, sampled every " << mSampleInterval << " bytes, "
+	   << std::llround(mTotalBytes) << " bytes attributed\n";
+
+	ss << std::setw(12) << "bytes" << std::setw(8) << "%" << std::setw(10) << "count"
+	   << "  " << std::left << std::setw(10) << "type" << std::setw(30) << "location" << "function\n" << std::right;
+
+	for( const SiteStats& site : sites )
+	{
+		std::string location = site.file;
+
+		if( site.line >= 0 )
+			location += ":" + std::to_string(site.line);
+
+		double percent = mTotalBytes > 0 ? 100.0 * site.bytes / mTotalBytes : 0.0;
+
+		ss << std::setw(12) << std::llround(site.bytes)
+		   << std::setw(8) << std::fixed << std::setprecision(1) << percent
+		   << std::setw(10) << std::llround(site.count)
+		   << "  " << std::left << std::setw(10) << MemoryManager::GetTypeName(site.type)
+		   << std::setw(30) << location << site.function << "\n" << std::right;
+	}
+
+	return ss.str();
+}
+
+void AllocationProfiler::OnAllocation(void* userData, const GarbageCollected* gc, unsigned bytes)
+{
+	AllocationProfiler* self = static_cast<AllocationProfiler*>(userData);
+
+	if( self->mSampleInterval == 1 )
+	{
+		self->RecordSample(gc, bytes, bytes);
+		return;
+	}
+
+	self->mBytesUntilSample -= bytes;
+
+	if( self->mBytesUntilSample > 0 )
+		return;
+
+	// a large allocation can be worth more than one sample
+	unsigned samples = 0;
+
+	while( self->mBytesUntilSample <= 0 )
+	{
+		self->mBytesUntilSample += self->NextSampleDistance();
+		++samples;
+	}
+
+	self->RecordSample(gc, bytes, samples);
+}
+
+void AllocationProfiler::RecordSample(const GarbageCollected* gc, unsigned allocated, unsigned samples)
+{
+	std::string file = "<native>";
+	std::string function = "<native>";
+	int line = -1;
+	const CodeObject* codeObject = nullptr;
+
+	const StackFrame* frame = mVirtualMachine.GetCurrentFrame();
+
+	if( frame )
+	{
+		codeObject = frame->function->codeObject;
+
+		mVirtualMachine.LocationFromFrame(frame, &line, &file);
+
+		function = "function@" + file;
+
+		if( ! codeObject->instructionLines.empty() )
+			function += ":" + std::to_string(codeObject->instructionLines.front().line);
+	}
+
+	Site& site = mSites[SiteKey(file, line, codeObject, gc->type)];
+
+	if( site.function.empty() )
+		site.function = function;
+
+	double bytes = double(samples) * mSampleInterval;
+
+	site.bytes += bytes;
+
+	// the whole object is new, otherwise one that was there grew
+	if( allocated == gc->size )
+		site.count += bytes / allocated;
+
+	mTotalBytes += bytes;
+}
+
+unsigned AllocationProfiler::NextSampleDistance()
+{
+	// exponentially distributed distances keep periodic allocation
+	// patterns from always hitting (or missing) the same sites
+	std::exponential_distribution<double> distribution(1.0 / mSampleInterval);
+
+	return unsigned(distribution(mRandom)) + 1;
+}
+
+}
@@ -0,0 +1,80 @@
+#ifndef _ALLOCATION_PROFILER_INCLUDED_
+#define _ALLOCATION_PROFILER_INCLUDED_
+
+#include <map>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Value.h"
+
+namespace element
+{
+
+class VirtualMachine;
+struct CodeObject;
+struct GarbageCollected;
+
+
+// Samples heap allocations and attributes them to the source line and
+// function that was executing when they were made. With a sampling interval
+// of N bytes, on average one allocation is recorded for every N bytes
+// allocated and stands for N bytes worth of allocations. An interval of 1
+// records every single allocation. The bytes an array, object or string
+// grows by later are allocations of the line that grew it.
+class AllocationProfiler
+{
+public:
+	struct SiteStats
+	{
+		std::string	file;
+		int			line; // -1 for natives
+		Value::Type	type;
+		std::string	function;
+		double		bytes;
+		double		count; // objects created, growing one does not add to it
+	};
+
+public:
+				AllocationProfiler(VirtualMachine& vm);
+				~AllocationProfiler();
+
+	void		Start(unsigned sampleInterval);
+	void		Stop();
+	bool		IsRunning() const;
+	void		Reset();
+
+	std::vector<SiteStats>	GetSites() const; // the most bytes first
+	std::string				GetReport(unsigned maxLines = 0) const;
+
+protected:
+	static void	OnAllocation(void* userData, const GarbageCollected* gc, unsigned bytes);
+
+	void		RecordSample(const GarbageCollected* gc, unsigned allocated, unsigned samples);
+	unsigned	NextSampleDistance();
+
+private:
+	typedef std::tuple<std::string, int, const CodeObject*, Value::Type> SiteKey;
+
+	struct Site
+	{
+		std::string	function;
+		double		bytes = 0;
+		double		count = 0;
+	};
+
+	VirtualMachine&				mVirtualMachine;
+
+	bool						mRunning;
+	unsigned					mSampleInterval;
+	long long					mBytesUntilSample;
+	std::minstd_rand			mRandom;
+
+	std::map<SiteKey, Site>		mSites;
+	double						mTotalBytes;
+};
+
+}
+
+#endif // _ALLOCATION_PROFILER_INCLUDED_
@@ -1,9 +1,14 @@
 #include "Compiler.h"
 
+#include <algorithm>
+
 #include "Logger.h"
 #include "OpCodes.h"
 #include "DataTypes.h"
 #include "AST.h"
+#include "FlowOptimizer.h"
+#include "Inliner.h"
+#include "TypeInference.h"
 
 using namespace std::string_literals;
 
@@ -15,6 +20,7 @@ Compiler::Compiler(Logger& logger)
 , mCurrentFunction(nullptr)
 , mConstantsOffset(0)
 , mSymbolsOffset(0)
+, mProfile(nullptr)
 {
 	ResetState();
 }
@@ -23,9 +29,31 @@ std::unique_ptr<char[]> Compiler::Compile(const ast::FunctionNode* node)
 {
 	BuildFunction(node, true);
 
+	Inliner inliner(mConstants, mConstantsOffset, mProfile);
+
+	for( unsigned i = mConstantsOffset; i < mConstants.size(); ++i )
+		if( mConstants[i].type == Constant::CT_CodeObject )
+			inliner.Inline(mConstants[i].codeObject, int(i));
+
+	for( unsigned i = mConstantsOffset; i < mConstants.size(); ++i )
+		if( mConstants[i].type == Constant::CT_CodeObject )
+		{
+			Optimize(mConstants[i].codeObject);
+
+			if( mProfile )
+				UseTypeFeedback(mConstants[i].codeObject, int(i));
+
+			ComputeMaxStackDepth(mConstants[i].codeObject);
+		}
+
 	return BuildBinaryData();
 }
 
+void Compiler::SetProfile(const ExecutionProfile* profile)
+{
+	mProfile = profile;
+}
+
 void Compiler::ResetState()
 {
 	mLoopContexts.clear();
@@ -245,6 +273,7 @@ void Compiler::BuildVariableLoad(const ast::Node* node, bool keepValue)
 		case ast::VariableNode::SMT_Native:			opCode = OpCode::OC_LoadNative;		break;
 		case ast::VariableNode::SMT_LocalBoxed:		opCode = OpCode::OC_LoadFromBox;	break;
 		case ast::VariableNode::SMT_FreeVariable:	opCode = OpCode::OC_LoadFromClosure;break;
+		case ast::VariableNode::SMT_FreeValue:		opCode = OpCode::OC_LoadCaptured;	break;
 		}
 
 		mCurrentFunction->instructions.emplace_back( opCode, n->index );
@@ -420,13 +449,10 @@ void Compiler::BuildBooleanOp(const ast::Node* node, bool keepValue)
 
 	EmitInstructions(n->rhs, true);
 	
-	// TODO: right now if we short-circuit an expression like 'a and b and c' at 'a'
-	// then the jump will take us to another jump at 'b' which will execute right away
-	// because there will be a 'false' on the stack from the 'a' evaluation and then
-	// one more for 'c'. If 'and' and 'or' have right-to-left associativity then the
-	// 'n->rhs' will contain all the stuff we need to jump over and we will have only
-	// one jump. This will not work if someone explicitly defines '(a and b) and c'
-	// but usually people don't do that. In Python both cases generate only one jump.
+	// If we short-circuit an expression like 'a and b and c' at 'a' the jump takes
+	// us to another jump at 'b' which will execute right away, because there will be
+	// a 'false' on the stack from the 'a' evaluation. The optimizer threads the first
+	// jump directly to the end, so there is only one jump, like in Python.
 
 	unsigned jumpTarget = mCurrentFunction->instructions.size();
 	mCurrentFunction->instructions[jumpIndex].A = jumpTarget;
@@ -455,9 +481,14 @@ void Compiler::BuildArrowOp(const ast::Node* node, bool keepValue)
 	// if we didn't keep the value, there will be a 'pop' after it
 	int callIndex = int(mCurrentFunction->instructions.size()) - (keepValue ? 1 : 2);
 
-	// A is the number of arguments used
+	// A is the number of arguments used, or the call site that knows it
 	// adjust it so that it knows about the new argument we added
-	mCurrentFunction->instructions[ callIndex ].A += 1;
+	Instruction& call = mCurrentFunction->instructions[ callIndex ];
+
+	if( call.opCode == OpCode::OC_CallMethod )
+		mCurrentFunction->callSites[ call.A ].argumentsCount += 1;
+	else
+		call.A += 1;
 }
 
 void Compiler::BuildArrayPushPop(const ast::Node* node, bool keepValue)
@@ -809,6 +840,7 @@ void Compiler::BuildFunction(const ast::Node* node, bool keepValue)
 
 	mCurrentFunction->namedParametersCount = int(n->namedParameters.size());
 	mCurrentFunction->localVariablesCount = n->localVariablesCount;
+	mCurrentFunction->usesArguments = n->usesArguments;
 	mCurrentFunction->closureMapping = n->closureMapping;
 
 	// if parameters need to be boxed, this is their first occurrence, so we box them right away
@@ -858,9 +890,37 @@ void Compiler::BuildFunctionCall(const ast::Node* node, bool keepValue)
 	for( auto argument : argsNode->arguments )
 		EmitInstructions(argument, true);
 
-	EmitInstructions(n->function, true);
+	const ast::VariableNode* methodName = nullptr;
+
+	if( n->function->type == ast::Node::N_BinaryOperator &&
+		((const ast::BinaryOperatorNode*)n->function)->op == T_Dot )
+	{
+		const ast::Node* rhs = ((const ast::BinaryOperatorNode*)n->function)->rhs;
+
+		if( rhs->type == ast::Node::N_Variable &&
+			((const ast::VariableNode*)rhs)->variableType == ast::VariableNode::V_Named )
+		{
+			methodName = (const ast::VariableNode*)rhs;
+		}
+	}
+
+	if( methodName ) // the object is passed as 'this' right away
+	{
+		EmitInstructions(((const ast::BinaryOperatorNode*)n->function)->lhs, true);
 
-	mCurrentFunction->instructions.emplace_back( OpCode::OC_FunctionCall, argsNode->arguments.size() );
+		CallSite callSite;
+		callSite.hash			= UpdateSymbol(methodName->name);
+		callSite.argumentsCount	= int(argsNode->arguments.size());
+
+		mCurrentFunction->instructions.emplace_back( OpCode::OC_CallMethod, mCurrentFunction->callSites.size() );
+		mCurrentFunction->callSites.push_back( callSite );
+	}
+	else
+	{
+		EmitInstructions(n->function, true);
+
+		mCurrentFunction->instructions.emplace_back( OpCode::OC_FunctionCall, argsNode->arguments.size() );
+	}
 
 	if( ! keepValue )
 		mCurrentFunction->instructions.emplace_back( OpCode::OC_Pop );
@@ -1034,6 +1094,457 @@ void Compiler::BuildJumpStatement(const ast::Node* node)
 	}
 }
 
+void Compiler::Optimize(CodeObject* codeObject)
+{
+	// one change can make room for another, so repeat until nothing changes
+	bool changed = true;
+	bool flowOptimized = false;
+
+	while( changed )
+	{
+		changed = ThreadJumps(codeObject);
+		changed = RemoveRedundantInstructions(codeObject) || changed;
+		changed = RemoveUnreachableCode(codeObject) || changed;
+
+		// the rest is done once, on code that is already cleaned up
+		if( ! changed && ! flowOptimized )
+		{
+			flowOptimized = true;
+			changed = FlowOptimizer(codeObject).Optimize();
+		}
+	}
+
+	// the passes above know only the instructions that check their operands
+	TypeInference(codeObject, mConstants).Specialize();
+}
+
+static std::vector<bool> FindJumpTargets(const std::vector<Instruction>& instructions)
+{
+	std::vector<bool> targets(instructions.size() + 1, false);
+
+	for( const Instruction& instruction : instructions )
+		if( IsJump(instruction.opCode) )
+			targets[instruction.A] = true;
+
+	return targets;
+}
+
+bool Compiler::ThreadJumps(CodeObject* codeObject)
+{
+	std::vector<Instruction>& instructions = codeObject->instructions;
+	const int size = int(instructions.size());
+	bool changed = false;
+
+	for( int i = 0; i < size; ++i )
+	{
+		Instruction& jump = instructions[i];
+
+		if( ! IsJump(jump.opCode) )
+			continue;
+
+		// a jump that only jumps if the value is false keeps it on the stack
+		bool keepsFalse =	jump.opCode == OpCode::OC_JumpIfFalse ||
+							jump.opCode == OpCode::OC_JumpIfFalseOrPop;
+
+		int target = jump.A;
+
+		// the count of hops is limited, so a cycle of jumps is not followed forever
+		for( int hops = 0; hops < size && target < size; ++hops )
+		{
+			const Instruction& next = instructions[target];
+			int nextTarget = -1;
+
+			if( next.opCode == OpCode::OC_Jump )
+			{
+				nextTarget = next.A;
+			}
+			else if( keepsFalse &&
+					(next.opCode == OpCode::OC_JumpIfFalse ||
+					 next.opCode == OpCode::OC_JumpIfFalseOrPop) )
+			{
+				nextTarget = next.A; // the same false value, it will jump again
+			}
+			else if(jump.opCode == OpCode::OC_JumpIfTrueOrPop &&
+					next.opCode == OpCode::OC_JumpIfTrueOrPop )
+			{
+				nextTarget = next.A; // the same true value, it will jump again
+			}
+
+			// only the plain jumps back are safe points, the conditional ones stay forward
+			if( nextTarget < 0 || nextTarget == target || (jump.opCode != OpCode::OC_Jump && nextTarget <= i) )
+				break;
+
+			target = nextTarget;
+		}
+
+		if( target != jump.A )
+		{
+			jump.A = target;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+bool Compiler::RemoveRedundantInstructions(CodeObject* codeObject)
+{
+	std::vector<Instruction>& instructions = codeObject->instructions;
+	const int size = int(instructions.size());
+
+	std::vector<bool> targets = FindJumpTargets(instructions);
+	std::vector<bool> removed(size, false);
+	bool changed = false;
+
+	// The second instruction of a pair must not be the target of a jump, it
+	// would be left without the first one. The first one can be, jumps to it
+	// go to what comes after the pair.
+	for( int i = 0; i + 1 < size; ++i )
+	{
+		Instruction& first = instructions[i];
+		Instruction& second = instructions[i + 1];
+
+		if( first.opCode == OpCode::OC_Jump && first.A == i + 1 ) // a jump to the next instruction
+		{
+			removed[i] = true;
+			changed = true;
+			continue;
+		}
+
+		if( targets[i + 1] )
+			continue;
+
+		OpCode replacement = first.opCode;
+		bool removeBoth = false;
+
+		if( (first.opCode == OpCode::OC_LoadConstant ||
+			 first.opCode == OpCode::OC_LoadLocal ||
+			 first.opCode == OpCode::OC_LoadHash) &&
+			second.opCode == OpCode::OC_Pop )
+		{
+			removeBoth = true;
+		}
+		else if( first.opCode == OpCode::OC_Rotate2 && second.opCode == OpCode::OC_Rotate2 )
+		{
+			removeBoth = true;
+		}
+		else if( first.opCode == OpCode::OC_Duplicate )
+		{
+			switch( second.opCode )
+			{
+			case OpCode::OC_PopStoreLocal:		replacement = OpCode::OC_StoreLocal;		break;
+			case OpCode::OC_PopStoreGlobal:		replacement = OpCode::OC_StoreGlobal;		break;
+			case OpCode::OC_PopStoreToBox:		replacement = OpCode::OC_StoreToBox;		break;
+			case OpCode::OC_PopStoreToClosure:	replacement = OpCode::OC_StoreToClosure;	break;
+			default: break;
+			}
+		}
+		else if( second.opCode == OpCode::OC_Pop ) // a store that keeps the value, which is not needed
+		{
+			switch( first.opCode )
+			{
+			case OpCode::OC_StoreLocal:			replacement = OpCode::OC_PopStoreLocal;		break;
+			case OpCode::OC_StoreGlobal:		replacement = OpCode::OC_PopStoreGlobal;	break;
+			case OpCode::OC_StoreToBox:			replacement = OpCode::OC_PopStoreToBox;		break;
+			case OpCode::OC_StoreToClosure:		replacement = OpCode::OC_PopStoreToClosure;	break;
+			case OpCode::OC_StoreElement:		replacement = OpCode::OC_PopStoreElement;	break;
+			case OpCode::OC_StoreMember:		replacement = OpCode::OC_PopStoreMember;	break;
+			default: break;
+			}
+		}
+
+		if( removeBoth )
+		{
+			removed[i] = true;
+			removed[i + 1] = true;
+		}
+		else if( replacement != first.opCode )
+		{
+			// the store takes its operand from the second instruction
+			first = Instruction(replacement, first.opCode == OpCode::OC_Duplicate ? second.A : first.A);
+			removed[i + 1] = true;
+		}
+		else
+		{
+			continue;
+		}
+
+		changed = true;
+		++i; // the pair is done, the next one starts after it
+	}
+
+	if( changed )
+		RemoveInstructions(codeObject, removed);
+
+	return changed;
+}
+
+bool Compiler::RemoveUnreachableCode(CodeObject* codeObject)
+{
+	std::vector<Instruction>& instructions = codeObject->instructions;
+	const int size = int(instructions.size());
+
+	std::vector<bool> reached(size, false);
+	std::vector<int> toVisit = {0};
+
+	// the end of the function stays, even if a loop never lets it get there
+	reached[size - 1] = true;
+
+	while( ! toVisit.empty() )
+	{
+		int i = toVisit.back();
+		toVisit.pop_back();
+
+		while( i < size && ! reached[i] )
+		{
+			reached[i] = true;
+
+			const Instruction& instruction = instructions[i];
+
+			if( IsJump(instruction.opCode) )
+				toVisit.push_back(instruction.A);
+
+			if( instruction.opCode == OpCode::OC_Jump || instruction.opCode == OpCode::OC_EndFunction )
+				break;
+
+			++i;
+		}
+	}
+
+	std::vector<bool> removed(size);
+	bool changed = false;
+
+	for( int i = 0; i < size; ++i )
+	{
+		removed[i] = ! reached[i];
+		changed = changed || removed[i];
+	}
+
+	if( changed )
+		RemoveInstructions(codeObject, removed);
+
+	return changed;
+}
+
+void Compiler::RemoveInstructions(CodeObject* codeObject, const std::vector<bool>& removed)
+{
+	std::vector<Instruction>& instructions = codeObject->instructions;
+	const int size = int(instructions.size());
+
+	// where each instruction goes, the removed ones map to the next one that stays
+	std::vector<int> newIndices(size + 1);
+	int newSize = 0;
+
+	for( int i = 0; i < size; ++i )
+	{
+		newIndices[i] = newSize;
+
+		if( ! removed[i] )
+			instructions[newSize++] = instructions[i];
+	}
+
+	newIndices[size] = newSize;
+	instructions.resize(newSize, Instruction(OpCode::OC_Pop));
+
+	for( Instruction& instruction : instructions )
+		if( IsJump(instruction.opCode) )
+			instruction.A = newIndices[instruction.A];
+
+	// when several lines now start at the same instruction, the last one has it
+	std::vector<SourceCodeLine> lines;
+
+	for( const SourceCodeLine& line : codeObject->instructionLines )
+	{
+		int index = newIndices[line.instructionIndex];
+
+		if( index == newSize )
+			break;
+
+		if( ! lines.empty() && lines.back().instructionIndex == index )
+			lines.pop_back();
+
+		if( lines.empty() || lines.back().line != line.line || lines.back().calledFrom != line.calledFrom )
+			lines.push_back({line.line, index, line.calledFrom});
+	}
+
+	codeObject->instructionLines = std::move(lines);
+
+	std::vector<LoopReload> reloads;
+
+	for( const LoopReload& reload : codeObject->loopReloads )
+		if( ! removed[reload.jumpIndex] )
+			reloads.push_back({newIndices[reload.jumpIndex], newIndices[reload.loadsIndex]});
+
+	codeObject->loopReloads = std::move(reloads);
+}
+
+void Compiler::UseTypeFeedback(CodeObject* codeObject, int function)
+{
+	// the operations that got two ints every time in the run of the profile
+	// check that they do and take the short way then
+	std::vector<bool> ints = mProfile->GetIntOperands(function, codeObject);
+
+	for( size_t i = 0; i < ints.size(); ++i )
+		if( ints[i] )
+			codeObject->instructions[i].opCode = CheckedOpCode(codeObject->instructions[i].opCode);
+}
+
+// how many values an instruction leaves on the stack, minus the ones it takes,
+// once the function it calls has returned
+static int StackEffect(const CodeObject* codeObject, const Instruction& instruction)
+{
+	const int A = instruction.A;
+
+	switch( instruction.opCode )
+	{
+	case OpCode::OC_Duplicate:
+	case OpCode::OC_LoadConstant:
+	case OpCode::OC_LoadLocal:
+	case OpCode::OC_LoadGlobal:
+	case OpCode::OC_LoadNative:
+	case OpCode::OC_LoadArgument:
+	case OpCode::OC_LoadArgsArray:
+	case OpCode::OC_LoadThis:
+	case OpCode::OC_MakeEmptyObject:
+	case OpCode::OC_LoadHash:
+	case OpCode::OC_IteratorHasNext:
+	case OpCode::OC_IteratorGetNext:
+	case OpCode::OC_LoadFromBox:
+	case OpCode::OC_LoadFromClosure:
+	case OpCode::OC_LoadCaptured:
+		return 1;
+
+	case OpCode::OC_Pop:
+	case OpCode::OC_MoveToTOS2:
+	case OpCode::OC_PopStoreLocal:
+	case OpCode::OC_PopStoreGlobal:
+	case OpCode::OC_LoadElement:
+	case OpCode::OC_ArrayPushBack:
+	case OpCode::OC_LoadMember:
+	case OpCode::OC_PopStoreToBox:
+	case OpCode::OC_PopStoreToClosure:
+	case OpCode::OC_PopJumpIfFalse:
+	case OpCode::OC_Add:
+	case OpCode::OC_Subtract:
+	case OpCode::OC_Multiply:
+	case OpCode::OC_Divide:
+	case OpCode::OC_Power:
+	case OpCode::OC_Modulo:
+	case OpCode::OC_Concatenate:
+	case OpCode::OC_Xor:
+	case OpCode::OC_Equal:
+	case OpCode::OC_NotEqual:
+	case OpCode::OC_Less:
+	case OpCode::OC_Greater:
+	case OpCode::OC_LessEqual:
+	case OpCode::OC_GreaterEqual:
+	case OpCode::OC_AddInt:
+	case OpCode::OC_SubtractInt:
+	case OpCode::OC_MultiplyInt:
+	case OpCode::OC_EqualInt:
+	case OpCode::OC_NotEqualInt:
+	case OpCode::OC_LessInt:
+	case OpCode::OC_GreaterInt:
+	case OpCode::OC_LessEqualInt:
+	case OpCode::OC_GreaterEqualInt:
+	case OpCode::OC_AddIntChecked:
+	case OpCode::OC_SubtractIntChecked:
+	case OpCode::OC_MultiplyIntChecked:
+	case OpCode::OC_LessIntChecked:
+	case OpCode::OC_GreaterIntChecked:
+	case OpCode::OC_LessEqualIntChecked:
+	case OpCode::OC_GreaterEqualIntChecked:
+		return -1;
+
+	case OpCode::OC_StoreElement:
+	case OpCode::OC_StoreMember:
+		return -2;
+
+	case OpCode::OC_PopStoreElement:
+	case OpCode::OC_PopStoreMember:
+		return -3;
+
+	case OpCode::OC_PopN:			return -A;
+	case OpCode::OC_Unpack:			return A - 1;
+	case OpCode::OC_MakeArray:		return 1 - A;
+	case OpCode::OC_MakeObject:		return 1 - 2 * A;
+	case OpCode::OC_FunctionCall:	return -A;
+
+	case OpCode::OC_CallMethod:
+		return A >= 0 && A < int(codeObject->callSites.size()) ? -codeObject->callSites[A].argumentsCount : 0;
+
+	default: // the ones that change the value on top in place, the jumps without their pops
+		return 0;
+	}
+}
+
+void Compiler::ComputeMaxStackDepth(CodeObject* codeObject)
+{
+	const std::vector<Instruction>& instructions = codeObject->instructions;
+	const int size = int(instructions.size());
+
+	// the stack before each instruction, -1 until a path gets to it. The code
+	// leaves the stack as it found it on every path through a loop, a loop
+	// that does not would grow it past every value pushed by the code once.
+	std::vector<int> heights(size, -1);
+	std::vector<int> toVisit;
+	int limit = 0;
+
+	for( const Instruction& instruction : instructions )
+		limit += std::max(StackEffect(codeObject, instruction), 0);
+
+	auto reach = [&](int index, int height)
+	{
+		height = std::max(height, 0);
+
+		if( index < size && height > heights[index] && height <= limit )
+		{
+			heights[index] = height;
+			toVisit.push_back(index);
+		}
+	};
+
+	int maxDepth = 0;
+
+	if( size > 0 )
+		reach(0, 0);
+
+	while( ! toVisit.empty() )
+	{
+		const int i = toVisit.back();
+		toVisit.pop_back();
+
+		const Instruction& instruction = instructions[i];
+		const int after = heights[i] + StackEffect(codeObject, instruction);
+
+		maxDepth = std::max(maxDepth, std::max(heights[i], after));
+
+		switch( instruction.opCode )
+		{
+		case OpCode::OC_EndFunction:
+			break;
+
+		case OpCode::OC_Jump:
+			reach(instruction.A, after);
+			break;
+
+		case OpCode::OC_JumpIfFalseOrPop: // the value stays when it jumps
+		case OpCode::OC_JumpIfTrueOrPop:
+			reach(instruction.A, heights[i]);
+			reach(i + 1, after - 1);
+			break;
+
+		default:
+			if( IsJump(instruction.opCode) )
+				reach(instruction.A, after);
+			reach(i + 1, after);
+			break;
+		}
+	}
+
+	codeObject->maxStackDepth = maxDepth;
+}
+
 unsigned Compiler::UpdateSymbol(const std::string& name)
 {
 	unsigned hash = Symbol::Hash(name);
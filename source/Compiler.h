@@ -12,6 +12,7 @@ namespace element
 {
 
 class Logger;
+class ExecutionProfile;
 struct CodeObject;
 
 namespace ast
@@ -27,6 +28,8 @@ public:  Compiler(Logger& logger);
 
 	auto Compile(const ast::FunctionNode* node) -> std::unique_ptr<char[]>;
 
+	void SetProfile(const ExecutionProfile* profile); // of an earlier run, for the code compiled after this
+
 	void ResetState();
 
 protected:
@@ -72,6 +75,14 @@ protected:
 
 	unsigned UpdateSymbol(const std::string& name);
 
+	void Optimize					(CodeObject* codeObject);
+	bool ThreadJumps				(CodeObject* codeObject);
+	bool RemoveRedundantInstructions(CodeObject* codeObject);
+	bool RemoveUnreachableCode		(CodeObject* codeObject);
+	void RemoveInstructions			(CodeObject* codeObject, const std::vector<bool>& removed);
+	void UseTypeFeedback			(CodeObject* codeObject, int function);
+	void ComputeMaxStackDepth		(CodeObject* codeObject);
+
 	std::unique_ptr<char[]> BuildBinaryData();
 
 private:
@@ -88,6 +99,8 @@ private:
 	std::unordered_map<unsigned, unsigned>	mSymbolIndices;
 	std::vector<Symbol>						mSymbols;
 	unsigned								mSymbolsOffset;
+
+	const ExecutionProfile*					mProfile;
 };
 
 }
@@ -98,13 +98,18 @@ unsigned Constant::CalculateSize() const
 		unsigned closureSize		= codeObject ? codeObject->closureMapping.size() : 0;
 		unsigned instructionsCount	= codeObject ? codeObject->instructions.size() : 0;
 		unsigned linesCount			= codeObject ? codeObject->instructionLines.size() : 0;
+		unsigned callSitesCount		= codeObject ? codeObject->callSites.size() : 0;
+		unsigned reloadsCount		= codeObject ? codeObject->loopReloads.size() : 0;
 		
 		return	sizeof(Constant::Type) + 
-				3 * sizeof(unsigned) +
-				2 * sizeof(int) +
+				5 * sizeof(unsigned) +
+				3 * sizeof(int) +
+				sizeof(bool) +
 				closureSize * sizeof(int) +
+				callSitesCount * sizeof(CallSite) +
 				instructionsCount * sizeof(Instruction) +
-				linesCount * sizeof(SourceCodeLine);
+				linesCount * sizeof(SourceCodeLine) +
+				reloadsCount * sizeof(LoopReload);
 	}
 	}
 	
@@ -166,6 +171,16 @@ char* Constant::WriteConstant(char* memoryDestination) const
 		memcpy(memoryDestination, &linesCount, sizeof(unsigned));
 		memoryDestination += sizeof(unsigned);
 		
+		unsigned callSitesCount = codeObject ? codeObject->callSites.size() : 0;
+		
+		memcpy(memoryDestination, &callSitesCount, sizeof(unsigned));
+		memoryDestination += sizeof(unsigned);
+		
+		unsigned reloadsCount = codeObject ? codeObject->loopReloads.size() : 0;
+		
+		memcpy(memoryDestination, &reloadsCount, sizeof(unsigned));
+		memoryDestination += sizeof(unsigned);
+		
 		int localsCount = codeObject ? codeObject->localVariablesCount : 0;
 				
 		memcpy(memoryDestination, &localsCount, sizeof(int));
@@ -176,6 +191,16 @@ char* Constant::WriteConstant(char* memoryDestination) const
 		memcpy(memoryDestination, &paramsCount, sizeof(int));
 		memoryDestination += sizeof(int);
 		
+		int stackDepth = codeObject ? codeObject->maxStackDepth : 0;
+		
+		memcpy(memoryDestination, &stackDepth, sizeof(int));
+		memoryDestination += sizeof(int);
+		
+		bool usesArguments = codeObject ? codeObject->usesArguments : false;
+		
+		memcpy(memoryDestination, &usesArguments, sizeof(bool));
+		memoryDestination += sizeof(bool);
+		
 		if( codeObject && closureSize > 0 )
 		{
 			unsigned size = closureSize * sizeof(int);
@@ -190,6 +215,13 @@ char* Constant::WriteConstant(char* memoryDestination) const
 			memoryDestination += size;
 		}
 		
+		if( codeObject && callSitesCount > 0 )
+		{
+			unsigned size = callSitesCount * sizeof(CallSite);
+			memcpy(memoryDestination, codeObject->callSites.data(), size);
+			memoryDestination += size;
+		}
+		
 		if( codeObject && linesCount > 0 )
 		{
 			unsigned size = linesCount * sizeof(SourceCodeLine);
@@ -197,6 +229,13 @@ char* Constant::WriteConstant(char* memoryDestination) const
 			memoryDestination += size;
 		}
 		
+		if( codeObject && reloadsCount > 0 )
+		{
+			unsigned size = reloadsCount * sizeof(LoopReload);
+			memcpy(memoryDestination, codeObject->loopReloads.data(), size);
+			memoryDestination += size;
+		}
+		
 		return memoryDestination;
 	}
 	}
@@ -254,6 +293,16 @@ char* Constant::ReadConstant(char* memorySource)
 		memcpy(&linesCount, memorySource, sizeof(unsigned));
 		memorySource += sizeof(unsigned);
 		
+		unsigned callSitesCount = 0;
+		
+		memcpy(&callSitesCount, memorySource, sizeof(unsigned));
+		memorySource += sizeof(unsigned);
+		
+		unsigned reloadsCount = 0;
+		
+		memcpy(&reloadsCount, memorySource, sizeof(unsigned));
+		memorySource += sizeof(unsigned);
+		
 		int localsCount = 0;
 				
 		memcpy(&localsCount, memorySource, sizeof(int));
@@ -263,6 +312,16 @@ char* Constant::ReadConstant(char* memorySource)
 		
 		memcpy(&paramsCount, memorySource, sizeof(int));
 		memorySource += sizeof(int);
+		
+		int stackDepth = 0;
+		
+		memcpy(&stackDepth, memorySource, sizeof(int));
+		memorySource += sizeof(int);
+		
+		bool usesArguments = false;
+		
+		memcpy(&usesArguments, memorySource, sizeof(bool));
+		memorySource += sizeof(bool);
 				
 		codeObject = new CodeObject();
 		
@@ -278,14 +337,28 @@ char* Constant::ReadConstant(char* memorySource)
 			memorySource += instructionsCount * sizeof(Instruction);
 		}
 		
+		if( callSitesCount > 0 )
+		{
+			codeObject->callSites.assign((CallSite*)memorySource, (CallSite*)memorySource + callSitesCount);
+			memorySource += callSitesCount * sizeof(CallSite);
+		}
+		
 		if( linesCount > 0 )
 		{
 			codeObject->instructionLines.assign((SourceCodeLine*)memorySource, (SourceCodeLine*)memorySource + linesCount);
 			memorySource += linesCount * sizeof(SourceCodeLine);
 		}
 		
+		if( reloadsCount > 0 )
+		{
+			codeObject->loopReloads.assign((LoopReload*)memorySource, (LoopReload*)memorySource + reloadsCount);
+			memorySource += reloadsCount * sizeof(LoopReload);
+		}
+		
 		codeObject->localVariablesCount = localsCount;
 		codeObject->namedParametersCount = paramsCount;
+		codeObject->maxStackDepth = stackDepth;
+		codeObject->usesArguments = usesArguments;
 		
 		return memorySource;
 	}
@@ -318,7 +391,7 @@ std::string Constant::AsDebugString() const
 	case CT_CodeObject:
 	{
 		std::stringstream result;
-		result << "function - " << codeObject->localVariablesCount << " locals (" << codeObject->namedParametersCount << " parameters)\n";
+		result << "function - " << codeObject->localVariablesCount << " locals (" << codeObject->namedParametersCount << " parameters), stack depth " << codeObject->maxStackDepth << "\n";
 
 		unsigned linesIndex = 0;
 		unsigned closureSize = codeObject->closureMapping.size();
@@ -335,12 +408,24 @@ std::string Constant::AsDebugString() const
 
 				int variableIndex = codeObject->closureMapping[i];
 				if( variableIndex >= 0 )
-					result << "local boxed " << variableIndex << "\n";
+					result << "local " << variableIndex << "\n";
 				else
 					result << "free variable " << (-variableIndex - 1) << "\n";
 			}
 		}
 
+		if( ! codeObject->callSites.empty() )
+		{
+			result << "           call sites:\n";
+
+			for( unsigned i = 0; i < codeObject->callSites.size(); ++i )
+			{
+				const CallSite& callSite = codeObject->callSites[i];
+
+				result << "           [" << i << "] method " << callSite.hash << " with " << callSite.argumentsCount << " arguments\n";
+			}
+		}
+
 		for( unsigned i = 0; i < instructionsSize; ++i )
 		{
 			Instruction* instruction = &codeObject->instructions[i];
@@ -0,0 +1,328 @@
+#include "CppEmitter.h"
+
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+#include "Jit.h"
+#include "OpCodes.h"
+
+namespace element
+{
+
+CppEmitter::CppEmitter(const std::vector<Value>& constants)
+: mConstants(constants)
+{
+}
+
+void CppEmitter::Emit(const std::string& sourceName, const std::vector<const CodeObject*>& codeObjects, std::ostream& output) const
+{
+	output	<< "// Translated from " << sourceName << " by 'element --emit-cpp', do not edit.\n"
+			<< "// Built into the interpreter, it runs the code objects of the module as long\n"
+			<< "// as their bytecode stays the same.\n"
+			<< "\n"
+			<< "#include \"Jit.h\"\n"
+			<< "#include \"OpCodes.h\"\n"
+			<< "\n"
+			<< "// back to the interpreter at instruction 'i', none of it is done yet\n"
+			<< "#define EXIT(i) do { state->top = top; return i; } while( false )\n"
+			<< "#define INTS (top[-2].type == Value::VT_Int && top[-1].type == Value::VT_Int)\n"
+			<< "\n"
+			<< "namespace\n"
+			<< "{\n"
+			<< "\n"
+			<< "using namespace element;\n"
+			<< "\n"
+			<< "// the members of Value are not inline, these are\n"
+			<< "inline bool Truthy(const Value& value) { return value.type == Value::VT_Bool ? value.boolean : value.type != Value::VT_Nil; }\n"
+			<< "inline void SetNil(Value& value) { value.type = Value::VT_Nil; value.integer = 0; }\n"
+			<< "inline void SetBool(Value& value, bool boolean) { value.type = Value::VT_Bool; value.boolean = boolean; }\n"
+			<< "inline void SetInt(Value& value, int integer) { value.type = Value::VT_Int; value.integer = integer; }\n"
+			<< "inline void SetFloat(Value& value, float floatingPoint) { value.type = Value::VT_Float; value.floatingPoint = floatingPoint; }\n";
+
+	for( size_t i = 0; i < codeObjects.size(); ++i )
+		EmitCodeObject(int(i), *codeObjects[i], output);
+
+	output	<< "\n"
+			<< "const JitTranslation translations[] =\n"
+			<< "{\n";
+
+	for( size_t i = 0; i < codeObjects.size(); ++i )
+	{
+		output	<< "\t{0x" << std::hex << Jit::Fingerprint(*codeObjects[i], mConstants) << std::dec
+				<< "ull, CodeObject" << i << "},\n";
+	}
+
+	output	<< "};\n"
+			<< "\n"
+			<< "const bool registered = Jit::RegisterTranslations(translations, sizeof(translations) / sizeof(translations[0]));\n"
+			<< "\n"
+			<< "}\n"
+			<< "\n"
+			<< "#undef EXIT\n"
+			<< "#undef INTS\n";
+}
+
+void CppEmitter::EmitCodeObject(int number, const CodeObject& codeObject, std::ostream& output) const
+{
+	const int count = int(codeObject.instructions.size());
+
+	output	<< "\n";
+
+	if( ! codeObject.instructionLines.empty() )
+		output << "// from line " << codeObject.instructionLines.front().line << "\n";
+
+	output	<< "int CodeObject" << number << "(JitState* state, int index)\n"
+			<< "{\n"
+			<< "\tValue* top = state->top;\n"
+			<< "\tValue* const limit = state->limit;\n"
+			<< "\tValue* const locals = state->locals;\n"
+			<< "\tValue* const globals = state->globals;\n"
+			<< "\tconst int globalsCount = int(state->globalsCount);\n"
+			<< "\t(void)limit; (void)locals; (void)globals; (void)globalsCount;\n"
+			<< "\n"
+			<< "\tswitch( index )\n"
+			<< "\t{\n";
+
+	for( int i = 0; i < count; ++i )
+		output << "\tcase " << i << ": goto I" << i << ";\n";
+
+	output	<< "\tdefault: EXIT(index);\n"
+			<< "\t}\n";
+
+	for( int i = 0; i < count; ++i )
+		EmitInstruction(codeObject, i, output);
+
+	output	<< "}\n";
+}
+
+void CppEmitter::EmitInstruction(const CodeObject& codeObject, int index, std::ostream& output) const
+{
+	const Instruction& instruction = codeObject.instructions[index];
+	const int A = instruction.A;
+	const std::string i = std::to_string(index);
+	const std::string a = std::to_string(A);
+	const std::string exit = "EXIT(" + i + ");";
+	const std::string checkPush = "if( top == limit ) " + exit + "\n\t";
+
+	std::string text; // without the padding
+
+	for( char c : instruction.AsString() )
+		if( c != ' ' || (! text.empty() && text.back() != ' ') )
+			text += c;
+
+	text.erase(text.find_last_not_of(' ') + 1);
+
+	output << "\nI" << i << ": // " << text << "\n\t";
+
+	// the arithmetic of ints is done here, the rest in the helper of the jit
+	auto arithmetic = [&](const std::string& ints)
+	{
+		const OpCode untyped = UntypedOpCode(instruction.opCode);
+		const bool typed = IsTyped(instruction.opCode); // the compiler knows they are ints
+		const std::string opCode = std::to_string(int(untyped));
+
+		if( ! ints.empty() && ! typed )
+			output << "if( " << ints << " ) ";
+
+		if( ! ints.empty() )
+		{
+			switch( untyped )
+			{
+			case OC_Add:		output << "top[-2].integer = int(unsigned(top[-2].integer) + unsigned(top[-1].integer));"; break;
+			case OC_Subtract:	output << "top[-2].integer = int(unsigned(top[-2].integer) - unsigned(top[-1].integer));"; break;
+			case OC_Multiply:	output << "top[-2].integer = int(unsigned(top[-2].integer) * unsigned(top[-1].integer));"; break;
+			case OC_Divide:		output << "top[-2].integer /= top[-1].integer;"; break;
+			case OC_Modulo:		output << "top[-2].integer %= top[-1].integer;"; break;
+			case OC_Equal:		output << "SetBool(top[-2], top[-2].integer == top[-1].integer);"; break;
+			case OC_NotEqual:	output << "SetBool(top[-2], top[-2].integer != top[-1].integer);"; break;
+			case OC_Less:		output << "SetBool(top[-2], top[-2].integer < top[-1].integer);"; break;
+			case OC_Greater:	output << "SetBool(top[-2], top[-2].integer > top[-1].integer);"; break;
+			case OC_LessEqual:	output << "SetBool(top[-2], top[-2].integer <= top[-1].integer);"; break;
+			default:			output << "SetBool(top[-2], top[-2].integer >= top[-1].integer);"; break;
+			}
+
+			if( typed )
+			{
+				output << "\n\t--top;";
+				return;
+			}
+
+			output << "\n\telse ";
+		}
+
+		output << "if( ! Jit::Arithmetic(top - 2, " << opCode << ") ) " << exit << "\n\t--top;";
+	};
+
+	switch( instruction.opCode )
+	{
+	case OC_Pop:
+		output << "--top;";
+		break;
+
+	case OC_PopN:
+		output << "top -= " << a << ";";
+		break;
+
+	case OC_Rotate2:
+		output << "{ Value value = top[-1]; top[-1] = top[-2]; top[-2] = value; }";
+		break;
+
+	case OC_MoveToTOS2:
+		output << "top[-3] = top[-1]; --top;";
+		break;
+
+	case OC_Duplicate:
+		output << checkPush << "*top = top[-1]; ++top;";
+		break;
+
+	case OC_LoadConstant:
+	{
+		std::string constant = ConstantAsCpp(A, "*top");
+
+		if( constant.empty() )
+			output << exit;
+		else
+			output << checkPush << constant << "; ++top;";
+		break;
+	}
+
+	case OC_LoadLocal:
+		output << checkPush << "*top++ = locals[" << a << "];";
+		break;
+
+	case OC_StoreLocal:
+		output << "locals[" << a << "] = top[-1];";
+		break;
+
+	case OC_PopStoreLocal:
+		output << "locals[" << a << "] = *--top;";
+		break;
+
+	case OC_LoadGlobal:
+		output << "if( top == limit || " << a << " >= globalsCount ) " << exit << "\n\t*top++ = globals[" << a << "];";
+		break;
+
+	case OC_StoreGlobal:
+		output << "if( " << a << " >= globalsCount ) " << exit << "\n\tglobals[" << a << "] = top[-1];";
+		break;
+
+	case OC_PopStoreGlobal:
+		output << "if( " << a << " >= globalsCount ) " << exit << "\n\tglobals[" << a << "] = *--top;";
+		break;
+
+	case OC_Jump:
+		if( A <= index ) // backward jumps close loops, with the jit on the interpreter runs their traces
+			output << "if( state->tracing || state->safePointRequested->load(std::memory_order_relaxed) ) " << exit << "\n\t";
+		output << "goto I" << a << ";";
+		break;
+
+	case OC_JumpIfFalse:
+		output << "if( ! Truthy(top[-1]) ) goto I" << a << ";";
+		break;
+
+	case OC_PopJumpIfFalse:
+		output << "if( ! Truthy(*--top) ) goto I" << a << ";";
+		break;
+
+	case OC_JumpIfFalseOrPop:
+		output << "if( ! Truthy(top[-1]) ) goto I" << a << ";\n\t--top;";
+		break;
+
+	case OC_JumpIfTrueOrPop:
+		output << "if( Truthy(top[-1]) ) goto I" << a << ";\n\t--top;";
+		break;
+
+	case OC_Add:
+	case OC_Subtract:
+	case OC_Multiply:
+	case OC_Equal:
+	case OC_NotEqual:
+	case OC_Less:
+	case OC_Greater:
+	case OC_LessEqual:
+	case OC_GreaterEqual:
+	case OC_AddInt:
+	case OC_SubtractInt:
+	case OC_MultiplyInt:
+	case OC_EqualInt:
+	case OC_NotEqualInt:
+	case OC_LessInt:
+	case OC_GreaterInt:
+	case OC_LessEqualInt:
+	case OC_GreaterEqualInt:
+	case OC_AddIntChecked:
+	case OC_SubtractIntChecked:
+	case OC_MultiplyIntChecked:
+	case OC_LessIntChecked:
+	case OC_GreaterIntChecked:
+	case OC_LessEqualIntChecked:
+	case OC_GreaterEqualIntChecked:
+		arithmetic("INTS");
+		break;
+
+	case OC_Divide:
+	case OC_Modulo: // 0 and -1 as divisors are left to the interpreter
+		arithmetic("INTS && top[-1].integer != 0 && top[-1].integer != -1");
+		break;
+
+	case OC_Power:
+	case OC_Xor:
+		arithmetic("");
+		break;
+
+	case OC_UnaryPlus:
+		output << "if( top[-1].type != Value::VT_Int && top[-1].type != Value::VT_Float ) " << exit;
+		break;
+
+	case OC_UnaryMinus:
+		output	<< "if( top[-1].type == Value::VT_Int ) top[-1].integer = int(0u - unsigned(top[-1].integer));\n"
+				<< "\telse if( ! Jit::Arithmetic(top - 1, " << int(OC_UnaryMinus) << ") ) " << exit;
+		break;
+
+	case OC_UnaryNot:
+		output << "SetBool(top[-1], ! Truthy(top[-1]));";
+		break;
+
+	default:
+		output << exit;
+		break;
+	}
+
+	output << "\n";
+}
+
+std::string CppEmitter::ConstantAsCpp(int index, const std::string& target) const
+{
+	if( index < 0 || index >= int(mConstants.size()) )
+		return "";
+
+	const Value& constant = mConstants[index];
+	std::ostringstream text;
+
+	switch( constant.type )
+	{
+	case Value::VT_Nil:
+		return "SetNil(" + target + ")";
+
+	case Value::VT_Bool:
+		return "SetBool(" + target + (constant.boolean ? ", true)" : ", false)");
+
+	case Value::VT_Int:
+		return "SetInt(" + target + ", " + std::to_string(constant.integer) + ")";
+
+	case Value::VT_Float:
+		if( ! std::isfinite(constant.floatingPoint) )
+			return "";
+
+		// enough digits to get the same float back
+		text << std::setprecision(std::numeric_limits<float>::max_digits10) << std::showpoint << constant.floatingPoint;
+		return "SetFloat(" + target + ", " + text.str() + "f)";
+
+	default: // strings and functions are objects of the virtual machine
+		return "";
+	}
+}
+
+}
@@ -0,0 +1,40 @@
+#ifndef _CPP_EMITTER_INCLUDED_
+#define _CPP_EMITTER_INCLUDED_
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "DataTypes.h"
+
+namespace element
+{
+
+// Translates code objects to a C++ source file, for the modules that rarely
+// change and are worth compiling ahead of time. Each code object becomes a
+// function that does what the baseline jit does inline: stack shuffling,
+// loads and stores, jumps, and arithmetic and comparisons of numbers. For
+// anything else, and at backward jumps so hot loops still get traced, it
+// returns to the interpreter at that instruction. Linked
+// into the interpreter, the file registers its functions by the fingerprints
+// of their bytecode, and every code object that is loaded with the same
+// bytecode runs its function instead of being interpreted.
+class CppEmitter
+{
+public:
+					CppEmitter(const std::vector<Value>& constants);
+
+	void			Emit(const std::string& sourceName, const std::vector<const CodeObject*>& codeObjects, std::ostream& output) const;
+
+private:
+	void			EmitCodeObject(int number, const CodeObject& codeObject, std::ostream& output) const;
+	void			EmitInstruction(const CodeObject& codeObject, int index, std::ostream& output) const;
+	std::string		ConstantAsCpp(int index, const std::string& target) const; // sets the target, empty for the ones left to the interpreter
+
+private:
+	const std::vector<Value>&	mConstants;
+};
+
+}
+
+#endif // _CPP_EMITTER_INCLUDED_
@@ -1,7 +1,9 @@
 #include "DataTypes.h"
 
+#include <algorithm>
 #include <sstream>
 #include <iomanip>
+#include <new>
 #include "Symbol.h"
 #include "Constant.h"
 
@@ -12,6 +14,10 @@ CodeObject::CodeObject()
 : module(nullptr)
 , localVariablesCount(0)
 , namedParametersCount(0)
+, usesArguments(false)
+, maxStackDepth(0)
+, hotness(0)
+, jitCode(nullptr)
 {
 }
 
@@ -23,11 +29,140 @@ CodeObject::CodeObject(	Instruction* instructions, unsigned instructionsSize,
 , module(nullptr)
 , localVariablesCount(localVariablesCount)
 , namedParametersCount(namedParametersCount)
+, usesArguments(true)
+, maxStackDepth(0)
 , instructionLines(lines, lines + linesSize)
+, hotness(0)
+, jitCode(nullptr)
 {
 }
 
 
+StackFrames::StackFrames()
+: mSize(0)
+, mBack(nullptr)
+{
+}
+
+StackFrames::~StackFrames()
+{
+	clear();
+
+	for( StackFrame* block : mBlocks )
+		::operator delete(block);
+}
+
+size_t StackFrames::capacity() const
+{
+	return 1 + FirstBlockSize * ((size_t(1) << mBlocks.size()) - 1);
+}
+
+StackFrame& StackFrames::emplace_back()
+{
+	if( mSize == capacity() )
+	{
+		size_t blockSize = FirstBlockSize << mBlocks.size();
+		mBlocks.push_back( (StackFrame*)::operator new(blockSize * sizeof(StackFrame)) );
+	}
+
+	mBack = new(Slot(mSize)) StackFrame();
+	++mSize;
+
+	return *mBack;
+}
+
+void StackFrames::pop_back()
+{
+	mBack->~StackFrame();
+	--mSize;
+
+	mBack = mSize > 0 ? Slot(mSize - 1) : nullptr;
+}
+
+void StackFrames::clear()
+{
+	while( mSize > 0 )
+		pop_back();
+}
+
+StackFrame* StackFrames::Slot(size_t index) const
+{
+	if( index == 0 )
+		return (StackFrame*)mFirst;
+
+	index -= 1;
+
+	for( size_t i = 0; ; ++i )
+	{
+		size_t blockSize = FirstBlockSize << i;
+
+		if( index < blockSize )
+			return mBlocks[i] + index;
+
+		index -= blockSize;
+	}
+}
+
+
+ValueStack::ValueStack()
+: mBegin(nullptr)
+, mTop(nullptr)
+, mEnd(nullptr)
+{
+}
+
+ValueStack::~ValueStack()
+{
+	delete[] mBegin;
+}
+
+void ValueStack::resize(size_t count)
+{
+	reserve(count);
+
+	for( Value* value = mTop; value < mBegin + count; ++value )
+		*value = Value();
+
+	mTop = mBegin + count;
+}
+
+void ValueStack::clear()
+{
+	mTop = mBegin;
+}
+
+void ValueStack::shrink_to_fit()
+{
+	if( mTop == mEnd )
+		return;
+
+	size_t count = size();
+	Value* values = count > 0 ? new Value[count] : nullptr;
+
+	std::copy(mBegin, mTop, values);
+	delete[] mBegin;
+
+	mBegin = values;
+	mTop = values + count;
+	mEnd = mTop;
+}
+
+void ValueStack::Grow(size_t count)
+{
+	size_t newCapacity = std::max(count, capacity() * 2);
+	size_t oldSize = size();
+
+	Value* values = new Value[newCapacity];
+
+	std::copy(mBegin, mTop, values);
+	delete[] mBegin;
+
+	mBegin = values;
+	mTop = values + oldSize;
+	mEnd = values + newCapacity;
+}
+
+
 std::string BytecodeSymbolsAsDebugString(const char* bytecode)
 {
 	unsigned* p = (unsigned*)bytecode;
@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <utility>
 
 #include "GarbageCollected.h"
 #include "OpCodes.h"
@@ -12,10 +13,14 @@
 namespace element
 {
 
+struct JitCode;
+
+
 struct SourceCodeLine
 {
 	int line;
 	int instructionIndex;
+	int calledFrom;	// the line of the call when it is in an inlined body, 0 when it is not
 };
 
 
@@ -30,14 +35,43 @@ struct Module
 };
 
 
+// A loop whose invariant loads were moved before it by the optimizer. When a
+// script is suspended at the jump back, the host can change the objects they
+// come from, so the loads are run again when it is resumed.
+struct LoopReload
+{
+	int jumpIndex;	// the jump back to the start of the loop
+	int loadsIndex;	// the first of the moved loads, the start comes after the last one
+};
+
+
+// A method call like 'object.member(arguments)'. It remembers the proto
+// object it found the method in the last time, and where in its members.
+struct CallSite
+{
+	unsigned				hash;
+	int						argumentsCount;
+
+	mutable const Object*	holder	= nullptr;
+	mutable unsigned		index	= 0;
+};
+
+
 struct CodeObject
 {
 	std::vector<Instruction>	instructions;
 	Module*						module;
 	int							localVariablesCount;
 	int							namedParametersCount;
+	bool						usesArguments; // the anonymous ones, with $$ or $N
+	int							maxStackDepth; // the most values its code has on the stack at once
 	std::vector<int>			closureMapping;
+	std::vector<CallSite>		callSites;
 	std::vector<SourceCodeLine>	instructionLines;
+	std::vector<LoopReload>		loopReloads;
+	
+	mutable unsigned			hotness; // calls and backward jumps, until it is compiled
+	mutable JitCode*			jitCode; // owned by the jit
 	
 	CodeObject();
 	CodeObject(CodeObject&& o) = default;
@@ -54,11 +88,189 @@ struct StackFrame
 	const Instruction*	instructions	= nullptr;
 	std::vector<Value>*	globals			= nullptr;
 	std::vector<Value>	variables;
-	Array				anonymousParameters;
+	std::unique_ptr<Array>	anonymousParameters; // only for code that uses them
 	Value				thisObject;
 };
 
 
+// The call frames of an execution context. A frame never moves once it is
+// created, things keep pointers to it. The first frame is stored inline, so a
+// coroutine that does not call anything needs no storage for frames of its
+// own. The rest go in blocks that double in size and stay allocated for when
+// the context is used again.
+class StackFrames
+{
+public:
+	class ConstIterator
+	{
+	public:
+		ConstIterator(const StackFrames* frames, size_t index)
+		: mFrames(frames)
+		, mIndex(index)
+		{
+		}
+
+		const StackFrame& operator*() const
+		{
+			return *mFrames->Slot(mIndex);
+		}
+
+		ConstIterator& operator++()
+		{
+			++mIndex;
+			return *this;
+		}
+
+		bool operator!=(const ConstIterator& o) const
+		{
+			return mIndex != o.mIndex;
+		}
+
+	private:
+		const StackFrames*	mFrames;
+		size_t				mIndex;
+	};
+
+	StackFrames();
+	~StackFrames();
+
+	StackFrames(const StackFrames&) = delete;
+	StackFrames& operator=(const StackFrames&) = delete;
+
+	bool empty() const
+	{
+		return mSize == 0;
+	}
+
+	size_t size() const
+	{
+		return mSize;
+	}
+
+	StackFrame& back()
+	{
+		return *mBack;
+	}
+
+	size_t			capacity() const;
+	StackFrame&		emplace_back();
+	void			pop_back();
+	void			clear();
+
+	ConstIterator	begin() const	{ return ConstIterator(this, 0); }
+	ConstIterator	end() const		{ return ConstIterator(this, mSize); }
+
+private:
+	StackFrame*		Slot(size_t index) const;
+
+	static const size_t FirstBlockSize = 4;
+
+	alignas(StackFrame) char	mFirst[sizeof(StackFrame)];
+	std::vector<StackFrame*>	mBlocks; // raw storage, block i has room for FirstBlockSize << i frames
+	size_t						mSize;
+	StackFrame*					mBack;
+};
+
+
+// The stack of values of an execution context. A call makes room for the most
+// values the called function can have on it, so the instructions that load a
+// value can push it without checking for room with 'push_back_reserved'. The
+// storage only grows, the slots above the top keep whatever was in them.
+class ValueStack
+{
+public:
+	typedef Value value_type;
+
+	ValueStack();
+	~ValueStack();
+
+	ValueStack(const ValueStack&) = delete;
+	ValueStack& operator=(const ValueStack&) = delete;
+
+	bool empty() const
+	{
+		return mTop == mBegin;
+	}
+
+	size_t size() const
+	{
+		return size_t(mTop - mBegin);
+	}
+
+	size_t capacity() const
+	{
+		return size_t(mEnd - mBegin);
+	}
+
+	Value& back()
+	{
+		return mTop[-1];
+	}
+
+	Value& operator[](size_t index)
+	{
+		return mBegin[index];
+	}
+
+	const Value& operator[](size_t index) const
+	{
+		return mBegin[index];
+	}
+
+	void push_back(const Value& value)
+	{
+		if( mTop == mEnd )
+			Grow(size() + 1);
+
+		*mTop++ = value;
+	}
+
+	template<class... Args>
+	void emplace_back(Args&&... args)
+	{
+		if( mTop == mEnd )
+			Grow(size() + 1);
+
+		*mTop++ = Value(std::forward<Args>(args)...);
+	}
+
+	// only for room made with 'reserve' before
+	void push_back_reserved(const Value& value)
+	{
+		*mTop++ = value;
+	}
+
+	void pop_back()
+	{
+		--mTop;
+	}
+
+	void reserve(size_t count)
+	{
+		if( count > capacity() )
+			Grow(count);
+	}
+
+	void			resize(size_t count); // the new values are nil
+	void			resize_reserved(size_t count) { mTop = mBegin + count; } // keeps the values written past the end
+	void			clear();
+	void			shrink_to_fit();
+
+	Value*			data()			{ return mBegin; }
+	Value*			begin()			{ return mBegin; }
+	Value*			end()			{ return mTop; }
+	const Value*	begin() const	{ return mBegin; }
+	const Value*	end() const		{ return mTop; }
+
+private:
+	void			Grow(size_t count); // to at least 'count', at least double
+
+	Value*	mBegin;
+	Value*	mTop;
+	Value*	mEnd;
+};
+
+
 struct ExecutionContext
 {
 	enum State : char
@@ -71,8 +283,8 @@ struct ExecutionContext
 	State					state	= CRS_NotStarted;
 	ExecutionContext*		parent	= nullptr;
 	Value					lastObject;
-	std::deque<StackFrame>	stackFrames; // this needs to be a deque, because things keep references to it
-	std::vector<Value>		stack;
+	StackFrames				stackFrames;
+	ValueStack				stack;
 };
 
 
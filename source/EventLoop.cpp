@@ -0,0 +1,432 @@
+#include "EventLoop.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+	// no readiness polling, files are read and written when they are asked for
+#else
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#include <cerrno>
+	#ifdef __linux__
+		#include <sys/epoll.h>
+	#endif
+#endif
+
+#include "VirtualMachine.h"
+
+namespace element
+{
+
+static const size_t ChunkSize = 64 * 1024;
+
+
+EventLoop::EventLoop(VirtualMachine& vm)
+: mVirtualMachine(vm)
+, mPollableCount(0)
+, mCurrentTaskWaits(false)
+, mRunning(false)
+, mEpoll(-1)
+{
+#ifdef __linux__
+	mEpoll = epoll_create1(EPOLL_CLOEXEC);
+#endif
+
+	mVirtualMachine.GetMemoryManager().AddExternalRoots(this);
+}
+
+EventLoop::~EventLoop()
+{
+	ResetState();
+
+	mVirtualMachine.GetMemoryManager().RemoveExternalRoots(this);
+
+#ifndef _WIN32
+	if( mEpoll >= 0 )
+		close(mEpoll);
+#endif
+}
+
+void EventLoop::ResetState()
+{
+#ifndef _WIN32
+	for( auto& kvp : mOperations )
+		close(kvp.first); // also takes it out of the epoll set
+#endif
+
+	mReadyTasks.clear();
+	mTimers.clear();
+	mOperations.clear();
+	mPollableCount = 0;
+
+	mCurrentTask = Value();
+	mCurrentTaskWaits = false;
+	mRunning = false;
+}
+
+void EventLoop::Spawn(const Value& coroutine)
+{
+	mReadyTasks.push_back({coroutine, Value()});
+}
+
+bool EventLoop::Run()
+{
+	return RunUntil([] { return false; });
+}
+
+bool EventLoop::RunUntil(const std::function<bool()>& isDone)
+{
+	if( mRunning )
+	{
+		mVirtualMachine.SetError("the event loop is already running");
+		return false;
+	}
+
+	mRunning = true;
+
+	while( ! isDone() && HasWork() )
+	{
+		if( ! RunTurn() )
+		{
+			ResetState();
+			return false;
+		}
+	}
+
+	mRunning = false;
+
+	return true;
+}
+
+bool EventLoop::IsRunning() const
+{
+	return mRunning;
+}
+
+bool EventLoop::CanSuspend() const
+{
+	return mCurrentTask.type == Value::VT_Function && mVirtualMachine.CanSuspendCoroutine(mCurrentTask.function);
+}
+
+Value EventLoop::GetCurrentTask() const
+{
+	return mCurrentTask;
+}
+
+void EventLoop::Suspend()
+{
+	mCurrentTaskWaits = true;
+	mVirtualMachine.SuspendCoroutine();
+}
+
+void EventLoop::Wake(const Value& coroutine, const Value& resumeValue)
+{
+	mReadyTasks.push_back({coroutine, resumeValue});
+}
+
+void EventLoop::Sleep(std::chrono::milliseconds time)
+{
+	mTimers.push_back({std::chrono::steady_clock::now() + time, mCurrentTask});
+
+	std::push_heap(mTimers.begin(), mTimers.end(), IsLater);
+
+	Suspend();
+}
+
+void EventLoop::ReadFile(const std::string& path)
+{
+#ifdef _WIN32
+	std::ifstream file(path, std::ios::binary);
+	std::stringstream data;
+
+	if( file && (data << file.rdbuf()) )
+		Resume(mVirtualMachine.GetMemoryManager().NewString(data.str()));
+	else
+		Resume(mVirtualMachine.GetMemoryManager().NewError("file-not-found"));
+#else
+	Operation operation;
+	operation.coroutine = mCurrentTask;
+	operation.path = path;
+	operation.fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+	StartOperation(std::move(operation));
+#endif
+}
+
+void EventLoop::WriteFile(const std::string& path, const std::string& data)
+{
+#ifdef _WIN32
+	std::ofstream file(path, std::ios::binary);
+
+	if( file && file.write(data.data(), data.size()) )
+		Resume(Value(true));
+	else
+		Resume(mVirtualMachine.GetMemoryManager().NewError("cannot-write-file"));
+#else
+	Operation operation;
+	operation.coroutine = mCurrentTask;
+	operation.path = path;
+	operation.writing = true;
+	operation.data = data;
+	operation.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+
+	StartOperation(std::move(operation));
+#endif
+}
+
+void EventLoop::GetReferences(std::vector<GarbageCollected*>& references) const
+{
+	auto addReference = [&](const Value& value)
+	{
+		if( value.IsGarbageCollected() )
+			references.push_back(value.garbageCollected);
+	};
+
+	for( const Task& task : mReadyTasks )
+	{
+		addReference(task.coroutine);
+		addReference(task.resumeValue);
+	}
+
+	for( const Timer& timer : mTimers )
+		addReference(timer.coroutine);
+
+	for( const auto& kvp : mOperations )
+		addReference(kvp.second.coroutine);
+
+	addReference(mCurrentTask);
+}
+
+bool EventLoop::HasWork() const
+{
+	return ! mReadyTasks.empty() || ! mTimers.empty() || ! mOperations.empty();
+}
+
+bool EventLoop::RunTurn()
+{
+	MemoryManager& memoryManager = mVirtualMachine.GetMemoryManager();
+
+	// everything the loop keeps is an external root, the rest can go
+	size_t temporaryRoots = memoryManager.GetTemporaryRootsCount();
+
+	Poll( GetPollTimeout() );
+
+	// only the ones ready now, the ones they spawn wait for the next turn
+	size_t readyCount = mReadyTasks.size();
+
+	for( size_t i = 0; i < readyCount; ++i )
+	{
+		Task task = std::move(mReadyTasks.front());
+		mReadyTasks.pop_front();
+
+		mCurrentTask = task.coroutine;
+		mCurrentTaskWaits = false;
+
+		if( task.resumeValue.IsNil() )
+			mVirtualMachine.CallFunction(task.coroutine, {});
+		else
+			mVirtualMachine.CallFunction(task.coroutine, {task.resumeValue});
+
+		mCurrentTask = Value();
+
+		if( mVirtualMachine.HasError() )
+			return false;
+
+		const ExecutionContext* context = task.coroutine.function->executionContext;
+
+		if( ! mCurrentTaskWaits && context->state != ExecutionContext::CRS_Finished ) // it just yielded
+			mReadyTasks.push_back({task.coroutine, Value()});
+	}
+
+	memoryManager.RemoveTemporaryRoots(temporaryRoots);
+
+	return true;
+}
+
+void EventLoop::Resume(const Value& result)
+{
+	// still suspended, so the other coroutines get their turn first
+	Wake(mCurrentTask, result);
+	Suspend();
+}
+
+void EventLoop::StartOperation(Operation&& operation)
+{
+#ifndef _WIN32
+	if( operation.fd < 0 )
+	{
+		Resume( mVirtualMachine.GetMemoryManager().NewError(operation.writing ? "cannot-write-file" : "file-not-found") );
+		return;
+	}
+
+	Suspend();
+
+	#ifdef __linux__
+	struct stat status;
+
+	if( mEpoll >= 0 && fstat(operation.fd, &status) == 0 && ! S_ISREG(status.st_mode) )
+	{
+		epoll_event event = {};
+		event.events = operation.writing ? EPOLLOUT : EPOLLIN;
+		event.data.fd = operation.fd;
+
+		// files epoll cannot watch are handled like regular ones
+		if( epoll_ctl(mEpoll, EPOLL_CTL_ADD, operation.fd, &event) == 0 )
+		{
+			operation.pollable = true;
+			++mPollableCount;
+		}
+	}
+	#endif
+
+	int fd = operation.fd;
+	mOperations.emplace(fd, std::move(operation));
+#endif
+}
+
+bool EventLoop::IsLater(const Timer& a, const Timer& b)
+{
+	return a.deadline > b.deadline; // makes the heap keep the earliest first
+}
+
+bool EventLoop::ContinueOperation(Operation& operation)
+{
+#ifndef _WIN32
+	if( operation.writing )
+	{
+		while( operation.offset < operation.data.size() )
+		{
+			size_t size = std::min(ChunkSize, operation.data.size() - operation.offset);
+			ssize_t written = write(operation.fd, operation.data.data() + operation.offset, size);
+
+			if( written >= 0 )
+			{
+				operation.offset += size_t(written);
+
+				if( ! operation.pollable && operation.offset < operation.data.size() )
+					return true; // a chunk per turn
+			}
+			else if( errno == EAGAIN || errno == EWOULDBLOCK )
+			{
+				return true;
+			}
+			else if( errno != EINTR )
+			{
+				FinishOperation(operation, mVirtualMachine.GetMemoryManager().NewError("cannot-write-file"));
+				return false;
+			}
+		}
+
+		FinishOperation(operation, Value(true));
+		return false;
+	}
+
+	char buffer[ChunkSize];
+
+	while( true )
+	{
+		ssize_t count = read(operation.fd, buffer, sizeof(buffer));
+
+		if( count > 0 )
+		{
+			operation.data.append(buffer, size_t(count));
+
+			if( ! operation.pollable )
+				return true; // a chunk per turn
+		}
+		else if( count == 0 )
+		{
+			FinishOperation(operation, mVirtualMachine.GetMemoryManager().NewString(operation.data));
+			return false;
+		}
+		else if( errno == EAGAIN || errno == EWOULDBLOCK )
+		{
+			return true;
+		}
+		else if( errno != EINTR )
+		{
+			FinishOperation(operation, mVirtualMachine.GetMemoryManager().NewError("cannot-read-file"));
+			return false;
+		}
+	}
+#else
+	return false;
+#endif
+}
+
+void EventLoop::FinishOperation(Operation& operation, const Value& result)
+{
+#ifndef _WIN32
+	close(operation.fd); // also takes it out of the epoll set
+#endif
+
+	if( operation.pollable )
+		--mPollableCount;
+
+	mReadyTasks.push_back({operation.coroutine, result});
+}
+
+int EventLoop::GetPollTimeout() const
+{
+	if( ! mReadyTasks.empty() || int(mOperations.size()) > mPollableCount )
+		return 0;
+
+	if( ! mTimers.empty() )
+	{
+		auto left = mTimers.front().deadline - std::chrono::steady_clock::now();
+		auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(left + std::chrono::microseconds(999));
+
+		return std::max(0, int(milliseconds.count()));
+	}
+
+	return mPollableCount > 0 ? -1 : 0;
+}
+
+void EventLoop::Poll(int timeout)
+{
+	// regular files first, a chunk each
+	std::vector<int> finished;
+
+	for( auto& kvp : mOperations )
+		if( ! kvp.second.pollable && ! ContinueOperation(kvp.second) )
+			finished.push_back(kvp.first);
+
+#ifdef __linux__
+	if( mPollableCount > 0 || timeout > 0 )
+	{
+		epoll_event events[64];
+
+		int count = epoll_wait(mEpoll, events, 64, timeout);
+
+		for( int i = 0; i < count; ++i )
+		{
+			auto it = mOperations.find(events[i].data.fd);
+
+			if( it != mOperations.end() && ! ContinueOperation(it->second) )
+				finished.push_back(it->first);
+		}
+	}
+#else
+	if( timeout > 0 )
+		std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+#endif
+
+	for( int fd : finished )
+		mOperations.erase(fd);
+
+	auto now = std::chrono::steady_clock::now();
+
+	while( ! mTimers.empty() && mTimers.front().deadline <= now )
+	{
+		std::pop_heap(mTimers.begin(), mTimers.end(), IsLater);
+
+		mReadyTasks.push_back({mTimers.back().coroutine, Value()});
+		mTimers.pop_back();
+	}
+}
+
+}
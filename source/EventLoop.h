@@ -0,0 +1,107 @@
+#ifndef _EVENT_LOOP_INCLUDED_
+#define _EVENT_LOOP_INCLUDED_
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "MemoryManager.h"
+
+namespace element
+{
+
+class VirtualMachine;
+
+
+// Runs spawned coroutines one after another on the thread of the virtual
+// machine. A coroutine that sleeps or waits for a file is suspended and the
+// loop resumes it with the result once it is ready, in the meantime the other
+// coroutines run. Pipes and other pollable files are watched with epoll.
+// Regular files are always ready as far as epoll is concerned, so they are
+// read and written one chunk per turn of the loop instead.
+class EventLoop : public ExternalRoots
+{
+public:
+					EventLoop(VirtualMachine& vm);
+					~EventLoop();
+
+	void			ResetState();
+
+	void			Spawn(const Value& coroutine);
+	bool			Run(); // until every coroutine is finished, false on error
+	bool			RunUntil(const std::function<bool()>& isDone); // or until nothing is left to run
+	bool			IsRunning() const;
+
+	// whether the native being called can suspend the current coroutine
+	bool			CanSuspend() const;
+	Value			GetCurrentTask() const;
+
+	// for natives that keep the coroutine somewhere else until it can go on
+	void			Suspend();
+	void			Wake(const Value& coroutine, const Value& resumeValue);
+
+	// these suspend the current coroutine until they are done
+	void			Sleep(std::chrono::milliseconds time);
+	void			ReadFile(const std::string& path);
+	void			WriteFile(const std::string& path, const std::string& data);
+
+	void			GetReferences(std::vector<GarbageCollected*>& references) const override;
+
+private:
+	struct Task
+	{
+		Value		coroutine;
+		Value		resumeValue;
+	};
+
+	struct Timer
+	{
+		std::chrono::steady_clock::time_point	deadline;
+		Value									coroutine;
+	};
+
+	struct Operation
+	{
+		Value			coroutine;
+		int				fd = -1;
+		bool			writing = false;
+		bool			pollable = false;
+		std::string		data;
+		size_t			offset = 0;
+		std::string		path;
+	};
+
+	bool			HasWork() const;
+	bool			RunTurn(); // false on error
+
+	void			Resume(const Value& result); // with a result that is ready right away
+	void			StartOperation(Operation&& operation);
+	bool			ContinueOperation(Operation& operation); // false when done
+	void			FinishOperation(Operation& operation, const Value& result);
+
+	int				GetPollTimeout() const;
+	void			Poll(int timeout);
+
+	static bool		IsLater(const Timer& a, const Timer& b);
+
+private:
+	VirtualMachine&							mVirtualMachine;
+
+	std::deque<Task>						mReadyTasks;
+	std::vector<Timer>						mTimers; // a heap, the earliest deadline first
+	std::unordered_map<int, Operation>		mOperations; // by file descriptor
+	int										mPollableCount;
+
+	Value									mCurrentTask;
+	bool									mCurrentTaskWaits;
+	bool									mRunning;
+
+	int										mEpoll;
+};
+
+}
+
+#endif // _EVENT_LOOP_INCLUDED_
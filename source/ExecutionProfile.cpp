@@ -0,0 +1,241 @@
+#include "ExecutionProfile.h"
+
+#include <fstream>
+
+#include "DataTypes.h"
+#include "GarbageCollected.h"
+
+namespace element
+{
+
+static const char* const ProfileHeader = "element-profile 1";
+
+
+void ExecutionProfile::CountHotness(const CodeObject* codeObject)
+{
+	++mRecordedHotness[codeObject];
+}
+
+void ExecutionProfile::RecordCall(const CodeObject* caller, int global, const Function* callee)
+{
+	auto it = mRecordedCalls.emplace(RecordedCall(caller, global), callee).first;
+
+	if( it->second != callee )
+		it->second = nullptr;
+}
+
+void ExecutionProfile::RecordOperands(const CodeObject* codeObject, int index, bool ints)
+{
+	std::vector<char>& operands = mRecordedOperands[codeObject];
+
+	if( operands.empty() )
+		operands.resize(codeObject->instructions.size(), 0);
+
+	if( ints && operands[index] == 0 )
+		operands[index] = 1;
+	else if( ! ints )
+		operands[index] = 2;
+}
+
+void ExecutionProfile::ClearRecording()
+{
+	mRecordedHotness.clear();
+	mRecordedCalls.clear();
+	mRecordedOperands.clear();
+}
+
+bool ExecutionProfile::Save(const std::string& filename, const std::vector<Value>& constants) const
+{
+	std::ofstream file(filename);
+
+	if( ! file )
+		return false;
+
+	// the closures made at runtime are not constants, the calls to them are left out
+	std::unordered_map<const CodeObject*, int> codeObjects;
+	std::unordered_map<const Function*, int> functions;
+
+	for( size_t i = 0; i < constants.size(); ++i )
+	{
+		if( constants[i].type != Value::VT_Function )
+			continue;
+
+		codeObjects.emplace(constants[i].function->codeObject, int(i));
+		functions.emplace(constants[i].function, int(i));
+	}
+
+	file << ProfileHeader << '\n';
+
+	std::map<int, unsigned> hotness; // sorted, so the same runs make the same files
+
+	for( const auto& recorded : mRecordedHotness )
+	{
+		auto function = codeObjects.find(recorded.first);
+
+		if( function != codeObjects.end() )
+			hotness[function->second] += recorded.second;
+	}
+
+	for( const auto& function : hotness )
+		file << "hot " << function.first << ' ' << function.second << '\n';
+
+	std::map<Call, int> calls;
+
+	for( const auto& recorded : mRecordedCalls )
+	{
+		auto caller = codeObjects.find(recorded.first.first);
+		auto callee = functions.find(recorded.second);
+
+		if( caller == codeObjects.end() )
+			continue;
+
+		int target = callee != functions.end() ? callee->second : -1;
+		auto it = calls.emplace(Call(caller->second, recorded.first.second), target).first;
+
+		if( it->second != target )
+			it->second = -1;
+	}
+
+	for( const auto& call : calls )
+		file << "call " << call.first.first << ' ' << call.first.second << ' ' << call.second << '\n';
+
+	std::set<Operation> operations;
+
+	for( const auto& recorded : mRecordedOperands )
+	{
+		auto function = codeObjects.find(recorded.first);
+
+		if( function == codeObjects.end() )
+			continue;
+
+		std::vector<Operation> found = FindOperations(recorded.first, function->second);
+
+		for( size_t i = 0; i < found.size(); ++i )
+			if( recorded.second[i] == 1 && std::get<0>(found[i]) >= 0 )
+				operations.insert(found[i]);
+	}
+
+	for( const Operation& operation : operations )
+	{
+		file	<< "ints " << std::get<0>(operation) << ' ' << std::get<1>(operation) << ' '
+				<< std::get<2>(operation) << ' ' << std::get<3>(operation) << '\n';
+	}
+
+	return bool(file);
+}
+
+bool ExecutionProfile::Load(const std::string& filename)
+{
+	std::ifstream file(filename);
+	std::string line;
+
+	if( ! std::getline(file, line) || line != ProfileHeader )
+		return false;
+
+	mHotness.clear();
+	mCallTargets.clear();
+	mIntOperations.clear();
+
+	std::string kind;
+	bool valid = true;
+
+	while( valid && file >> kind )
+	{
+		if( kind == "hot" )
+		{
+			int function;
+			unsigned count;
+
+			valid = bool(file >> function >> count);
+
+			if( valid )
+				mHotness[function] = count;
+		}
+		else if( kind == "call" )
+		{
+			int caller, global, callee;
+
+			valid = bool(file >> caller >> global >> callee);
+
+			if( valid )
+				mCallTargets[Call(caller, global)] = callee;
+		}
+		else if( kind == "ints" )
+		{
+			int function, line, opCode, before;
+
+			valid = bool(file >> function >> line >> opCode >> before);
+
+			if( valid )
+				mIntOperations.emplace(function, line, opCode, before);
+		}
+		else
+		{
+			valid = false;
+		}
+	}
+
+	// a damaged file is not used at all
+	if( ! valid )
+	{
+		mHotness.clear();
+		mCallTargets.clear();
+		mIntOperations.clear();
+	}
+
+	return valid;
+}
+
+unsigned ExecutionProfile::GetHotness(int function) const
+{
+	auto it = mHotness.find(function);
+	return it != mHotness.end() ? it->second : 0;
+}
+
+int ExecutionProfile::GetCallTarget(int caller, int global) const
+{
+	auto it = mCallTargets.find(Call(caller, global));
+	return it != mCallTargets.end() ? it->second : -1;
+}
+
+std::vector<bool> ExecutionProfile::GetIntOperands(int function, const CodeObject* codeObject) const
+{
+	std::vector<Operation> operations = FindOperations(codeObject, function);
+	std::vector<bool> ints(operations.size(), false);
+
+	for( size_t i = 0; i < operations.size(); ++i )
+		ints[i] = std::get<0>(operations[i]) >= 0 && mIntOperations.count(operations[i]) > 0;
+
+	return ints;
+}
+
+std::vector<ExecutionProfile::Operation> ExecutionProfile::FindOperations(const CodeObject* codeObject, int function)
+{
+	const std::vector<Instruction>& instructions = codeObject->instructions;
+	const std::vector<SourceCodeLine>& lines = codeObject->instructionLines;
+
+	std::vector<Operation> operations(instructions.size(), Operation(-1, 0, 0, 0));
+	std::map<std::pair<int, int>, int> counts; // of each operation on each line, so far
+
+	auto next = lines.begin();
+	int line = 0;
+
+	for( size_t i = 0; i < instructions.size(); ++i )
+	{
+		for( ; next != lines.end() && next->instructionIndex <= int(i); ++next )
+			line = next->line;
+
+		// the typed ones are counted too, the compiler can know the types in one run and not in another
+		const OpCode opCode = UntypedOpCode(instructions[i].opCode);
+
+		if( CheckedOpCode(opCode) == opCode )
+			continue;
+
+		int before = counts[std::make_pair(line, int(opCode))]++;
+		operations[i] = Operation(function, line, int(opCode), before);
+	}
+
+	return operations;
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef _EXECUTION_PROFILE_INCLUDED_
+#define _EXECUTION_PROFILE_INCLUDED_
+
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Value.h"
+
+namespace element
+{
+
+struct CodeObject;
+
+
+// What a run of a module has shown about its code, kept in a file for the runs
+// after it: how hot each function got, which function was called from each
+// global, in each function, and which binary operations got two ints every time
+// they ran. The functions are the indices of their constants,
+// which are the same as long as the same files are run in the same order. When
+// they are not the same, the profile only gives worse guesses, since the code
+// compiled from it checks them before it relies on them.
+class ExecutionProfile
+{
+public:
+	// recording, while the code runs
+	void		CountHotness(const CodeObject* codeObject);
+	void		RecordCall(const CodeObject* caller, int global, const Function* callee);
+	void		RecordOperands(const CodeObject* codeObject, int index, bool ints); // of the binary operation at 'index'
+	void		ClearRecording();
+
+	bool		Save(const std::string& filename, const std::vector<Value>& constants) const;
+
+	// using, while the code of a later run is compiled
+	bool		Load(const std::string& filename);
+
+	unsigned	GetHotness(int function) const;
+	int			GetCallTarget(int caller, int global) const; // -1 when it is not always the same function
+	std::vector<bool> GetIntOperands(int function, const CodeObject* codeObject) const; // for each instruction
+
+protected:
+	typedef std::pair<const CodeObject*, int> RecordedCall;
+	typedef std::pair<int, int> Call;
+
+	// A binary operation is told apart by its function, its line, its operation
+	// and the count of the same operations before it on the line. These stay the
+	// same when the code around it is compiled differently, with other calls
+	// inlined. The ones that are not binary operations have -1 as function.
+	typedef std::tuple<int, int, int, int> Operation;
+
+	static std::vector<Operation> FindOperations(const CodeObject* codeObject, int function);
+
+	std::unordered_map<const CodeObject*, unsigned>	mRecordedHotness;
+	std::map<RecordedCall, const Function*>			mRecordedCalls; // nullptr after a second function
+	std::unordered_map<const CodeObject*, std::vector<char>>	mRecordedOperands; // 1 while they are ints, 2 after others
+
+	std::map<int, unsigned>							mHotness;
+	std::map<Call, int>								mCallTargets;
+	std::set<Operation>								mIntOperations;
+};
+
+}
+
+#endif // _EXECUTION_PROFILE_INCLUDED_
@@ -24,10 +24,10 @@ bool GetFileExists(const std::string& filename)
 std::string GetExecutableLocation()
 {
 #ifdef _WIN32
-	static char result[MAX_PATH];
+	char result[MAX_PATH];
 	return std::string(result, GetModuleFileName(0, result, MAX_PATH));
 #else
-	static char result[PATH_MAX];
+	char result[PATH_MAX];
 	ssize_t count = readlink("/proc/self/exe", result, PATH_MAX);
 	return std::string(result, count > 0 ? count : 0);
 #endif
@@ -36,10 +36,10 @@ std::string GetExecutableLocation()
 std::string GetCurrentWorkingDirectory()
 {
 #ifdef _WIN32
-	static char result[MAX_PATH];
+	char result[MAX_PATH];
 	return _getcwd(result, MAX_PATH) ? std::string(result) : std::string("");
 #else
-	static char result[PATH_MAX];
+	char result[PATH_MAX];
 	return getcwd(result, PATH_MAX) ? std::string(result) : std::string("");
 #endif
 }
@@ -55,6 +55,15 @@ bool IsPathDelimiter(char c)
 	return c == '/' || c == '\\';
 }
 
+// "/a/b" "\\a\\b" "C:\\a" -> true, "a/b" "./a" -> false
+bool IsAbsolutePath(const std::string& path)
+{
+	if( ! path.empty() && IsPathDelimiter(path[0]) )
+		return true;
+
+	return path.size() > 1 && path[1] == ':';
+}
+
 // "a/b.c/d/e.txt" -> "a/b.c/d/"
 std::string PathOf(const std::string& pathAndName)
 {
@@ -253,6 +262,9 @@ std::string FileManager::ResolveFile(std::string filename) const
 	if( ExtensionOf(filename).empty() )
 		filename.append(".element");
 	
+	if( IsAbsolutePath(filename) )
+		return GetFileExists(filename) ? NormalizePath(filename) : std::string();
+	
 	std::string testFilename = ConcatenatePaths(mLocationOfExecutingFile.back(), filename);
 	
 	if( GetFileExists(testFilename) )
@@ -26,7 +26,7 @@ public:				FileManager();
 	std::string		PushFileToExecute(const std::string& filename);
 	void			PopFileToExecute();
 
-protected:
+	// Same resolution as 'PushFileToExecute', without entering the file.
 	std::string		ResolveFile(std::string filename) const;
 	
 private:
@@ -0,0 +1,739 @@
+#include "FlowOptimizer.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace element
+{
+
+// after one of these any member of any object can be different
+static bool ChangesObjects(OpCode opCode)
+{
+	switch( opCode )
+	{
+	case OpCode::OC_Unpack:
+	case OpCode::OC_StoreElement:
+	case OpCode::OC_PopStoreElement:
+	case OpCode::OC_ArrayPushBack:
+	case OpCode::OC_ArrayPopBack:
+	case OpCode::OC_StoreMember:
+	case OpCode::OC_PopStoreMember:
+	case OpCode::OC_MakeIterator:
+	case OpCode::OC_IteratorHasNext:
+	case OpCode::OC_IteratorGetNext:
+	case OpCode::OC_FunctionCall:
+	case OpCode::OC_CallMethod:
+	case OpCode::OC_Yield:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// the ones that can't fail and leave nothing behind that is seen after an error
+static bool IsHarmless(OpCode opCode)
+{
+	switch( opCode )
+	{
+	case OpCode::OC_Pop:
+	case OpCode::OC_Rotate2:
+	case OpCode::OC_Duplicate:
+	case OpCode::OC_LoadConstant:
+	case OpCode::OC_LoadLocal:
+	case OpCode::OC_LoadGlobal:
+	case OpCode::OC_LoadNative:
+	case OpCode::OC_LoadArgument:
+	case OpCode::OC_LoadThis:
+	case OpCode::OC_StoreLocal:
+	case OpCode::OC_PopStoreLocal:
+	case OpCode::OC_LoadHash:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// the instructions that can run after the one at 'index'
+static int FindSuccessors(const std::vector<Instruction>& instructions, int index, int successors[2])
+{
+	const Instruction& instruction = instructions[index];
+
+	if( instruction.opCode == OpCode::OC_Jump )
+	{
+		successors[0] = instruction.A;
+		return 1;
+	}
+
+	if( instruction.opCode == OpCode::OC_EndFunction )
+		return 0;
+
+	successors[0] = index + 1;
+
+	if( ! IsJump(instruction.opCode) )
+		return 1;
+
+	successors[1] = instruction.A;
+	return 2;
+}
+
+
+FlowOptimizer::FlowOptimizer(CodeObject* codeObject)
+: mCodeObject(codeObject)
+, mInstructions(codeObject->instructions)
+{
+	FindJumpTargets();
+}
+
+bool FlowOptimizer::Optimize()
+{
+	if( mInstructions.empty() )
+		return false;
+
+	// the copies are replaced first, so the chains of the copies are the same as the others
+	bool changed = PropagateCopies();
+	changed = HoistLoopInvariants() || changed;
+	changed = EliminateCommonChains() || changed;
+	changed = RemoveDeadStores() || changed;
+	return changed;
+}
+
+bool FlowOptimizer::HoistLoopInvariants()
+{
+	// the last jump back to an instruction is the end of the loop that starts there
+	std::map<int, int> loops;
+
+	for( int i = 0; i < int(mInstructions.size()); ++i )
+		if( mInstructions[i].opCode == OpCode::OC_Jump && mInstructions[i].A <= i )
+			loops[mInstructions[i].A] = i;
+
+	bool changed = false;
+
+	// From the last loop to the first one, the starts of the ones left are not
+	// moved and only the ends of the ones around it are.
+	for( auto it = loops.rbegin(); it != loops.rend(); ++it )
+	{
+		int oldSize = int(mInstructions.size());
+
+		if( ! HoistLoopInvariants(it->first, it->second) )
+			continue;
+
+		int growth = int(mInstructions.size()) - oldSize;
+
+		for( auto outer = std::next(it); outer != loops.rend(); ++outer )
+			if( outer->second > it->second )
+				outer->second += growth;
+
+		changed = true;
+	}
+
+	return changed;
+}
+
+// A loop like
+//		head:	condition
+//				PopJumpIfFalse end
+//				body
+//				Jump head
+//		end:
+// becomes
+//				condition
+//				PopJumpIfFalse end
+//				the invariant chains, each one stored in a new local
+//		start:	body
+//				condition
+//				PopJumpIfFalse end
+//				Jump start
+//		end:
+// with the chains loaded from their locals inside. They are loaded only when
+// the loop runs and only when they would be loaded without an error anyway:
+// they are in the part of the condition without jumps, that was just run, or
+// in the body before anything that can fail. A script can be suspended at
+// the jump back and the host can change objects before it is resumed, so the
+// loads are run again then, see 'LoopReload'. Only the innermost loops are
+// changed, the ones around them would have loads that are not run again.
+bool FlowOptimizer::HoistLoopInvariants(int head, int backJump)
+{
+	const int size = int(mInstructions.size());
+	const int end = backJump + 1;
+
+	int test = -1; // where the loop ends if the condition is false
+
+	for( int i = head; i < backJump && test < 0; ++i )
+		if( mInstructions[i].opCode == OpCode::OC_PopJumpIfFalse && mInstructions[i].A == end )
+			test = i;
+
+	if( test < 0 )
+		return false;
+
+	// Nothing in the loop changes objects, the jumps from the condition stay in
+	// it or go to the end and only the start of the loop is a target from the
+	// outside or from the body.
+	for( int i = 0; i < size; ++i )
+	{
+		const Instruction& instruction = mInstructions[i];
+		bool inside = i >= head && i <= backJump;
+
+		if( inside && ChangesObjects(instruction.opCode) )
+			return false;
+
+		if( inside && i != backJump && instruction.opCode == OpCode::OC_Jump && instruction.A <= i )
+			return false;
+
+		if( ! IsJump(instruction.opCode) )
+			continue;
+
+		int target = instruction.A;
+
+		if( target > head && target <= backJump && (! inside || (i > test && target <= test)) )
+			return false;
+
+		if( i >= head && i < test && target != end && (target <= head || target > test) )
+			return false;
+	}
+
+	// the chains to load before the loop, by the first one of each key
+	std::map<ChainKey, int> temps;
+	std::vector<std::pair<int, int>> hoisted;
+
+	auto hoist = [&](int index, int members)
+	{
+		ChainKey key = MakeChainKey(index, members);
+
+		for( int i = head; i <= backJump; ++i )
+			if( StoresTo(mInstructions[i], key) )
+				return;
+
+		if( temps.count(key) == 0 )
+		{
+			temps[key] = mCodeObject->localVariablesCount++;
+			hoisted.emplace_back(index, members);
+		}
+	};
+
+	for( int i = head; i < test && (i == head || ! mTargets[i]) && ! IsJump(mInstructions[i].opCode); )
+	{
+		int members = ChainLength(i);
+
+		if( members > 1 )
+		{
+			hoist(i, members - 1);
+			i += 1 + 2 * members;
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	for( int i = test + 1; i < backJump && ! mTargets[i]; ++i )
+	{
+		int members = ChainLength(i);
+
+		if( members > 1 )
+		{
+			hoist(i, members - 1);
+			break; // its last member can fail
+		}
+
+		if( ! IsHarmless(mInstructions[i].opCode) )
+			break;
+	}
+
+	if( hoisted.empty() )
+		return false;
+
+	std::vector<Emitted> code;
+
+	auto emit = [&](int from, int to, int copy, bool replace)
+	{
+		for( int i = from; i < to; )
+		{
+			const Instruction& instruction = mInstructions[i];
+			int members = replace ? ChainLength(i) - 1 : 0;
+
+			for( ; members > 0; --members )
+			{
+				auto it = temps.find(MakeChainKey(i, members));
+
+				if( it != temps.end() )
+				{
+					code.push_back({Instruction(OpCode::OC_LoadLocal, it->second), i, copy, 0});
+					break;
+				}
+			}
+
+			if( members > 0 )
+			{
+				i += 1 + 2 * members;
+				continue;
+			}
+
+			Emitted emitted = {instruction, i, copy, 0};
+
+			// The jumps inside the condition stay in its copy. The ones from the body
+			// to the start, or to the jump back to it, go to the copy too.
+			if( IsJump(instruction.opCode) && replace )
+			{
+				if( copy == 0 && instruction.A == backJump )
+					emitted.instruction.A = head;
+
+				if( emitted.instruction.A >= head && emitted.instruction.A <= test && (copy == 1 || emitted.instruction.A == head) )
+					emitted.targetCopy = 1;
+			}
+
+			code.push_back(emitted);
+			++i;
+		}
+	};
+
+	emit(0, test + 1, 0, false);
+
+	const int loadsIndex = int(code.size());
+
+	for( const std::pair<int, int>& chain : hoisted )
+	{
+		int members = chain.second;
+		ChainKey key = MakeChainKey(chain.first, members);
+
+		emit(chain.first, chain.first + 1 + 2 * members, 2, false);
+		code.push_back({Instruction(OpCode::OC_PopStoreLocal, temps[key]), chain.first, 2, 0});
+	}
+
+	emit(test + 1, backJump, 0, true);
+	emit(head, test + 1, 1, true);
+
+	const int jumpIndex = int(code.size());
+
+	if( test + 1 < backJump )
+		code.push_back({Instruction(OpCode::OC_Jump, test + 1), backJump, 0, 0});
+	else // there is no body, only the condition is repeated
+		code.push_back({Instruction(OpCode::OC_Jump, head), backJump, 0, 1});
+
+	emit(end, size, 0, false);
+
+	Assemble(code);
+	mCodeObject->loopReloads.push_back({jumpIndex, loadsIndex});
+	return true;
+}
+
+bool FlowOptimizer::EliminateCommonChains()
+{
+	const int size = int(mInstructions.size());
+
+	struct Loaded
+	{
+		int index;	// the first one of the key
+		int temp;	// the local it is stored in, once another one is found
+	};
+
+	std::map<ChainKey, Loaded> loaded;
+	std::vector<int> replaced(size, 0); // the members loaded from a local instead
+	std::vector<int> replacedTemps(size, -1);
+	std::vector<int> storesAfter(size, -1);
+	bool changed = false;
+
+	for( int i = 0; i < size; )
+	{
+		const Instruction& instruction = mInstructions[i];
+
+		if( mTargets[i] ) // the ones loaded on the other ways here are not known
+			loaded.clear();
+
+		int members = ChainLength(i);
+
+		if( members > 1 )
+		{
+			// the longest one loaded before
+			int found = members - 1;
+			auto it = loaded.end();
+
+			for( ; found > 0; --found )
+			{
+				it = loaded.find(MakeChainKey(i, found));
+
+				if( it != loaded.end() )
+					break;
+			}
+
+			if( found > 0 )
+			{
+				Loaded& first = it->second;
+
+				if( first.temp < 0 )
+				{
+					first.temp = mCodeObject->localVariablesCount++;
+					storesAfter[first.index + 2 * found] = first.temp;
+				}
+
+				replaced[i] = found;
+				replacedTemps[i] = first.temp;
+				changed = true;
+			}
+
+			for( int m = 1; m < members; ++m )
+				loaded.emplace(MakeChainKey(i, m), Loaded{i, -1});
+
+			i += 1 + 2 * members;
+			continue;
+		}
+
+		if( ChangesObjects(instruction.opCode) )
+		{
+			loaded.clear();
+		}
+		else
+		{
+			for( auto it = loaded.begin(); it != loaded.end(); )
+			{
+				if( StoresTo(instruction, it->first) )
+					it = loaded.erase(it);
+				else
+					++it;
+			}
+		}
+
+		++i;
+	}
+
+	if( ! changed )
+		return false;
+
+	std::vector<Emitted> code;
+
+	for( int i = 0; i < size; )
+	{
+		if( replaced[i] > 0 )
+		{
+			code.push_back({Instruction(OpCode::OC_LoadLocal, replacedTemps[i]), i, 0, 0});
+			i += 1 + 2 * replaced[i];
+			continue;
+		}
+
+		code.push_back({mInstructions[i], i, 0, 0});
+
+		if( storesAfter[i] >= 0 )
+			code.push_back({Instruction(OpCode::OC_StoreLocal, storesAfter[i]), i, 0, 0});
+
+		++i;
+	}
+
+	Assemble(code);
+	return true;
+}
+
+bool FlowOptimizer::PropagateCopies()
+{
+	const int size = int(mInstructions.size());
+
+	std::map<int, int> copies; // the locals that hold the same value as another one
+	bool changed = false;
+
+	for( int i = 0; i < size; ++i )
+	{
+		Instruction& instruction = mInstructions[i];
+
+		if( mTargets[i] )
+			copies.clear();
+
+		if( instruction.opCode == OpCode::OC_LoadLocal )
+		{
+			auto it = copies.find(instruction.A);
+
+			if( it != copies.end() )
+			{
+				instruction.A = it->second;
+				changed = true;
+			}
+
+			continue;
+		}
+
+		if( instruction.opCode != OpCode::OC_StoreLocal &&
+			instruction.opCode != OpCode::OC_PopStoreLocal &&
+			instruction.opCode != OpCode::OC_MakeBox )
+			continue;
+
+		int local = instruction.A;
+
+		copies.erase(local);
+
+		for( auto it = copies.begin(); it != copies.end(); )
+		{
+			if( it->second == local )
+				it = copies.erase(it);
+			else
+				++it;
+		}
+
+		const Instruction* previous = i > 0 && ! mTargets[i] ? &mInstructions[i - 1] : nullptr;
+
+		if( instruction.opCode != OpCode::OC_MakeBox &&
+			previous && previous->opCode == OpCode::OC_LoadLocal && previous->A != local )
+		{
+			copies[local] = previous->A;
+		}
+	}
+
+	return changed;
+}
+
+bool FlowOptimizer::RemoveDeadStores()
+{
+	const int size = int(mInstructions.size());
+	const int locals = mCodeObject->localVariablesCount;
+
+	if( locals == 0 )
+		return false;
+
+	// the locals that are loaded later, before they are stored again, one bit each
+	const int words = (locals + 63) / 64;
+	std::vector<uint64_t> liveIn((size + 1) * words, 0);
+	std::vector<uint64_t> liveOut(words);
+
+	auto findLiveOut = [&](int index)
+	{
+		int successors[2];
+		int count = FindSuccessors(mInstructions, index, successors);
+
+		std::fill(liveOut.begin(), liveOut.end(), 0);
+
+		for( int s = 0; s < count; ++s )
+			for( int w = 0; w < words; ++w )
+				liveOut[w] |= liveIn[successors[s] * words + w];
+	};
+
+	auto isLive = [&](int local)
+	{
+		return (liveOut[local / 64] >> (local % 64)) & 1;
+	};
+
+	bool changed = true;
+
+	while( changed )
+	{
+		changed = false;
+
+		for( int i = size - 1; i >= 0; --i )
+		{
+			const Instruction& instruction = mInstructions[i];
+
+			findLiveOut(i);
+
+			switch( instruction.opCode )
+			{
+			case OpCode::OC_StoreLocal:
+			case OpCode::OC_PopStoreLocal:
+				liveOut[instruction.A / 64] &= ~(uint64_t(1) << (instruction.A % 64));
+				break;
+
+			case OpCode::OC_LoadLocal:
+			case OpCode::OC_MakeBox:
+			case OpCode::OC_LoadFromBox:
+			case OpCode::OC_StoreToBox:
+			case OpCode::OC_PopStoreToBox:
+				liveOut[instruction.A / 64] |= uint64_t(1) << (instruction.A % 64);
+				break;
+
+			case OpCode::OC_MakeClosure: // it copies the values of the ones it captures
+				std::fill(liveOut.begin(), liveOut.end(), ~uint64_t(0));
+				break;
+
+			default:
+				break;
+			}
+
+			if( ! std::equal(liveOut.begin(), liveOut.end(), liveIn.begin() + i * words) )
+			{
+				std::copy(liveOut.begin(), liveOut.end(), liveIn.begin() + i * words);
+				changed = true;
+			}
+		}
+	}
+
+	std::vector<Emitted> code;
+	bool removed = false;
+
+	for( int i = 0; i < size; ++i )
+	{
+		Instruction& instruction = mInstructions[i];
+
+		if( instruction.opCode == OpCode::OC_StoreLocal || instruction.opCode == OpCode::OC_PopStoreLocal )
+		{
+			findLiveOut(i);
+
+			if( ! isLive(instruction.A) )
+			{
+				changed = true;
+
+				if( instruction.opCode == OpCode::OC_PopStoreLocal )
+				{
+					instruction = Instruction(OpCode::OC_Pop);
+				}
+				else // the value stays on the stack, there is nothing to do
+				{
+					removed = true;
+					continue;
+				}
+			}
+		}
+
+		code.push_back({instruction, i, 0, 0});
+	}
+
+	if( removed )
+		Assemble(code);
+
+	return changed;
+}
+
+int FlowOptimizer::ChainLength(int index) const
+{
+	OpCode opCode = mInstructions[index].opCode;
+
+	if( opCode != OpCode::OC_LoadLocal &&
+		opCode != OpCode::OC_LoadGlobal &&
+		opCode != OpCode::OC_LoadThis )
+		return 0;
+
+	const int size = int(mInstructions.size());
+	int members = 0;
+
+	for( int i = index + 1; i + 1 < size; i += 2, ++members )
+	{
+		if( mInstructions[i].opCode != OpCode::OC_LoadHash ||
+			mInstructions[i + 1].opCode != OpCode::OC_LoadMember ||
+			mTargets[i] || mTargets[i + 1] )
+			break;
+	}
+
+	return members;
+}
+
+FlowOptimizer::ChainKey FlowOptimizer::MakeChainKey(int index, int members) const
+{
+	ChainKey key = { unsigned(mInstructions[index].opCode), unsigned(mInstructions[index].A) };
+
+	for( int m = 0; m < members; ++m )
+		key.push_back(mInstructions[index + 1 + 2 * m].H);
+
+	return key;
+}
+
+bool FlowOptimizer::StoresTo(const Instruction& instruction, const ChainKey& key) const
+{
+	if( unsigned(instruction.A) != key[1] )
+		return false;
+
+	switch( OpCode(key[0]) )
+	{
+	case OpCode::OC_LoadLocal:
+		return	instruction.opCode == OpCode::OC_StoreLocal ||
+				instruction.opCode == OpCode::OC_PopStoreLocal ||
+				instruction.opCode == OpCode::OC_MakeBox;
+
+	case OpCode::OC_LoadGlobal:
+		return	instruction.opCode == OpCode::OC_StoreGlobal ||
+				instruction.opCode == OpCode::OC_PopStoreGlobal;
+
+	default: // 'this' stays the same
+		return false;
+	}
+}
+
+void FlowOptimizer::FindJumpTargets()
+{
+	mTargets.assign(mInstructions.size() + 1, false);
+
+	for( const Instruction& instruction : mInstructions )
+		if( IsJump(instruction.opCode) )
+			mTargets[instruction.A] = true;
+}
+
+void FlowOptimizer::Assemble(const std::vector<Emitted>& code)
+{
+	Assemble(mCodeObject, code);
+	FindJumpTargets();
+}
+
+void FlowOptimizer::Assemble(CodeObject* codeObject, const std::vector<Emitted>& code)
+{
+	const int oldSize = int(codeObject->instructions.size());
+	const int newSize = int(code.size());
+
+	int copies = 1;
+
+	for( const Emitted& emitted : code )
+		copies = std::max(copies, emitted.copy + 1);
+
+	// where each instruction is now in each copy, the first one that comes from it
+	std::vector<std::vector<int>> newIndices(copies, std::vector<int>(oldSize + 1, -1));
+
+	for( int i = newSize - 1; i >= 0; --i )
+		newIndices[code[i].copy][code[i].origin] = i;
+
+	newIndices[0][oldSize] = newSize;
+
+	// the ones that are gone go to the next one that is not
+	for( std::vector<int>& indices : newIndices )
+		for( int i = oldSize - 1; i >= 0; --i )
+			if( indices[i] < 0 )
+				indices[i] = indices[i + 1];
+
+	std::vector<Instruction> instructions;
+	instructions.reserve(newSize);
+
+	for( const Emitted& emitted : code )
+	{
+		Instruction instruction = emitted.instruction;
+
+		if( IsJump(instruction.opCode) && emitted.targetCopy >= 0 )
+		{
+			int target = newIndices[emitted.targetCopy][instruction.A];
+			instruction.A = target >= 0 ? target : newIndices[0][instruction.A];
+		}
+
+		instructions.push_back(instruction);
+	}
+
+	// a jump back that is gone or copied has no loads to run again
+	std::vector<LoopReload> reloads;
+
+	for( const LoopReload& reload : codeObject->loopReloads )
+	{
+		int jumpIndex = newIndices[0][reload.jumpIndex];
+
+		if( jumpIndex < newSize && code[jumpIndex].origin == reload.jumpIndex && code[jumpIndex].copy == 0 )
+			reloads.push_back({jumpIndex, newIndices[0][reload.loadsIndex]});
+	}
+
+	// each one keeps the line of the one it comes from
+	const std::vector<SourceCodeLine>& oldLines = codeObject->instructionLines;
+	std::vector<SourceCodeLine> lines;
+
+	for( int i = 0; i < newSize; ++i )
+	{
+		int line = code[i].line;
+		int calledFrom = code[i].calledFrom;
+
+		if( line == 0 )
+		{
+			auto it = std::upper_bound(oldLines.begin(), oldLines.end(), code[i].origin,
+				[](int index, const SourceCodeLine& line) { return index < line.instructionIndex; });
+
+			if( it == oldLines.begin() )
+				continue;
+
+			line = (it - 1)->line;
+			calledFrom = (it - 1)->calledFrom;
+		}
+
+		if( lines.empty() || lines.back().line != line || lines.back().calledFrom != calledFrom )
+			lines.push_back({line, i, calledFrom});
+	}
+
+	codeObject->instructions = std::move(instructions);
+	codeObject->instructionLines = std::move(lines);
+	codeObject->loopReloads = std::move(reloads);
+}
+
+}
@@ -0,0 +1,67 @@
+#ifndef _FLOW_OPTIMIZER_INCLUDED_
+#define _FLOW_OPTIMIZER_INCLUDED_
+
+#include <map>
+#include <vector>
+
+#include "DataTypes.h"
+#include "OpCodes.h"
+
+namespace element
+{
+
+// Optimizations that follow the values through the jumps of a function, done
+// on its bytecode after the compiler has built it. The object of a chain of
+// members like 'a.b.c' is loaded once before an inner loop that changes no
+// objects, instead of on every iteration, and once in a stretch of code without
+// stores and calls in it. The last member of a chain is still loaded where it was,
+// so the functions called after it get the same 'this'. Copies of local
+// variables are replaced by the originals and the stores to locals that are
+// not loaded again are removed.
+class FlowOptimizer
+{
+public:
+					FlowOptimizer(CodeObject* codeObject);
+
+	bool			Optimize(); // true if the code was changed
+
+	struct Emitted
+	{
+		Instruction	instruction;
+		int			origin;		// the instruction it comes from, for its line and for the jumps to it
+		int			copy;		// 0 for the one place of an instruction, more for its copies
+		int			targetCopy;	// the copy a jump goes to, -1 if its target is already in the new code
+		int			line;		// 0 for the line of the origin, the line it comes from in another function
+		int			calledFrom;	// with 'line', the line of the call that function is inlined at
+	};
+
+	// replaces the instructions of the code object with the new ones
+	static void		Assemble(CodeObject* codeObject, const std::vector<Emitted>& code);
+
+protected:
+	// The instructions that load a variable and then its members, one by one.
+	// The key of the first 'members' of them is the variable and their hashes.
+	typedef std::vector<unsigned> ChainKey;
+
+	bool			HoistLoopInvariants();
+	bool			HoistLoopInvariants(int head, int backJump);
+	bool			EliminateCommonChains();
+	bool			PropagateCopies();
+	bool			RemoveDeadStores();
+
+	int				ChainLength(int index) const; // the count of members loaded after it
+	ChainKey		MakeChainKey(int index, int members) const;
+	bool			StoresTo(const Instruction& instruction, const ChainKey& key) const;
+
+	void			FindJumpTargets();
+	void			Assemble(const std::vector<Emitted>& code);
+
+protected:
+	CodeObject*					mCodeObject;
+	std::vector<Instruction>&	mInstructions;
+	std::vector<bool>			mTargets;
+};
+
+}
+
+#endif // _FLOW_OPTIMIZER_INCLUDED_
@@ -1,5 +1,7 @@
 #include "GarbageCollected.h"
 
+#include <memory>
+
 #include "DataTypes.h"
 #include "VirtualMachine.h"
 
@@ -7,9 +9,9 @@ namespace element
 {
 
 GarbageCollected::GarbageCollected(Value::Type type)
-: next(nullptr)
-, type(type)
-, state(GC_White0)
+: type(type)
+, state(GC_Static) // until the MemoryManager adopts it
+, size(0)
 {}
 
 
@@ -86,15 +88,29 @@ Function::Function(const CodeObject* codeObject)
 : GarbageCollected(Value::VT_Function)
 , codeObject(codeObject)
 , executionContext(nullptr)
+, freeVariablesCount(0)
 {
 }
 
-Function::Function(const Function* o)
+Function::Function(const Function* o, unsigned freeVariablesCount)
 : GarbageCollected(Value::VT_Function)
 , codeObject(o->codeObject)
-, freeVariables(o->freeVariables)
 , executionContext(nullptr)
+, freeVariablesCount(freeVariablesCount)
 {
+	static_assert(sizeof(Function) % alignof(Value) == 0, "the free variables must be aligned");
+
+	Value* freeVariables = FreeVariables();
+
+	if( o->freeVariablesCount == freeVariablesCount )
+		std::uninitialized_copy(o->FreeVariables(), o->FreeVariables() + freeVariablesCount, freeVariables);
+	else
+		std::uninitialized_fill(freeVariables, freeVariables + freeVariablesCount, Value());
+}
+
+unsigned Function::SizeWith(unsigned freeVariablesCount)
+{
+	return unsigned(sizeof(Function) + freeVariablesCount * sizeof(Value));
 }
 
 
@@ -112,6 +128,51 @@ Iterator::~Iterator()
 }
 
 
+Channel::Channel(unsigned capacity)
+: GarbageCollected(Value::VT_Channel)
+, buffer(capacity)
+, first(0)
+, count(0)
+, closed(false)
+{
+}
+
+bool Channel::IsFull() const
+{
+	return count == buffer.size();
+}
+
+void Channel::Push(const Value& value)
+{
+	buffer[(first + count) % buffer.size()] = value;
+	++count;
+}
+
+Value Channel::Pop()
+{
+	Value value = buffer[first];
+	buffer[first] = Value(); // so the collector does not keep it alive
+
+	first = (first + 1) % buffer.size();
+	--count;
+
+	return value;
+}
+
+
+void IteratorImplementation::GetReferences(std::vector<GarbageCollected*>& references) const
+{
+	if( thisObjectUsed.IsGarbageCollected() )
+		references.push_back(thisObjectUsed.garbageCollected);
+
+	if( hasNextFunction.IsGarbageCollected() )
+		references.push_back(hasNextFunction.garbageCollected);
+
+	if( getNextFunction.IsGarbageCollected() )
+		references.push_back(getNextFunction.garbageCollected);
+}
+
+
 ArrayIterator::ArrayIterator(Array* array)
 : array(array)
 {
@@ -130,11 +191,15 @@ ArrayIterator::ArrayIterator(Array* array)
 	});
 }
 
-void ArrayIterator::UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-									GarbageCollected::State currentWhite)
+unsigned ArrayIterator::CalculateSize() const
+{
+	return sizeof(ArrayIterator);
+}
+
+void ArrayIterator::GetReferences(std::vector<GarbageCollected*>& references) const
 {
-	if( array->state == currentWhite )
-		grayList.push_back(array);
+	IteratorImplementation::GetReferences(references);
+	references.push_back(array);
 }
 
 
@@ -158,11 +223,15 @@ StringIterator::StringIterator(String* str)
 	});
 }
 
-void StringIterator::UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-									 GarbageCollected::State currentWhite)
+unsigned StringIterator::CalculateSize() const
+{
+	return sizeof(StringIterator);
+}
+
+void StringIterator::GetReferences(std::vector<GarbageCollected*>& references) const
 {
-	if( str->state == currentWhite )
-		grayList.push_back(str);
+	IteratorImplementation::GetReferences(references);
+	references.push_back(str);
 }
 
 
@@ -173,11 +242,9 @@ ObjectIterator::ObjectIterator(const Value& object, const Value& hasNext, const
 	getNextFunction	= getNext;
 }
 
-void ObjectIterator::UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-									GarbageCollected::State currentWhite)
+unsigned ObjectIterator::CalculateSize() const
 {
-	if( thisObjectUsed.object->state == currentWhite )
-		grayList.push_back(thisObjectUsed.object);
+	return sizeof(ObjectIterator);
 }
 
 
@@ -193,11 +260,9 @@ CoroutineIterator::CoroutineIterator(Function* coroutine)
 	getNextFunction = coroutine;
 }
 
-void CoroutineIterator::UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-									GarbageCollected::State currentWhite)
+unsigned CoroutineIterator::CalculateSize() const
 {
-	if( getNextFunction.function->state == currentWhite )
-		grayList.push_back(getNextFunction.function);
+	return sizeof(CoroutineIterator);
 }
 
 }
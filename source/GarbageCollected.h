@@ -16,19 +16,15 @@ struct ExecutionContext;
 
 struct GarbageCollected
 {
-	enum State : char // Tri-color marking (incremental garbage collection)
+	enum State : char // mark bits are kept in the bitmaps of the heap pages
 	{
-		GC_White0	= 0, // not used 0
-		GC_White1	= 1, // not used 1
-		GC_Gray		= 2, // to be checked
-		GC_Black	= 3, // used
-
-		GC_Static	= 4, // not part of garbage collection (constants)
+		GC_Heap		= 0, // allocated in a heap page by the MemoryManager
+		GC_Static	= 1, // not part of garbage collection (constants)
 	};
 
-	GarbageCollected*	next;
 	Value::Type			type;
 	State				state;
+	unsigned			size; // bytes accounted for this object, including owned storage
 
 	GarbageCollected(Value::Type type);
 };
@@ -90,22 +86,30 @@ struct Box : public GarbageCollected
 };
 
 
+// The free variables are stored right after the function in the same slot,
+// one for each entry of the closure mapping of its code object.
 struct Function : public GarbageCollected
 {
 	const CodeObject*	codeObject;
-	std::vector<Box*>	freeVariables;
 	ExecutionContext*	executionContext;
+	unsigned			freeVariablesCount;
 
 	Function(const CodeObject* codeObject);
-	Function(const Function* o);
+	Function(const Function* o, unsigned freeVariablesCount); // copies the free variables of 'o' if it has as many
+
+	// boxes, or the values themselves if they never change
+	Value*			FreeVariables()			{ return reinterpret_cast<Value*>(this + 1); }
+	const Value*	FreeVariables() const	{ return reinterpret_cast<const Value*>(this + 1); }
+
+	static unsigned	SizeWith(unsigned freeVariablesCount);
 };
 
 
 struct IteratorImplementation
 {
 	virtual ~IteratorImplementation() = default;
-	virtual void UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-								GarbageCollected::State currentWhite) {};
+	virtual unsigned CalculateSize() const { return sizeof(IteratorImplementation); }
+	virtual void GetReferences(std::vector<GarbageCollected*>& references) const;
 	Value thisObjectUsed;
 	Value hasNextFunction;
 	Value getNextFunction;
@@ -124,6 +128,27 @@ struct Iterator : public GarbageCollected
 };
 
 
+// A bounded queue of values between the coroutines of one virtual machine.
+// The buffer is used as a ring. Senders that find it full and receivers that
+// find it empty wait in line, suspended, until the other side comes along.
+struct Channel : public GarbageCollected
+{
+	std::vector<Value>	buffer; // as many slots as the capacity
+	unsigned			first;
+	unsigned			count;
+	bool				closed;
+
+	std::deque<std::pair<Function*, Value>>	waitingSenders; // with the values they send
+	std::deque<Function*>					waitingReceivers;
+
+	Channel(unsigned capacity);
+
+	bool IsFull() const;
+	void Push(const Value& value);
+	Value Pop();
+};
+
+
 struct ArrayIterator : public IteratorImplementation
 {
 	Array* array;
@@ -132,8 +157,8 @@ struct ArrayIterator : public IteratorImplementation
 
 	ArrayIterator(Array* array);
 
-	virtual void UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-								GarbageCollected::State currentWhite) override;
+	virtual unsigned CalculateSize() const override;
+	virtual void GetReferences(std::vector<GarbageCollected*>& references) const override;
 };
 
 
@@ -145,8 +170,8 @@ struct StringIterator : public IteratorImplementation
 
 	StringIterator(String* str);
 
-	virtual void UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-								GarbageCollected::State currentWhite) override;
+	virtual unsigned CalculateSize() const override;
+	virtual void GetReferences(std::vector<GarbageCollected*>& references) const override;
 };
 
 
@@ -154,8 +179,7 @@ struct ObjectIterator : public IteratorImplementation
 {
 	ObjectIterator(const Value& object, const Value& hasNext, const Value& getNext);
 
-	virtual void UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-								GarbageCollected::State currentWhite) override;
+	virtual unsigned CalculateSize() const override;
 };
 
 
@@ -163,8 +187,7 @@ struct CoroutineIterator : public IteratorImplementation
 {
 	CoroutineIterator(Function* coroutine);
 
-	virtual void UpdateGrayList(std::deque<GarbageCollected*>& grayList,
-								GarbageCollected::State currentWhite) override;
+	virtual unsigned CalculateSize() const override;
 };
 
 }
@@ -0,0 +1,89 @@
+#ifndef _HEAP_PAGE_INCLUDED_
+#define _HEAP_PAGE_INCLUDED_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "GarbageCollected.h"
+
+namespace element
+{
+
+// Heap objects live in aligned pages of equally sized slots. Which slots are
+// in use and which slots were reached during marking is kept in two bitmaps
+// in the page header, so the objects themselves carry no list pointers and
+// sweeping a page is a scan over its bitmaps. Objects too big for any slot
+// size get a page (spanning as many aligned blocks as needed) of their own.
+struct HeapPage
+{
+	static const unsigned	Size			= 64 * 1024;
+	static const unsigned	MinSlotSize		= 16;
+	static const unsigned	MaxSlots		= Size / MinSlotSize;
+	static const unsigned	BitmapWords		= MaxSlots / 64;
+	static const unsigned	LargeObjectClass = ~0u;
+
+	unsigned	slotSize;
+	unsigned	slotsCount;
+	unsigned	liveCount;
+	unsigned	sizeClass;
+	size_t		mappedSize;
+	bool		decommitted;
+
+	uint64_t	allocatedBits[BitmapWords];
+	uint64_t	markBits[BitmapWords];
+
+	static unsigned SlotsOffset()
+	{
+		return (sizeof(HeapPage) + 15) & ~15u;
+	}
+
+	static HeapPage* FromObject(const GarbageCollected* gc)
+	{
+		return (HeapPage*)(uintptr_t(gc) & ~uintptr_t(Size - 1));
+	}
+
+	unsigned SlotIndex(const GarbageCollected* gc) const
+	{
+		return unsigned(((const char*)gc - ((const char*)this + SlotsOffset())) / slotSize);
+	}
+
+	GarbageCollected* SlotAt(unsigned index)
+	{
+		return (GarbageCollected*)((char*)this + SlotsOffset() + size_t(index) * slotSize);
+	}
+
+	// the bits of the given bitmap word that belong to actual slots
+	uint64_t ValidSlotsMask(unsigned word) const
+	{
+		unsigned first = word * 64;
+
+		if( first + 64 <= slotsCount )
+			return ~uint64_t(0);
+
+		if( first >= slotsCount )
+			return 0;
+
+		return (uint64_t(1) << (slotsCount - first)) - 1;
+	}
+
+	unsigned UsedBitmapWords() const
+	{
+		return (slotsCount + 63) / 64;
+	}
+
+	bool IsMarked(const GarbageCollected* gc) const
+	{
+		unsigned index = SlotIndex(gc);
+		return (markBits[index / 64] >> (index % 64)) & 1;
+	}
+
+	void SetMarked(const GarbageCollected* gc)
+	{
+		unsigned index = SlotIndex(gc);
+		markBits[index / 64] |= uint64_t(1) << (index % 64);
+	}
+};
+
+}
+
+#endif // _HEAP_PAGE_INCLUDED_
@@ -0,0 +1,246 @@
+#include "Inliner.h"
+
+#include <algorithm>
+
+#include "FlowOptimizer.h"
+#include "OpCodes.h"
+
+namespace element
+{
+
+// longer functions are not worth the copies of their bodies
+static const int MaxInlinedSize = 32;
+
+Inliner::Inliner(const std::deque<Constant>& constants, unsigned firstConstant, const ExecutionProfile* profile)
+: mConstants(constants)
+, mFirstConstant(firstConstant)
+, mProfile(profile)
+{
+	std::map<int, int> stores; // to each global
+	std::map<int, int> functions;
+
+	for( unsigned c = firstConstant; c < constants.size(); ++c )
+	{
+		if( constants[c].type != Constant::CT_CodeObject )
+			continue;
+
+		const std::vector<Instruction>& instructions = constants[c].codeObject->instructions;
+
+		std::vector<bool> targets(instructions.size() + 1, false);
+
+		for( const Instruction& instruction : instructions )
+			if( IsJump(instruction.opCode) )
+				targets[instruction.A] = true;
+
+		for( size_t i = 0; i < instructions.size(); ++i )
+		{
+			const Instruction& instruction = instructions[i];
+
+			if( instruction.opCode != OpCode::OC_StoreGlobal &&
+				instruction.opCode != OpCode::OC_PopStoreGlobal )
+				continue;
+
+			++stores[instruction.A];
+
+			if( i == 0 || targets[i] || instructions[i - 1].opCode != OpCode::OC_LoadConstant )
+				continue;
+
+			int function = instructions[i - 1].A;
+
+			if( CanBeInlined(function) )
+				functions[instruction.A] = function;
+		}
+	}
+
+	for( const auto& function : functions )
+		if( stores[function.first] == 1 )
+			mFunctions.insert(function);
+}
+
+bool Inliner::Inline(CodeObject* codeObject, int index)
+{
+	const std::vector<Instruction>& instructions = codeObject->instructions;
+	const int size = int(instructions.size());
+
+	std::vector<bool> targets(size + 1, false);
+
+	for( const Instruction& instruction : instructions )
+		if( IsJump(instruction.opCode) )
+			targets[instruction.A] = true;
+
+	// the bodies don't call anything, so one of them runs at a time and they share their locals
+	const int firstLocal = codeObject->localVariablesCount;
+	int localsCount = 0;
+	bool changed = false;
+
+	std::vector<FlowOptimizer::Emitted> code;
+
+	for( int i = 0; i < size; ++i )
+	{
+		const Instruction& load = instructions[i];
+
+		const int function = load.opCode == OpCode::OC_LoadGlobal ? FindCallTarget(index, load.A) : -1;
+
+		if( function < 0 ||
+			i + 1 == size ||
+			instructions[i + 1].opCode != OpCode::OC_FunctionCall ||
+			targets[i + 1] )
+		{
+			code.push_back({load, i, 0, 0});
+			continue;
+		}
+
+		const CodeObject* inlined = mConstants[function].codeObject;
+		const int argumentsCount = instructions[i + 1].A;
+		const int parametersCount = inlined->namedParametersCount;
+		const int variablesCount = inlined->localVariablesCount;
+		const int anonymousCount = inlined->usesArguments ? std::max(argumentsCount - parametersCount, 0) : 0;
+
+		localsCount = std::max(localsCount, variablesCount + anonymousCount);
+
+		// is the global still the function
+		code.push_back({load, i, 0, 0});
+		code.push_back({Instruction(OpCode::OC_LoadConstant, function), i, 1, 0});
+		code.push_back({Instruction(OpCode::OC_Equal), i, 1, 0});
+
+		const int check = int(code.size());
+		code.push_back({Instruction(OpCode::OC_PopJumpIfFalse), i, 1, -1});
+
+		// the arguments are bound to the parameters like a call does, from the last one
+		for( int a = argumentsCount - 1; a >= 0; --a )
+		{
+			if( a < parametersCount )
+				code.push_back({Instruction(OpCode::OC_PopStoreLocal, firstLocal + a), i + 1, 1, 0});
+			else if( a - parametersCount < anonymousCount )
+				code.push_back({Instruction(OpCode::OC_PopStoreLocal, firstLocal + variablesCount + a - parametersCount), i + 1, 1, 0});
+			else
+				code.push_back({Instruction(OpCode::OC_Pop), i + 1, 1, 0});
+		}
+
+		// the rest start as nil, as in a new frame
+		for( int v = std::min(argumentsCount, parametersCount); v < variablesCount; ++v )
+		{
+			code.push_back({Instruction(OpCode::OC_LoadConstant, 0), i + 1, 1, 0});
+			code.push_back({Instruction(OpCode::OC_PopStoreLocal, firstLocal + v), i + 1, 1, 0});
+		}
+
+		const int bodyStart = int(code.size());
+		const int bodySize = int(inlined->instructions.size());
+		const int slowCall = bodyStart + bodySize;
+		const int end = slowCall + 2;
+
+		// the body keeps the lines of the function, an error in it is reported
+		// there and at the line of the call, as if the function was called
+		auto callLine = std::upper_bound(codeObject->instructionLines.begin(), codeObject->instructionLines.end(), i + 1,
+			[](int index, const SourceCodeLine& line) { return index < line.instructionIndex; });
+		const int calledFrom = callLine != codeObject->instructionLines.begin() ? (callLine - 1)->line : -1;
+
+		auto bodyLine = inlined->instructionLines.begin();
+		int line = 0;
+
+		for( int b = 0; b < bodySize; ++b )
+		{
+			Instruction instruction = inlined->instructions[b];
+
+			for( ; bodyLine != inlined->instructionLines.end() && bodyLine->instructionIndex <= b; ++bodyLine )
+				line = bodyLine->line;
+
+			switch( instruction.opCode )
+			{
+			case OpCode::OC_LoadLocal:
+			case OpCode::OC_StoreLocal:
+			case OpCode::OC_PopStoreLocal:
+				instruction.A += firstLocal;
+				break;
+
+			case OpCode::OC_LoadArgument:
+				if( instruction.A < anonymousCount )
+					instruction = Instruction(OpCode::OC_LoadLocal, firstLocal + variablesCount + instruction.A);
+				else
+					instruction = Instruction(OpCode::OC_LoadConstant, 0); // nil
+				break;
+
+			case OpCode::OC_EndFunction:
+				instruction = Instruction(OpCode::OC_Jump, end);
+				break;
+
+			default:
+				if( IsJump(instruction.opCode) )
+					instruction.A += bodyStart;
+				break;
+			}
+
+			code.push_back({instruction, i + 1, 1, IsJump(instruction.opCode) ? -1 : 0, line, calledFrom});
+		}
+
+		code[check].instruction.A = slowCall;
+
+		code.push_back({load, i + 1, 1, 0});
+		code.push_back({instructions[i + 1], i + 1, 1, 0});
+
+		++i; // the call is done too
+		changed = true;
+	}
+
+	if( ! changed )
+		return false;
+
+	codeObject->localVariablesCount += localsCount;
+
+	FlowOptimizer::Assemble(codeObject, code);
+	return true;
+}
+
+int Inliner::FindCallTarget(int caller, int global) const
+{
+	auto function = mFunctions.find(global);
+
+	if( function != mFunctions.end() )
+		return function->second;
+
+	// the global can hold another function at any time, the check before the body covers that
+	int callee = mProfile ? mProfile->GetCallTarget(caller, global) : -1;
+
+	return CanBeInlined(callee) ? callee : -1;
+}
+
+bool Inliner::CanBeInlined(int function) const
+{
+	if( function < int(mFirstConstant) ||
+		function >= int(mConstants.size()) ||
+		mConstants[function].type != Constant::CT_CodeObject )
+		return false;
+
+	const CodeObject* codeObject = mConstants[function].codeObject;
+
+	if( ! codeObject->closureMapping.empty() || int(codeObject->instructions.size()) > MaxInlinedSize )
+		return false;
+
+	for( const Instruction& instruction : codeObject->instructions )
+	{
+		switch( instruction.opCode )
+		{
+		case OpCode::OC_LoadArgsArray:
+		case OpCode::OC_LoadThis:
+		case OpCode::OC_MakeBox:
+		case OpCode::OC_LoadFromBox:
+		case OpCode::OC_StoreToBox:
+		case OpCode::OC_PopStoreToBox:
+		case OpCode::OC_MakeClosure:
+		case OpCode::OC_LoadFromClosure:
+		case OpCode::OC_LoadCaptured:
+		case OpCode::OC_StoreToClosure:
+		case OpCode::OC_PopStoreToClosure:
+		case OpCode::OC_FunctionCall:
+		case OpCode::OC_CallMethod:
+		case OpCode::OC_Yield:
+			return false;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef _INLINER_INCLUDED_
+#define _INLINER_INCLUDED_
+
+#include <deque>
+#include <map>
+
+#include "Constant.h"
+#include "DataTypes.h"
+#include "ExecutionProfile.h"
+
+namespace element
+{
+
+// Puts the bodies of small functions in the place of the calls to them. The
+// calls are to globals that are set once in the module, to a function that
+// calls nothing, captures nothing and uses neither 'this' nor '$$'. Before
+// the body the call checks that the global still holds that function and
+// makes a normal call if it doesn't, like when it is called before the global
+// is set or after the global is set again from the REPL. The parameters and
+// locals of the function get new locals in the caller and its 'return'
+// jumps to the end of the body, like the end of the function does. The body
+// keeps the lines of the function and the line of the call, so the stack
+// trace of an error in it is the one the call would give. With a
+// profile of an earlier run, the calls to globals that are set more than once
+// are inlined too, when they always went to the same function in that run.
+class Inliner
+{
+public:
+					Inliner(const std::deque<Constant>& constants, unsigned firstConstant, const ExecutionProfile* profile);
+
+	bool			Inline(CodeObject* codeObject, int index); // true if a call was inlined, 'index' is its constant
+
+protected:
+	int				FindCallTarget(int caller, int global) const; // the constant of the function, -1 if there is none
+	bool			CanBeInlined(int function) const;
+
+protected:
+	const std::deque<Constant>&	mConstants;
+	const unsigned				mFirstConstant;
+	const ExecutionProfile*		mProfile;
+	std::map<int, int>			mFunctions; // the constants of the functions in the globals they are set to
+};
+
+}
+
+#endif // _INLINER_INCLUDED_
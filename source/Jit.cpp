@@ -0,0 +1,1986 @@
+#include "Jit.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+
+#if defined(__x86_64__) && defined(__linux__)
+	#define ELEMENT_JIT 1
+	#include <sys/mman.h>
+	#include <unistd.h>
+#else
+	#define ELEMENT_JIT 0
+#endif
+
+namespace element
+{
+
+namespace
+{
+
+// Runs 'function' with room for at least 'reserve' more values on the stack,
+// returns the instruction index it stopped at. The code may use all of the
+// capacity of the stack, calls already reserve the deepest stack of the
+// function. The baseline code and the translations check for room before
+// each push and leave when it runs out, only traces need a reserve.
+template<class Function>
+int Enter(const Function& function, size_t reserve, StackFrame* frame,
+		  ValueStack& stack, const std::atomic<bool>& safePointRequested, bool tracing)
+{
+	size_t size = stack.size();
+	stack.reserve(size + reserve);
+
+	JitState state;
+	state.top					= stack.data() + size;
+	state.limit					= stack.data() + stack.capacity();
+	state.locals				= frame->variables.data();
+	state.globals				= frame->globals->data();
+	state.globalsCount			= frame->globals->size();
+	state.safePointRequested	= &safePointRequested;
+	state.tracing				= tracing;
+
+	int index = function(&state);
+
+	stack.resize_reserved( size_t(state.top - stack.data()) );
+
+	return index;
+}
+
+std::unordered_map<uint64_t, JitCode::Translation>& GetTranslations()
+{
+	static std::unordered_map<uint64_t, JitCode::Translation> translations;
+	return translations;
+}
+
+}
+
+#if ELEMENT_JIT
+
+namespace
+{
+
+// the fewest instructions the baseline code runs from an entry point, fewer
+// are faster in the interpreter than entering the code and leaving it again
+const int MinEntryStretch = 4;
+
+// machine code with its entry point
+struct EntryPoint
+{
+	const unsigned char*	memory;
+	int						entry;
+
+	int operator()(JitState* state) const
+	{
+		return reinterpret_cast<JitCode::EntryFunction>(memory)(state, memory + entry);
+	}
+};
+
+enum Register
+{
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+enum Condition
+{
+	CC_Below		= 0x2,
+	CC_AboveEqual	= 0x3,
+	CC_Equal		= 0x4,
+	CC_NotEqual		= 0x5,
+	CC_BelowEqual	= 0x6,
+	CC_Above		= 0x7,
+	CC_Parity		= 0xA,
+	CC_NoParity		= 0xB,
+	CC_Less			= 0xC,
+	CC_GreaterEqual	= 0xD,
+	CC_LessEqual	= 0xE,
+	CC_Greater		= 0xF,
+};
+
+// the registers the compiled code keeps the interpreter state in, all of
+// them preserved across calls to C++
+const int Top		= R12;
+const int Locals	= R13;
+const int State		= R14;
+const int Limit		= R15;
+
+const int V			= int(sizeof(Value));
+const int Payload	= int(offsetof(Value, integer));
+
+static_assert(sizeof(Value) == 16 && offsetof(Value, type) == 0, "values are copied as 16 bytes with the type first");
+
+
+// Just the encodings the compiler needs. Memory operands are always
+// [base + disp32], which works for any base register.
+class Assembler
+{
+public:
+	std::vector<unsigned char> code;
+
+	size_t Size() const { return code.size(); }
+
+	void Byte(int b) { code.push_back( (unsigned char)b ); }
+
+	void Dword(uint32_t d)
+	{
+		for( int i = 0; i < 4; ++i )
+			Byte( (d >> (8 * i)) & 0xff );
+	}
+
+	void Qword(uint64_t q)
+	{
+		for( int i = 0; i < 8; ++i )
+			Byte( (q >> (8 * i)) & 0xff );
+	}
+
+	void Rex(bool wide, int reg, int base)
+	{
+		int rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((base & 8) >> 3);
+
+		if( rex != 0x40 )
+			Byte(rex);
+	}
+
+	void Memory(int reg, int base, int displacement)
+	{
+		Byte( 0x80 | ((reg & 7) << 3) | (base & 7) );
+
+		if( (base & 7) == RSP ) // rsp and r12 need a SIB byte
+			Byte(0x24);
+
+		Dword( uint32_t(displacement) );
+	}
+
+	void Registers(int reg, int rm) { Byte( 0xC0 | ((reg & 7) << 3) | (rm & 7) ); }
+
+	// moves
+	void Move(int dst, int src)							{ Rex(true, src, dst); Byte(0x89); Registers(src, dst); }
+	void Load(int reg, int base, int disp)				{ Rex(true, reg, base); Byte(0x8B); Memory(reg, base, disp); }
+	void Store(int base, int disp, int reg)				{ Rex(true, reg, base); Byte(0x89); Memory(reg, base, disp); }
+	void Load32(int reg, int base, int disp)			{ Rex(false, reg, base); Byte(0x8B); Memory(reg, base, disp); }
+	void LoadByte(int reg, int base, int disp)			{ Rex(false, reg, base); Byte(0x0F); Byte(0xB6); Memory(reg, base, disp); }
+	void StoreByte(int base, int disp, int imm)			{ Rex(false, 0, base); Byte(0xC6); Memory(0, base, disp); Byte(imm); }
+	void LoadValue(int xmm, int base, int disp)			{ Rex(false, xmm, base); Byte(0x0F); Byte(0x10); Memory(xmm, base, disp); }
+	void StoreValue(int base, int disp, int xmm)		{ Rex(false, xmm, base); Byte(0x0F); Byte(0x11); Memory(xmm, base, disp); }
+	void Lea(int reg, int base, int disp)				{ Rex(true, reg, base); Byte(0x8D); Memory(reg, base, disp); }
+	void Lea32(int reg, int base, int disp)				{ Rex(false, reg, base); Byte(0x8D); Memory(reg, base, disp); }
+	void MoveImmediate(int reg, uint64_t imm)			{ Rex(true, 0, reg); Byte(0xB8 + (reg & 7)); Qword(imm); }
+	void MoveImmediate32(int reg, uint32_t imm)			{ Rex(false, 0, reg); Byte(0xB8 + (reg & 7)); Dword(imm); }
+	void ZeroExtendByte(int dst, int src)				{ Rex(false, dst, src); Byte(0x0F); Byte(0xB6); Registers(dst, src); }
+	void ConditionalMove32(int cc, int dst, int src)	{ Rex(false, dst, src); Byte(0x0F); Byte(0x40 + cc); Registers(dst, src); }
+	void SetCondition(int cc, int reg)					{ Rex(false, 0, reg); Byte(0x0F); Byte(0x90 + cc); Registers(0, reg); }
+
+	// arithmetic, 'op' is the 'r32, r/m32' form of add, sub or cmp
+	void Arithmetic32(int op, int reg, int base, int disp)	{ Rex(false, reg, base); Byte(op); Memory(reg, base, disp); }
+	void Multiply32(int reg, int base, int disp)		{ Rex(false, reg, base); Byte(0x0F); Byte(0xAF); Memory(reg, base, disp); }
+	void Divide32(int reg)								{ Rex(false, 0, reg); Byte(0xF7); Registers(7, reg); }
+	void Negate32(int reg)								{ Rex(false, 0, reg); Byte(0xF7); Registers(3, reg); }
+	void SignExtend()									{ Byte(0x99); }
+	void XorImmediate32(int reg, uint32_t imm)			{ Rex(false, 0, reg); Byte(0x81); Registers(6, reg); Dword(imm); }
+
+	// comparisons
+	void Compare(int a, int b)							{ Rex(true, b, a); Byte(0x39); Registers(b, a); }
+	void CompareImmediate(bool wide, int reg, int imm)	{ Rex(wide, 0, reg); Byte(0x81); Registers(7, reg); Dword( uint32_t(imm) ); }
+	void CompareByte(int base, int disp, int imm)		{ Rex(false, 0, base); Byte(0x80); Memory(7, base, disp); Byte(imm); }
+	void Test32(int a, int b)							{ Rex(false, b, a); Byte(0x85); Registers(b, a); }
+	void TestLow8(int reg)								{ Rex(false, reg, reg); Byte(0x84); Registers(reg, reg); }
+
+	// between registers, 'op' is the 'r/m32, r32' form of add, sub, cmp, or 'r/m8, r8' of and, or
+	void Move32(int dst, int src)						{ Rex(false, src, dst); Byte(0x89); Registers(src, dst); }
+	void Operation32(int op, int dst, int src)			{ Rex(false, src, dst); Byte(op); Registers(src, dst); }
+	void OperationImmediate32(int ext, int reg, uint32_t imm)	{ Rex(false, 0, reg); Byte(0x81); Registers(ext, reg); Dword(imm); }
+	void MultiplyRegisters32(int dst, int src)			{ Rex(false, dst, src); Byte(0x0F); Byte(0xAF); Registers(dst, src); }
+	void MultiplyImmediate32(int dst, int src, uint32_t imm)	{ Rex(false, dst, src); Byte(0x69); Registers(dst, src); Dword(imm); }
+	void StoreImmediate(int base, int disp, uint32_t imm)	{ Rex(true, 0, base); Byte(0xC7); Memory(0, base, disp); Dword(imm); }
+
+	// single precision floats, 'op' is 0x58 add, 0x59 mul, 0x5C sub or 0x5E div
+	void Sse(int prefix, int op, int reg, int rm)
+	{
+		if( prefix )
+			Byte(prefix);
+
+		Rex(false, reg, rm);
+		Byte(0x0F);
+		Byte(op);
+		Registers(reg, rm);
+	}
+
+	void SseMemory(int prefix, int op, int reg, int base, int disp)
+	{
+		if( prefix )
+			Byte(prefix);
+
+		Rex(false, reg, base);
+		Byte(0x0F);
+		Byte(op);
+		Memory(reg, base, disp);
+	}
+
+	void LoadFloat(int xmm, int base, int disp)			{ SseMemory(0xF3, 0x10, xmm, base, disp); }
+	void StoreFloat(int base, int disp, int xmm)		{ SseMemory(0xF3, 0x11, xmm, base, disp); }
+	void FloatOperation(int op, int dst, int src)		{ Sse(0xF3, op, dst, src); }
+	void IntToFloat(int xmm, int reg)					{ Sse(0xF3, 0x2A, xmm, reg); }
+	void CompareFloats(int a, int b)					{ Sse(0, 0x2E, a, b); }
+	void MoveFloat(int dst, int src)					{ Sse(0, 0x28, dst, src); }
+	void XorFloats(int dst, int src)					{ Sse(0, 0x57, dst, src); }
+	void MoveToFloat(int xmm, int reg)					{ Sse(0x66, 0x6E, xmm, reg); }
+
+	// control flow, the jumps return where their target goes for 'Patch'
+	void Push(int reg)									{ Rex(false, 0, reg); Byte(0x50 + (reg & 7)); }
+	void Pop(int reg)									{ Rex(false, 0, reg); Byte(0x58 + (reg & 7)); }
+	void Return()										{ Byte(0xC3); }
+	void CallRegister(int reg)							{ Rex(false, 0, reg); Byte(0xFF); Registers(2, reg); }
+	void JumpRegister(int reg)							{ Rex(false, 0, reg); Byte(0xFF); Registers(4, reg); }
+	size_t Jump()										{ Byte(0xE9); Dword(0); return Size() - 4; }
+	size_t JumpIf(int cc)								{ Byte(0x0F); Byte(0x80 + cc); Dword(0); return Size() - 4; }
+
+	void Patch(size_t at, size_t target)
+	{
+		uint32_t relative = uint32_t( int64_t(target) - int64_t(at + 4) );
+		std::memcpy(&code[at], &relative, 4);
+	}
+};
+
+
+struct SlowPath
+{
+	std::vector<size_t>	from;
+	int					index;
+	OpCode				opCode;
+	bool				unary;
+};
+
+
+// All code starts like this, called as
+// int (JitState* state, const unsigned char* entry)
+// and returns through the epilogue with the instruction index to continue
+// from in eax. rbx is saved to keep the stack aligned for calls to C++, the
+// traces keep the globals in it.
+size_t EmitPrologue(Assembler& a)
+{
+	a.Push(RBX);
+	a.Push(R12);
+	a.Push(R13);
+	a.Push(R14);
+	a.Push(R15);
+	a.Move(State, RDI);
+	a.Load(Top, State, offsetof(JitState, top));
+	a.Load(Limit, State, offsetof(JitState, limit));
+	a.Load(Locals, State, offsetof(JitState, locals));
+	a.JumpRegister(RSI);
+
+	const size_t epilogue = a.Size();
+
+	a.Store(State, offsetof(JitState, top), Top);
+	a.Pop(R15);
+	a.Pop(R14);
+	a.Pop(R13);
+	a.Pop(R12);
+	a.Pop(RBX);
+	a.Return();
+
+	return epilogue;
+}
+
+// The code is written while the memory is writable, then it is only executable.
+bool Install(const Assembler& a, unsigned char** memory, size_t* size)
+{
+	size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+	size_t mappedSize = (a.Size() + pageSize - 1) / pageSize * pageSize;
+
+	void* mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if( mapped == MAP_FAILED )
+		return false;
+
+	std::memcpy(mapped, a.code.data(), a.Size());
+
+	if( mprotect(mapped, mappedSize, PROT_READ | PROT_EXEC) != 0 )
+	{
+		munmap(mapped, mappedSize);
+		return false;
+	}
+
+	*memory = static_cast<unsigned char*>(mapped);
+	*size = mappedSize;
+
+	return true;
+}
+
+// traces ////////////////////////////////////////////////////////////////////
+const size_t MaxTraceLength = 1000;
+const size_t MaxTreeLength = 4000; // of all the traces of a loop compiled together
+const size_t MaxTraces = 16;
+const unsigned MaxTraceAttempts = 3;
+const unsigned MaxTraceMisses = 16;
+
+bool IsTraceable(const Value& value)
+{
+	return value.type == Value::VT_Int || value.type == Value::VT_Float || value.type == Value::VT_Bool;
+}
+
+// The payload of an int, float or bool, as the machine code sees it.
+uint32_t Bits(const Value& value)
+{
+	if( value.type == Value::VT_Float )
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value.floatingPoint, sizeof(bits));
+		return bits;
+	}
+
+	if( value.type == Value::VT_Bool )
+		return value.boolean ? 1 : 0;
+
+	return uint32_t(value.integer);
+}
+
+bool IsConditionalJump(OpCode opCode)
+{
+	return opCode == OC_JumpIfFalse || opCode == OC_PopJumpIfFalse ||
+		   opCode == OC_JumpIfFalseOrPop || opCode == OC_JumpIfTrueOrPop;
+}
+
+// Whether a conditional jump pops the value it tested.
+bool Pops(OpCode opCode, bool taken)
+{
+	return opCode == OC_PopJumpIfFalse || (! taken && opCode != OC_JumpIfFalse);
+}
+
+// Runs the rest of an iteration of the loop, from instruction 'start' to a
+// backward jump to 'head', on copies of the variables and the stack, and
+// records the instructions it executes. False when it does something a trace
+// cannot do, or leaves the loop.
+bool Record(const CodeObject& codeObject, const StackFrame& frame, const std::vector<Value>& constants,
+			int head, int backEdge, int start, std::vector<Value> stack, JitTrace* trace)
+{
+	std::vector<Value> locals = frame.variables;
+	std::vector<Value> globals = *frame.globals;
+
+	for( const Value& value : stack )
+	{
+		if( ! IsTraceable(value) )
+			return false;
+
+		trace->stack.push_back(value.type);
+	}
+
+	std::vector<JitTrace::Step>& steps = trace->steps;
+	int i = start;
+
+	while( steps.size() < MaxTraceLength && i >= head && i <= backEdge )
+	{
+		const Instruction& instruction = codeObject.instructions[i];
+		const OpCode opCode = UntypedOpCode(instruction.opCode); // the typed ones record the same types
+		const int A = instruction.A;
+
+		JitTrace::Step step = {i, false, Value::VT_Nil};
+		int next = i + 1;
+
+		switch( opCode )
+		{
+		case OC_Pop:
+			if( stack.empty() )
+				return false;
+			stack.pop_back();
+			break;
+
+		case OC_PopN:
+			if( A < 0 || int(stack.size()) < A )
+				return false;
+			stack.resize(stack.size() - A);
+			break;
+
+		case OC_Duplicate:
+			if( stack.empty() )
+				return false;
+			stack.push_back( stack.back() );
+			break;
+
+		case OC_LoadConstant:
+			if( A < 0 || A >= int(constants.size()) || ! IsTraceable(constants[A]) )
+				return false;
+			stack.push_back( constants[A] );
+			break;
+
+		case OC_LoadLocal:
+			if( ! IsTraceable(locals[A]) )
+				return false;
+			stack.push_back( locals[A] );
+			step.type = locals[A].type;
+			break;
+
+		case OC_LoadGlobal:
+			if( A < 0 || A >= int(globals.size()) || ! IsTraceable(globals[A]) )
+				return false;
+			stack.push_back( globals[A] );
+			step.type = globals[A].type;
+			break;
+
+		case OC_StoreLocal:
+		case OC_PopStoreLocal:
+			if( stack.empty() )
+				return false;
+			locals[A] = stack.back();
+			if( opCode == OC_PopStoreLocal )
+				stack.pop_back();
+			break;
+
+		case OC_StoreGlobal:
+		case OC_PopStoreGlobal:
+			if( stack.empty() || A < 0 || A >= int(globals.size()) )
+				return false;
+			globals[A] = stack.back();
+			if( opCode == OC_PopStoreGlobal )
+				stack.pop_back();
+			break;
+
+		case OC_Add:
+		case OC_Subtract:
+		case OC_Multiply:
+		case OC_Divide:
+		case OC_Modulo:
+		case OC_Equal:
+		case OC_NotEqual:
+		case OC_Less:
+		case OC_Greater:
+		case OC_LessEqual:
+		case OC_GreaterEqual:
+		{
+			if( stack.size() < 2 )
+				return false;
+
+			Value* operands = &stack[stack.size() - 2];
+
+			if( operands[0].IsBoolean() && operands[1].IsBoolean() && (opCode == OC_Equal || opCode == OC_NotEqual) )
+				operands[0] = Value( (operands[0].boolean == operands[1].boolean) == (opCode == OC_Equal) );
+			else if( opCode == OC_Modulo && ! (operands[0].IsInt() && operands[1].IsInt()) )
+				return false;
+			else if( ! Jit::Arithmetic(operands, opCode) )
+				return false;
+
+			stack.pop_back();
+			break;
+		}
+
+		case OC_UnaryMinus:
+			if( stack.empty() || ! Jit::Arithmetic(&stack.back(), opCode) )
+				return false;
+			break;
+
+		case OC_UnaryNot:
+			if( stack.empty() )
+				return false;
+			stack.back() = Value( ! stack.back().AsBool() );
+			break;
+
+		case OC_Jump:
+			if( A == head ) // around the loop
+			{
+				steps.push_back(step);
+				return stack.empty();
+			}
+			if( A < i ) // an inner loop
+				return false;
+			next = A;
+			break;
+
+		case OC_JumpIfFalse:
+		case OC_PopJumpIfFalse:
+		case OC_JumpIfFalseOrPop:
+		case OC_JumpIfTrueOrPop:
+		{
+			if( stack.empty() )
+				return false;
+
+			bool truth = stack.back().AsBool();
+			step.taken = (opCode == OC_JumpIfTrueOrPop) ? truth : ! truth;
+
+			if( Pops(opCode, step.taken) )
+				stack.pop_back();
+
+			if( step.taken )
+				next = A;
+			break;
+		}
+
+		default:
+			return false;
+		}
+
+		steps.push_back(step);
+		i = next;
+	}
+
+	return false;
+}
+
+
+// A value on the stack of a trace, a constant or in the register for its
+// depth. Ints and bools are in general purpose registers, floats in xmm1 to
+// xmm7. Side exits write them to the real stack.
+struct TraceValue
+{
+	Value	value; // the type, and the value of constants
+	bool	constant;
+};
+
+const int TraceRegisters[] = {RCX, RSI, RDI, R8, R9, R10, R11};
+const int MaxTraceDepth = 7;
+
+// Compiles the traces of a loop together. The first one is the loop, a side
+// exit of a trace that another trace starts at continues in that one. The
+// types of the variables are checked once, at 'entry', before the loop.
+class TraceCompiler
+{
+public:
+	TraceCompiler(const CodeObject& codeObject, const std::vector<Value>& constants,
+				  const std::vector<JitTrace>& traces, Assembler& assembler)
+	: mCodeObject(codeObject)
+	, mConstants(constants)
+	, mTraces(traces)
+	, mAssembler(assembler)
+	{
+	}
+
+	// false if something is not supported, or the types of the variables at
+	// the end of an iteration are not the ones it started with
+	bool Compile(size_t* entry, int* stackSize)
+	{
+		Assembler& a = mAssembler;
+
+		const size_t epilogue = EmitPrologue(a);
+		mLoop = a.Size();
+
+		if( ! CompilePath(mTraces[0], {}) )
+			return false;
+
+		// the branches can add more of them
+		for( size_t b = 0; b < mBranches.size(); ++b )
+		{
+			Branch branch = mBranches[b];
+
+			a.Patch(branch.from, a.Size());
+
+			if( ! CompilePath(*branch.trace, branch.state) )
+				return false;
+		}
+
+		for( const auto& types : mEnds )
+			for( const auto& guard : mGuards )
+				if( types.count(guard.first) && types.at(guard.first) != guard.second )
+					return false;
+
+		for( const SideExit& exit : mExits )
+		{
+			a.Patch(exit.from, a.Size());
+
+			for( int j = 0; j < int(exit.stack.size()); ++j )
+			{
+				const TraceValue& v = exit.stack[j];
+
+				a.StoreByte(Top, V * j, v.value.type);
+
+				if( v.constant )
+					a.StoreImmediate(Top, V * j + Payload, Bits(v.value));
+				else if( v.value.IsFloat() )
+					a.StoreFloat(Top, V * j + Payload, Xmm(j));
+				else
+					a.Store(Top, V * j + Payload, TraceRegisters[j]);
+			}
+
+			if( ! exit.stack.empty() )
+				a.Lea(Top, Top, V * int(exit.stack.size()));
+
+			a.MoveImmediate32(RAX, uint32_t(exit.index));
+			a.Patch(a.Jump(), epilogue);
+		}
+
+		// -1 tells the interpreter the traces did not run
+		*entry = a.Size();
+
+		std::vector<size_t> misses;
+
+		a.Load(RBX, State, offsetof(JitState, globals));
+
+		if( mGlobalsCount > 0 )
+		{
+			a.Load(RAX, State, offsetof(JitState, globalsCount));
+			a.CompareImmediate(true, RAX, mGlobalsCount);
+			misses.push_back( a.JumpIf(CC_Below) );
+		}
+
+		for( const auto& guard : mGuards )
+		{
+			if( guard.first < 0 )
+				a.CompareByte(RBX, V * (-1 - guard.first), guard.second);
+			else
+				a.CompareByte(Locals, V * guard.first, guard.second);
+
+			misses.push_back( a.JumpIf(CC_NotEqual) );
+		}
+
+		a.Patch(a.Jump(), mLoop);
+
+		for( size_t from : misses )
+			a.Patch(from, a.Size());
+
+		a.MoveImmediate32(RAX, uint32_t(-1));
+		a.Patch(a.Jump(), epilogue);
+
+		*stackSize = mDepth;
+		return true;
+	}
+
+private:
+	// what is known at a point of a trace
+	struct PathState
+	{
+		std::vector<TraceValue>		stack;
+		std::map<int, Value::Type>	types; // of the variables so far, globals are -1 - index
+	};
+
+	struct SideExit
+	{
+		size_t					from;
+		int						index;
+		std::vector<TraceValue>	stack;
+	};
+
+	struct Branch
+	{
+		size_t					from;
+		const JitTrace*			trace;
+		PathState				state;
+	};
+
+	static int Xmm(int k) { return k + 1; }
+	int Reg(int k) const { return TraceRegisters[k]; }
+
+	void ExitIf(int cc, int index)
+	{
+		mExits.push_back({mAssembler.JumpIf(cc), index, mState.stack});
+	}
+
+	void Push(const Value& value, bool constant)
+	{
+		mState.stack.push_back({value, constant});
+		mDepth = std::max(mDepth, int(mState.stack.size()));
+	}
+
+	// the type of a variable, the first time it is read it is checked
+	// before the loop
+	bool Variable(bool global, int index, Value::Type recorded, Value::Type* type)
+	{
+		int key = global ? -1 - index : index;
+		auto it = mState.types.find(key);
+
+		if( it == mState.types.end() )
+		{
+			auto guard = mGuards.emplace(key, recorded).first;
+
+			if( guard->second != recorded ) // another trace saw it with another type
+				return false;
+
+			it = mState.types.emplace(key, recorded).first;
+		}
+
+		*type = it->second;
+
+		if( global )
+			mGlobalsCount = std::max(mGlobalsCount, index + 1);
+		return true;
+	}
+
+	// the constant at depth k into its register
+	void Materialize(int k)
+	{
+		Assembler& a = mAssembler;
+
+		TraceValue& v = mState.stack[k];
+
+		if( ! v.constant )
+			return;
+
+		if( v.value.IsFloat() )
+		{
+			a.MoveImmediate32(RAX, Bits(v.value));
+			a.MoveToFloat(Xmm(k), RAX);
+		}
+		else
+		{
+			a.MoveImmediate32(Reg(k), Bits(v.value));
+		}
+
+		v.constant = false;
+	}
+
+	// the value at depth k as a float in the 'target' xmm register
+	void ToFloat(int k, int target)
+	{
+		Assembler& a = mAssembler;
+
+		const TraceValue& v = mState.stack[k];
+
+		if( v.constant )
+		{
+			a.MoveImmediate32(RAX, Bits( Value(v.value.AsFloat()) ));
+			a.MoveToFloat(target, RAX);
+		}
+		else if( v.value.IsFloat() )
+		{
+			if( target != Xmm(k) )
+				a.MoveFloat(target, Xmm(k));
+		}
+		else
+		{
+			a.IntToFloat(target, Reg(k));
+		}
+	}
+
+	bool Binary(int index, OpCode opCode)
+	{
+		Assembler& a = mAssembler;
+
+		std::vector<TraceValue>& stack = mState.stack;
+
+		const int k = int(stack.size()) - 2; // the depth of the left operand
+		const TraceValue lhs = stack[k];
+		const TraceValue rhs = stack[k + 1];
+
+		const bool bools = lhs.value.IsBoolean() && rhs.value.IsBoolean();
+		const bool ints = lhs.value.IsInt() && rhs.value.IsInt();
+
+		if( (lhs.value.IsBoolean() || rhs.value.IsBoolean()) && ! (bools && (opCode == OC_Equal || opCode == OC_NotEqual)) )
+			return false;
+
+		if( lhs.constant && rhs.constant )
+		{
+			Value operands[2] = {lhs.value, rhs.value};
+
+			if( bools )
+				operands[0] = Value( (lhs.value.boolean == rhs.value.boolean) == (opCode == OC_Equal) );
+			else if( ! Jit::Arithmetic(operands, opCode) )
+				return false;
+
+			stack.pop_back();
+			stack.back() = {operands[0], true};
+			return true;
+		}
+
+		if( opCode >= OC_Equal ) // comparisons
+		{
+			if( ints || bools )
+			{
+				static const std::map<int, int> conditions = {
+					{OC_Equal, CC_Equal}, {OC_NotEqual, CC_NotEqual},
+					{OC_Less, CC_Less}, {OC_Greater, CC_Greater},
+					{OC_LessEqual, CC_LessEqual}, {OC_GreaterEqual, CC_GreaterEqual},
+				};
+
+				Materialize(k);
+
+				if( rhs.constant )
+					a.CompareImmediate(false, Reg(k), int(Bits(rhs.value)));
+				else
+					a.Operation32(0x39, Reg(k), Reg(k + 1));
+
+				a.SetCondition(conditions.at(opCode), RAX);
+			}
+			else
+			{
+				// unordered, with a NaN, is neither less, greater nor equal
+				const int left = Xmm(k);
+				const int right = (rhs.value.IsFloat() && ! rhs.constant) ? Xmm(k + 1) : 0;
+
+				ToFloat(k, left);
+
+				if( right == 0 )
+					ToFloat(k + 1, 0);
+
+				switch( opCode )
+				{
+				case OC_Less:			a.CompareFloats(right, left); a.SetCondition(CC_Above, RAX); break;
+				case OC_LessEqual:		a.CompareFloats(right, left); a.SetCondition(CC_AboveEqual, RAX); break;
+				case OC_Greater:		a.CompareFloats(left, right); a.SetCondition(CC_Above, RAX); break;
+				case OC_GreaterEqual:	a.CompareFloats(left, right); a.SetCondition(CC_AboveEqual, RAX); break;
+
+				case OC_Equal:
+					a.CompareFloats(left, right);
+					a.SetCondition(CC_Equal, RAX);
+					a.SetCondition(CC_NoParity, RDX);
+					a.Operation32(0x20, RAX, RDX); // and al, dl
+					break;
+
+				default: // OC_NotEqual
+					a.CompareFloats(left, right);
+					a.SetCondition(CC_NotEqual, RAX);
+					a.SetCondition(CC_Parity, RDX);
+					a.Operation32(0x08, RAX, RDX); // or al, dl
+					break;
+				}
+			}
+
+			a.ZeroExtendByte(Reg(k), RAX);
+
+			stack.pop_back();
+			stack.back() = {Value(false), false};
+			return true;
+		}
+
+		if( ints )
+		{
+			if( opCode == OC_Divide || opCode == OC_Modulo )
+			{
+				// 0 and -1 as divisors are left to the interpreter
+				if( rhs.constant )
+				{
+					if( rhs.value.integer == 0 || rhs.value.integer == -1 )
+						return false;
+				}
+				else
+				{
+					a.Lea32(RAX, Reg(k + 1), 1);
+					a.CompareImmediate(false, RAX, 1);
+					ExitIf(CC_BelowEqual, index);
+				}
+
+				if( lhs.constant )
+					a.MoveImmediate32(RAX, Bits(lhs.value));
+				else
+					a.Move32(RAX, Reg(k));
+
+				int divisor = Reg(k + 1);
+
+				if( rhs.constant )
+				{
+					divisor = Limit; // traces do not need it
+					a.MoveImmediate32(divisor, Bits(rhs.value));
+				}
+
+				a.SignExtend();
+				a.Divide32(divisor);
+				a.Move32(Reg(k), opCode == OC_Divide ? RAX : RDX);
+			}
+			else
+			{
+				Materialize(k);
+
+				if( opCode == OC_Multiply )
+				{
+					if( rhs.constant )
+						a.MultiplyImmediate32(Reg(k), Reg(k), Bits(rhs.value));
+					else
+						a.MultiplyRegisters32(Reg(k), Reg(k + 1));
+				}
+				else if( rhs.constant )
+				{
+					a.OperationImmediate32(opCode == OC_Add ? 0 : 5, Reg(k), Bits(rhs.value));
+				}
+				else
+				{
+					a.Operation32(opCode == OC_Add ? 0x01 : 0x29, Reg(k), Reg(k + 1));
+				}
+			}
+
+			stack.pop_back();
+			stack.back() = {Value(0), false};
+			return true;
+		}
+
+		// floats, or an int and a float
+		if( opCode == OC_Modulo )
+			return false;
+
+		if( opCode == OC_Divide ) // the interpreter reports the division by zero
+		{
+			if( rhs.constant )
+			{
+				if( rhs.value.AsFloat() == 0 )
+					return false;
+			}
+			else if( rhs.value.IsInt() )
+			{
+				a.Test32(Reg(k + 1), Reg(k + 1));
+				ExitIf(CC_Equal, index);
+			}
+			else
+			{
+				a.XorFloats(0, 0);
+				a.CompareFloats(Xmm(k + 1), 0);
+				ExitIf(CC_Equal, index);
+			}
+		}
+
+		static const std::map<int, int> operations = {
+			{OC_Add, 0x58}, {OC_Multiply, 0x59}, {OC_Subtract, 0x5C}, {OC_Divide, 0x5E},
+		};
+
+		const int left = Xmm(k);
+		const int right = (rhs.value.IsFloat() && ! rhs.constant) ? Xmm(k + 1) : 0;
+
+		ToFloat(k, left);
+
+		if( right == 0 )
+			ToFloat(k + 1, 0);
+
+		a.FloatOperation(operations.at(opCode), left, right);
+
+		stack.pop_back();
+		stack.back() = {Value(0.0f), false};
+		return true;
+	}
+
+	// the trace that continues where 'index' goes the other way
+	const JitTrace* FindBranch(int index, bool taken) const
+	{
+		for( size_t t = 1; t < mTraces.size(); ++t )
+		{
+			const JitTrace& trace = mTraces[t];
+
+			if( trace.steps[0].index != index || trace.steps[0].taken != taken || trace.stack.size() != mState.stack.size() )
+				continue;
+
+			bool same = true;
+
+			for( size_t j = 0; j < trace.stack.size(); ++j )
+				same = same && trace.stack[j] == mState.stack[j].value.type;
+
+			if( same )
+				return &trace;
+		}
+
+		return nullptr;
+	}
+
+	// a branch starts with the conditional jump the trace before it tested
+	bool CompilePath(const JitTrace& trace, const PathState& state)
+	{
+		Assembler& a = mAssembler;
+
+		mState = state;
+		mLength += trace.steps.size();
+
+		for( size_t s = 0; s < trace.steps.size(); ++s )
+		{
+			const JitTrace::Step& step = trace.steps[s];
+			const int i = step.index;
+			const Instruction& instruction = mCodeObject.instructions[i];
+			const OpCode opCode = UntypedOpCode(instruction.opCode);
+			const int A = instruction.A;
+
+			std::vector<TraceValue>& stack = mState.stack;
+			const int k = int(stack.size()); // the depth of the next value
+
+			const bool global = opCode == OC_LoadGlobal || opCode == OC_StoreGlobal || opCode == OC_PopStoreGlobal;
+			const int base = global ? RBX : Locals;
+
+			switch( opCode )
+			{
+			case OC_Pop:
+				stack.pop_back();
+				break;
+
+			case OC_PopN:
+				stack.resize(stack.size() - A);
+				break;
+
+			case OC_Duplicate:
+				if( k >= MaxTraceDepth )
+					return false;
+
+				Push(stack.back().value, stack.back().constant);
+
+				if( ! stack.back().constant )
+				{
+					if( stack.back().value.IsFloat() )
+						a.MoveFloat(Xmm(k), Xmm(k - 1));
+					else
+						a.Move32(Reg(k), Reg(k - 1));
+				}
+				break;
+
+			case OC_LoadConstant:
+				if( k >= MaxTraceDepth )
+					return false;
+
+				Push(mConstants[A], true);
+				break;
+
+			case OC_LoadLocal:
+			case OC_LoadGlobal:
+			{
+				Value::Type type;
+
+				if( k >= MaxTraceDepth || ! Variable(global, A, step.type, &type) )
+					return false;
+
+				if( type == Value::VT_Float )
+					a.LoadFloat(Xmm(k), base, V * A + Payload);
+				else if( type == Value::VT_Bool )
+					a.LoadByte(Reg(k), base, V * A + Payload);
+				else
+					a.Load32(Reg(k), base, V * A + Payload);
+
+				Value value;
+				value.type = type;
+				Push(value, false);
+				break;
+			}
+
+			case OC_StoreLocal:
+			case OC_PopStoreLocal:
+			case OC_StoreGlobal:
+			case OC_PopStoreGlobal:
+			{
+				const TraceValue& v = stack.back();
+
+				mState.types[global ? -1 - A : A] = v.value.type;
+
+				if( global )
+					mGlobalsCount = std::max(mGlobalsCount, A + 1);
+
+				a.StoreByte(base, V * A, v.value.type);
+
+				if( v.constant )
+					a.StoreImmediate(base, V * A + Payload, Bits(v.value));
+				else if( v.value.IsFloat() )
+					a.StoreFloat(base, V * A + Payload, Xmm(k - 1));
+				else
+					a.Store(base, V * A + Payload, Reg(k - 1));
+
+				if( opCode == OC_PopStoreLocal || opCode == OC_PopStoreGlobal )
+					stack.pop_back();
+				break;
+			}
+
+			case OC_Add:
+			case OC_Subtract:
+			case OC_Multiply:
+			case OC_Divide:
+			case OC_Modulo:
+			case OC_Equal:
+			case OC_NotEqual:
+			case OC_Less:
+			case OC_Greater:
+			case OC_LessEqual:
+			case OC_GreaterEqual:
+				if( ! Binary(i, opCode) )
+					return false;
+				break;
+
+			case OC_UnaryMinus:
+			{
+				TraceValue& v = stack.back();
+
+				if( v.constant )
+				{
+					if( ! Jit::Arithmetic(&v.value, opCode) )
+						return false;
+				}
+				else if( v.value.IsInt() )
+				{
+					a.Negate32(Reg(k - 1));
+				}
+				else if( v.value.IsFloat() )
+				{
+					a.MoveImmediate32(RAX, 0x80000000); // the sign bit
+					a.MoveToFloat(0, RAX);
+					a.XorFloats(Xmm(k - 1), 0);
+				}
+				else
+				{
+					return false;
+				}
+				break;
+			}
+
+			case OC_UnaryNot:
+			{
+				TraceValue& v = stack.back();
+
+				if( v.constant || ! v.value.IsBoolean() ) // ints and floats are always true
+					v = {Value( ! v.value.AsBool() ), true};
+				else
+					a.XorImmediate32(Reg(k - 1), 1);
+				break;
+			}
+
+			case OC_Jump: // forward, or around the loop at the end
+				break;
+
+			case OC_JumpIfFalse:
+			case OC_PopJumpIfFalse:
+			case OC_JumpIfFalseOrPop:
+			case OC_JumpIfTrueOrPop:
+			{
+				const TraceValue& v = stack.back();
+				const bool truth = (opCode == OC_JumpIfTrueOrPop) ? step.taken : ! step.taken;
+
+				if( s == 0 && &trace != &mTraces[0] )
+				{
+					// the trace it branched off tested it
+				}
+				else if( v.constant || ! v.value.IsBoolean() )
+				{
+					if( v.value.AsBool() != truth )
+						return false;
+				}
+				else
+				{
+					a.Test32(Reg(k - 1), Reg(k - 1));
+
+					const int cc = truth ? CC_Equal : CC_NotEqual;
+					const JitTrace* branch = FindBranch(i, ! step.taken);
+
+					// leave the trace when it goes the other way, or go on in
+					// the one that starts there
+					if( branch && mLength + branch->steps.size() <= MaxTreeLength )
+					{
+						mBranches.push_back({a.JumpIf(cc), branch, mState});
+						mLength += branch->steps.size();
+					}
+					else
+					{
+						ExitIf(cc, i);
+					}
+				}
+
+				if( Pops(opCode, step.taken) )
+					stack.pop_back();
+				break;
+			}
+
+			default:
+				return false;
+			}
+		}
+
+		if( ! mState.stack.empty() )
+			return false;
+
+		mEnds.push_back(mState.types);
+
+		// the backward jump is a safe point
+		a.Load(RAX, State, offsetof(JitState, safePointRequested));
+		a.CompareByte(RAX, 0, 0);
+		ExitIf(CC_NotEqual, trace.steps.back().index);
+		a.Patch(a.Jump(), mLoop);
+
+		return true;
+	}
+
+private:
+	const CodeObject&				mCodeObject;
+	const std::vector<Value>&		mConstants;
+	const std::vector<JitTrace>&	mTraces;
+	Assembler&						mAssembler;
+
+	size_t							mLoop = 0;
+	PathState						mState;
+	std::vector<SideExit>			mExits;
+	std::vector<Branch>				mBranches; // to compile after the current trace
+	std::map<int, Value::Type>		mGuards; // of the variables read before they are written
+	std::vector<std::map<int, Value::Type>> mEnds; // the types at the end of each trace
+	int								mGlobalsCount = 0;
+	int								mDepth = 0;
+	size_t							mLength = 0;
+};
+
+// loops are left to the tracing until it gives up on them
+bool CanTrace(const JitCode& code, int head)
+{
+	for( const JitLoop& loop : code.loops )
+		if( loop.head == head )
+			return ! loop.failed;
+
+	return true;
+}
+
+}
+
+#endif // ELEMENT_JIT
+
+
+Jit::Jit(const std::vector<Value>& constants, const std::atomic<bool>& safePointRequested)
+: mConstants(constants)
+, mSafePointRequested(safePointRequested)
+, mTracing(true)
+{
+}
+
+Jit::~Jit()
+{
+	ResetState();
+}
+
+void Jit::ResetState()
+{
+#if ELEMENT_JIT
+	for( const std::unique_ptr<JitCode>& code : mCode )
+	{
+		if( code->memory )
+			munmap(code->memory, code->size);
+
+		for( const JitLoop& loop : code->loops )
+			if( loop.memory )
+				munmap(loop.memory, loop.size);
+	}
+#endif
+
+	mCode.clear();
+}
+
+void Jit::SetTracing(bool tracing)
+{
+	mTracing = tracing;
+}
+
+JitCode& Jit::GetCode(const CodeObject& codeObject)
+{
+	if( ! codeObject.jitCode )
+	{
+		mCode.emplace_back(new JitCode);
+		codeObject.jitCode = mCode.back().get();
+	}
+
+	return *codeObject.jitCode;
+}
+
+bool Jit::Compile(const CodeObject& codeObject)
+{
+#if ELEMENT_JIT
+	JitCode& code = GetCode(codeObject);
+
+	if( code.memory || code.translation )
+		return true;
+
+	const std::vector<Instruction>& instructions = codeObject.instructions;
+	const int count = int(instructions.size());
+
+	Assembler a;
+
+	std::vector<size_t> starts(count);
+	std::vector<int> entries(count, -1);
+	std::vector<std::pair<size_t, int>> toInstruction; // the jumps to patch
+	std::vector<std::pair<size_t, int>> toExit;
+	std::vector<SlowPath> slowPaths;
+
+	const size_t epilogue = EmitPrologue(a);
+
+	auto exitIf = [&](int cc, int index)
+	{
+		toExit.emplace_back(a.JumpIf(cc), index);
+	};
+
+	auto jumpTo = [&](int cc, int index)
+	{
+		toInstruction.emplace_back(cc < 0 ? a.Jump() : a.JumpIf(cc), index);
+	};
+
+	auto checkPush = [&](int index)
+	{
+		a.Compare(Top, Limit);
+		exitIf(CC_AboveEqual, index);
+	};
+
+	// TOS as a bool in ecx, and the zero flag set when it is false
+	auto truth = [&]()
+	{
+		a.LoadByte(RAX, Top, -V);
+		a.MoveImmediate32(RCX, 1);
+		a.Test32(RAX, RAX);
+		a.ConditionalMove32(CC_Equal, RCX, RAX); // nil
+		a.LoadByte(RDX, Top, -V + Payload);
+		a.CompareImmediate(false, RAX, Value::VT_Bool);
+		a.ConditionalMove32(CC_Equal, RCX, RDX);
+		a.Test32(RCX, RCX);
+	};
+
+	auto slowPath = [&](int index, OpCode opCode, bool unary) -> SlowPath&
+	{
+		slowPaths.push_back({{}, index, opCode, unary});
+		return slowPaths.back();
+	};
+
+	for( int i = 0; i < count; ++i )
+	{
+		const Instruction& instruction = instructions[i];
+		const int A = instruction.A;
+
+		starts[i] = a.Size();
+		entries[i] = int(a.Size());
+
+		switch( instruction.opCode )
+		{
+		case OC_Pop:
+			a.Lea(Top, Top, -V);
+			break;
+
+		case OC_PopN:
+			a.Lea(Top, Top, -V * A);
+			break;
+
+		case OC_Rotate2:
+			a.LoadValue(0, Top, -V);
+			a.LoadValue(1, Top, -2 * V);
+			a.StoreValue(Top, -V, 1);
+			a.StoreValue(Top, -2 * V, 0);
+			break;
+
+		case OC_MoveToTOS2:
+			a.LoadValue(0, Top, -V);
+			a.StoreValue(Top, -3 * V, 0);
+			a.Lea(Top, Top, -V);
+			break;
+
+		case OC_Duplicate:
+			checkPush(i);
+			a.LoadValue(0, Top, -V);
+			a.StoreValue(Top, 0, 0);
+			a.Lea(Top, Top, V);
+			break;
+
+		case OC_LoadConstant:
+		{
+			if( A < 0 || A >= int(mConstants.size()) )
+			{
+				entries[i] = -1;
+				break;
+			}
+
+			uint64_t words[2];
+			std::memcpy(words, &mConstants[A], sizeof(words));
+
+			checkPush(i);
+			a.MoveImmediate(RAX, words[0]);
+			a.Store(Top, 0, RAX);
+			a.MoveImmediate(RAX, words[1]);
+			a.Store(Top, 8, RAX);
+			a.Lea(Top, Top, V);
+			break;
+		}
+
+		case OC_LoadLocal:
+			checkPush(i);
+			a.LoadValue(0, Locals, V * A);
+			a.StoreValue(Top, 0, 0);
+			a.Lea(Top, Top, V);
+			break;
+
+		case OC_StoreLocal:
+		case OC_PopStoreLocal:
+			a.LoadValue(0, Top, -V);
+			a.StoreValue(Locals, V * A, 0);
+			if( instruction.opCode == OC_PopStoreLocal )
+				a.Lea(Top, Top, -V);
+			break;
+
+		case OC_LoadGlobal:
+			checkPush(i);
+			a.Load(RAX, State, offsetof(JitState, globalsCount));
+			a.CompareImmediate(true, RAX, A);
+			exitIf(CC_BelowEqual, i);
+			a.Load(RAX, State, offsetof(JitState, globals));
+			a.LoadValue(0, RAX, V * A);
+			a.StoreValue(Top, 0, 0);
+			a.Lea(Top, Top, V);
+			break;
+
+		case OC_StoreGlobal:
+		case OC_PopStoreGlobal:
+			a.Load(RAX, State, offsetof(JitState, globalsCount));
+			a.CompareImmediate(true, RAX, A);
+			exitIf(CC_BelowEqual, i); // the interpreter makes room for it
+			a.Load(RAX, State, offsetof(JitState, globals));
+			a.LoadValue(0, Top, -V);
+			a.StoreValue(RAX, V * A, 0);
+			if( instruction.opCode == OC_PopStoreGlobal )
+				a.Lea(Top, Top, -V);
+			break;
+
+		case OC_Jump:
+			if( A <= i && CanTrace(code, A) ) // the interpreter runs the trace of the loop
+			{
+				entries[i] = -1;
+				break;
+			}
+			if( A <= i ) // backward jumps close loops, they are safe points
+			{
+				a.Load(RAX, State, offsetof(JitState, safePointRequested));
+				a.CompareByte(RAX, 0, 0);
+				exitIf(CC_NotEqual, i);
+			}
+			jumpTo(-1, A);
+			break;
+
+		case OC_JumpIfFalse:
+			truth();
+			jumpTo(CC_Equal, A);
+			break;
+
+		case OC_PopJumpIfFalse:
+			truth();
+			a.Lea(Top, Top, -V); // keeps the flags
+			jumpTo(CC_Equal, A);
+			break;
+
+		case OC_JumpIfFalseOrPop:
+			truth();
+			jumpTo(CC_Equal, A);
+			a.Lea(Top, Top, -V);
+			break;
+
+		case OC_JumpIfTrueOrPop:
+			truth();
+			jumpTo(CC_NotEqual, A);
+			a.Lea(Top, Top, -V);
+			break;
+
+		case OC_Add:
+		case OC_Subtract:
+		case OC_Multiply:
+		case OC_Divide:
+		case OC_Modulo:
+		case OC_AddInt:
+		case OC_SubtractInt:
+		case OC_MultiplyInt:
+		case OC_AddIntChecked:
+		case OC_SubtractIntChecked:
+		case OC_MultiplyIntChecked:
+		{
+			const OpCode opCode = UntypedOpCode(instruction.opCode);
+			SlowPath* slow = nullptr; // the typed ones have ints, they need none
+
+			if( ! IsTyped(instruction.opCode) )
+			{
+				slow = &slowPath(i, opCode, false);
+
+				a.CompareByte(Top, -2 * V, Value::VT_Int);
+				slow->from.push_back( a.JumpIf(CC_NotEqual) );
+				a.CompareByte(Top, -V, Value::VT_Int);
+				slow->from.push_back( a.JumpIf(CC_NotEqual) );
+			}
+
+			a.Load32(RAX, Top, -2 * V + Payload);
+
+			if( opCode == OC_Add )
+				a.Arithmetic32(0x03, RAX, Top, -V + Payload);
+			else if( opCode == OC_Subtract )
+				a.Arithmetic32(0x2B, RAX, Top, -V + Payload);
+			else if( opCode == OC_Multiply )
+				a.Multiply32(RAX, Top, -V + Payload);
+			else
+			{
+				// 0 and -1 as divisors are left to the slow path
+				a.Load32(RCX, Top, -V + Payload);
+				a.Lea32(RDX, RCX, 1);
+				a.CompareImmediate(false, RDX, 1);
+				slow->from.push_back( a.JumpIf(CC_BelowEqual) );
+				a.SignExtend();
+				a.Divide32(RCX);
+
+				if( opCode == OC_Modulo )
+					a.Move(RAX, RDX);
+			}
+
+			a.Store(Top, -2 * V + Payload, RAX); // the type stays int
+			a.Lea(Top, Top, -V);
+			break;
+		}
+
+		case OC_Power:
+		case OC_Xor:
+			slowPath(i, instruction.opCode, false).from.push_back( a.Jump() );
+			break;
+
+		case OC_Equal:
+		case OC_NotEqual:
+		case OC_Less:
+		case OC_Greater:
+		case OC_LessEqual:
+		case OC_GreaterEqual:
+		case OC_EqualInt:
+		case OC_NotEqualInt:
+		case OC_LessInt:
+		case OC_GreaterInt:
+		case OC_LessEqualInt:
+		case OC_GreaterEqualInt:
+		case OC_LessIntChecked:
+		case OC_GreaterIntChecked:
+		case OC_LessEqualIntChecked:
+		case OC_GreaterEqualIntChecked:
+		{
+			static const std::map<int, int> conditions = {
+				{OC_Equal, CC_Equal}, {OC_NotEqual, CC_NotEqual},
+				{OC_Less, CC_Less}, {OC_Greater, CC_Greater},
+				{OC_LessEqual, CC_LessEqual}, {OC_GreaterEqual, CC_GreaterEqual},
+			};
+
+			const OpCode opCode = UntypedOpCode(instruction.opCode);
+
+			if( ! IsTyped(instruction.opCode) )
+			{
+				SlowPath& slow = slowPath(i, opCode, false);
+
+				a.CompareByte(Top, -2 * V, Value::VT_Int);
+				slow.from.push_back( a.JumpIf(CC_NotEqual) );
+				a.CompareByte(Top, -V, Value::VT_Int);
+				slow.from.push_back( a.JumpIf(CC_NotEqual) );
+			}
+
+			a.Load32(RAX, Top, -2 * V + Payload);
+			a.Arithmetic32(0x3B, RAX, Top, -V + Payload);
+			a.SetCondition(conditions.at(opCode), RAX);
+			a.ZeroExtendByte(RAX, RAX);
+			a.StoreByte(Top, -2 * V, Value::VT_Bool);
+			a.Store(Top, -2 * V + Payload, RAX);
+			a.Lea(Top, Top, -V);
+			break;
+		}
+
+		case OC_UnaryPlus:
+			a.CompareByte(Top, -V, Value::VT_Int);
+			jumpTo(CC_Equal, i + 1);
+			a.CompareByte(Top, -V, Value::VT_Float);
+			exitIf(CC_NotEqual, i);
+			break;
+
+		case OC_UnaryMinus:
+		{
+			SlowPath& slow = slowPath(i, instruction.opCode, true);
+
+			a.CompareByte(Top, -V, Value::VT_Int);
+			slow.from.push_back( a.JumpIf(CC_NotEqual) );
+			a.Load32(RAX, Top, -V + Payload);
+			a.Negate32(RAX);
+			a.Store(Top, -V + Payload, RAX);
+			break;
+		}
+
+		case OC_UnaryNot:
+			truth();
+			a.XorImmediate32(RCX, 1);
+			a.StoreByte(Top, -V, Value::VT_Bool);
+			a.Store(Top, -V + Payload, RCX);
+			break;
+
+		default:
+			entries[i] = -1;
+			break;
+		}
+
+		if( entries[i] < 0 ) // the interpreter does this one
+		{
+			a.MoveImmediate32(RAX, uint32_t(i));
+			a.Patch(a.Jump(), epilogue);
+		}
+	}
+
+	for( const SlowPath& slow : slowPaths )
+	{
+		for( size_t from : slow.from )
+			a.Patch(from, a.Size());
+
+		a.Lea(RDI, Top, slow.unary ? -V : -2 * V);
+		a.MoveImmediate32(RSI, uint32_t(slow.opCode));
+		a.MoveImmediate(RAX, uint64_t(&Jit::Arithmetic));
+		a.CallRegister(RAX);
+		a.TestLow8(RAX);
+		exitIf(CC_Equal, slow.index);
+
+		if( ! slow.unary )
+			a.Lea(Top, Top, -V);
+
+		jumpTo(-1, slow.index + 1);
+	}
+
+	for( const auto& jump : toInstruction )
+		a.Patch(jump.first, starts[jump.second]);
+
+	// one way out for each instruction that can leave
+	std::map<int, size_t> exits;
+
+	for( const auto& jump : toExit )
+	{
+		auto it = exits.find(jump.second);
+
+		if( it == exits.end() )
+		{
+			it = exits.emplace(jump.second, a.Size()).first;
+
+			a.MoveImmediate32(RAX, uint32_t(jump.second));
+			a.Patch(a.Jump(), epilogue);
+		}
+
+		a.Patch(jump.first, it->second);
+	}
+
+	if( ! Install(a, &code.memory, &code.size) )
+		return false;
+
+	// no entry points at the end of a stretch of compiled instructions, unless
+	// a jump in it can lead somewhere else
+	for( int i = count - 1, run = 0; i >= 0; --i )
+	{
+		const OpCode opCode = instructions[i].opCode;
+
+		if( entries[i] < 0 )
+			run = 0;
+		else if( opCode == OC_Jump || IsConditionalJump(opCode) )
+			run = MinEntryStretch;
+		else if( ++run < MinEntryStretch )
+			entries[i] = -1;
+	}
+
+	code.entries = std::move(entries);
+
+	return true;
+#else
+	(void)codeObject;
+	return false;
+#endif
+}
+
+void Jit::Run(const JitCode& code, StackFrame* frame, ValueStack& stack) const
+{
+	int start = int(frame->ip - frame->instructions);
+
+	if( code.translation )
+	{
+		auto translation = [&code, start](JitState* state) { return code.translation(state, start); };
+
+		int index = Enter(translation, 0, frame, stack, mSafePointRequested, mTracing);
+
+		frame->ip = frame->instructions + index;
+		return;
+	}
+
+#if ELEMENT_JIT
+	int entry = code.entries[start];
+
+	if( entry < 0 )
+		return;
+
+	int index = Enter(EntryPoint{code.memory, entry}, 0, frame, stack, mSafePointRequested, mTracing);
+
+	frame->ip = frame->instructions + index;
+#endif
+}
+
+void Jit::RunLoop(const CodeObject& codeObject, StackFrame* frame, int backEdge, ValueStack& stack)
+{
+#if ELEMENT_JIT
+	JitCode& code = GetCode(codeObject);
+
+	if( code.loopOfBackEdge.empty() )
+		code.loopOfBackEdge.resize(codeObject.instructions.size(), 0);
+
+	int& slot = code.loopOfBackEdge[backEdge];
+
+	if( slot < 0 ) // given up
+		return;
+
+	if( slot == 0 ) // the first jump from here, other jumps may close the same loop
+	{
+		int head = int(frame->ip - frame->instructions);
+
+		auto it = std::find_if(code.loops.begin(), code.loops.end(), [head](const JitLoop& loop) { return loop.head == head; });
+
+		if( it == code.loops.end() )
+		{
+			code.loops.emplace_back();
+			code.loops.back().head = head;
+			code.loops.back().backEdge = backEdge;
+			it = code.loops.end() - 1;
+		}
+
+		slot = it->failed ? -1 : int(it - code.loops.begin()) + 1;
+
+		if( slot < 0 )
+			return;
+	}
+
+	JitLoop& loop = code.loops[slot - 1];
+
+	if( loop.traces.empty() )
+	{
+		if( ++loop.hotness < TraceThreshold )
+			return;
+
+		loop.hotness = 0;
+
+		if( ! RecordTrace(codeObject, *frame, stack, stack.size(), loop) || ! CompileTraces(codeObject, loop) )
+		{
+			loop.traces.clear();
+
+			if( ++loop.attempts >= MaxTraceAttempts )
+				GiveUp(codeObject, loop);
+			return;
+		}
+	}
+
+	size_t stackStart = stack.size();
+	int index = RunTrace(loop, frame, stack);
+
+	if( index < 0 )
+	{
+		if( ++loop.misses >= MaxTraceMisses )
+			GiveUp(codeObject, loop);
+		return;
+	}
+
+	// a conditional jump that often goes the other way gets a trace from there
+	if( index != loop.backEdge &&
+		IsConditionalJump(codeObject.instructions[index].opCode) &&
+		loop.traces.size() < MaxTraces &&
+		++loop.sideExits[index] == TraceThreshold &&
+		RecordTrace(codeObject, *frame, stack, stackStart, loop) &&
+		! CompileTraces(codeObject, loop) )
+	{
+		loop.traces.pop_back();
+
+		if( ! CompileTraces(codeObject, loop) )
+			GiveUp(codeObject, loop);
+	}
+#else
+	(void)codeObject;
+	(void)frame;
+	(void)backEdge;
+	(void)stack;
+#endif
+}
+
+bool Jit::RecordTrace(const CodeObject& codeObject, const StackFrame& frame, const ValueStack& stack, size_t stackStart, JitLoop& loop)
+{
+#if ELEMENT_JIT
+	JitTrace trace;
+	std::vector<Value> values(stack.begin() + stackStart, stack.end());
+
+	int start = int(frame.ip - frame.instructions);
+
+	if( ! Record(codeObject, frame, mConstants, loop.head, loop.backEdge, start, std::move(values), &trace) )
+		return false;
+
+	loop.traces.push_back( std::move(trace) );
+	return true;
+#else
+	(void)codeObject;
+	(void)frame;
+	(void)stack;
+	(void)stackStart;
+	(void)loop;
+	return false;
+#endif
+}
+
+bool Jit::CompileTraces(const CodeObject& codeObject, JitLoop& loop)
+{
+#if ELEMENT_JIT
+	Assembler a;
+	TraceCompiler compiler(codeObject, mConstants, loop.traces, a);
+
+	size_t entry = 0;
+	int stackSize = 0;
+	unsigned char* memory = nullptr;
+	size_t size = 0;
+
+	if( ! compiler.Compile(&entry, &stackSize) || ! Install(a, &memory, &size) )
+		return false;
+
+	if( loop.memory )
+		munmap(loop.memory, loop.size);
+
+	loop.memory = memory;
+	loop.size = size;
+	loop.entry = int(entry);
+	loop.stackSize = stackSize;
+
+	return true;
+#else
+	(void)codeObject;
+	(void)loop;
+	return false;
+#endif
+}
+
+int Jit::RunTrace(const JitLoop& loop, StackFrame* frame, ValueStack& stack) const
+{
+#if ELEMENT_JIT
+	int index = Enter(EntryPoint{loop.memory, loop.entry}, size_t(loop.stackSize), frame, stack, mSafePointRequested, mTracing);
+
+	if( index >= 0 ) // or the variables do not have the types it was compiled for
+		frame->ip = frame->instructions + index;
+
+	return index;
+#else
+	(void)loop;
+	(void)frame;
+	(void)stack;
+	return -1;
+#endif
+}
+
+void Jit::GiveUp(const CodeObject& codeObject, JitLoop& loop)
+{
+	loop.failed = true;
+
+#if ELEMENT_JIT
+	// the baseline code left the loop to the interpreter, it gets compiled
+	// again with the loop in it once the code object is hot again
+	JitCode& code = *codeObject.jitCode;
+
+	// its backward jumps stop calling 'RunLoop'
+	const int slot = int(&loop - code.loops.data()) + 1;
+	std::replace(code.loopOfBackEdge.begin(), code.loopOfBackEdge.end(), slot, -1);
+
+	if( code.memory )
+	{
+		munmap(code.memory, code.size);
+		code.memory = nullptr;
+		code.size = 0;
+		code.entries.clear();
+		codeObject.hotness = 0;
+	}
+#else
+	(void)codeObject;
+#endif
+}
+
+void Jit::AttachTranslation(const CodeObject& codeObject)
+{
+	const auto& translations = GetTranslations();
+
+	if( translations.empty() )
+		return;
+
+	auto it = translations.find( Fingerprint(codeObject, mConstants) );
+
+	if( it != translations.end() )
+		GetCode(codeObject).translation = it->second;
+}
+
+bool Jit::RegisterTranslations(const JitTranslation* translations, size_t count)
+{
+	for( size_t i = 0; i < count; ++i )
+		GetTranslations().emplace(translations[i].fingerprint, translations[i].function);
+
+	return true;
+}
+
+uint64_t Jit::Fingerprint(const CodeObject& codeObject, const std::vector<Value>& constants)
+{
+	// FNV-1a of everything the translation depends on, the indices of
+	// constants differ with the order the modules are loaded in so their
+	// values are used instead
+	uint64_t hash = 14695981039346656037ull;
+
+	auto add = [&hash](uint32_t word)
+	{
+		for( int i = 0; i < 4; ++i )
+		{
+			hash ^= (word >> (8 * i)) & 0xff;
+			hash *= 1099511628211ull;
+		}
+	};
+
+	for( const Instruction& instruction : codeObject.instructions )
+	{
+		add( uint32_t(instruction.opCode) );
+
+		if( instruction.opCode != OC_LoadConstant )
+		{
+			add( uint32_t(instruction.A) );
+			continue;
+		}
+
+		const Value& constant = constants[instruction.A];
+
+		uint32_t bits = 0;
+
+		if( constant.IsInt() )
+			bits = uint32_t(constant.integer);
+		else if( constant.IsFloat() )
+			std::memcpy(&bits, &constant.floatingPoint, sizeof(bits));
+		else if( constant.IsBoolean() )
+			bits = constant.boolean ? 1 : 0;
+
+		add( uint32_t(constant.type) );
+		add(bits);
+	}
+
+	return hash;
+}
+
+bool Jit::Arithmetic(Value* operands, int opCode)
+{
+	const Value& lhs = operands[0];
+
+	if( opCode == OC_UnaryMinus )
+	{
+		if( ! lhs.IsNumber() )
+			return false;
+
+		operands[0] = lhs.IsInt() ? Value(-lhs.AsInt()) : Value(-lhs.AsFloat());
+		return true;
+	}
+
+	const Value& rhs = operands[1];
+	Value result;
+
+	if( opCode == OC_Xor )
+	{
+		operands[0] = Value( !lhs.AsBool() != !rhs.AsBool() ); // anything can be turned into a bool
+		return true;
+	}
+
+	if( ! lhs.IsNumber() || ! rhs.IsNumber() )
+		return false;
+
+	bool ints = lhs.IsInt() && rhs.IsInt();
+
+	switch( opCode )
+	{
+	case OC_Add:			result = ints ? Value(lhs.AsInt() + rhs.AsInt()) : Value(lhs.AsFloat() + rhs.AsFloat()); break;
+	case OC_Subtract:		result = ints ? Value(lhs.AsInt() - rhs.AsInt()) : Value(lhs.AsFloat() - rhs.AsFloat()); break;
+	case OC_Multiply:		result = ints ? Value(lhs.AsInt() * rhs.AsInt()) : Value(lhs.AsFloat() * rhs.AsFloat()); break;
+
+	case OC_Divide:
+		if( rhs.AsFloat() == 0 || (ints && rhs.AsInt() == -1) )
+			return false;
+		result = ints ? Value(lhs.AsInt() / rhs.AsInt()) : Value(lhs.AsFloat() / rhs.AsFloat());
+		break;
+
+	case OC_Modulo:
+		if( ints && (rhs.AsInt() == 0 || rhs.AsInt() == -1) )
+			return false;
+		result = ints ? Value(lhs.AsInt() % rhs.AsInt()) : Value( float(std::fmod(lhs.AsFloat(), rhs.AsFloat())) );
+		break;
+
+	case OC_Power:
+		if( lhs.IsFloat() )
+			result = float(std::pow(lhs.AsFloat(), rhs.AsFloat()));
+		else
+			result = int(std::pow(lhs.AsInt(), rhs.AsFloat()));
+		break;
+
+	case OC_Equal:			result = ints ? lhs.AsInt() == rhs.AsInt() : lhs.AsFloat() == rhs.AsFloat(); break;
+	case OC_NotEqual:		result = ints ? lhs.AsInt() != rhs.AsInt() : lhs.AsFloat() != rhs.AsFloat(); break;
+	case OC_Less:			result = ints ? lhs.AsInt() <  rhs.AsInt() : lhs.AsFloat() <  rhs.AsFloat(); break;
+	case OC_Greater:		result = ints ? lhs.AsInt() >  rhs.AsInt() : lhs.AsFloat() >  rhs.AsFloat(); break;
+	case OC_LessEqual:		result = ints ? lhs.AsInt() <= rhs.AsInt() : lhs.AsFloat() <= rhs.AsFloat(); break;
+	case OC_GreaterEqual:	result = ints ? lhs.AsInt() >= rhs.AsInt() : lhs.AsFloat() >= rhs.AsFloat(); break;
+
+	default:
+		return false;
+	}
+
+	operands[0] = result;
+	return true;
+}
+
+}
@@ -0,0 +1,180 @@
+#ifndef _JIT_INCLUDED_
+#define _JIT_INCLUDED_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "DataTypes.h"
+
+namespace element
+{
+
+// What the machine code, or the C++ translation of a code object, sees of the
+// interpreter while it runs.
+struct JitState
+{
+	Value*						top; // one past the last value on the stack
+	Value*						limit; // where the reserved stack space ends
+	Value*						locals;
+	Value*						globals;
+	size_t						globalsCount;
+	const std::atomic<bool>*	safePointRequested;
+	bool						tracing; // a translation returns at backward jumps, for the traces of loops
+};
+
+
+// A path through the body of a loop, as it was recorded.
+struct JitTrace
+{
+	struct Step
+	{
+		int			index;
+		bool		taken; // whether a conditional jump jumped
+		Value::Type	type; // of the value a load got
+	};
+
+	std::vector<Step>			steps;
+	std::vector<Value::Type>	stack; // of the values on the stack where it starts
+};
+
+
+// A loop of a code object and the traces of its iterations, once they have
+// been recorded. The first trace starts at the head of the loop, the others
+// where the ones before them were left too often.
+struct JitLoop
+{
+	int						head; // the instruction the backward jump goes to
+	int						backEdge; // the backward jump
+	unsigned				hotness		= 0; // backward jumps since the last attempt to trace it
+	unsigned				attempts	= 0;
+	unsigned				misses		= 0; // entries that failed the type guards
+	bool					failed		= false; // never try again
+
+	std::vector<JitTrace>	traces;
+	std::map<int, unsigned>	sideExits; // times the traces were left at each instruction
+
+	unsigned char*			memory		= nullptr;
+	size_t					size		= 0;
+	int						entry		= 0; // offset of the type checks before the loop
+	int						stackSize	= 0; // the most values a side exit leaves on the stack
+};
+
+
+// The machine code of a code object. The baseline code has an entry point
+// for every instruction the interpreter can hand it over at. A translation
+// made with --emit-cpp and linked in takes the place of the baseline code.
+struct JitCode
+{
+	typedef int (*EntryFunction)(JitState* state, const unsigned char* entry);
+	typedef int (*Translation)(JitState* state, int index); // starts at any instruction
+
+	unsigned char*		memory		= nullptr;
+	size_t				size		= 0;
+	std::vector<int>	entries; // offset of each instruction, -1 for the ones it does not compile
+
+	Translation			translation	= nullptr;
+
+	std::vector<JitLoop> loops;
+	std::vector<int>	loopOfBackEdge; // for each instruction, its index in 'loops' + 1, 0 before the first jump, -1 once given up
+};
+
+
+// A translated code object, found by the fingerprint of its bytecode.
+struct JitTranslation
+{
+	uint64_t				fingerprint;
+	JitCode::Translation	function;
+};
+
+
+// Compiles bytecode to x86-64 machine code, in two ways.
+//
+// The baseline compiler translates whole code objects, each instruction on
+// its own: jumps, stack shuffling, loads and stores of locals, globals and
+// constants, and integer arithmetic and comparisons are done inline, floats
+// go through a helper. Anything else, a value of an unexpected type or a
+// safe point that needs handling makes the code return to the interpreter
+// at that instruction. All checks come before any change to the state, so
+// the interpreter simply executes the instruction itself.
+//
+// The trace compiler handles hot loops. One iteration is recorded by running
+// it on a copy of the variables, which gives the path through the loop body
+// and the types of everything along it. That path is compiled with the
+// types of the variables checked once before the loop, the values of
+// expressions kept in registers instead of on the stack, and unboxed int
+// and float arithmetic. Where a later iteration leaves the path, the values
+// the path holds in registers are written to the stack and the interpreter
+// goes on from there. A place where that happens often gets a trace of its
+// own from there to the end of the iteration, and all traces of the loop
+// are compiled together as a tree.
+//
+// Only available on x86-64 Linux, elsewhere nothing gets compiled.
+class Jit
+{
+public:
+	// calls and backward jumps a code object makes before it is compiled
+	static const unsigned HotnessThreshold = 1000;
+	// backward jumps to the head of a loop, or exits from its traces at the
+	// same instruction, before an iteration is recorded from there
+	static const unsigned TraceThreshold = 50;
+
+				Jit(const std::vector<Value>& constants, const std::atomic<bool>& safePointRequested);
+				~Jit();
+
+	void		ResetState();
+
+	// when the jit is off, translations run their loops themselves
+	void		SetTracing(bool tracing);
+
+	// sets the 'jitCode' of the code object, false if it cannot be compiled
+	bool		Compile(const CodeObject& codeObject);
+
+	// runs from the current instruction of the frame until the code returns
+	// to the interpreter, the frame then points at the next instruction to run
+	void		Run(const JitCode& code, StackFrame* frame, ValueStack& stack) const;
+
+	// for a backward jump from 'backEdge' to the current instruction of the
+	// frame, runs the trace of the loop if it has one, or counts towards one
+	void		RunLoop(const CodeObject& codeObject, StackFrame* frame, int backEdge, ValueStack& stack);
+
+	// false once the loop closed by 'backEdge' has been given up, it is not
+	// worth calling 'RunLoop' for it anymore
+	static bool	IsTracing(const CodeObject& codeObject, int backEdge)
+	{
+		const JitCode* code = codeObject.jitCode;
+		return ! code || code->loopOfBackEdge.empty() || code->loopOfBackEdge[backEdge] >= 0;
+	}
+
+	// gives the code object its translation, if one with its fingerprint is linked in
+	void		AttachTranslation(const CodeObject& codeObject);
+
+	// the translations register themselves before main
+	static bool		RegisterTranslations(const JitTranslation* translations, size_t count);
+	static uint64_t	Fingerprint(const CodeObject& codeObject, const std::vector<Value>& constants);
+
+	// the arithmetic the compiled code does not do inline, for floats and mixed
+	// numbers, the result replaces the first operand; false leaves the operands
+	// to the interpreter
+	static bool		Arithmetic(Value* operands, int opCode);
+
+private:
+	JitCode&	GetCode(const CodeObject& codeObject);
+	bool		RecordTrace(const CodeObject& codeObject, const StackFrame& frame, const ValueStack& stack, size_t stackStart, JitLoop& loop);
+	bool		CompileTraces(const CodeObject& codeObject, JitLoop& loop);
+	int			RunTrace(const JitLoop& loop, StackFrame* frame, ValueStack& stack) const; // -1 if it did not match the types
+	void		GiveUp(const CodeObject& codeObject, JitLoop& loop);
+
+private:
+	const std::vector<Value>&				mConstants;
+	const std::atomic<bool>&				mSafePointRequested;
+	bool									mTracing;
+
+	std::vector<std::unique_ptr<JitCode>>	mCode;
+};
+
+}
+
+#endif // _JIT_INCLUDED_
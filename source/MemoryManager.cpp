@@ -1,17 +1,109 @@
 #include "MemoryManager.h"
 
 #include <algorithm>
+#include <fstream>
+#include <functional>
+#include <new>
+
+#if defined(_WIN32)
+	#include <malloc.h>
+	#include <intrin.h>
+#else
+	#include <sys/mman.h>
+#endif
 
 namespace element
 {
 
+static const unsigned SlotSizes[] = { 16, 24, 32, 40, 48, 64, 80, 96, 128, 160, 192, 256,
+									  384, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+
+static const unsigned MaxSlotSize = 4096;
+
+// pooled execution contexts of coroutines and native calls into scripts
+static const size_t MaxFreeExecutionContexts	= 256;
+static const size_t InitialStackSize			= 8;
+static const size_t MaxPooledStackSize			= 1024;
+
+static unsigned CountTrailingZeros(uint64_t bits)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return unsigned(index);
+#else
+	return unsigned(__builtin_ctzll(bits));
+#endif
+}
+
+static unsigned CountBits(uint64_t bits)
+{
+#if defined(_MSC_VER)
+	return unsigned(__popcnt64(bits));
+#else
+	return unsigned(__builtin_popcountll(bits));
+#endif
+}
+
+// Pages are requested from the OS directly, aligned to HeapPage::Size so
+// that the page of any object can be found by masking its address.
+static void* MapPages(size_t size)
+{
+#if defined(_WIN32)
+	return _aligned_malloc(size, HeapPage::Size);
+#else
+	size_t reserved = size + HeapPage::Size;
+
+	void* mapping = mmap(nullptr, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if( mapping == MAP_FAILED )
+		return nullptr;
+
+	uintptr_t begin		= uintptr_t(mapping);
+	uintptr_t aligned	= (begin + HeapPage::Size - 1) & ~uintptr_t(HeapPage::Size - 1);
+	uintptr_t end		= begin + reserved;
+
+	if( aligned > begin )
+		munmap(mapping, aligned - begin);
+
+	if( end > aligned + size )
+		munmap((void*)(aligned + size), end - (aligned + size));
+
+	return (void*)aligned;
+#endif
+}
+
+static void UnmapPages(void* memory, size_t size)
+{
+#if defined(_WIN32)
+	_aligned_free(memory);
+#else
+	munmap(memory, size);
+#endif
+}
+
+// Gives the physical memory behind the slots of an empty page back to the OS.
+// The address range stays valid and reads back as zeroes when reused.
+static void DecommitSlots(HeapPage* page)
+{
+#if !defined(_WIN32)
+	const uintptr_t SystemPageSize = 4096;
+
+	uintptr_t begin	= (uintptr_t(page) + HeapPage::SlotsOffset() + SystemPageSize - 1) & ~(SystemPageSize - 1);
+	uintptr_t end	= uintptr_t(page) + page->mappedSize;
+
+	if( end > begin )
+		madvise((void*)begin, end - begin, MADV_DONTNEED);
+#endif
+
+	page->decommitted = true;
+}
+
 MemoryManager::MemoryManager()
-: mHeapHead(nullptr)
+: mSweptLargePages(0)
 , mGCStage(GCS_Ready)
-, mCurrentWhite(GarbageCollected::GC_White0)
-, mNextWhite(GarbageCollected::GC_White1)
-, mPreviousGC(nullptr)
-, mCurrentGC(nullptr)
+, mModuleCopiesCount(0)
+, mInNativeCode(false)
 , mHeapStringsCount(0)
 , mHeapArraysCount(0)
 , mHeapObjectsCount(0)
@@ -19,12 +111,52 @@ MemoryManager::MemoryManager()
 , mHeapBoxesCount(0)
 , mHeapIteratorsCount(0)
 , mHeapErrorsCount(0)
+, mHeapChannelsCount(0)
+, mHeapStringsBytes(0)
+, mHeapArraysBytes(0)
+, mHeapObjectsBytes(0)
+, mHeapFunctionsBytes(0)
+, mHeapBoxesBytes(0)
+, mHeapIteratorsBytes(0)
+, mHeapErrorsBytes(0)
+, mHeapChannelsBytes(0)
+, mHeapBytes(0)
+, mPeakHeapBytes(0)
+, mTotalBytesAllocated(0)
+, mHeapLimit(0)
+, mAllocationHook(nullptr)
+, mAllocationHookUserData(nullptr)
 {
+	mFinishedContext.state = ExecutionContext::CRS_Finished;
+
+	for( unsigned slotSize : SlotSizes )
+	{
+		mSizeClasses.emplace_back();
+		mSizeClasses.back().slotSize = slotSize;
+	}
+
+	// map every size (in steps of 8 bytes) to the smallest fitting size class
+	mSizeClassForSize.resize(MaxSlotSize / 8 + 1);
+
+	unsigned sizeClass = 0;
+	for( unsigned i = 0; i < mSizeClassForSize.size(); ++i )
+	{
+		while( SlotSizes[sizeClass] < i * 8 )
+			++sizeClass;
+
+		mSizeClassForSize[i] = (unsigned char)sizeClass;
+	}
 }
 
 MemoryManager::~MemoryManager()
 {
 	DeleteHeap();
+
+	for( ExecutionContext* context : mExecutionContexts )
+		delete context;
+
+	for( ExecutionContext* context : mFreeExecutionContexts )
+		delete context;
 }
 
 void MemoryManager::ResetState()
@@ -32,15 +164,20 @@ void MemoryManager::ResetState()
 	mDefaultModule = Module();
 	
 	mModules.clear();
+	mModuleCopiesCount = 0;
+
+	for( ExecutionContext* context : mExecutionContexts )
+		ReleaseExecutionContext(context);
+
 	mExecutionContexts.clear();
+	mTemporaryRoots.clear();
+	mInNativeCode = false;
 	
 	DeleteHeap();
 	
-	mGCStage		= GCS_Ready;
-	mCurrentWhite	= GarbageCollected::GC_White0;
-	mNextWhite		= GarbageCollected::GC_White1;
-	mPreviousGC		= nullptr;
-	mCurrentGC		= nullptr;
+	mGCStage = GCS_Ready;
+	mGrayList.clear();
+	mMarkedCoroutines.clear();
 	
 	mHeapStringsCount	= 0;
 	mHeapArraysCount	= 0;
@@ -49,6 +186,20 @@ void MemoryManager::ResetState()
 	mHeapBoxesCount		= 0;
 	mHeapIteratorsCount = 0;
 	mHeapErrorsCount	= 0;
+	mHeapChannelsCount	= 0;
+	
+	mHeapStringsBytes	= 0;
+	mHeapArraysBytes	= 0;
+	mHeapObjectsBytes	= 0;
+	mHeapFunctionsBytes	= 0;
+	mHeapBoxesBytes		= 0;
+	mHeapIteratorsBytes	= 0;
+	mHeapErrorsBytes	= 0;
+	mHeapChannelsBytes	= 0;
+	
+	mHeapBytes				= 0;
+	mPeakHeapBytes			= 0;
+	mTotalBytesAllocated	= 0;
 }
 
 Module& MemoryManager::GetDefaultModule()
@@ -66,9 +217,15 @@ Module& MemoryManager::GetModuleForFile(const std::string& filename)
 	return module;
 }
 
+Module& MemoryManager::NewModuleForCopy(const std::string& filename)
+{
+	// every copy gets globals of its own, even when they come from the same file
+	return GetModuleForFile(filename + " (copy " + std::to_string(++mModuleCopiesCount) + ")");
+}
+
 String* MemoryManager::NewString()
 {
-	String* newString = new String();
+	String* newString = new(AllocateSlot(sizeof(String))) String();
 
 	AddToHeap(newString);
 
@@ -79,7 +236,7 @@ String* MemoryManager::NewString()
 
 String*	MemoryManager::NewString(const std::string& str)
 {
-	String* newString = new String(str);
+	String* newString = new(AllocateSlot(sizeof(String))) String(str);
 
 	AddToHeap(newString);
 
@@ -90,7 +247,7 @@ String*	MemoryManager::NewString(const std::string& str)
 
 String*	MemoryManager::NewString(const char* str, int size)
 {
-	String* newString = new String(str, size);
+	String* newString = new(AllocateSlot(sizeof(String))) String(str, size);
 
 	AddToHeap(newString);
 
@@ -101,7 +258,7 @@ String*	MemoryManager::NewString(const char* str, int size)
 
 Array* MemoryManager::NewArray()
 {
-	Array* newArray = new Array();
+	Array* newArray = new(AllocateSlot(sizeof(Array))) Array();
 
 	AddToHeap(newArray);
 
@@ -112,7 +269,7 @@ Array* MemoryManager::NewArray()
 
 Object* MemoryManager::NewObject()
 {
-	Object* newObject = new Object();
+	Object* newObject = new(AllocateSlot(sizeof(Object))) Object();
 
 	AddToHeap(newObject);
 
@@ -123,8 +280,8 @@ Object* MemoryManager::NewObject()
 
 Object* MemoryManager::NewObject(const Object* other)
 {
-	Object* newObject = new Object();
-	*newObject = *other;
+	Object* newObject = new(AllocateSlot(sizeof(Object))) Object();
+	newObject->members = other->members;
 
 	AddToHeap(newObject);
 
@@ -135,7 +292,9 @@ Object* MemoryManager::NewObject(const Object* other)
 
 Function* MemoryManager::NewFunction(const Function* other)
 {
-	Function* newFunction = new Function(other);
+	unsigned freeVariablesCount = unsigned(other->codeObject->closureMapping.size());
+
+	Function* newFunction = new(AllocateSlot(Function::SizeWith(freeVariablesCount))) Function(other, freeVariablesCount);
 
 	AddToHeap(newFunction);
 
@@ -146,16 +305,22 @@ Function* MemoryManager::NewFunction(const Function* other)
 
 Function* MemoryManager::NewCoroutine(const Function* other)
 {
-	Function* newFunction = NewFunction(other);
+	unsigned freeVariablesCount = unsigned(other->codeObject->closureMapping.size());
+
+	Function* newFunction = new(AllocateSlot(Function::SizeWith(freeVariablesCount))) Function(other, freeVariablesCount);
+
+	newFunction->executionContext = AcquireExecutionContext();
 
-	newFunction->executionContext = new ExecutionContext();
+	AddToHeap(newFunction);
+
+	++mHeapFunctionsCount;
 
 	return newFunction;
 }
 
 Box* MemoryManager::NewBox()
 {
-	Box* newBox = new Box();
+	Box* newBox = new(AllocateSlot(sizeof(Box))) Box();
 
 	AddToHeap(newBox);
 
@@ -166,7 +331,7 @@ Box* MemoryManager::NewBox()
 
 Box* MemoryManager::NewBox(const Value& value)
 {
-	Box* newBox = new Box();
+	Box* newBox = new(AllocateSlot(sizeof(Box))) Box();
 
 	newBox->value = value;
 	
@@ -179,7 +344,7 @@ Box* MemoryManager::NewBox(const Value& value)
 
 Iterator* MemoryManager::NewIterator(IteratorImplementation* newIterator)
 {
-	Iterator* iterator = new Iterator(newIterator);
+	Iterator* iterator = new(AllocateSlot(sizeof(Iterator))) Iterator(newIterator);
 
 	AddToHeap(iterator);
 
@@ -190,7 +355,7 @@ Iterator* MemoryManager::NewIterator(IteratorImplementation* newIterator)
 
 Error* MemoryManager::NewError(const std::string& errorMessage)
 {
-	Error* newError = new Error(errorMessage);
+	Error* newError = new(AllocateSlot(sizeof(Error))) Error(errorMessage);
 
 	AddToHeap(newError);
 	
@@ -199,9 +364,20 @@ Error* MemoryManager::NewError(const std::string& errorMessage)
 	return newError;
 }
 
+Channel* MemoryManager::NewChannel(unsigned capacity)
+{
+	Channel* newChannel = new(AllocateSlot(sizeof(Channel))) Channel(capacity);
+
+	AddToHeap(newChannel);
+
+	++mHeapChannelsCount;
+
+	return newChannel;
+}
+
 ExecutionContext* MemoryManager::NewRootExecutionContext()
 {
-    ExecutionContext* newContext = new ExecutionContext();
+    ExecutionContext* newContext = AcquireExecutionContext();
 
     mExecutionContexts.push_back(newContext);
 
@@ -215,20 +391,72 @@ bool MemoryManager::DeleteRootExecutionContext(ExecutionContext* context)
 	if( it != mExecutionContexts.end() )
 	{
 		mExecutionContexts.erase(it);
-		delete context;
+		ReleaseExecutionContext(context);
 		return true;
 	}
 
 	return false;
 }
 
+void MemoryManager::FinishCoroutine(Function* coroutine)
+{
+	ExecutionContext* context = coroutine->executionContext;
+
+	if( context == &mFinishedContext )
+		return;
+
+	coroutine->executionContext = &mFinishedContext;
+
+	ReleaseExecutionContext(context);
+	UpdateSize(coroutine);
+}
+
+ExecutionContext* MemoryManager::AcquireExecutionContext()
+{
+	if( mFreeExecutionContexts.empty() )
+	{
+		ExecutionContext* newContext = new ExecutionContext();
+		newContext->stack.reserve(InitialStackSize);
+		return newContext;
+	}
+
+	ExecutionContext* context = mFreeExecutionContexts.back();
+	mFreeExecutionContexts.pop_back();
+
+	return context;
+}
+
+void MemoryManager::ReleaseExecutionContext(ExecutionContext* context)
+{
+	if( mFreeExecutionContexts.size() >= MaxFreeExecutionContexts )
+	{
+		delete context;
+		return;
+	}
+
+	context->state = ExecutionContext::CRS_NotStarted;
+	context->parent = nullptr;
+	context->lastObject = Value();
+	context->stackFrames.clear();
+	context->stack.clear();
+
+	// a deep recursion should not keep its stack around forever
+	if( context->stack.capacity() > MaxPooledStackSize )
+	{
+		context->stack.shrink_to_fit();
+		context->stack.reserve(InitialStackSize);
+	}
+
+	mFreeExecutionContexts.push_back(context);
+}
+
 void MemoryManager::GarbageCollect(int steps)
 {
 	switch( mGCStage )
 	{
 	case GCS_Ready:
 		mGrayList.clear();
-		std::swap(mCurrentWhite, mNextWhite); // White0 <-> White1
+		mMarkedCoroutines.clear();
 		mGCStage = GCS_MarkRoots;
 
 	case GCS_MarkRoots:
@@ -238,38 +466,100 @@ void MemoryManager::GarbageCollect(int steps)
 		mGCStage = GCS_Mark;
 
 	case GCS_Mark:
-		steps = Mark(steps);
-		if( steps <= 0 )
-			return;
-		mGCStage = GCS_SweepHead;
-
-	case GCS_SweepHead:
-		steps = SweepHead(steps);
-		if( steps <= 0 )
-			return;
-		mGCStage = GCS_SweepRest;
+		do
+		{
+			steps = Mark(steps);
+			if( steps <= 0 )
+				return;
+		}
+		while( Remark() );
+		StartSweeping();
+		mGCStage = GCS_Sweep;
 
-	case GCS_SweepRest:
-		steps = SweepRest(steps);
+	case GCS_Sweep:
+		steps = Sweep(steps);
 		if( steps <= 0 )
 			return;
 		mGCStage = GCS_Ready;
 	}
 }
 
+void MemoryManager::FullGarbageCollect()
+{
+	// a cycle that is already under way may keep objects that died since
+	// it started, so finish it first and then run a complete one
+	if( mGCStage != GCS_Ready )
+		GarbageCollect();
+
+	GarbageCollect();
+}
+
 void MemoryManager::UpdateGcRelationship(GarbageCollected* parent, const Value& child)
 {
 	// the tri-color invariant states that at no point shall
 	// a black node be directly connected to a white node
-	if( parent->state == GarbageCollected::GC_Black &&
+	// (gray parents are treated as black, which is merely conservative)
+	if( (mGCStage == GCS_MarkRoots || mGCStage == GCS_Mark) &&
 		child.IsGarbageCollected() &&
-		child.garbageCollected->state == mCurrentWhite )
+		IsMarked(parent) &&
+		! IsMarked(child.garbageCollected) )
 	{
-		child.garbageCollected->state = GarbageCollected::State::GC_Gray;
+		HeapPage::FromObject(child.garbageCollected)->SetMarked(child.garbageCollected);
 		mGrayList.push_back( child.garbageCollected );
 	}
 }
 
+void MemoryManager::SetHeapLimit(size_t bytes)
+{
+	mHeapLimit = bytes;
+}
+
+size_t MemoryManager::GetHeapLimit() const
+{
+	return mHeapLimit;
+}
+
+bool MemoryManager::IsOverHeapLimit() const
+{
+	return mHeapLimit > 0 && mHeapBytes > mHeapLimit;
+}
+
+void MemoryManager::SetInNativeCode(bool inNativeCode)
+{
+	mInNativeCode = inNativeCode;
+}
+
+bool MemoryManager::IsInNativeCode() const
+{
+	return mInNativeCode;
+}
+
+void MemoryManager::AddTemporaryRoot(const Value& value)
+{
+	if( value.IsGarbageCollected() )
+		mTemporaryRoots.push_back(value.garbageCollected);
+}
+
+size_t MemoryManager::GetTemporaryRootsCount() const
+{
+	return mTemporaryRoots.size();
+}
+
+void MemoryManager::RemoveTemporaryRoots(size_t downToCount)
+{
+	mTemporaryRoots.resize(downToCount);
+}
+
+void MemoryManager::AddExternalRoots(const ExternalRoots* roots)
+{
+	mExternalRoots.push_back(roots);
+}
+
+void MemoryManager::RemoveExternalRoots(const ExternalRoots* roots)
+{
+	mExternalRoots.erase(std::remove(mExternalRoots.begin(), mExternalRoots.end(), roots), mExternalRoots.end());
+}
+
 int MemoryManager::GetHeapObjectsCount(Value::Type type) const
 {
 	switch( type )
@@ -281,89 +571,738 @@ int MemoryManager::GetHeapObjectsCount(Value::Type type) const
 	case Value::VT_Box:			return mHeapBoxesCount;
 	case Value::VT_Iterator:	return mHeapIteratorsCount;
 	case Value::VT_Error:		return mHeapErrorsCount;
+	case Value::VT_Channel:		return mHeapChannelsCount;
+	default:					return 0;
+	}
+}
+
+size_t MemoryManager::GetHeapObjectsBytes(Value::Type type) const
+{
+	switch( type )
+	{
+	case Value::VT_String:		return mHeapStringsBytes;
+	case Value::VT_Array:		return mHeapArraysBytes;
+	case Value::VT_Object:		return mHeapObjectsBytes;
+	case Value::VT_Function:	return mHeapFunctionsBytes;
+	case Value::VT_Box:			return mHeapBoxesBytes;
+	case Value::VT_Iterator:	return mHeapIteratorsBytes;
+	case Value::VT_Error:		return mHeapErrorsBytes;
+	case Value::VT_Channel:		return mHeapChannelsBytes;
 	default:					return 0;
 	}
 }
 
+void MemoryManager::SetAllocationHook(AllocationHook hook, void* userData)
+{
+	mAllocationHook = hook;
+	mAllocationHookUserData = userData;
+}
+
+size_t MemoryManager::GetHeapBytes() const
+{
+	return mHeapBytes;
+}
+
+size_t MemoryManager::GetPeakHeapBytes() const
+{
+	return mPeakHeapBytes;
+}
+
+size_t MemoryManager::GetTotalBytesAllocated() const
+{
+	return mTotalBytesAllocated;
+}
+
+void MemoryManager::UpdateHeapBytes()
+{
+	// objects are re-measured when they are marked, but containers
+	// can grow at any time, so walk the whole heap for exact numbers
+	auto updatePage = [this](HeapPage* page)
+	{
+		for( unsigned word = 0; word < page->UsedBitmapWords(); ++word )
+			for( uint64_t bits = page->allocatedBits[word]; bits; bits &= bits - 1 )
+				UpdateSize(page->SlotAt(word * 64 + CountTrailingZeros(bits)));
+	};
+
+	for( SizeClass& sizeClass : mSizeClasses )
+		for( HeapPage* page : sizeClass.pages )
+			updatePage(page);
+
+	for( HeapPage* page : mLargePages )
+		if( page )
+			updatePage(page);
+}
+
+const char* MemoryManager::GetTypeName(Value::Type type)
+{
+	switch( type )
+	{
+	case Value::VT_String:		return "string";
+	case Value::VT_Array:		return "array";
+	case Value::VT_Object:		return "object";
+	case Value::VT_Function:	return "function";
+	case Value::VT_Box:			return "box";
+	case Value::VT_Iterator:	return "iterator";
+	case Value::VT_Error:		return "error";
+	case Value::VT_Channel:		return "channel";
+	default:					return "unknown";
+	}
+}
+
+static void WriteJsonString(std::ostream& out, const std::string& str, size_t maxLength)
+{
+	out << '"';
+
+	for( size_t i = 0; i < str.size() && i < maxLength; ++i )
+	{
+		unsigned char c = str[i];
+
+		if( c == '"' || c == '\\' )
+			out << '\\' << c;
+		else if( c < 0x20 || c >= 0x7f )
+			out << '?';
+		else
+			out << c;
+	}
+
+	if( str.size() > maxLength )
+		out << "...";
+
+	out << '"';
+}
+
+bool MemoryManager::WriteHeapSnapshot(const std::string& filename)
+{
+	std::ofstream file(filename);
+
+	if( ! file )
+		return false;
+
+	UpdateHeapBytes();
+
+	std::unordered_map<const GarbageCollected*, unsigned> ids;
+	std::unordered_map<const GarbageCollected*, std::vector<std::string>> roots;
+	std::vector<const GarbageCollected*> objects;
+
+	auto addRootObject = [&](const GarbageCollected* gc, const std::string& label)
+	{
+		if( ids.emplace(gc, unsigned(objects.size() + 1)).second )
+			objects.push_back(gc);
+
+		roots[gc].push_back(label);
+	};
+
+	auto addRoot = [&](const Value& value, const std::string& label)
+	{
+		if( value.IsGarbageCollected() )
+			addRootObject(value.garbageCollected, label);
+	};
+
+	// names every value an execution context holds on to, 'add' is given each one
+	auto labelContext = [](const ExecutionContext* context, const std::string& prefix,
+						   const std::function<void(const Value&, const std::string&)>& add)
+	{
+		unsigned frameIndex = 0;
+
+		for( const StackFrame& frame : context->stackFrames )
+		{
+			std::string framePrefix = prefix + " frame " + std::to_string(frameIndex++);
+
+			add(Value(frame.function), framePrefix + " function");
+			add(frame.thisObject, framePrefix + " this");
+
+			for( size_t i = 0; i < frame.variables.size(); ++i )
+				add(frame.variables[i], framePrefix + " local " + std::to_string(i));
+
+			if( frame.anonymousParameters )
+				for( size_t i = 0; i < frame.anonymousParameters->elements.size(); ++i )
+					add(frame.anonymousParameters->elements[i], framePrefix + " argument " + std::to_string(i));
+		}
+
+		for( size_t i = 0; i < context->stack.size(); ++i )
+			add(context->stack[i], prefix + " stack " + std::to_string(i));
+
+		add(context->lastObject, prefix + " last object");
+	};
+
+	// the same roots MarkRoots uses
+	for( size_t i = 0; i < mDefaultModule.globals.size(); ++i )
+		addRoot(mDefaultModule.globals[i], "global " + std::to_string(i));
+
+	for( auto& kvp : mModules )
+	{
+		for( size_t i = 0; i < kvp.second.globals.size(); ++i )
+			addRoot(kvp.second.globals[i], "global " + kvp.first + " " + std::to_string(i));
+
+		addRoot(kvp.second.result, "module " + kvp.first);
+	}
+
+	for( size_t i = 0; i < mExecutionContexts.size(); ++i )
+		labelContext(mExecutionContexts[i], "context " + std::to_string(i), addRoot);
+
+	for( size_t i = 0; i < mTemporaryRoots.size(); ++i )
+		addRootObject(mTemporaryRoots[i], "native " + std::to_string(i));
+
+	for( size_t i = 0; i < mExternalRoots.size(); ++i )
+	{
+		std::vector<GarbageCollected*> references;
+		mExternalRoots[i]->GetReferences(references);
+
+		for( GarbageCollected* gc : references )
+			addRootObject(gc, "external " + std::to_string(i));
+	}
+
+	// the same edges Mark follows, visited breadth first
+	std::vector<std::vector<unsigned>> edges;
+	std::vector<GarbageCollected*> references;
+
+	for( size_t current = 0; current < objects.size(); ++current )
+	{
+		const GarbageCollected* gc = objects[current];
+
+		references.clear();
+		GetReferences(gc, references);
+
+		std::vector<unsigned> objectEdges;
+
+		for( GarbageCollected* reference : references )
+		{
+			auto it = ids.emplace(reference, unsigned(objects.size() + 1));
+
+			if( it.second )
+				objects.push_back(reference);
+
+			objectEdges.push_back(it.first->second);
+		}
+
+		edges.push_back(std::move(objectEdges));
+
+		if( gc->type == Value::VT_Function && ((const Function*)gc)->executionContext )
+		{
+			std::string prefix = "coroutine " + std::to_string(current + 1);
+
+			// the coroutine already has edges to them, they only get the names
+			labelContext(((const Function*)gc)->executionContext, prefix, [&](const Value& value, const std::string& label)
+			{
+				if( value.IsGarbageCollected() && value.garbageCollected != gc )
+					roots[value.garbageCollected].push_back(label);
+			});
+		}
+	}
+
+	file << "{\n\"heap_bytes\":" << mHeapBytes << ",\n\"objects\":[\n";
+
+	for( size_t i = 0; i < objects.size(); ++i )
+	{
+		const GarbageCollected* gc = objects[i];
+
+		file << "{\"id\":" << i + 1 << ",\"type\":\"" << GetTypeName(gc->type) << "\"";
+
+		// constants live outside of the heap and are not accounted
+		if( gc->state == GarbageCollected::GC_Static )
+			file << ",\"static\":true";
+
+		file << ",\"size\":" << gc->size;
+
+		if( gc->type == Value::VT_String )
+		{
+			file << ",\"value\":";
+			WriteJsonString(file, ((const String*)gc)->str, 40);
+		}
+		else if( gc->type == Value::VT_Error )
+		{
+			file << ",\"value\":";
+			WriteJsonString(file, ((const Error*)gc)->errorString, 40);
+		}
+
+		file << ",\"edges\":[";
+		for( size_t e = 0; e < edges[i].size(); ++e )
+			file << (e ? "," : "") << edges[i][e];
+		file << "]";
+
+		auto it = roots.find(gc);
+		if( it != roots.end() )
+		{
+			file << ",\"roots\":[";
+			for( size_t r = 0; r < it->second.size(); ++r )
+			{
+				file << (r ? "," : "");
+				WriteJsonString(file, it->second[r], std::string::npos);
+			}
+			file << "]";
+		}
+
+		file << (i + 1 < objects.size() ? "},\n" : "}\n");
+	}
+
+	file << "]\n}\n";
+
+	return bool(file);
+}
+
 void MemoryManager::DeleteHeap()
 {
-	while( mHeapHead )
+	auto deletePage = [this](HeapPage* page)
+	{
+		for( unsigned word = 0; word < page->UsedBitmapWords(); ++word )
+			for( uint64_t bits = page->allocatedBits[word]; bits; bits &= bits - 1 )
+				FreeGC(page->SlotAt(word * 64 + CountTrailingZeros(bits)));
+
+		FreePage(page);
+	};
+
+	for( SizeClass& sizeClass : mSizeClasses )
 	{
-		GarbageCollected* next = mHeapHead->next;;
-		FreeGC(mHeapHead);
-		mHeapHead = next;
+		for( HeapPage* page : sizeClass.pages )
+			deletePage(page);
+
+		sizeClass.pages.clear();
+		sizeClass.sweptPages	= 0;
+		sizeClass.currentPage	= 0;
+		sizeClass.currentWord	= 0;
+	}
+
+	for( HeapPage* page : mLargePages )
+		if( page )
+			deletePage(page);
+
+	mLargePages.clear();
+	mSweptLargePages = 0;
+}
+
+void* MemoryManager::AllocateSlot(unsigned size)
+{
+	if( size > MaxSlotSize )
+		return AllocateLargeObject(size);
+
+	SizeClass& sizeClass = mSizeClasses[ mSizeClassForSize[(size + 7) / 8] ];
+
+	while( true )
+	{
+		if( sizeClass.currentPage == sizeClass.pages.size() )
+		{
+			// every page is full, all of them have been swept already
+			sizeClass.pages.push_back( NewPage(sizeClass.slotSize, unsigned(&sizeClass - mSizeClasses.data()), HeapPage::Size) );
+			sizeClass.sweptPages = sizeClass.pages.size();
+			sizeClass.currentWord = 0;
+		}
+
+		HeapPage* page = sizeClass.pages[sizeClass.currentPage];
+
+		// lazy sweeping, one page per refill
+		if( sizeClass.currentPage == sizeClass.sweptPages )
+		{
+			SweepPage(page);
+			++sizeClass.sweptPages;
+		}
+
+		for( ; sizeClass.currentWord < page->UsedBitmapWords(); ++sizeClass.currentWord )
+		{
+			unsigned word = sizeClass.currentWord;
+			uint64_t freeSlots = ~page->allocatedBits[word] & page->ValidSlotsMask(word);
+
+			if( freeSlots )
+			{
+				unsigned bit = CountTrailingZeros(freeSlots);
+
+				page->allocatedBits[word] |= uint64_t(1) << bit;
+				page->liveCount += 1;
+				page->decommitted = false;
+
+				return page->SlotAt(word * 64 + bit);
+			}
+		}
+
+		++sizeClass.currentPage;
+		sizeClass.currentWord = 0;
 	}
 }
 
+void* MemoryManager::AllocateLargeObject(unsigned size)
+{
+	// large objects are swept lazily too, one page per allocation
+	if( mSweptLargePages < mLargePages.size() )
+	{
+		HeapPage*& page = mLargePages[mSweptLargePages++];
+
+		if( page && (SweepPage(page), page->liveCount == 0) )
+		{
+			FreePage(page);
+			page = nullptr;
+		}
+	}
+
+	size_t mappedSize = (HeapPage::SlotsOffset() + size + HeapPage::Size - 1) & ~size_t(HeapPage::Size - 1);
+
+	HeapPage* page = NewPage(size, HeapPage::LargeObjectClass, mappedSize);
+
+	page->allocatedBits[0] = 1;
+	page->liveCount = 1;
+
+	mLargePages.push_back(page);
+
+	// a page added during sweeping is still ahead of the sweeper,
+	// it has to look marked to survive until the next cycle
+	if( mGCStage == GCS_Sweep )
+		page->markBits[0] = 1;
+	else
+		mSweptLargePages = mLargePages.size();
+
+	return page->SlotAt(0);
+}
+
+HeapPage* MemoryManager::NewPage(unsigned slotSize, unsigned sizeClass, size_t mappedSize)
+{
+	void* memory = MapPages(mappedSize);
+
+	if( ! memory )
+		throw std::bad_alloc();
+
+	HeapPage* page = new(memory) HeapPage();
+
+	page->slotSize		= slotSize;
+	page->slotsCount	= sizeClass == HeapPage::LargeObjectClass ?
+							1 : unsigned((mappedSize - HeapPage::SlotsOffset()) / slotSize);
+	page->liveCount		= 0;
+	page->sizeClass		= sizeClass;
+	page->mappedSize	= mappedSize;
+	page->decommitted	= false;
+
+	std::fill(std::begin(page->allocatedBits), std::end(page->allocatedBits), 0);
+	std::fill(std::begin(page->markBits), std::end(page->markBits), 0);
+
+	return page;
+}
+
+void MemoryManager::FreePage(HeapPage* page)
+{
+	UnmapPages(page, page->mappedSize);
+}
+
 void MemoryManager::AddToHeap(GarbageCollected* gc)
 {
-	gc->state = mNextWhite;
+	gc->state = GarbageCollected::GC_Heap;
 
-	if( mHeapHead )
-		gc->next = mHeapHead;
-	
-	mHeapHead = gc;
+	// objects created while marking are already past the roots,
+	// they have to be traced like every other reachable object
+	if( mGCStage == GCS_MarkRoots || mGCStage == GCS_Mark )
+	{
+		HeapPage::FromObject(gc)->SetMarked(gc);
+		mGrayList.push_back(gc);
+	}
+
+	if( mInNativeCode )
+		mTemporaryRoots.push_back(gc);
+
+	UpdateSize(gc);
 }
 
 void MemoryManager::FreeGC(GarbageCollected* gc)
 {
+	HeapBytesForType(gc->type) -= gc->size;
+	mHeapBytes -= gc->size;
+
 	switch( gc->type )
 	{
+	// the memory of the slot itself is reclaimed by the sweeper
 	case Value::VT_String:
-		delete (String*)gc;
+		((String*)gc)->~String();
 		--mHeapStringsCount;
 		break;
 
 	case Value::VT_Array:
-		delete (Array*)gc;
+		((Array*)gc)->~Array();
 		--mHeapArraysCount;
 		break;
 
 	case Value::VT_Object:
-		delete (Object*)gc;
+		((Object*)gc)->~Object();
 		--mHeapObjectsCount;
 		break;
 
 	case Value::VT_Function:
 	{
 		Function* f = (Function*)gc;
-		if( f->executionContext )
-			delete f->executionContext;
-		delete f;
+		if( f->executionContext && f->executionContext != &mFinishedContext )
+			ReleaseExecutionContext(f->executionContext);
+		f->~Function();
 		--mHeapFunctionsCount;
 		break;
 	}
 	case Value::VT_Box:
-		delete (Box*)gc;
+		((Box*)gc)->~Box();
 		--mHeapBoxesCount;
 		break;
 
 	case Value::VT_Iterator:
-		delete (Iterator*)gc; // virtual call
+		((Iterator*)gc)->~Iterator(); // deletes the implementation through a virtual call
 		--mHeapIteratorsCount;
 		break;
 
 	case Value::VT_Error:
-		delete (Error*)gc;
+		((Error*)gc)->~Error();
 		--mHeapErrorsCount;
 		break;
 
+	case Value::VT_Channel:
+		((Channel*)gc)->~Channel();
+		--mHeapChannelsCount;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void MemoryManager::UpdateSize(GarbageCollected* gc)
+{
+	if( gc->state == GarbageCollected::GC_Static ) // not part of the heap
+		return;
+
+	unsigned newSize = CalculateSize(gc);
+
+	if( newSize == gc->size )
+		return;
+
+	size_t& typeBytes = HeapBytesForType(gc->type);
+
+	if( newSize > gc->size )
+	{
+		unsigned grownBy = newSize - gc->size;
+
+		typeBytes				+= grownBy;
+		mHeapBytes				+= grownBy;
+		mTotalBytesAllocated	+= grownBy;
+
+		if( mHeapBytes > mPeakHeapBytes )
+			mPeakHeapBytes = mHeapBytes;
+
+		gc->size = newSize;
+
+		if( mAllocationHook )
+			mAllocationHook(mAllocationHookUserData, gc, grownBy);
+	}
+	else
+	{
+		unsigned shrunkBy = gc->size - newSize;
+
+		typeBytes	-= shrunkBy;
+		mHeapBytes	-= shrunkBy;
+
+		gc->size = newSize;
+	}
+}
+
+size_t& MemoryManager::HeapBytesForType(Value::Type type)
+{
+	switch( type )
+	{
+	case Value::VT_String:		return mHeapStringsBytes;
+	case Value::VT_Array:		return mHeapArraysBytes;
+	case Value::VT_Object:		return mHeapObjectsBytes;
+	case Value::VT_Function:	return mHeapFunctionsBytes;
+	case Value::VT_Box:			return mHeapBoxesBytes;
+	case Value::VT_Iterator:	return mHeapIteratorsBytes;
+	case Value::VT_Channel:		return mHeapChannelsBytes;
+	default:					return mHeapErrorsBytes;
+	}
+}
+
+static unsigned StringBufferSize(const std::string& str, const void* owner, unsigned ownerSize)
+{
+	const char* data = str.data();
+	const char* ownerBegin = (const char*)owner;
+
+	// short strings are stored inside the std::string object itself
+	if( data >= ownerBegin && data < ownerBegin + ownerSize )
+		return 0;
+
+	return unsigned(str.capacity() + 1);
+}
+
+unsigned MemoryManager::CalculateSize(const GarbageCollected* gc) const
+{
+	switch( gc->type )
+	{
+	case Value::VT_String:
+	{
+		const String* s = (const String*)gc;
+		return sizeof(String) + StringBufferSize(s->str, s, sizeof(String));
+	}
+	case Value::VT_Error:
+	{
+		const Error* e = (const Error*)gc;
+		return sizeof(Error) + StringBufferSize(e->errorString, e, sizeof(Error));
+	}
+	case Value::VT_Array:
+		return sizeof(Array) + unsigned(((const Array*)gc)->elements.capacity() * sizeof(Value));
+
+	case Value::VT_Object:
+		return sizeof(Object) + unsigned(((const Object*)gc)->members.capacity() * sizeof(Object::Member));
+
+	case Value::VT_Function:
+	{
+		const Function* f = (const Function*)gc;
+		unsigned size = Function::SizeWith(f->freeVariablesCount);
+		if( f->executionContext && f->executionContext != &mFinishedContext )
+			size += CalculateSize(f->executionContext);
+		return size;
+	}
+	case Value::VT_Box:
+		return sizeof(Box);
+
+	case Value::VT_Iterator:
+		return sizeof(Iterator) + ((const Iterator*)gc)->implementation->CalculateSize(); // virtual call
+
+	case Value::VT_Channel:
+	{
+		const Channel* c = (const Channel*)gc;
+		return sizeof(Channel) + unsigned(c->buffer.capacity() * sizeof(Value) +
+										  c->waitingSenders.size() * sizeof(std::pair<Function*, Value>) +
+										  c->waitingReceivers.size() * sizeof(Function*));
+	}
+
+	default:
+		return 0;
+	}
+}
+
+unsigned MemoryManager::CalculateSize(const ExecutionContext* context) const
+{
+	unsigned size = sizeof(ExecutionContext); // with the first frame
+
+	size += unsigned((context->stackFrames.capacity() - 1) * sizeof(StackFrame));
+	size += unsigned(context->stack.capacity() * sizeof(Value));
+
+	for( const StackFrame& frame : context->stackFrames )
+	{
+		size += unsigned(frame.variables.capacity() * sizeof(Value));
+		if( frame.anonymousParameters )
+			size += unsigned(sizeof(Array) + frame.anonymousParameters->elements.capacity() * sizeof(Value));
+	}
+
+	return size;
+}
+
+void MemoryManager::GetReferences(const GarbageCollected* gc, std::vector<GarbageCollected*>& references) const
+{
+	switch( gc->type )
+	{
+	case Value::VT_Array:
+		for( const Value& element : ((const Array*)gc)->elements )
+			if( element.IsGarbageCollected() )
+				references.push_back(element.garbageCollected);
+		break;
+
+	case Value::VT_Object:
+		for( const Object::Member& member : ((const Object*)gc)->members )
+			if( member.value.IsGarbageCollected() )
+				references.push_back(member.value.garbageCollected);
+		break;
+
+	case Value::VT_Function:
+	{
+		const Function* function = (const Function*)gc;
+		const Value* freeVariables = function->FreeVariables();
+		for( unsigned i = 0; i < function->freeVariablesCount; ++i )
+			if( freeVariables[i].IsGarbageCollected() )
+				references.push_back(freeVariables[i].garbageCollected);
+
+		if( function->executionContext )
+			GetReferences(function->executionContext, references);
+		break;
+	}
+
+	case Value::VT_Box:
+		if( ((const Box*)gc)->value.IsGarbageCollected() )
+			references.push_back(((const Box*)gc)->value.garbageCollected);
+		break;
+
+	case Value::VT_Iterator:
+		((const Iterator*)gc)->implementation->GetReferences(references); // virtual call
+		break;
+
+	case Value::VT_Channel:
+	{
+		const Channel* channel = (const Channel*)gc;
+		for( const Value& value : channel->buffer )
+			if( value.IsGarbageCollected() )
+				references.push_back(value.garbageCollected);
+
+		for( const auto& sender : channel->waitingSenders )
+		{
+			references.push_back(sender.first);
+			if( sender.second.IsGarbageCollected() )
+				references.push_back(sender.second.garbageCollected);
+		}
+
+		for( Function* receiver : channel->waitingReceivers )
+			references.push_back(receiver);
+		break;
+	}
+
 	default:
 		break;
 	}
 }
 
+void MemoryManager::GetReferences(const ExecutionContext* context, std::vector<GarbageCollected*>& references) const
+{
+	auto addReference = [&](const Value& value)
+	{
+		if( value.IsGarbageCollected() )
+			references.push_back(value.garbageCollected);
+	};
+
+	for( const StackFrame& frame : context->stackFrames )
+	{
+		addReference(Value(frame.function)); // closures can be called without being stored anywhere
+		addReference(frame.thisObject);
+
+		for( const Value& local : frame.variables )
+			addReference(local);
+
+		if( frame.anonymousParameters )
+			for( const Value& anonymousParameter : frame.anonymousParameters->elements )
+				addReference(anonymousParameter);
+	}
+
+	for( const Value& value : context->stack )
+		addReference(value);
+
+	addReference(context->lastObject);
+}
+
+bool MemoryManager::IsMarked(const GarbageCollected* gc) const
+{
+	// constants (and arrays embedded in stack frames) are never collected
+	if( gc->state == GarbageCollected::GC_Static )
+		return true;
+
+	return HeapPage::FromObject(gc)->IsMarked(gc);
+}
+
 void MemoryManager::MakeGrayIfNeeded(GarbageCollected* gc, int* steps)
 {
-	if( gc->state == mCurrentWhite )
+	if( ! IsMarked(gc) )
 	{
-		gc->state = GarbageCollected::GC_Gray;
+		HeapPage::FromObject(gc)->SetMarked(gc);
 		mGrayList.push_back(gc);
 
 		*steps -= 1;
 	}
 }
 
+void MemoryManager::MakeGrayIfNeeded(ExecutionContext* context, int* steps)
+{
+	std::vector<GarbageCollected*> references;
+
+	GetReferences(context, references);
+
+	for( GarbageCollected* reference : references )
+		MakeGrayIfNeeded(reference, steps);
+}
+
 int MemoryManager::MarkRoots(int steps)
 {
 	for( Value& global : mDefaultModule.globals )
@@ -371,26 +1310,31 @@ int MemoryManager::MarkRoots(int steps)
 			MakeGrayIfNeeded(global.garbageCollected, &steps);
 	
 	for( auto& kvp : mModules )
+	{
 		for( Value& global : kvp.second.globals )
 			if( global.IsGarbageCollected() )
 				MakeGrayIfNeeded(global.garbageCollected, &steps);
 
+		// loading a module again returns the same result
+		if( kvp.second.result.IsGarbageCollected() )
+			MakeGrayIfNeeded(kvp.second.result.garbageCollected, &steps);
+	}
+
 	for( ExecutionContext* context : mExecutionContexts )
-	{
-		for( StackFrame& frame : context->stackFrames )
-		{
-			for( Value& local : frame.variables )
-				if( local.IsGarbageCollected() )
-					MakeGrayIfNeeded(local.garbageCollected, &steps);
+		MakeGrayIfNeeded(context, &steps);
 
-			for( Value& anonymousParameter : frame.anonymousParameters.elements )
-				if( anonymousParameter.IsGarbageCollected() )
-					MakeGrayIfNeeded(anonymousParameter.garbageCollected, &steps);
-		}
+	for( GarbageCollected* gc : mTemporaryRoots )
+		MakeGrayIfNeeded(gc, &steps);
 
-		for( Value& value : context->stack )
-			if( value.IsGarbageCollected() )
-				MakeGrayIfNeeded(value.garbageCollected, &steps);
+	std::vector<GarbageCollected*> references;
+
+	for( const ExternalRoots* roots : mExternalRoots )
+	{
+		references.clear();
+		roots->GetReferences(references);
+
+		for( GarbageCollected* gc : references )
+			MakeGrayIfNeeded(gc, &steps);
 	}
 
 	return steps;
@@ -399,14 +1343,16 @@ int MemoryManager::MarkRoots(int steps)
 int MemoryManager::Mark(int steps)
 {
 	GarbageCollected* currentObject = nullptr;
+	std::vector<GarbageCollected*> references;
 
 	while( ! mGrayList.empty() && steps > 0 )
 	{
 		currentObject = mGrayList.back();
-		currentObject->state = GarbageCollected::GC_Black;
 		mGrayList.pop_back();
 		steps -= 1;
 
+		UpdateSize(currentObject);
+
 		switch( currentObject->type )
 		{
 		case Value::VT_Array:
@@ -424,26 +1370,15 @@ int MemoryManager::Mark(int steps)
 		case Value::VT_Function:
 		{
 			Function* function = ((Function*)currentObject);
-			for( Box* box : function->freeVariables )
-				if( box )
-					MakeGrayIfNeeded(box, &steps);
+			Value* freeVariables = function->FreeVariables();
+			for( unsigned i = 0; i < function->freeVariablesCount; ++i )
+				if( freeVariables[i].IsGarbageCollected() )
+					MakeGrayIfNeeded(freeVariables[i].garbageCollected, &steps);
 
 			if( function->executionContext )
 			{
-				for( StackFrame& frame : function->executionContext->stackFrames )
-				{
-					for( Value& local : frame.variables )
-						if( local.IsGarbageCollected() )
-							MakeGrayIfNeeded(local.garbageCollected, &steps);
-
-					for( Value& anonymousParameter : frame.anonymousParameters.elements )
-						if( anonymousParameter.IsGarbageCollected() )
-							MakeGrayIfNeeded(anonymousParameter.garbageCollected, &steps);
-				}
-
-				for( Value& value : function->executionContext->stack )
-					if( value.IsGarbageCollected() )
-						MakeGrayIfNeeded(value.garbageCollected, &steps);
+				MakeGrayIfNeeded(function->executionContext, &steps);
+				mMarkedCoroutines.push_back(function);
 			}
 			break;
 		}
@@ -457,7 +1392,17 @@ int MemoryManager::Mark(int steps)
 		}
 
 		case Value::VT_Iterator:
-			((Iterator*)currentObject)->implementation->UpdateGrayList(mGrayList, mCurrentWhite); // virtual call
+			references.clear();
+			((Iterator*)currentObject)->implementation->GetReferences(references); // virtual call
+			for( GarbageCollected* reference : references )
+				MakeGrayIfNeeded(reference, &steps);
+			break;
+
+		case Value::VT_Channel:
+			references.clear();
+			GetReferences(currentObject, references);
+			for( GarbageCollected* reference : references )
+				MakeGrayIfNeeded(reference, &steps);
 			break;
 
 		default:
@@ -468,51 +1413,101 @@ int MemoryManager::Mark(int steps)
 	return steps;
 }
 
-int MemoryManager::SweepHead(int steps)
+bool MemoryManager::Remark()
 {
-	while( mHeapHead && steps > 0 )
-	{
-		if( mHeapHead->state == mCurrentWhite )
-		{
-			GarbageCollected* next = mHeapHead->next;
-			FreeGC(mHeapHead);
-			mHeapHead = next;
-		}
-		else
-		{
-			mHeapHead->state = mNextWhite;
-			mPreviousGC = mHeapHead;
-			mCurrentGC = mHeapHead->next;
-			break;
-		}
+	// Stores into stack frames and coroutine contexts are not guarded by
+	// UpdateGcRelationship, so before sweeping look at the roots and at
+	// the coroutines once more. Returns whether marking has to continue.
+	int steps = std::numeric_limits<int>::max();
 
-		steps -= 1;
+	MarkRoots(steps);
+
+	for( Function* coroutine : mMarkedCoroutines )
+		MakeGrayIfNeeded(coroutine->executionContext, &steps);
+
+	return ! mGrayList.empty();
+}
+
+void MemoryManager::StartSweeping()
+{
+	mMarkedCoroutines.clear();
+
+	for( SizeClass& sizeClass : mSizeClasses )
+	{
+		sizeClass.sweptPages	= 0;
+		sizeClass.currentPage	= 0;
+		sizeClass.currentWord	= 0;
 	}
 
-	return steps;
+	mSweptLargePages = 0;
 }
 
-int MemoryManager::SweepRest(int steps)
+int MemoryManager::Sweep(int steps)
 {
-	while( mCurrentGC && steps > 0 )
+	for( SizeClass& sizeClass : mSizeClasses )
 	{
-		if( mCurrentGC->state == mCurrentWhite )
+		while( sizeClass.sweptPages < sizeClass.pages.size() )
 		{
-			mPreviousGC->next = mCurrentGC->next;
-			FreeGC(mCurrentGC);
-			mCurrentGC = mPreviousGC->next;
+			if( steps <= 0 )
+				return steps;
+
+			steps -= std::max(1u, SweepPage(sizeClass.pages[sizeClass.sweptPages++]));
 		}
-		else
+	}
+
+	while( mSweptLargePages < mLargePages.size() )
+	{
+		if( steps <= 0 )
+			return steps;
+
+		HeapPage*& page = mLargePages[mSweptLargePages++];
+
+		if( ! page )
+			continue;
+
+		steps -= std::max(1u, SweepPage(page));
+
+		if( page->liveCount == 0 )
 		{
-			mCurrentGC->state = mNextWhite;
-			mPreviousGC = mCurrentGC;
-			mCurrentGC = mCurrentGC->next;
+			FreePage(page);
+			page = nullptr;
 		}
+	}
 
-		steps -= 1;
+	// every large page has been looked at, drop the freed ones
+	mLargePages.erase(std::remove(mLargePages.begin(), mLargePages.end(), nullptr), mLargePages.end());
+	mSweptLargePages = mLargePages.size();
+
+	return std::max(steps, 1);
+}
+
+unsigned MemoryManager::SweepPage(HeapPage* page)
+{
+	unsigned examined = 0;
+	unsigned live = 0;
+
+	for( unsigned word = 0; word < page->UsedBitmapWords(); ++word )
+	{
+		uint64_t allocated	= page->allocatedBits[word];
+		uint64_t marked		= page->markBits[word];
+
+		examined += CountBits(allocated);
+
+		for( uint64_t dead = allocated & ~marked; dead; dead &= dead - 1 )
+			FreeGC(page->SlotAt(word * 64 + CountTrailingZeros(dead)));
+
+		page->allocatedBits[word]	= allocated & marked;
+		page->markBits[word]		= 0;
+
+		live += CountBits(allocated & marked);
 	}
 
-	return steps;
+	page->liveCount = live;
+
+	if( live == 0 && ! page->decommitted && page->sizeClass != HeapPage::LargeObjectClass )
+		DecommitSlots(page);
+
+	return examined;
 }
 
 }
@@ -8,12 +8,28 @@
 
 #include "DataTypes.h"
 #include "GarbageCollected.h"
+#include "HeapPage.h"
 
 namespace element
 {
 
+// Something outside of the heap and the execution contexts that holds on to
+// heap objects, like the coroutines waiting in the event loop.
+class ExternalRoots
+{
+public:
+	virtual ~ExternalRoots() = default;
+	virtual void GetReferences(std::vector<GarbageCollected*>& references) const = 0;
+};
+
+
 class MemoryManager
 {
+public:
+	// called with the bytes a heap object got, all of them for a new one or the
+	// ones it grew by, after they have been accounted
+	typedef void (*AllocationHook)(void* userData, const GarbageCollected* gc, unsigned bytes);
+
 public:					MemoryManager();
 						~MemoryManager();
 						
@@ -21,6 +37,7 @@ public:					MemoryManager();
 	
 	Module&				GetDefaultModule();
 	Module&				GetModuleForFile(const std::string& filename);
+	Module&				NewModuleForCopy(const std::string& filename); // code copied from another virtual machine
 
 	String*				NewString();
 	String*				NewString(const std::string& str);
@@ -34,15 +51,46 @@ public:					MemoryManager();
 	Box*				NewBox(const Value& value);
 	Iterator*			NewIterator(IteratorImplementation* newIterator);
 	Error*				NewError(const std::string& errorMessage);
+	Channel*			NewChannel(unsigned capacity);
 
 	ExecutionContext*	NewRootExecutionContext();
 	bool				DeleteRootExecutionContext(ExecutionContext* context);
+	void				FinishCoroutine(Function* coroutine); // its context can be used again right away
 
 	void				GarbageCollect(int steps = std::numeric_limits<int>::max());
+	void				FullGarbageCollect();
 
 	void				UpdateGcRelationship(GarbageCollected* parent, const Value& child);
+	void				UpdateSize(GarbageCollected* gc);
+
+	void				SetHeapLimit(size_t bytes); // 0 means no limit
+	size_t				GetHeapLimit() const;
+	bool				IsOverHeapLimit() const;
+
+	// Values held only in the C++ variables of native functions are not
+	// visible to the collector. While in native code every new object is
+	// kept as a temporary root, the VM removes them when the native returns.
+	void				SetInNativeCode(bool inNativeCode);
+	bool				IsInNativeCode() const;
+	void				AddTemporaryRoot(const Value& value);
+	size_t				GetTemporaryRootsCount() const;
+	void				RemoveTemporaryRoots(size_t downToCount);
+
+	void				AddExternalRoots(const ExternalRoots* roots);
+	void				RemoveExternalRoots(const ExternalRoots* roots);
 
 	int					GetHeapObjectsCount(Value::Type type) const;
+	size_t				GetHeapObjectsBytes(Value::Type type) const;
+	size_t				GetHeapBytes() const;
+	size_t				GetPeakHeapBytes() const;
+	size_t				GetTotalBytesAllocated() const;
+	void				UpdateHeapBytes();
+
+	bool				WriteHeapSnapshot(const std::string& filename);
+
+	void				SetAllocationHook(AllocationHook hook, void* userData);
+
+	static const char*	GetTypeName(Value::Type type);
 	
 protected:
 	enum GCStage : char
@@ -50,35 +98,69 @@ protected:
 		GCS_Ready		= 0,
 		GCS_MarkRoots	= 1,
 		GCS_Mark		= 2,
-		GCS_SweepHead	= 3,
-		GCS_SweepRest	= 4,
+		GCS_Sweep		= 3,
+	};
+
+	struct SizeClass
+	{
+		unsigned				slotSize		= 0;
+		std::vector<HeapPage*>	pages;
+		size_t					sweptPages		= 0; // pages before this one are swept in the current cycle
+		size_t					currentPage		= 0; // the page allocations are made from
+		unsigned				currentWord		= 0; // where to continue looking for free slots
 	};
 
 protected:
 	void		DeleteHeap();
+	void*		AllocateSlot(unsigned size);
+	void*		AllocateLargeObject(unsigned size);
+	HeapPage*	NewPage(unsigned slotSize, unsigned sizeClass, size_t mappedSize);
+	void		FreePage(HeapPage* page);
 	void		AddToHeap(GarbageCollected* gc);
 	void		FreeGC(GarbageCollected* gc);
+
+	ExecutionContext*	AcquireExecutionContext();
+	void				ReleaseExecutionContext(ExecutionContext* context);
+	size_t&		HeapBytesForType(Value::Type type);
+
+	unsigned	CalculateSize(const GarbageCollected* gc) const;
+	unsigned	CalculateSize(const ExecutionContext* context) const;
+
+	void		GetReferences(const GarbageCollected* gc, std::vector<GarbageCollected*>& references) const;
+	void		GetReferences(const ExecutionContext* context, std::vector<GarbageCollected*>& references) const;
+	bool		IsMarked(const GarbageCollected* gc) const;
 	void		MakeGrayIfNeeded(GarbageCollected* gc, int* steps);
+	void		MakeGrayIfNeeded(ExecutionContext* context, int* steps);
 
 	int			MarkRoots(int steps);
 	int			Mark(int steps);
-	int			SweepHead(int steps);
-	int			SweepRest(int steps);
+	bool		Remark();
+	void		StartSweeping();
+	int			Sweep(int steps);
+	unsigned	SweepPage(HeapPage* page);
 
 private:
-	GarbageCollected*						mHeapHead;
+	std::vector<SizeClass>					mSizeClasses;
+	std::vector<unsigned char>				mSizeClassForSize; // indexed by size / 8
+	std::vector<HeapPage*>					mLargePages;
+	size_t									mSweptLargePages;
 
 	GCStage									mGCStage;
-	GarbageCollected::State					mCurrentWhite;
-	GarbageCollected::State					mNextWhite;
 	std::deque<GarbageCollected*>			mGrayList;
-	GarbageCollected*						mPreviousGC;
-	GarbageCollected*						mCurrentGC;
+	std::vector<Function*>					mMarkedCoroutines;
 
 	// memory roots
 	Module									mDefaultModule;
 	std::unordered_map<std::string, Module>	mModules;
+	unsigned								mModuleCopiesCount;
 	std::vector<ExecutionContext*>			mExecutionContexts;
+	std::vector<GarbageCollected*>			mTemporaryRoots;
+
+	// contexts are pooled, every finished coroutine points to the same one
+	std::vector<ExecutionContext*>			mFreeExecutionContexts;
+	ExecutionContext						mFinishedContext;
+	bool									mInNativeCode;
+	std::vector<const ExternalRoots*>		mExternalRoots;
 	
 	// statistics
 	int										mHeapStringsCount;
@@ -88,6 +170,24 @@ private:
 	int										mHeapBoxesCount;
 	int										mHeapIteratorsCount;
 	int										mHeapErrorsCount;
+	int										mHeapChannelsCount;
+
+	size_t									mHeapStringsBytes;
+	size_t									mHeapArraysBytes;
+	size_t									mHeapObjectsBytes;
+	size_t									mHeapFunctionsBytes;
+	size_t									mHeapBoxesBytes;
+	size_t									mHeapIteratorsBytes;
+	size_t									mHeapErrorsBytes;
+	size_t									mHeapChannelsBytes;
+
+	size_t									mHeapBytes;
+	size_t									mPeakHeapBytes;
+	size_t									mTotalBytesAllocated;
+	size_t									mHeapLimit;
+
+	AllocationHook							mAllocationHook;
+	void*									mAllocationHookUserData;
 };
 
 }
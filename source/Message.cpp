@@ -0,0 +1,473 @@
+#include "Message.h"
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+#include "VirtualMachine.h"
+#include "Symbol.h"
+
+namespace element
+{
+
+// Whether the code, or the code of a function it creates, assigns to one of
+// its free variables that are flagged as captured from outside.
+static bool AssignsToCaptured(VirtualMachine& vm, const CodeObject* codeObject, const std::vector<bool>& captured)
+{
+	for( const Instruction& instruction : codeObject->instructions )
+	{
+		switch( instruction.opCode )
+		{
+		case OC_StoreToClosure:
+		case OC_PopStoreToClosure:
+			if( captured[instruction.A] )
+				return true;
+			break;
+
+		case OC_LoadConstant: // functions are created from constants
+		{
+			Value constant = vm.GetConstant(instruction.A);
+
+			if( ! constant.IsFunction() )
+				break;
+
+			const CodeObject* nested = constant.function->codeObject;
+
+			std::vector<bool> nestedCaptured;
+			bool anyCaptured = false;
+
+			for( int indexToBox : nested->closureMapping )
+			{
+				nestedCaptured.push_back( indexToBox < 0 && captured[-indexToBox - 1] );
+				anyCaptured = anyCaptured || nestedCaptured.back();
+			}
+
+			if( anyCaptured && AssignsToCaptured(vm, nested, nestedCaptured) )
+				return true;
+
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+bool Message::FromValue(VirtualMachine& vm, const Value& value, std::string* outError)
+{
+	mNodes.clear();
+	mCode.clear();
+	mGlobals.clear();
+	mFilename.clear();
+
+	std::unordered_map<const GarbageCollected*, unsigned> ids;
+	std::unordered_map<const CodeObject*, int> codeIds;
+	std::map<std::tuple<int, const Module*, int>, int> globalIds; // by load instruction and module
+	std::vector<std::pair<Value, unsigned>> pending; // values whose nodes are not filled in yet
+
+	auto addNode = [&](const Value& v)
+	{
+		unsigned index = unsigned(mNodes.size());
+
+		if( v.IsGarbageCollected() )
+		{
+			auto it = ids.emplace(v.garbageCollected, index);
+
+			if( ! it.second ) // already copied
+				return it.first->second;
+		}
+
+		mNodes.emplace_back();
+		pending.emplace_back(v, index);
+
+		return index;
+	};
+
+	// every load of something outside of the copied code becomes a global load
+	auto addGlobal = [&](const Instruction& instruction, const Module* module, const Value& v)
+	{
+		auto key = std::make_tuple(int(instruction.opCode), module, instruction.A);
+		auto it = globalIds.find(key);
+
+		if( it != globalIds.end() )
+			return it->second;
+
+		int index = int(mGlobals.size());
+
+		globalIds.emplace(key, index);
+		mGlobals.push_back( addNode(v) );
+
+		return index;
+	};
+
+	auto addCode = [&](const CodeObject* codeObject)
+	{
+		auto it = codeIds.find(codeObject);
+
+		if( it != codeIds.end() )
+			return it->second;
+
+		int index = int(mCode.size());
+
+		codeIds.emplace(codeObject, index);
+		mCode.emplace_back();
+
+		if( mFilename.empty() )
+			mFilename = codeObject->module->filename;
+
+		Code code;
+		code.instructions			= codeObject->instructions;
+		code.localVariablesCount	= codeObject->localVariablesCount;
+		code.namedParametersCount	= codeObject->namedParametersCount;
+		code.maxStackDepth			= codeObject->maxStackDepth;
+		code.usesArguments			= codeObject->usesArguments;
+		code.closureMapping			= codeObject->closureMapping;
+		code.instructionLines		= codeObject->instructionLines;
+		code.loopReloads			= codeObject->loopReloads;
+
+		for( const CallSite& callSite : codeObject->callSites )
+		{
+			std::string name = "proto";
+
+			if( callSite.hash != Symbol::ProtoHash && ! vm.GetNameFromHash(callSite.hash, &name) )
+			{
+				*outError = "unknown hash value";
+				return -1;
+			}
+
+			code.callSites.emplace_back(std::move(name), callSite.argumentsCount);
+		}
+
+		for( Instruction& instruction : code.instructions )
+		{
+			int global = -1;
+
+			switch( instruction.opCode )
+			{
+			case OC_LoadConstant:
+				global = addGlobal(instruction, nullptr, vm.GetConstant(instruction.A));
+				break;
+
+			case OC_LoadNative:
+				global = addGlobal(instruction, nullptr, vm.GetNativeFunction(instruction.A));
+				break;
+
+			case OC_LoadHash:
+				global = addGlobal(instruction, nullptr, Value(instruction.H));
+				break;
+
+			case OC_LoadGlobal:
+			{
+				const std::vector<Value>& globals = codeObject->module->globals;
+				unsigned i = unsigned(instruction.A);
+
+				global = addGlobal(instruction, codeObject->module, i < globals.size() ? globals[i] : Value());
+				break;
+			}
+
+			case OC_StoreGlobal:
+			case OC_PopStoreGlobal:
+				*outError = "only pure functions can be copied between virtual machines, this one assigns to a global variable";
+				return -1;
+
+			default:
+				break;
+			}
+
+			if( global >= 0 )
+				instruction = Instruction(OC_LoadGlobal, global);
+		}
+
+		mCode[index] = std::move(code);
+
+		return index;
+	};
+
+	addNode(value);
+
+	// explicit stack, values can be nested very deeply
+	while( ! pending.empty() )
+	{
+		Value current = pending.back().first;
+		unsigned index = pending.back().second;
+		pending.pop_back();
+
+		switch( current.type )
+		{
+		case Value::VT_Nil:
+		case Value::VT_Int:
+		case Value::VT_Float:
+		case Value::VT_Bool:
+			mNodes[index].value = current;
+			break;
+
+		case Value::VT_NativeFunction: // the same in every virtual machine
+			mNodes[index].value = current;
+			break;
+
+		case Value::VT_Hash:
+			if( current.hash == Symbol::ProtoHash )
+				mNodes[index].text = "proto";
+			else if( ! vm.GetNameFromHash(current.hash, &mNodes[index].text) )
+			{
+				*outError = "unknown hash value";
+				return false;
+			}
+			break;
+
+		case Value::VT_String:
+			mNodes[index].text = current.string->str;
+			break;
+
+		case Value::VT_Error:
+			mNodes[index].text = current.error->errorString;
+			break;
+
+		case Value::VT_Array:
+		{
+			std::vector<unsigned> elements;
+			elements.reserve(current.array->elements.size());
+
+			for( const Value& element : current.array->elements )
+				elements.push_back( addNode(element) );
+
+			mNodes[index].elements = std::move(elements);
+			break;
+		}
+
+		case Value::VT_Object:
+		{
+			std::vector<std::pair<std::string, unsigned>> members;
+			members.reserve(current.object->members.size());
+
+			for( const Object::Member& member : current.object->members )
+			{
+				std::string name = "proto";
+
+				if( member.hash != Symbol::ProtoHash && ! vm.GetNameFromHash(member.hash, &name) )
+				{
+					*outError = "unknown member name";
+					return false;
+				}
+
+				members.emplace_back(std::move(name), addNode(member.value));
+			}
+
+			mNodes[index].members = std::move(members);
+			break;
+		}
+
+		case Value::VT_Box: // a free variable, the copy gets a box of its own
+			mNodes[index].elements = { addNode(current.box->value) };
+			break;
+
+		case Value::VT_Function:
+		{
+			const Function* function = current.function;
+
+			if( function->executionContext )
+			{
+				*outError = "coroutines cannot be copied between virtual machines";
+				return false;
+			}
+
+			std::vector<bool> captured(function->freeVariablesCount, true);
+
+			if( AssignsToCaptured(vm, function->codeObject, captured) )
+			{
+				*outError = "only pure functions can be copied between virtual machines, this one assigns to a captured variable";
+				return false;
+			}
+
+			int code = addCode(function->codeObject);
+
+			if( code < 0 )
+				return false;
+
+			std::vector<unsigned> freeVariables;
+			freeVariables.reserve(function->freeVariablesCount);
+
+			for( unsigned i = 0; i < function->freeVariablesCount; ++i )
+				freeVariables.push_back( addNode(function->FreeVariables()[i]) );
+
+			mNodes[index].code = code;
+			mNodes[index].elements = std::move(freeVariables);
+			break;
+		}
+
+		default:
+			*outError = std::string("values of type '") + MemoryManager::GetTypeName(current.type) + "' cannot be copied between virtual machines";
+			return false;
+		}
+
+		mNodes[index].type = current.type;
+	}
+
+	return true;
+}
+
+Value Message::ToValue(VirtualMachine& vm) const
+{
+	if( mNodes.empty() )
+		return Value();
+
+	MemoryManager& memoryManager = vm.GetMemoryManager();
+
+	Module* module = nullptr;
+	std::vector<const CodeObject*> code;
+
+	if( ! mCode.empty() )
+	{
+		module = &memoryManager.NewModuleForCopy(mFilename);
+
+		for( const Code& c : mCode )
+		{
+			CodeObject codeObject;
+			codeObject.instructions			= c.instructions;
+			codeObject.module				= module;
+			codeObject.localVariablesCount	= c.localVariablesCount;
+			codeObject.namedParametersCount	= c.namedParametersCount;
+			codeObject.maxStackDepth		= c.maxStackDepth;
+			codeObject.usesArguments		= c.usesArguments;
+			codeObject.closureMapping		= c.closureMapping;
+			codeObject.instructionLines		= c.instructionLines;
+			codeObject.loopReloads			= c.loopReloads;
+
+			for( const auto& callSite : c.callSites )
+			{
+				CallSite site;
+				site.hash			= vm.GetHashFromName(callSite.first);
+				site.argumentsCount	= callSite.second;
+
+				codeObject.callSites.push_back(site);
+			}
+
+			code.push_back( vm.AddCodeObject(std::move(codeObject)) );
+		}
+	}
+
+	std::vector<Value> values(mNodes.size());
+
+	// create every value first, so references and cycles can be linked after
+	for( size_t i = 0; i < mNodes.size(); ++i )
+	{
+		const Node& node = mNodes[i];
+
+		switch( node.type )
+		{
+		case Value::VT_Hash:	values[i] = Value( vm.GetHashFromName(node.text) );	break;
+		case Value::VT_String:	values[i] = memoryManager.NewString(node.text);		break;
+		case Value::VT_Error:	values[i] = memoryManager.NewError(node.text);		break;
+		case Value::VT_Array:	values[i] = memoryManager.NewArray();				break;
+		case Value::VT_Object:	values[i] = memoryManager.NewObject();				break;
+		case Value::VT_Box:		values[i] = memoryManager.NewBox();					break;
+		case Value::VT_Function:
+		{
+			Function prototype(code[node.code]);
+			values[i] = memoryManager.NewFunction(&prototype);
+			break;
+		}
+		default:				values[i] = node.value;								break;
+		}
+	}
+
+	for( size_t i = 0; i < mNodes.size(); ++i )
+	{
+		const Node& node = mNodes[i];
+
+		if( node.type == Value::VT_Array )
+		{
+			Array* array = values[i].array;
+
+			array->elements.reserve(node.elements.size());
+
+			for( unsigned element : node.elements )
+				array->elements.push_back( values[element] );
+
+			memoryManager.UpdateSize(array);
+		}
+		else if( node.type == Value::VT_Object )
+		{
+			Object* object = values[i].object;
+
+			object->members.clear();
+			object->members.reserve(node.members.size());
+
+			for( const auto& member : node.members )
+				object->members.emplace_back( vm.GetHashFromName(member.first), values[member.second] );
+
+			std::sort(object->members.begin(), object->members.end());
+
+			memoryManager.UpdateSize(object);
+		}
+		else if( node.type == Value::VT_Box )
+		{
+			values[i].box->value = values[ node.elements[0] ];
+		}
+		else if( node.type == Value::VT_Function )
+		{
+			Function* function = values[i].function;
+
+			// none for the prototypes that closures are made from
+			for( unsigned j = 0; j < node.elements.size(); ++j )
+				function->FreeVariables()[j] = values[ node.elements[j] ];
+		}
+	}
+
+	if( module )
+	{
+		module->globals.reserve(mGlobals.size());
+
+		for( unsigned global : mGlobals )
+			module->globals.push_back( values[global] );
+	}
+
+	return values[0];
+}
+
+
+bool MessageQueue::Push(Message&& message)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		if( mClosed )
+			return false;
+
+		mMessages.push_back( std::move(message) );
+	}
+
+	mCondition.notify_one();
+	return true;
+}
+
+bool MessageQueue::Pop(Message* outMessage)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	mCondition.wait(lock, [this] { return ! mMessages.empty() || mClosed; });
+
+	if( mMessages.empty() )
+		return false;
+
+	*outMessage = std::move( mMessages.front() );
+	mMessages.pop_front();
+
+	return true;
+}
+
+void MessageQueue::Close()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mClosed = true;
+	}
+
+	mCondition.notify_all();
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef _MESSAGE_INCLUDED_
+#define _MESSAGE_INCLUDED_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "DataTypes.h"
+
+namespace element
+{
+
+class VirtualMachine;
+
+
+// A deep copy of a value that belongs to no heap, so it can be handed from
+// one virtual machine (and thread) to another. Shared references and cycles
+// are preserved. Member names are stored as text and hashed again by the
+// receiving virtual machine, since hashes depend on the symbol table.
+// Functions are copied together with their code when they are pure, meaning
+// that neither they nor the functions they create assign to a global or to a
+// captured variable. Everything the code refers to outside of itself (its
+// constants, globals, natives and member names) is turned into globals of a
+// module of its own on the receiving side, and captured variables are copied
+// by value. Boxes, iterators and coroutines cannot be copied.
+class Message
+{
+public:
+	bool		FromValue(VirtualMachine& vm, const Value& value, std::string* outError);
+	Value		ToValue(VirtualMachine& vm) const;
+
+private:
+	struct Node
+	{
+		Value::Type		type = Value::VT_Nil;
+		Value			value;		// nil, int, float and bool
+		std::string		text;		// strings, error messages and hash names
+		std::vector<unsigned>							elements;	// or free variables, or the value in a box
+		std::vector<std::pair<std::string, unsigned>>	members;
+		int				code = -1;	// functions only
+	};
+
+	struct Code
+	{
+		std::vector<Instruction>	instructions;
+		int							localVariablesCount = 0;
+		int							namedParametersCount = 0;
+		int							maxStackDepth = 0;
+		bool						usesArguments = false;
+		std::vector<int>			closureMapping;
+		std::vector<std::pair<std::string, int>>	callSites; // method names and arguments counts
+		std::vector<SourceCodeLine>	instructionLines;
+		std::vector<LoopReload>		loopReloads;
+	};
+
+	std::vector<Node>		mNodes; // the copied value is the first one
+	std::vector<Code>		mCode;
+	std::vector<unsigned>	mGlobals; // the nodes loaded by the copied code
+	std::string				mFilename; // of the module the copied code came from
+};
+
+
+// A thread-safe queue of messages. Closing it wakes up every waiting reader,
+// the messages already in the queue can still be received after that.
+class MessageQueue
+{
+public:
+	bool		Push(Message&& message); // false if the queue is closed
+	bool		Pop(Message* outMessage); // blocks, false once closed and empty
+	void		Close();
+
+private:
+	std::mutex					mMutex;
+	std::condition_variable		mCondition;
+	std::deque<Message>			mMessages;
+	bool						mClosed = false;
+};
+
+}
+
+#endif // _MESSAGE_INCLUDED_
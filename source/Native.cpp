@@ -1,7 +1,13 @@
 #include "Native.h"
 
+#include <algorithm>
 #include <cmath>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <locale>
+#include <sstream>
+#include <thread>
 
 #include "VirtualMachine.h"
 #include "DataTypes.h"
@@ -22,6 +28,14 @@ const std::vector<NamedFunction> allFunctions =
 	{"this_call",			ThisCall},
 	{"garbage_collect",		GarbageCollect},
 	{"memory_stats",		MemoryStats},
+	{"heap_snapshot",		HeapSnapshot},
+	{"set_heap_limit",		SetHeapLimit},
+	{"set_step_budget",		SetStepBudget},
+	{"set_time_budget",		SetTimeBudget},
+	{"set_preemption_mode",	SetPreemptionMode},
+	{"interrupt",			Interrupt},
+	{"profile_allocations",	ProfileAllocations},
+	{"allocation_sites",	AllocationSites},
 	{"print",				Print},
 	{"to_upper",			ToUpper},
 	{"to_lower",			ToLower},
@@ -32,11 +46,24 @@ const std::vector<NamedFunction> allFunctions =
 	{"make_iterator",		MakeIterator},
 	{"iterator_has_next",	IteratorHasNext},
 	{"iterator_get_next",	IteratorGetNext},
+	{"spawn_worker",		SpawnWorker},
+	{"send",				Send},
+	{"receive",				Receive},
+	{"join_worker",			JoinWorker},
+	{"worker_pool_size",	WorkerPoolSize},
+	{"spawn",				Spawn},
+	{"sleep",				Sleep},
+	{"read_file",			ReadFile},
+	{"write_file",			WriteFile},
+	{"run_event_loop",		RunEventLoop},
+	{"channel",				MakeChannel},
+	{"close_channel",		CloseChannel},
 	{"range",				Range},
 	{"each",				Each},
 	{"times",				Times},
 	{"count",				Count},
 	{"map",					Map},
+	{"pmap",				ParallelMap},
 	{"filter",				Filter},
 	{"reduce",				Reduce},
 	{"all",					All},
@@ -184,6 +211,9 @@ Value Type(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>
 	case Value::VT_Error:
 		result.string->str = "error";
 		break;
+	case Value::VT_Channel:
+		result.string->str = "channel";
+		break;
 	default:
 		result.string->str = "<[???]>";
 		break;
@@ -242,6 +272,15 @@ Value GarbageCollect(VirtualMachine& vm, const Value& thisObject, const std::vec
 	return Value();
 }
 
+// an int while it fits in one, a float for heaps past 2 GiB
+static Value ByteCount(size_t bytes)
+{
+	if( bytes <= size_t(std::numeric_limits<int>::max()) )
+		return Value(int(bytes));
+
+	return Value(float(bytes));
+}
+
 Value MemoryStats(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
 {
 	MemoryManager& memoryManager = vm.GetMemoryManager();
@@ -253,8 +292,24 @@ Value MemoryStats(VirtualMachine& vm, const Value& thisObject, const std::vector
 	int boxes		= memoryManager.GetHeapObjectsCount(Value::VT_Box);
 	int iterators	= memoryManager.GetHeapObjectsCount(Value::VT_Iterator);
 	int errors		= memoryManager.GetHeapObjectsCount(Value::VT_Error);
+	int channels	= memoryManager.GetHeapObjectsCount(Value::VT_Channel);
+
+	int total = strings + arrays + objects + functions + boxes + iterators + errors + channels;
+
+	memoryManager.UpdateHeapBytes();
 
-	int total = strings + arrays + objects + functions + boxes + iterators + errors;
+	Value stringsBytes		= ByteCount(memoryManager.GetHeapObjectsBytes(Value::VT_String));
+	Value arraysBytes		= ByteCount(memoryManager.GetHeapObjectsBytes(Value::VT_Array));
+	Value objectsBytes		= ByteCount(memoryManager.GetHeapObjectsBytes(Value::VT_Object));
+	Value functionsBytes	= ByteCount(memoryManager.GetHeapObjectsBytes(Value::VT_Function));
+	Value boxesBytes		= ByteCount(memoryManager.GetHeapObjectsBytes(Value::VT_Box));
+	Value iteratorsBytes	= ByteCount(memoryManager.GetHeapObjectsBytes(Value::VT_Iterator));
+	Value errorsBytes		= ByteCount(memoryManager.GetHeapObjectsBytes(Value::VT_Error));
+	Value channelsBytes		= ByteCount(memoryManager.GetHeapObjectsBytes(Value::VT_Channel));
+
+	Value totalBytes		= ByteCount(memoryManager.GetHeapBytes());
+	Value peakBytes			= ByteCount(memoryManager.GetPeakHeapBytes());
+	Value allocatedBytes	= ByteCount(memoryManager.GetTotalBytesAllocated());
 
 	Value data = memoryManager.NewObject();
 	
@@ -265,11 +320,154 @@ Value MemoryStats(VirtualMachine& vm, const Value& thisObject, const std::vector
 	vm.SetMember(data, "heap_boxes_count",		Value(boxes));
 	vm.SetMember(data, "heap_iterators_count",	Value(iterators));
 	vm.SetMember(data, "heap_errors_count",		Value(errors));
+	vm.SetMember(data, "heap_channels_count",	Value(channels));
 	vm.SetMember(data, "heap_total_count",		Value(total));
 
+	vm.SetMember(data, "heap_strings_bytes",	stringsBytes);
+	vm.SetMember(data, "heap_arrays_bytes",		arraysBytes);
+	vm.SetMember(data, "heap_objects_bytes",	objectsBytes);
+	vm.SetMember(data, "heap_functions_bytes",	functionsBytes);
+	vm.SetMember(data, "heap_boxes_bytes",		boxesBytes);
+	vm.SetMember(data, "heap_iterators_bytes",	iteratorsBytes);
+	vm.SetMember(data, "heap_errors_bytes",		errorsBytes);
+	vm.SetMember(data, "heap_channels_bytes",	channelsBytes);
+	vm.SetMember(data, "heap_total_bytes",		totalBytes);
+	vm.SetMember(data, "heap_peak_bytes",		peakBytes);
+	vm.SetMember(data, "heap_allocated_bytes",	allocatedBytes);
+
 	return data;
 }
 
+Value HeapSnapshot(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsString() )
+	{
+		vm.SetError("function 'heap_snapshot(path)' takes a single string as an argument");
+		return Value();
+	}
+
+	if( ! vm.GetMemoryManager().WriteHeapSnapshot(args[0].string->str) )
+	{
+		vm.SetError("function 'heap_snapshot(path)' could not write to '" + args[0].string->str + "'");
+		return Value();
+	}
+
+	return Value();
+}
+
+Value SetHeapLimit(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsInt() || args[0].AsInt() < 0 )
+	{
+		vm.SetError("function 'set_heap_limit(bytes)' takes a single non-negative integer as an argument");
+		return Value();
+	}
+
+	vm.SetHeapLimit(size_t(args[0].AsInt()));
+
+	return Value();
+}
+
+Value SetStepBudget(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsInt() || args[0].AsInt() < 0 )
+	{
+		vm.SetError("function 'set_step_budget(steps)' takes a single non-negative integer as an argument");
+		return Value();
+	}
+
+	// counted from now, 0 means no budget
+	vm.SetStepBudget(args[0].AsInt());
+
+	return Value();
+}
+
+Value SetTimeBudget(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsInt() || args[0].AsInt() < 0 )
+	{
+		vm.SetError("function 'set_time_budget(milliseconds)' takes a single non-negative integer as an argument");
+		return Value();
+	}
+
+	// counted from now, 0 means no budget
+	vm.SetTimeBudget(std::chrono::milliseconds(args[0].AsInt()));
+
+	return Value();
+}
+
+Value SetPreemptionMode(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() == 1 && args[0].IsString() )
+	{
+		if( args[0].string->str == "abort" )
+		{
+			vm.SetPreemptionMode(VirtualMachine::PM_Abort);
+			return Value();
+		}
+
+		// the host decides when to resume, 'element' does it right away
+		if( args[0].string->str == "suspend" )
+		{
+			vm.SetPreemptionMode(VirtualMachine::PM_Suspend);
+			return Value();
+		}
+	}
+
+	vm.SetError("function 'set_preemption_mode(mode)' takes \"abort\" or \"suspend\" as an argument");
+	return Value();
+}
+
+Value Interrupt(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	// takes effect at the first safe point after this call returns
+	vm.RequestInterrupt();
+
+	return Value();
+}
+
+Value ProfileAllocations(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsInt() || args[0].AsInt() < 0 )
+	{
+		vm.SetError("function 'profile_allocations(interval)' takes a single non-negative integer as an argument");
+		return Value();
+	}
+
+	AllocationProfiler& profiler = vm.GetAllocationProfiler();
+
+	// 0 stops it, what it recorded stays for the report
+	if( args[0].AsInt() == 0 )
+		profiler.Stop();
+	else
+		profiler.Start(unsigned(args[0].AsInt()));
+
+	return Value();
+}
+
+Value AllocationSites(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	MemoryManager& memoryManager = vm.GetMemoryManager();
+
+	Array* result = memoryManager.NewArray();
+
+	for( const AllocationProfiler::SiteStats& site : vm.GetAllocationProfiler().GetSites() )
+	{
+		Value data = memoryManager.NewObject();
+
+		vm.SetMember(data, "file",		Value(memoryManager.NewString(site.file)));
+		vm.SetMember(data, "line",		Value(site.line));
+		vm.SetMember(data, "type",		Value(memoryManager.NewString(MemoryManager::GetTypeName(site.type))));
+		vm.SetMember(data, "function",	Value(memoryManager.NewString(site.function)));
+		vm.SetMember(data, "bytes",		Value(float(site.bytes)));
+		vm.SetMember(data, "count",		Value(float(site.count)));
+
+		result->elements.push_back(data);
+	}
+
+	return Value(result);
+}
+
 Value Print(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
 {
 	for( const Value& arg : args )
@@ -507,6 +705,433 @@ Value IteratorGetNext(VirtualMachine& vm, const Value& thisObject, const std::ve
 	return result;
 }
 
+Value SpawnWorker(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() < 2 || ! args[0].IsString() || ! args[1].IsString() )
+	{
+		vm.SetError("function 'spawn_worker(module, function, ...)' takes a file name and a function name as its first two arguments");
+		return Value();
+	}
+	
+	std::string module = vm.GetFileManager().ResolveFile(args[0].string->str);
+	
+	if( module.empty() )
+		return vm.GetMemoryManager().NewError("file-not-found");
+	
+	std::vector<Message> arguments(args.size() - 2);
+	
+	for( size_t i = 2; i < args.size(); ++i )
+	{
+		std::string error;
+		
+		if( ! arguments[i - 2].FromValue(vm, args[i], &error) )
+		{
+			vm.SetError("function 'spawn_worker(module, function, ...)' " + error);
+			return Value();
+		}
+	}
+	
+	auto worker = std::make_shared<Worker>(module, args[1].string->str);
+	
+	worker->SetSearchPaths( vm.GetFileManager().GetSearchPaths() );
+	worker->SetHeapLimit( vm.GetMemoryManager().GetHeapLimit() );
+	worker->SetArguments( std::move(arguments) );
+	
+	int handle = vm.AddWorker(worker);
+	
+	WorkerPool::GetInstance().Start(worker);
+	
+	return Value(handle);
+}
+
+static Worker* GetWorkerArgument(VirtualMachine& vm, const Value& value, const char* functionName)
+{
+	Worker* worker = value.IsInt() ? vm.GetWorker(value.integer) : nullptr;
+	
+	if( ! worker )
+		vm.SetError(std::string("function '") + functionName + "' takes a worker as a first argument");
+	
+	return worker;
+}
+
+// Waits for the channel in the event loop when the caller is not a spawned
+// coroutine that could be suspended instead. Fails if the loop is already
+// running further up, or if it runs out of coroutines before it is ready.
+static bool WaitForChannel(VirtualMachine& vm, const std::function<bool()>& isReady, const char* functionName)
+{
+	EventLoop& eventLoop = vm.GetEventLoop();
+
+	if( eventLoop.IsRunning() )
+	{
+		vm.SetError(std::string("function '") + functionName + "' can only wait on a channel directly in a spawned coroutine");
+		return false;
+	}
+
+	if( ! eventLoop.RunUntil(isReady) )
+		return false;
+
+	if( ! isReady() )
+	{
+		vm.SetError(std::string("function '") + functionName + "' would wait forever, no coroutine is left to use the channel");
+		return false;
+	}
+
+	return true;
+}
+
+static Value SendToChannel(VirtualMachine& vm, Channel* channel, const Value& value)
+{
+	MemoryManager& memoryManager = vm.GetMemoryManager();
+	EventLoop& eventLoop = vm.GetEventLoop();
+
+	auto isReady = [channel]
+	{
+		return channel->closed || ! channel->waitingReceivers.empty() || ! channel->IsFull();
+	};
+
+	if( ! isReady() )
+	{
+		if( eventLoop.CanSuspend() ) // the receiver that takes the value wakes it up
+		{
+			Value current = eventLoop.GetCurrentTask();
+
+			channel->waitingSenders.emplace_back(current.function, value);
+			memoryManager.UpdateGcRelationship(channel, current);
+			memoryManager.UpdateGcRelationship(channel, value);
+
+			eventLoop.Suspend();
+			return Value();
+		}
+
+		if( ! WaitForChannel(vm, isReady, "send(channel, value)") )
+			return Value();
+	}
+
+	if( channel->closed )
+		return memoryManager.NewError("channel-closed");
+
+	if( ! channel->waitingReceivers.empty() ) // straight to the one waiting the longest
+	{
+		Function* receiver = channel->waitingReceivers.front();
+		channel->waitingReceivers.pop_front();
+
+		eventLoop.Wake(Value(receiver), value);
+		return Value(true);
+	}
+
+	channel->Push(value);
+	memoryManager.UpdateGcRelationship(channel, value);
+
+	return Value(true);
+}
+
+static Value ReceiveFromChannel(VirtualMachine& vm, Channel* channel)
+{
+	MemoryManager& memoryManager = vm.GetMemoryManager();
+	EventLoop& eventLoop = vm.GetEventLoop();
+
+	auto isReady = [channel]
+	{
+		return channel->closed || channel->count > 0 || ! channel->waitingSenders.empty();
+	};
+
+	if( ! isReady() )
+	{
+		if( eventLoop.CanSuspend() ) // the sender of the next value wakes it up
+		{
+			Value current = eventLoop.GetCurrentTask();
+
+			channel->waitingReceivers.push_back(current.function);
+			memoryManager.UpdateGcRelationship(channel, current);
+
+			eventLoop.Suspend();
+			return Value();
+		}
+
+		if( ! WaitForChannel(vm, isReady, "receive(channel)") )
+			return Value();
+	}
+
+	if( channel->count == 0 && channel->waitingSenders.empty() ) // and closed
+		return memoryManager.NewError("channel-closed");
+
+	Value result;
+
+	if( channel->count > 0 )
+		result = channel->Pop();
+
+	if( ! channel->waitingSenders.empty() ) // the first sender in line gets its value in
+	{
+		auto sender = channel->waitingSenders.front();
+		channel->waitingSenders.pop_front();
+
+		if( channel->buffer.empty() )
+		{
+			result = sender.second;
+		}
+		else
+		{
+			channel->Push(sender.second);
+			memoryManager.UpdateGcRelationship(channel, sender.second);
+		}
+
+		eventLoop.Wake(Value(sender.first), Value(true));
+	}
+
+	return result;
+}
+
+Value Send(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() == 2 && args[0].IsChannel() )
+		return SendToChannel(vm, args[0].channel, args[1]);
+	
+	MessageQueue* queue = nullptr;
+	
+	if( args.size() == 2 && args[0].IsInt() && vm.IsJoinedWorker(args[0].integer) )
+	{
+		return Value(false); // like the closed inbox of a finished worker
+	}
+	else if( args.size() == 2 ) // from the parent to a worker
+	{
+		Worker* worker = GetWorkerArgument(vm, args[0], "send(worker, value)");
+		
+		if( ! worker )
+			return Value();
+		
+		queue = &worker->GetInbox();
+	}
+	else if( args.size() == 1 && vm.GetCurrentWorker() ) // from a worker to its parent
+	{
+		queue = &vm.GetCurrentWorker()->GetOutbox();
+	}
+	else
+	{
+		vm.SetError("function 'send(worker, value)' takes exactly two arguments, 'send(value)' is only available inside a worker");
+		return Value();
+	}
+	
+	Message message;
+	std::string error;
+	
+	if( ! message.FromValue(vm, args.back(), &error) )
+	{
+		vm.SetError("function 'send' " + error);
+		return Value();
+	}
+	
+	return Value( queue->Push(std::move(message)) );
+}
+
+Value Receive(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() == 1 && args[0].IsChannel() )
+		return ReceiveFromChannel(vm, args[0].channel);
+	
+	MessageQueue* queue = nullptr;
+	
+	if( args.size() == 1 && args[0].IsInt() && vm.IsJoinedWorker(args[0].integer) )
+	{
+		return vm.GetMemoryManager().NewError("channel-closed"); // like the outbox of a finished worker
+	}
+	else if( args.size() == 1 ) // in the parent, from a worker
+	{
+		Worker* worker = GetWorkerArgument(vm, args[0], "receive(worker)");
+		
+		if( ! worker )
+			return Value();
+		
+		queue = &worker->GetOutbox();
+	}
+	else if( args.empty() && vm.GetCurrentWorker() ) // in a worker, from its parent
+	{
+		queue = &vm.GetCurrentWorker()->GetInbox();
+	}
+	else
+	{
+		vm.SetError("function 'receive(worker)' takes exactly one argument, 'receive()' is only available inside a worker");
+		return Value();
+	}
+	
+	Message message;
+	
+	if( ! queue->Pop(&message) )
+		return vm.GetMemoryManager().NewError("channel-closed");
+	
+	return message.ToValue(vm);
+}
+
+Value JoinWorker(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 )
+	{
+		vm.SetError("function 'join_worker(worker)' takes exactly one argument");
+		return Value();
+	}
+	
+	Worker* worker = GetWorkerArgument(vm, args[0], "join_worker(worker)");
+	
+	if( ! worker )
+		return Value();
+	
+	Message result = worker->Join();
+	
+	// nothing more can come from a joined worker, its handle is free again
+	vm.RemoveWorker(args[0].integer);
+	
+	return result.ToValue(vm);
+}
+
+Value WorkerPoolSize(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( ! args.empty() )
+	{
+		vm.SetError("function 'worker_pool_size()' takes no arguments");
+		return Value();
+	}
+	
+	return Value( int(WorkerPool::GetInstance().GetThreadsCount()) );
+}
+
+Value Spawn(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || args[0].type != Value::VT_Function )
+	{
+		vm.SetError("function 'spawn(coroutine)' takes a coroutine or a function as an argument");
+		return Value();
+	}
+
+	Value coroutine = args[0];
+
+	if( ! coroutine.function->executionContext )
+		coroutine = vm.GetMemoryManager().NewCoroutine( coroutine.function );
+	else if( coroutine.function->executionContext->state == ExecutionContext::CRS_Finished )
+		return vm.GetMemoryManager().NewError("dead-coroutine");
+
+	vm.GetEventLoop().Spawn(coroutine);
+
+	return coroutine;
+}
+
+Value Sleep(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsNumber() || args[0].AsFloat() < 0.0f )
+	{
+		vm.SetError("function 'sleep(milliseconds)' takes a non-negative number as an argument");
+		return Value();
+	}
+
+	std::chrono::milliseconds time( (long long)args[0].AsFloat() );
+
+	EventLoop& eventLoop = vm.GetEventLoop();
+
+	if( eventLoop.CanSuspend() )
+		eventLoop.Sleep(time);
+	else // not in a spawned coroutine, nothing else could run anyway
+		std::this_thread::sleep_for(time);
+
+	return Value();
+}
+
+Value ReadFile(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsString() )
+	{
+		vm.SetError("function 'read_file(path)' takes a string as an argument");
+		return Value();
+	}
+
+	EventLoop& eventLoop = vm.GetEventLoop();
+
+	if( eventLoop.CanSuspend() )
+	{
+		eventLoop.ReadFile(args[0].string->str);
+		return Value();
+	}
+
+	std::ifstream file(args[0].string->str, std::ios::binary);
+	std::stringstream data;
+
+	if( ! file || ! (data << file.rdbuf()) )
+		return vm.GetMemoryManager().NewError("file-not-found");
+
+	return vm.GetMemoryManager().NewString(data.str());
+}
+
+Value WriteFile(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 2 || ! args[0].IsString() || ! args[1].IsString() )
+	{
+		vm.SetError("function 'write_file(path, text)' takes two strings as arguments");
+		return Value();
+	}
+
+	EventLoop& eventLoop = vm.GetEventLoop();
+
+	if( eventLoop.CanSuspend() )
+	{
+		eventLoop.WriteFile(args[0].string->str, args[1].string->str);
+		return Value();
+	}
+
+	std::ofstream file(args[0].string->str, std::ios::binary);
+
+	if( ! file || ! file.write(args[1].string->str.data(), args[1].string->str.size()) )
+		return vm.GetMemoryManager().NewError("cannot-write-file");
+
+	return Value(true);
+}
+
+Value RunEventLoop(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( ! args.empty() )
+	{
+		vm.SetError("function 'run_event_loop()' takes no arguments");
+		return Value();
+	}
+
+	vm.GetEventLoop().Run();
+
+	return Value();
+}
+
+Value MakeChannel(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsInt() || args[0].integer < 0 )
+	{
+		vm.SetError("function 'channel(capacity)' takes a non-negative integer as an argument");
+		return Value();
+	}
+
+	return vm.GetMemoryManager().NewChannel( unsigned(args[0].integer) );
+}
+
+Value CloseChannel(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 1 || ! args[0].IsChannel() )
+	{
+		vm.SetError("function 'close_channel(channel)' takes a channel as an argument");
+		return Value();
+	}
+
+	Channel* channel = args[0].channel;
+	EventLoop& eventLoop = vm.GetEventLoop();
+
+	channel->closed = true;
+
+	// whatever is in the buffer can still be received
+	for( Function* receiver : channel->waitingReceivers )
+		eventLoop.Wake(Value(receiver), vm.GetMemoryManager().NewError("channel-closed"));
+
+	for( const auto& sender : channel->waitingSenders )
+		eventLoop.Wake(Value(sender.first), vm.GetMemoryManager().NewError("channel-closed"));
+
+	channel->waitingReceivers.clear();
+	channel->waitingSenders.clear();
+
+	return Value();
+}
+
 
 struct RangeIterator : public IteratorImplementation
 {
@@ -532,6 +1157,11 @@ struct RangeIterator : public IteratorImplementation
 			return result;
 		});
 	}
+	
+	virtual unsigned CalculateSize() const override
+	{
+		return sizeof(RangeIterator);
+	}
 };
 
 
@@ -787,6 +1417,142 @@ Value Map(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>&
 	return Value();
 }
 
+Value ParallelMap(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
+{
+	if( args.size() != 2 && args.size() != 3 )
+	{
+		vm.SetError("function 'pmap(array, function, [chunk])' takes two or three arguments");
+		return Value();
+	}
+
+	if( ! args[0].IsArray() )
+	{
+		vm.SetError("function 'pmap(array, function, [chunk])': first argument is not an array");
+		return Value();
+	}
+
+	if( ! args[1].IsFunction() )
+	{
+		vm.SetError("function 'pmap(array, function, [chunk])': second argument is not a function");
+		return Value();
+	}
+
+	if( args.size() == 3 && (! args[2].IsInt() || args[2].integer < 1) )
+	{
+		vm.SetError("function 'pmap(array, function, [chunk])': chunk is not a positive integer");
+		return Value();
+	}
+
+	MemoryManager& memoryManager = vm.GetMemoryManager();
+	WorkerPool& workerPool = WorkerPool::GetInstance();
+
+	const std::vector<Value>& elements = args[0].array->elements;
+
+	int size = int(elements.size());
+	int threads = int(workerPool.GetThreadsCount());
+	int chunk = args.size() == 3 ? args[2].integer : std::max(1, (size + threads - 1) / threads);
+
+	Message function;
+	std::string error;
+
+	// checked even when there is nothing to run in parallel, so the same
+	// callbacks are accepted no matter the size of the array
+	if( ! function.FromValue(vm, args[1], &error) )
+	{
+		vm.SetError("function 'pmap(array, function, [chunk])' " + error);
+		return Value();
+	}
+
+	// a worker waiting for more workers could hold a thread they need
+	if( size <= chunk || vm.GetCurrentWorker() )
+		return Map(vm, thisObject, {args[0], args[1]});
+
+	Message map;
+	map.FromValue(vm, Value(Map), &error);
+
+	// a chunk without a worker runs here, when every thread of the pool is
+	// busy, maybe with workers that wait for this one
+	std::vector<std::shared_ptr<Worker>> workers;
+	std::vector<Value> parts;
+
+	for( int from = 0; from < size; from += chunk )
+	{
+		Array* part = memoryManager.NewArray();
+		part->elements.assign(elements.begin() + from, elements.begin() + std::min(size, from + chunk));
+
+		std::vector<Message> arguments(2);
+
+		if( ! arguments[0].FromValue(vm, Value(part), &error) )
+		{
+			for( const std::shared_ptr<Worker>& worker : workers )
+				worker->Stop();
+
+			vm.SetError("function 'pmap(array, function, [chunk])' " + error);
+			return Value();
+		}
+
+		arguments[1] = function;
+
+		auto worker = std::make_shared<Worker>( Message(map) );
+
+		worker->SetSearchPaths( vm.GetFileManager().GetSearchPaths() );
+		worker->SetHeapLimit( memoryManager.GetHeapLimit() );
+		worker->SetArguments( std::move(arguments) );
+
+		if( workerPool.TryStart(worker) )
+		{
+			workers.push_back(worker);
+			parts.push_back(Value());
+		}
+		else
+		{
+			workers.push_back(nullptr);
+			parts.push_back(Value(part));
+		}
+	}
+
+	for( Value& part : parts )
+	{
+		if( part.IsArray() )
+			part = Map(vm, thisObject, {part, args[1]});
+
+		if( vm.HasError() )
+		{
+			for( const std::shared_ptr<Worker>& worker : workers )
+				if( worker )
+					worker->Stop();
+
+			return Value();
+		}
+	}
+
+	Value result = memoryManager.NewArray();
+	result.array->elements.reserve(size);
+
+	for( size_t i = 0; i < workers.size(); ++i )
+	{
+		Value part = workers[i] ? workers[i]->Join().ToValue(vm) : parts[i];
+
+		if( part.IsError() )
+		{
+			if( error.empty() )
+				error = part.error->errorString;
+		}
+		else if( part.IsArray() )
+		{
+			result.array->elements.insert(result.array->elements.end(), part.array->elements.begin(), part.array->elements.end());
+		}
+	}
+
+	if( ! error.empty() )
+	{
+		vm.SetError("function 'pmap(array, function, [chunk])' failed in a worker:\n" + error);
+		return Value();
+	}
+
+	return result;
+}
+
 Value Filter(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args)
 {
 	if( args.size() != 2 )
@@ -26,6 +26,14 @@ Value Type				(VirtualMachine& vm, const Value& thisObject, const std::vector<Va
 Value ThisCall			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value GarbageCollect	(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value MemoryStats		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value HeapSnapshot		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value SetHeapLimit		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value SetStepBudget		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value SetTimeBudget		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value SetPreemptionMode	(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value Interrupt			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value ProfileAllocations(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value AllocationSites	(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value Print				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value ToUpper			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value ToLower			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
@@ -36,11 +44,24 @@ Value MakeCoroutine		(VirtualMachine& vm, const Value& thisObject, const std::ve
 Value MakeIterator		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value IteratorHasNext	(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value IteratorGetNext	(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value SpawnWorker		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value Send				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value Receive			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value JoinWorker		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value WorkerPoolSize	(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value Spawn				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value Sleep				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value ReadFile			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value WriteFile			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value RunEventLoop		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value MakeChannel		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value CloseChannel		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value Range				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value Each				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value Times				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value Count				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value Map				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
+Value ParallelMap		(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value Filter			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value Reduce			(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
 Value All				(VirtualMachine& vm, const Value& thisObject, const std::vector<Value>& args);
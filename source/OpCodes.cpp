@@ -9,6 +9,60 @@ Instruction::Instruction(OpCode opCode, int A)
 {
 }
 
+bool IsJump(OpCode opCode)
+{
+	return	opCode == OpCode::OC_Jump ||
+			opCode == OpCode::OC_JumpIfFalse ||
+			opCode == OpCode::OC_PopJumpIfFalse ||
+			opCode == OpCode::OC_JumpIfFalseOrPop ||
+			opCode == OpCode::OC_JumpIfTrueOrPop;
+}
+
+OpCode UntypedOpCode(OpCode opCode)
+{
+	switch( opCode )
+	{
+	case OpCode::OC_AddInt:				return OpCode::OC_Add;
+	case OpCode::OC_SubtractInt:		return OpCode::OC_Subtract;
+	case OpCode::OC_MultiplyInt:		return OpCode::OC_Multiply;
+	case OpCode::OC_EqualInt:			return OpCode::OC_Equal;
+	case OpCode::OC_NotEqualInt:		return OpCode::OC_NotEqual;
+	case OpCode::OC_LessInt:			return OpCode::OC_Less;
+	case OpCode::OC_GreaterInt:			return OpCode::OC_Greater;
+	case OpCode::OC_LessEqualInt:		return OpCode::OC_LessEqual;
+	case OpCode::OC_GreaterEqualInt:	return OpCode::OC_GreaterEqual;
+
+	case OpCode::OC_AddIntChecked:				return OpCode::OC_Add;
+	case OpCode::OC_SubtractIntChecked:			return OpCode::OC_Subtract;
+	case OpCode::OC_MultiplyIntChecked:			return OpCode::OC_Multiply;
+	case OpCode::OC_LessIntChecked:				return OpCode::OC_Less;
+	case OpCode::OC_GreaterIntChecked:			return OpCode::OC_Greater;
+	case OpCode::OC_LessEqualIntChecked:		return OpCode::OC_LessEqual;
+	case OpCode::OC_GreaterEqualIntChecked:		return OpCode::OC_GreaterEqual;
+	default:							return opCode;
+	}
+}
+
+OpCode CheckedOpCode(OpCode opCode)
+{
+	switch( opCode )
+	{
+	case OpCode::OC_Add:				return OpCode::OC_AddIntChecked;
+	case OpCode::OC_Subtract:			return OpCode::OC_SubtractIntChecked;
+	case OpCode::OC_Multiply:			return OpCode::OC_MultiplyIntChecked;
+	case OpCode::OC_Less:				return OpCode::OC_LessIntChecked;
+	case OpCode::OC_Greater:			return OpCode::OC_GreaterIntChecked;
+	case OpCode::OC_LessEqual:			return OpCode::OC_LessEqualIntChecked;
+	case OpCode::OC_GreaterEqual:		return OpCode::OC_GreaterEqualIntChecked;
+	default:							return opCode;
+	}
+}
+
+bool IsTyped(OpCode opCode)
+{
+	return opCode >= OpCode::OC_AddInt && opCode <= OpCode::OC_GreaterEqualInt;
+}
+
 std::string Instruction::AsString() const
 {
 	using namespace std::string_literals;
@@ -57,6 +111,7 @@ std::string Instruction::AsString() const
 	case OpCode::OC_PopStoreToBox:		return "PopStoreToBox     "s + std::to_string(int(A));
 	case OpCode::OC_MakeClosure:		return "MakeClosure";
 	case OpCode::OC_LoadFromClosure:	return "LoadFromClosure   "s + std::to_string(int(A));
+	case OpCode::OC_LoadCaptured:		return "LoadCaptured      "s + std::to_string(int(A));
 	case OpCode::OC_StoreToClosure:		return "StoreToClosure    "s + std::to_string(int(A));
 	case OpCode::OC_PopStoreToClosure:	return "PopStoreToClosure "s + std::to_string(int(A));
 
@@ -67,6 +122,7 @@ std::string Instruction::AsString() const
 	case OpCode::OC_JumpIfTrueOrPop:	return "JumpIfTrueOrPop   "s + std::to_string(int(A));
 
 	case OpCode::OC_FunctionCall:		return "FunctionCall      "s + std::to_string(int(A));
+	case OpCode::OC_CallMethod:			return "CallMethod        "s + std::to_string(int(A));
 	case OpCode::OC_Yield:				return "Yield";
 	case OpCode::OC_EndFunction:		return "EndFunction";
 
@@ -94,6 +150,24 @@ std::string Instruction::AsString() const
 	case OpCode::OC_UnaryConcatenate:	return "UnaryConcatenate";
 	case OpCode::OC_UnarySizeOf:		return "UnarySizeOf";
 
+	case OpCode::OC_AddInt:				return "AddInt";
+	case OpCode::OC_SubtractInt:		return "SubtractInt";
+	case OpCode::OC_MultiplyInt:		return "MultiplyInt";
+	case OpCode::OC_EqualInt:			return "EqualInt";
+	case OpCode::OC_NotEqualInt:		return "NotEqualInt";
+	case OpCode::OC_LessInt:			return "LessInt";
+	case OpCode::OC_GreaterInt:			return "GreaterInt";
+	case OpCode::OC_LessEqualInt:		return "LessEqualInt";
+	case OpCode::OC_GreaterEqualInt:	return "GreaterEqualInt";
+
+	case OpCode::OC_AddIntChecked:			return "AddIntChecked";
+	case OpCode::OC_SubtractIntChecked:		return "SubtractIntChecked";
+	case OpCode::OC_MultiplyIntChecked:		return "MultiplyIntChecked";
+	case OpCode::OC_LessIntChecked:			return "LessIntChecked";
+	case OpCode::OC_GreaterIntChecked:		return "GreaterIntChecked";
+	case OpCode::OC_LessEqualIntChecked:	return "LessEqualIntChecked";
+	case OpCode::OC_GreaterEqualIntChecked:	return "GreaterEqualIntChecked";
+
 	default: return "Unknown op code "s + std::to_string(int(opCode));
 	}
 }
@@ -65,6 +65,7 @@ enum OpCode : char
 
 	OC_MakeClosure,			// Create a closure from the function object at TOS and replace it
 	OC_LoadFromClosure,		// load the value of the free variable inside the closure at index A
+	OC_LoadCaptured,		// load the free variable copied into the closure at index A
 	OC_StoreToClosure,		// A is the index of the free variable inside the closure
 	OC_PopStoreToClosure,	// A is the index of the free variable inside the closure
 
@@ -76,6 +77,7 @@ enum OpCode : char
 	OC_JumpIfTrueOrPop,		// jump to A, if TOS is true, otherwise pop TOS (or-op)
 
 	OC_FunctionCall,		// function to call and arguments are on stack, A is arguments count
+	OC_CallMethod,			// TOS is the object, the arguments are under it, A is the index of the call site
 	OC_Yield,				// yield the value from TOS to the parent execution context
 	OC_EndFunction,			// end function sentinel
 
@@ -102,6 +104,31 @@ enum OpCode : char
 	OC_UnaryNot,
 	OC_UnaryConcatenate,
 	OC_UnarySizeOf,
+
+	// binary operations on two ints, put in by the compiler where it knows the
+	// types of the operands, they don't check them
+	OC_AddInt,
+	OC_SubtractInt,
+	OC_MultiplyInt,
+
+	OC_EqualInt,
+	OC_NotEqualInt,
+	OC_LessInt,
+	OC_GreaterInt,
+	OC_LessEqualInt,
+	OC_GreaterEqualInt,
+
+	// binary operations that got two ints every time they ran in the run of a
+	// profile, put in by the compiler when it uses the profile, they check the
+	// types and do the untyped operation when they are not two ints
+	OC_AddIntChecked,
+	OC_SubtractIntChecked,
+	OC_MultiplyIntChecked,
+
+	OC_LessIntChecked,
+	OC_GreaterIntChecked,
+	OC_LessEqualIntChecked,
+	OC_GreaterEqualIntChecked,
 };
 
 
@@ -120,6 +147,12 @@ struct Instruction
 	std::string AsString() const;
 };
 
+bool IsJump(OpCode opCode); // one of the instructions that can go to A
+
+OpCode UntypedOpCode(OpCode opCode); // the operation that checks the types, the same one for the rest
+OpCode CheckedOpCode(OpCode opCode); // the checked one for an untyped operation, the same one for the rest
+bool IsTyped(OpCode opCode); // one of the operations on two ints that don't check their operands
+
 }
 
 #endif // _OP_CODES_INCLUDED_
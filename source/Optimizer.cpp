@@ -0,0 +1,519 @@
+#include "Optimizer.h"
+
+#include <cmath>
+#include <limits>
+
+#include "AST.h"
+#include "Value.h"
+
+namespace element
+{
+
+// nil, bool, int and float literals as the values the virtual machine would
+// load for them, strings are handled on their own
+static bool IsValueLiteral(const ast::Node* node)
+{
+	return	node->type == ast::Node::N_Nil ||
+			node->type == ast::Node::N_Bool ||
+			node->type == ast::Node::N_Integer ||
+			node->type == ast::Node::N_Float;
+}
+
+static bool IsLiteral(const ast::Node* node)
+{
+	return IsValueLiteral(node) || node->type == ast::Node::N_String;
+}
+
+static Value LiteralAsValue(const ast::Node* node)
+{
+	switch( node->type )
+	{
+	case ast::Node::N_Bool:		return Value( ((const ast::BoolNode*)node)->value );
+	case ast::Node::N_Integer:	return Value( ((const ast::IntegerNode*)node)->value );
+	case ast::Node::N_Float:	return Value( ((const ast::FloatNode*)node)->value );
+	default:					return Value();
+	}
+}
+
+static std::string LiteralAsString(const ast::Node* node)
+{
+	if( node->type == ast::Node::N_String )
+		return ((const ast::StringNode*)node)->value;
+
+	return LiteralAsValue(node).AsString();
+}
+
+static bool LiteralAsBool(const ast::Node* node)
+{
+	return node->type == ast::Node::N_String || LiteralAsValue(node).AsBool();
+}
+
+static ast::Node* ValueAsLiteral(const Value& value, const SourceCoords& coords)
+{
+	switch( value.type )
+	{
+	case Value::VT_Bool:	return new ast::BoolNode(value.boolean, coords);
+	case Value::VT_Int:		return new ast::IntegerNode(value.integer, coords);
+	case Value::VT_Float:	return new ast::FloatNode(value.floatingPoint, coords);
+	default:				return new ast::Node(ast::Node::N_Nil, coords);
+	}
+}
+
+// ints wrap around on overflow, like they do in the virtual machine
+static int WrapAdd(int a, int b)		{ return int(unsigned(a) + unsigned(b)); }
+static int WrapSubtract(int a, int b)	{ return int(unsigned(a) - unsigned(b)); }
+static int WrapMultiply(int a, int b)	{ return int(unsigned(a) * unsigned(b)); }
+
+// Does the operation of the virtual machine on two literal values. False for
+// the ones it does not do here: the ones that are errors at run time, and the
+// ones with no defined result in C++.
+static bool FoldBinaryOperation(Token op, const Value& lhs, const Value& rhs, Value* result)
+{
+	const bool numbers = lhs.IsNumber() && rhs.IsNumber();
+	const bool ints = lhs.IsInt() && rhs.IsInt();
+
+	switch( op )
+	{
+	case T_Add:
+		if( ! numbers )
+			return false;
+		*result = ints ? Value(WrapAdd(lhs.integer, rhs.integer)) : Value(lhs.AsFloat() + rhs.AsFloat());
+		return true;
+
+	case T_Subtract:
+		if( ! numbers )
+			return false;
+		*result = ints ? Value(WrapSubtract(lhs.integer, rhs.integer)) : Value(lhs.AsFloat() - rhs.AsFloat());
+		return true;
+
+	case T_Multiply:
+		if( ! numbers )
+			return false;
+		*result = ints ? Value(WrapMultiply(lhs.integer, rhs.integer)) : Value(lhs.AsFloat() * rhs.AsFloat());
+		return true;
+
+	case T_Divide:
+		if( ! numbers || rhs.AsFloat() == 0 || (ints && rhs.integer == -1) )
+			return false;
+		*result = ints ? Value(lhs.integer / rhs.integer) : Value(lhs.AsFloat() / rhs.AsFloat());
+		return true;
+
+	case T_Modulo:
+		if( ! numbers || (ints && (rhs.integer == 0 || rhs.integer == -1)) )
+			return false;
+		*result = ints ? Value(lhs.integer % rhs.integer) : Value(std::fmod(lhs.AsFloat(), rhs.AsFloat()));
+		return true;
+
+	case T_Power:
+		if( ! numbers )
+			return false;
+
+		if( lhs.IsFloat() )
+		{
+			*result = Value( float(std::pow(lhs.AsFloat(), rhs.AsFloat())) );
+		}
+		else
+		{
+			double power = std::pow(lhs.AsInt(), rhs.AsFloat());
+
+			// out of range it has no defined int value
+			if( ! (power > double(std::numeric_limits<int>::min()) - 1.0 &&
+				   power < double(std::numeric_limits<int>::max()) + 1.0) )
+				return false;
+
+			*result = Value( int(power) );
+		}
+		return true;
+
+	case T_Xor:
+		*result = Value( !lhs.AsBool() != !rhs.AsBool() );
+		return true;
+
+	case T_Equal:
+	case T_NotEqual:
+	{
+		bool equal;
+
+		if( ints )
+			equal = lhs.integer == rhs.integer;
+		else if( numbers )
+			equal = lhs.AsFloat() == rhs.AsFloat();
+		else if( lhs.type == rhs.type )
+			equal = lhs.IsNil() || lhs.AsBool() == rhs.AsBool();
+		else
+			equal = false;
+
+		*result = Value( op == T_Equal ? equal : ! equal );
+		return true;
+	}
+
+	case T_Less:
+	case T_Greater:
+	case T_LessEqual:
+	case T_GreaterEqual:
+	{
+		if( ! numbers )
+			return false;
+
+		float a = lhs.AsFloat();
+		float b = rhs.AsFloat();
+
+		if( ints )
+		{
+			switch( op )
+			{
+			case T_Less:		*result = Value(lhs.integer <  rhs.integer); break;
+			case T_Greater:		*result = Value(lhs.integer >  rhs.integer); break;
+			case T_LessEqual:	*result = Value(lhs.integer <= rhs.integer); break;
+			default:			*result = Value(lhs.integer >= rhs.integer); break;
+			}
+		}
+		else
+		{
+			switch( op )
+			{
+			case T_Less:		*result = Value(a <  b); break;
+			case T_Greater:		*result = Value(a >  b); break;
+			case T_LessEqual:	*result = Value(a <= b); break;
+			default:			*result = Value(a >= b); break;
+			}
+		}
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+// whether the value of the node is an int or a float, or else it is an error
+static bool IsNumber(const ast::Node* node)
+{
+	if( node->type == ast::Node::N_Integer || node->type == ast::Node::N_Float )
+		return true;
+
+	if( node->type == ast::Node::N_UnaryOperator )
+	{
+		Token op = ((const ast::UnaryOperatorNode*)node)->op;
+		return op == T_Add || op == T_Subtract;
+	}
+
+	if( node->type == ast::Node::N_BinaryOperator )
+	{
+		Token op = ((const ast::BinaryOperatorNode*)node)->op;
+		// no '+', it also adds arrays and objects
+		return op == T_Subtract || op == T_Multiply || op == T_Divide || op == T_Power || op == T_Modulo;
+	}
+
+	return false;
+}
+
+static bool IsInteger(const ast::Node* node, int value)
+{
+	return node->type == ast::Node::N_Integer && ((const ast::IntegerNode*)node)->value == value;
+}
+
+// The compiler makes the box of a captured variable where it first occurs.
+// A node with such an occurrence in it cannot be dropped.
+static bool HasFirstBoxedOccurrence(const ast::Node* node)
+{
+	if( ! node )
+		return false;
+
+	switch( node->type )
+	{
+	case ast::Node::N_Variable:
+	{
+		const ast::VariableNode* n = (const ast::VariableNode*)node;
+		return n->firstOccurrence && n->semanticType == ast::VariableNode::SMT_LocalBoxed;
+	}
+
+	case ast::Node::N_Array:
+		for( const ast::Node* element : ((const ast::ArrayNode*)node)->elements )
+			if( HasFirstBoxedOccurrence(element) )
+				return true;
+		return false;
+
+	case ast::Node::N_Object:
+		for( const auto& member : ((const ast::ObjectNode*)node)->members )
+			if( HasFirstBoxedOccurrence(member.second) )
+				return true;
+		return false;
+
+	case ast::Node::N_FunctionCall:
+		return	HasFirstBoxedOccurrence( ((const ast::FunctionCallNode*)node)->function ) ||
+				HasFirstBoxedOccurrence( ((const ast::FunctionCallNode*)node)->arguments );
+
+	case ast::Node::N_Arguments:
+		for( const ast::Node* argument : ((const ast::ArgumentsNode*)node)->arguments )
+			if( HasFirstBoxedOccurrence(argument) )
+				return true;
+		return false;
+
+	case ast::Node::N_UnaryOperator:
+		return HasFirstBoxedOccurrence( ((const ast::UnaryOperatorNode*)node)->operand );
+
+	case ast::Node::N_BinaryOperator:
+		return	HasFirstBoxedOccurrence( ((const ast::BinaryOperatorNode*)node)->lhs ) ||
+				HasFirstBoxedOccurrence( ((const ast::BinaryOperatorNode*)node)->rhs );
+
+	case ast::Node::N_Block:
+		for( const ast::Node* n : ((const ast::BlockNode*)node)->nodes )
+			if( HasFirstBoxedOccurrence(n) )
+				return true;
+		return false;
+
+	case ast::Node::N_If:
+		return	HasFirstBoxedOccurrence( ((const ast::IfNode*)node)->condition ) ||
+				HasFirstBoxedOccurrence( ((const ast::IfNode*)node)->thenPath ) ||
+				HasFirstBoxedOccurrence( ((const ast::IfNode*)node)->elsePath );
+
+	case ast::Node::N_While:
+		return	HasFirstBoxedOccurrence( ((const ast::WhileNode*)node)->condition ) ||
+				HasFirstBoxedOccurrence( ((const ast::WhileNode*)node)->body );
+
+	case ast::Node::N_For:
+		return	HasFirstBoxedOccurrence( ((const ast::ForNode*)node)->iteratingVariable ) ||
+				HasFirstBoxedOccurrence( ((const ast::ForNode*)node)->iteratedExpression ) ||
+				HasFirstBoxedOccurrence( ((const ast::ForNode*)node)->body );
+
+	case ast::Node::N_Return:	return HasFirstBoxedOccurrence( ((const ast::ReturnNode*)node)->value );
+	case ast::Node::N_Break:	return HasFirstBoxedOccurrence( ((const ast::BreakNode*)node)->value );
+	case ast::Node::N_Continue:	return HasFirstBoxedOccurrence( ((const ast::ContinueNode*)node)->value );
+	case ast::Node::N_Yield:	return HasFirstBoxedOccurrence( ((const ast::YieldNode*)node)->value );
+
+	default: // literals, and functions, which box their own variables
+		return false;
+	}
+}
+
+void Optimizer::Optimize(ast::FunctionNode* node)
+{
+	OptimizeNode(node);
+}
+
+ast::Node* Optimizer::OptimizeNode(ast::Node* node)
+{
+	auto optimize = [this](ast::Node*& child)
+	{
+		if( child )
+			child = OptimizeNode(child);
+	};
+
+	switch( node->type )
+	{
+	case ast::Node::N_Array:
+		for( ast::Node*& element : ((ast::ArrayNode*)node)->elements )
+			optimize(element);
+		return node;
+
+	case ast::Node::N_Object: // the keys are names
+		for( auto& member : ((ast::ObjectNode*)node)->members )
+			optimize(member.second);
+		return node;
+
+	case ast::Node::N_Function:
+		optimize( ((ast::FunctionNode*)node)->body );
+		return node;
+
+	case ast::Node::N_FunctionCall:
+		optimize( ((ast::FunctionCallNode*)node)->function );
+		optimize( ((ast::FunctionCallNode*)node)->arguments );
+		return node;
+
+	case ast::Node::N_Arguments:
+		for( ast::Node*& argument : ((ast::ArgumentsNode*)node)->arguments )
+			optimize(argument);
+		return node;
+
+	case ast::Node::N_UnaryOperator:
+		return OptimizeUnaryOperator((ast::UnaryOperatorNode*)node);
+
+	case ast::Node::N_BinaryOperator:
+		return OptimizeBinaryOperator((ast::BinaryOperatorNode*)node);
+
+	case ast::Node::N_Block:
+		for( ast::Node*& n : ((ast::BlockNode*)node)->nodes )
+			optimize(n);
+		return node;
+
+	case ast::Node::N_If:
+		return OptimizeIf((ast::IfNode*)node);
+
+	case ast::Node::N_While:
+		optimize( ((ast::WhileNode*)node)->condition );
+		optimize( ((ast::WhileNode*)node)->body );
+		return node;
+
+	case ast::Node::N_For: // the iterating variable is assigned to
+		optimize( ((ast::ForNode*)node)->iteratedExpression );
+		optimize( ((ast::ForNode*)node)->body );
+		return node;
+
+	case ast::Node::N_Return:	optimize( ((ast::ReturnNode*)node)->value );	return node;
+	case ast::Node::N_Break:	optimize( ((ast::BreakNode*)node)->value );		return node;
+	case ast::Node::N_Continue:	optimize( ((ast::ContinueNode*)node)->value );	return node;
+	case ast::Node::N_Yield:	optimize( ((ast::YieldNode*)node)->value );		return node;
+
+	default: // literals and variables
+		return node;
+	}
+}
+
+ast::Node* Optimizer::OptimizeUnaryOperator(ast::UnaryOperatorNode* node)
+{
+	node->operand = OptimizeNode(node->operand);
+
+	const ast::Node* operand = node->operand;
+
+	if( ! IsLiteral(operand) )
+		return node;
+
+	ast::Node* result = nullptr;
+
+	if( node->op == T_Not )
+	{
+		result = new ast::BoolNode( ! LiteralAsBool(operand), node->coords );
+	}
+	else if( node->op == T_Subtract && operand->type == ast::Node::N_Integer )
+	{
+		result = new ast::IntegerNode( WrapSubtract(0, ((const ast::IntegerNode*)operand)->value), node->coords );
+	}
+	else if( node->op == T_Subtract && operand->type == ast::Node::N_Float )
+	{
+		result = new ast::FloatNode( -((const ast::FloatNode*)operand)->value, node->coords );
+	}
+	else if( node->op == T_Add && IsNumber(operand) )
+	{
+		result = node->operand;
+		node->operand = nullptr;
+	}
+
+	if( ! result )
+		return node;
+
+	delete node;
+	return result;
+}
+
+ast::Node* Optimizer::OptimizeBinaryOperator(ast::BinaryOperatorNode* node)
+{
+	switch( node->op )
+	{
+	case T_Assignment:
+	case T_AssignAdd:
+	case T_AssignSubtract:
+	case T_AssignMultiply:
+	case T_AssignDivide:
+	case T_AssignPower:
+	case T_AssignModulo:
+	case T_AssignConcatenate:
+	case T_ArrayPopBack:
+	{
+		// the target is stored into, only what it is made of can change
+		ast::Node*& target = node->op == T_ArrayPopBack ? node->rhs : node->lhs;
+		ast::Node*& value = node->op == T_ArrayPopBack ? node->lhs : node->rhs;
+
+		if( target->type == ast::Node::N_BinaryOperator )
+		{
+			ast::BinaryOperatorNode* n = (ast::BinaryOperatorNode*)target;
+			n->lhs = OptimizeNode(n->lhs);
+
+			if( n->op != T_Dot )
+				n->rhs = OptimizeNode(n->rhs);
+		}
+
+		value = OptimizeNode(value);
+		return node;
+	}
+
+	case T_Dot: // the right side is a name
+		node->lhs = OptimizeNode(node->lhs);
+		return node;
+
+	default:
+		break;
+	}
+
+	node->lhs = OptimizeNode(node->lhs);
+	node->rhs = OptimizeNode(node->rhs);
+
+	ast::Node*& lhs = node->lhs;
+	ast::Node*& rhs = node->rhs;
+	ast::Node* result = nullptr;
+
+	if( node->op == T_And || node->op == T_Or )
+	{
+		// the left side decides if the right one is evaluated, the result is one of them
+		if( IsLiteral(lhs) && ! HasFirstBoxedOccurrence(rhs) )
+		{
+			bool keepLeft = LiteralAsBool(lhs) == (node->op == T_Or);
+			ast::Node*& kept = keepLeft ? lhs : rhs;
+
+			result = kept;
+			kept = nullptr;
+		}
+	}
+	else if( node->op == T_Concatenate && IsLiteral(lhs) && IsLiteral(rhs) )
+	{
+		result = new ast::StringNode( LiteralAsString(lhs) + LiteralAsString(rhs), node->coords );
+	}
+	else if( IsValueLiteral(lhs) && IsValueLiteral(rhs) )
+	{
+		Value value;
+
+		if( FoldBinaryOperation(node->op, LiteralAsValue(lhs), LiteralAsValue(rhs), &value) )
+			result = ValueAsLiteral(value, node->coords);
+	}
+	else if((node->op == T_Multiply && IsInteger(rhs, 1)) ||
+			(node->op == T_Divide	&& IsInteger(rhs, 1)) ||
+			(node->op == T_Subtract	&& IsInteger(rhs, 0)) ||
+			(node->op == T_Power	&& IsInteger(rhs, 1)) )
+	{
+		// x * 1, x / 1, x - 0 and x ^ 1 are x, as long as it is a number,
+		// x + 0 is not, -0.0 + 0 is 0.0
+		if( IsNumber(lhs) )
+		{
+			result = lhs;
+			lhs = nullptr;
+		}
+	}
+	else if( node->op == T_Multiply && IsInteger(lhs, 1) && IsNumber(rhs) )
+	{
+		result = rhs;
+		rhs = nullptr;
+	}
+
+	if( ! result )
+		return node;
+
+	delete node;
+	return result;
+}
+
+ast::Node* Optimizer::OptimizeIf(ast::IfNode* node)
+{
+	node->condition = OptimizeNode(node->condition);
+	node->thenPath = OptimizeNode(node->thenPath);
+
+	if( node->elsePath )
+		node->elsePath = OptimizeNode(node->elsePath);
+
+	if( ! IsLiteral(node->condition) )
+		return node;
+
+	ast::Node*& taken = LiteralAsBool(node->condition) ? node->thenPath : node->elsePath;
+	ast::Node*& dropped = LiteralAsBool(node->condition) ? node->elsePath : node->thenPath;
+
+	if( HasFirstBoxedOccurrence(dropped) )
+		return node;
+
+	// without an 'else' the value of the 'if' is nil
+	ast::Node* result = taken ? taken : new ast::Node(ast::Node::N_Nil, node->coords);
+	taken = nullptr;
+
+	delete node;
+	return result;
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef _OPTIMIZER_H_INCLUDED_
+#define _OPTIMIZER_H_INCLUDED_
+
+namespace element
+{
+
+namespace ast
+{
+	struct Node;
+	struct FunctionNode;
+	struct UnaryOperatorNode;
+	struct BinaryOperatorNode;
+	struct IfNode;
+}
+
+
+// Simplifies the AST after the semantic analysis, before it is compiled.
+// Operations on literals are done here instead of every time the code runs,
+// with the same results the virtual machine would get. Identities like
+// 'x * 1' and 'x ^ 1' are removed when 'x' is known to be a number and the
+// branches of an 'if' with a literal condition are dropped. Anything that
+// would be an error at run time is left as it is, so it still is.
+class Optimizer
+{
+public:
+	void		Optimize(ast::FunctionNode* node);
+
+protected:
+	// the node to put in the place of 'node', which is deleted if that is another one
+	ast::Node*	OptimizeNode(ast::Node* node);
+	ast::Node*	OptimizeUnaryOperator(ast::UnaryOperatorNode* node);
+	ast::Node*	OptimizeBinaryOperator(ast::BinaryOperatorNode* node);
+	ast::Node*	OptimizeIf(ast::IfNode* node);
+};
+
+}
+
+#endif // _OPTIMIZER_H_INCLUDED_
@@ -1,6 +1,7 @@
 #include "SemanticAnalyzer.h"
 
 #include <algorithm>
+#include <set>
 #include "Logger.h"
 #include "AST.h"
 
@@ -30,9 +31,13 @@ void SemanticAnalyzer::Analyze(ast::FunctionNode* node)
 
 	ResolveNamesInNodes({node});
 
+	if( ! mLogger.HasErrorMessages() )
+		CaptureByValue();
+
 	mContext.clear();
 	mFunctionScopes.clear();
 	mGlobalVariables.clear();
+	mFunctionNodes.clear();
 }
 
 void SemanticAnalyzer::AddNativeFunction(const std::string& name, int index)
@@ -46,6 +51,7 @@ void SemanticAnalyzer::ResetState()
 	mFunctionScopes.clear();
 	mGlobalVariables.clear();
 	mNativeFunctions.clear();
+	mFunctionNodes.clear();
 
 	mCurrentFunctionNode = nullptr;
 }
@@ -65,8 +71,15 @@ bool SemanticAnalyzer::AnalyzeNode(ast::Node* node)
 		return true;
 
 	case ast::Node::N_Variable:
-		mCurrentFunctionNode->referencedVariables.push_back((ast::VariableNode*)node);
+	{
+		ast::VariableNode* n = (ast::VariableNode*)node;
+
+		if( n->variableType == ast::VariableNode::V_ArgumentList || n->variableType >= 0 )
+			mCurrentFunctionNode->usesArguments = true;
+
+		mCurrentFunctionNode->referencedVariables.push_back(n);
 		return true;
+	}
 
 	case ast::Node::N_Arguments:
 	{
@@ -132,6 +145,8 @@ bool SemanticAnalyzer::AnalyzeNode(ast::Node* node)
 		if( ! CheckAssignable(n->iteratingVariable) )
 			return false;
 
+		MarkAssigned(n->iteratingVariable);
+
 		mContext.push_back(CXT_InLoop);
 
 		bool ok = 	AnalyzeNode(n->iteratingVariable)	&&
@@ -207,6 +222,8 @@ bool SemanticAnalyzer::AnalyzeNode(ast::Node* node)
 
 		mContext.push_back(mContext.empty() ? ContextType::CXT_InGlobal : ContextType::CXT_InFunction);
 
+		mFunctionNodes.emplace_back(n, mCurrentFunctionNode);
+
 		ast::FunctionNode* oldFunctionNode = mCurrentFunctionNode;
 		mCurrentFunctionNode = n;
 
@@ -363,6 +380,8 @@ bool SemanticAnalyzer::AnalyzeBinaryOperator(const ast::BinaryOperatorNode* n)
 
 		if( ! CheckAssignable(n->lhs) )
 			return false;
+
+		MarkAssigned(n->lhs);
 	}
 
 	if( n->op == Token::T_Assignment &&
@@ -377,6 +396,8 @@ bool SemanticAnalyzer::AnalyzeBinaryOperator(const ast::BinaryOperatorNode* n)
 	{
 		if( ! CheckAssignable(n->rhs) )
 			return false;
+
+		MarkAssigned(n->rhs);
 	}
 
 	if( n->op == Token::T_LeftBracket )
@@ -484,6 +505,19 @@ bool SemanticAnalyzer::CheckAssignable(const ast::Node* node) const
 	return false;
 }
 
+void SemanticAnalyzer::MarkAssigned(ast::Node* node)
+{
+	if( node->type == ast::Node::N_Variable )
+	{
+		((ast::VariableNode*)node)->isAssigned = true;
+	}
+	else if( node->type == ast::Node::N_Array )
+	{
+		for( ast::Node* e : ((ast::ArrayNode*)node)->elements )
+			MarkAssigned(e);
+	}
+}
+
 bool SemanticAnalyzer::IsBreakContinueReturn(const ast::Node* node) const
 {
 	return	node->type == ast::Node::N_Break ||
@@ -957,4 +991,68 @@ bool SemanticAnalyzer::TryToFindNameInTheEnclosingFunctions(ast::VariableNode* v
 	return false;
 }
 
+void SemanticAnalyzer::CaptureByValue()
+{
+	// A captured variable that is stored into only where it is defined gets a
+	// new box every time the store runs and nothing ever changes the value in
+	// that box. The closures can keep a copy of the value instead of the box.
+	typedef std::pair<ast::FunctionNode*, int> Origin; // a function and its local variable
+
+	std::map<const ast::FunctionNode*, std::vector<Origin>> origins; // of the free variables
+
+	for( const auto& f : mFunctionNodes )
+	{
+		std::vector<Origin>& functionOrigins = origins[f.first];
+
+		for( int index : f.first->closureMapping )
+		{
+			if( index >= 0 )
+				functionOrigins.emplace_back(f.second, index);
+			else // from a free variable of the enclosing function
+				functionOrigins.push_back( origins[f.second][-index - 1] );
+		}
+	}
+
+	std::set<Origin> changing;
+
+	for( const auto& f : mFunctionNodes )
+	{
+		for( const ast::VariableNode* vn : f.first->referencedVariables )
+		{
+			if( ! vn->isAssigned )
+				continue;
+
+			if( vn->semanticType == ast::VariableNode::SMT_LocalBoxed && ! vn->firstOccurrence )
+				changing.emplace(f.first, vn->index); // parameters are never a first occurrence
+			else if( vn->semanticType == ast::VariableNode::SMT_FreeVariable )
+				changing.insert( origins[f.first][vn->index] );
+		}
+	}
+
+	for( const auto& f : mFunctionNodes )
+	{
+		ast::FunctionNode* function = f.first;
+		const std::vector<Origin>& functionOrigins = origins[function];
+
+		for( ast::VariableNode* vn : function->referencedVariables )
+		{
+			if( vn->semanticType == ast::VariableNode::SMT_LocalBoxed &&
+				changing.count({function, vn->index}) == 0 )
+			{
+				vn->semanticType = ast::VariableNode::SMT_Local;
+			}
+			else if( vn->semanticType == ast::VariableNode::SMT_FreeVariable &&
+					 changing.count(functionOrigins[vn->index]) == 0 )
+			{
+				vn->semanticType = ast::VariableNode::SMT_FreeValue;
+			}
+		}
+
+		std::vector<int>& parametersToBox = function->parametersToBox;
+
+		parametersToBox.erase(std::remove_if(parametersToBox.begin(), parametersToBox.end(),
+			[&](int index) { return changing.count({function, index}) == 0; }), parametersToBox.end());
+	}
+}
+
 }
@@ -4,6 +4,7 @@
 #include <string>
 #include <deque>
 #include <map>
+#include <vector>
 #include "Logger.h"
 
 namespace element
@@ -62,6 +63,7 @@ protected:
 	bool	AnalyzeBinaryOperator(const ast::BinaryOperatorNode* n);
 
 	bool	CheckAssignable(const ast::Node* node) const;
+	void	MarkAssigned(ast::Node* node);
 	bool	IsBreakContinueReturn(const ast::Node* node) const;
 	bool	IsBreakContinue(const ast::Node* node) const;
 	bool	IsReturn(const ast::Node* node) const;
@@ -73,6 +75,8 @@ protected:
 	void	ResolveName(ast::VariableNode* vn);
 	bool	TryToFindNameInTheEnclosingFunctions(ast::VariableNode* vn);
 
+	void	CaptureByValue();
+
 private:
 	Logger&						mLogger;
 
@@ -80,6 +84,9 @@ private:
 
 	ast::FunctionNode*			mCurrentFunctionNode;
 
+	// every function and the one it is defined in, enclosing functions come first
+	std::vector<std::pair<ast::FunctionNode*, ast::FunctionNode*>> mFunctionNodes;
+
 	std::vector<FunctionScope>	mFunctionScopes;
 
 	std::vector<std::string>	mGlobalVariables;
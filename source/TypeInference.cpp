@@ -0,0 +1,460 @@
+#include "TypeInference.h"
+
+#include "FlowOptimizer.h"
+#include "OpCodes.h"
+
+namespace element
+{
+
+// the one that does the same on two ints without checking them, the same one for the rest
+static OpCode IntOpCode(OpCode opCode)
+{
+	switch( opCode )
+	{
+	case OpCode::OC_Add:			return OpCode::OC_AddInt;
+	case OpCode::OC_Subtract:		return OpCode::OC_SubtractInt;
+	case OpCode::OC_Multiply:		return OpCode::OC_MultiplyInt;
+	case OpCode::OC_Equal:			return OpCode::OC_EqualInt;
+	case OpCode::OC_NotEqual:		return OpCode::OC_NotEqualInt;
+	case OpCode::OC_Less:			return OpCode::OC_LessInt;
+	case OpCode::OC_Greater:		return OpCode::OC_GreaterInt;
+	case OpCode::OC_LessEqual:		return OpCode::OC_LessEqualInt;
+	case OpCode::OC_GreaterEqual:	return OpCode::OC_GreaterEqualInt;
+	default:						return opCode;
+	}
+}
+
+
+TypeInference::TypeInference(CodeObject* codeObject, const std::deque<Constant>& constants)
+: mCodeObject(codeObject)
+, mInstructions(codeObject->instructions)
+, mConstants(constants)
+, mStarts(codeObject->instructions.size() + 1, false)
+{
+	mStarts[0] = true;
+
+	for( size_t i = 0; i < mInstructions.size(); ++i )
+	{
+		const Instruction& instruction = mInstructions[i];
+
+		if( IsJump(instruction.opCode) )
+			mStarts[instruction.A] = true;
+
+		if( IsJump(instruction.opCode) || instruction.opCode == OpCode::OC_EndFunction )
+			mStarts[i + 1] = true;
+	}
+}
+
+bool TypeInference::Specialize()
+{
+	const int size = int(mInstructions.size());
+
+	if( size == 0 )
+		return false;
+
+	// the types of the locals before each block and if a path gets to it yet
+	std::vector<Types> before(size);
+	std::vector<bool> reached(size, false);
+
+	// the parameters are whatever the caller gives, the rest start as nil
+	before[0].assign(mCodeObject->localVariablesCount, IT_Nil);
+	reached[0] = true;
+
+	for( int p = 0; p < mCodeObject->namedParametersCount && p < mCodeObject->localVariablesCount; ++p )
+		before[0][p] = IT_Any;
+
+	std::vector<int> pending = {0};
+
+	while( ! pending.empty() )
+	{
+		const int start = pending.back();
+		pending.pop_back();
+
+		Types locals = before[start];
+		const int end = Run(start, locals, false);
+		const Instruction& last = mInstructions[end];
+
+		int successors[2];
+		int count = 0;
+
+		if( last.opCode != OpCode::OC_Jump && last.opCode != OpCode::OC_EndFunction && end + 1 < size )
+			successors[count++] = end + 1;
+
+		if( IsJump(last.opCode) )
+			successors[count++] = last.A;
+
+		for( int s = 0; s < count; ++s )
+		{
+			Types& next = before[successors[s]];
+			bool changed = ! reached[successors[s]];
+
+			if( changed )
+			{
+				next = locals;
+				reached[successors[s]] = true;
+			}
+			else
+			{
+				for( size_t v = 0; v < next.size(); ++v )
+				{
+					if( next[v] != locals[v] && next[v] != IT_Any )
+					{
+						next[v] = IT_Any;
+						changed = true;
+					}
+				}
+			}
+
+			if( changed )
+				pending.push_back(successors[s]);
+		}
+	}
+
+	bool changed = false;
+
+	for( int start = 0; start < size; ++start )
+	{
+		if( ! mStarts[start] || ! reached[start] )
+			continue;
+
+		Types locals = before[start];
+		const int end = Run(start, locals, true);
+
+		for( int i = start; i <= end; ++i )
+			if( IsTyped(mInstructions[i].opCode) )
+				changed = true;
+	}
+
+	if( ! mPowers.empty() )
+	{
+		LowerPowers();
+		changed = true;
+	}
+
+	return changed;
+}
+
+void TypeInference::LowerPowers()
+{
+	std::vector<FlowOptimizer::Emitted> code;
+	size_t next = 0;
+
+	for( int i = 0; i < int(mInstructions.size()); ++i )
+	{
+		const bool power = next < mPowers.size() && mPowers[next].first == i;
+
+		// the exponent goes with its power
+		if( next < mPowers.size() && mPowers[next].first == i + 1 )
+			continue;
+
+		if( ! power )
+		{
+			code.push_back({mInstructions[i], i, 0, 0, 0});
+			continue;
+		}
+
+		// x ^ 2 is x * x, x ^ 3 is x * x * x and x ^ 4 is (x * x) * (x * x). The
+		// products are exact for ints and for squares, for higher powers of
+		// floats they can differ from pow() in the last bit.
+		const int exponent = mConstants[mInstructions[i - 1].A].integer;
+		const Instruction multiply( mPowers[next].second == IT_Int ? OpCode::OC_MultiplyInt : OpCode::OC_Multiply );
+		const Instruction duplicate( OpCode::OC_Duplicate );
+
+		code.push_back({duplicate, i, 0, 0, 0});
+
+		if( exponent == 3 )
+			code.push_back({duplicate, i, 0, 0, 0});
+
+		code.push_back({multiply, i, 0, 0, 0});
+
+		if( exponent == 4 )
+			code.push_back({duplicate, i, 0, 0, 0});
+
+		if( exponent >= 3 )
+			code.push_back({multiply, i, 0, 0, 0});
+
+		++next;
+	}
+
+	mPowers.clear();
+	FlowOptimizer::Assemble(mCodeObject, code);
+}
+
+TypeInference::Type TypeInference::ConstantType(int index) const
+{
+	if( index < 0 || index >= int(mConstants.size()) )
+		return IT_Any;
+
+	switch( mConstants[index].type )
+	{
+	case Constant::CT_Nil:		return IT_Nil;
+	case Constant::CT_Bool:		return IT_Bool;
+	case Constant::CT_Integer:	return IT_Int;
+	case Constant::CT_Float:	return IT_Float;
+	case Constant::CT_String:	return IT_String;
+	default:					return IT_Any;
+	}
+}
+
+TypeInference::Type TypeInference::BinaryType(OpCode opCode, Type lhs, Type rhs)
+{
+	const bool numbers = (lhs == IT_Int || lhs == IT_Float) && (rhs == IT_Int || rhs == IT_Float);
+
+	// the operations that fail give nothing, so only the results of the rest count
+	switch( UntypedOpCode(opCode) )
+	{
+	case OpCode::OC_Add:
+		if( lhs == IT_Array && rhs == IT_Array )
+			return IT_Array;
+		if( lhs == IT_Object && rhs == IT_Object )
+			return IT_Object;
+		// fall through
+	case OpCode::OC_Subtract:
+	case OpCode::OC_Multiply:
+	case OpCode::OC_Divide:
+	case OpCode::OC_Modulo:
+		if( lhs == IT_Int && rhs == IT_Int )
+			return IT_Int;
+		return numbers ? IT_Float : IT_Any;
+
+	case OpCode::OC_Power: // it has the type of its left side
+		return lhs == IT_Int || lhs == IT_Float ? lhs : IT_Any;
+
+	case OpCode::OC_Concatenate:
+		return IT_String;
+
+	case OpCode::OC_Xor:
+	case OpCode::OC_Equal:
+	case OpCode::OC_NotEqual:
+	case OpCode::OC_Less:
+	case OpCode::OC_Greater:
+	case OpCode::OC_LessEqual:
+	case OpCode::OC_GreaterEqual:
+		return IT_Bool;
+
+	default:
+		return IT_Any;
+	}
+}
+
+TypeInference::Type TypeInference::UnaryType(OpCode opCode, Type operand)
+{
+	switch( opCode )
+	{
+	case OpCode::OC_UnaryPlus:
+	case OpCode::OC_UnaryMinus:
+		return operand == IT_Int || operand == IT_Float ? operand : IT_Any;
+
+	case OpCode::OC_UnaryNot:
+		return IT_Bool;
+
+	case OpCode::OC_UnaryConcatenate:
+		return IT_String;
+
+	case OpCode::OC_UnarySizeOf:
+		return IT_Int;
+
+	default:
+		return IT_Any;
+	}
+}
+
+int TypeInference::Run(int start, Types& locals, bool specialize)
+{
+	const int size = int(mInstructions.size());
+
+	// the types of the values pushed in this block, the ones under them can be anything
+	std::vector<Type> stack;
+
+	auto pop = [&stack]()
+	{
+		if( stack.empty() )
+			return IT_Any;
+
+		Type type = stack.back();
+		stack.pop_back();
+		return type;
+	};
+
+	auto local = [&locals](int index)
+	{
+		return index >= 0 && index < int(locals.size()) ? &locals[index] : nullptr;
+	};
+
+	for( int i = start; ; ++i )
+	{
+		Instruction& instruction = mInstructions[i];
+		const int A = instruction.A;
+
+		switch( instruction.opCode )
+		{
+		case OpCode::OC_Pop:
+		case OpCode::OC_PopStoreGlobal:
+		case OpCode::OC_PopStoreToBox:
+		case OpCode::OC_PopStoreToClosure:
+		case OpCode::OC_PopJumpIfFalse:
+			pop();
+			break;
+
+		case OpCode::OC_PopN:
+			for( int n = 0; n < A; ++n )
+				pop();
+			break;
+
+		case OpCode::OC_Rotate2:
+		{
+			Type top = pop();
+			Type under = pop();
+			stack.push_back(top);
+			stack.push_back(under);
+			break;
+		}
+
+		case OpCode::OC_MoveToTOS2:
+		{
+			Type top = pop();
+
+			if( stack.size() >= 2 )
+				stack[stack.size() - 2] = top;
+			break;
+		}
+
+		case OpCode::OC_Duplicate:
+			stack.push_back(stack.empty() ? IT_Any : stack.back());
+			break;
+
+		case OpCode::OC_LoadConstant:
+			stack.push_back(ConstantType(A));
+			break;
+
+		case OpCode::OC_LoadLocal:
+			stack.push_back(local(A) ? *local(A) : IT_Any);
+			break;
+
+		case OpCode::OC_LoadArgsArray:
+			stack.push_back(IT_Array);
+			break;
+
+		case OpCode::OC_LoadGlobal:
+		case OpCode::OC_LoadNative:
+		case OpCode::OC_LoadArgument:
+		case OpCode::OC_LoadThis:
+		case OpCode::OC_LoadHash:
+		case OpCode::OC_LoadFromBox:
+		case OpCode::OC_LoadFromClosure:
+		case OpCode::OC_LoadCaptured:
+			stack.push_back(IT_Any);
+			break;
+
+		case OpCode::OC_StoreLocal:
+			if( local(A) )
+				*local(A) = stack.empty() ? IT_Any : stack.back();
+			break;
+
+		case OpCode::OC_PopStoreLocal:
+		{
+			Type type = pop();
+
+			if( local(A) )
+				*local(A) = type;
+			break;
+		}
+
+		case OpCode::OC_MakeBox: // the local holds the box from now on
+			if( local(A) )
+				*local(A) = IT_Any;
+			break;
+
+		case OpCode::OC_StoreGlobal:
+		case OpCode::OC_StoreToBox:
+		case OpCode::OC_StoreToClosure:
+		case OpCode::OC_Jump:
+		case OpCode::OC_JumpIfFalse:
+		case OpCode::OC_JumpIfFalseOrPop: // the block ends with them, the values after them aren't known
+		case OpCode::OC_JumpIfTrueOrPop:
+			break;
+
+		case OpCode::OC_MakeArray:
+			for( int n = 0; n < A; ++n )
+				pop();
+			stack.push_back(IT_Array);
+			break;
+
+		case OpCode::OC_MakeObject:
+			stack.clear();
+			stack.push_back(IT_Object);
+			break;
+
+		case OpCode::OC_MakeEmptyObject:
+			stack.push_back(IT_Object);
+			break;
+
+		case OpCode::OC_Add:
+		case OpCode::OC_Subtract:
+		case OpCode::OC_Multiply:
+		case OpCode::OC_Divide:
+		case OpCode::OC_Power:
+		case OpCode::OC_Modulo:
+		case OpCode::OC_Concatenate:
+		case OpCode::OC_Xor:
+		case OpCode::OC_Equal:
+		case OpCode::OC_NotEqual:
+		case OpCode::OC_Less:
+		case OpCode::OC_Greater:
+		case OpCode::OC_LessEqual:
+		case OpCode::OC_GreaterEqual:
+		case OpCode::OC_AddInt:
+		case OpCode::OC_SubtractInt:
+		case OpCode::OC_MultiplyInt:
+		case OpCode::OC_EqualInt:
+		case OpCode::OC_NotEqualInt:
+		case OpCode::OC_LessInt:
+		case OpCode::OC_GreaterInt:
+		case OpCode::OC_LessEqualInt:
+		case OpCode::OC_GreaterEqualInt:
+		case OpCode::OC_AddIntChecked:
+		case OpCode::OC_SubtractIntChecked:
+		case OpCode::OC_MultiplyIntChecked:
+		case OpCode::OC_LessIntChecked:
+		case OpCode::OC_GreaterIntChecked:
+		case OpCode::OC_LessEqualIntChecked:
+		case OpCode::OC_GreaterEqualIntChecked:
+		{
+			Type rhs = pop();
+			Type lhs = pop();
+
+			if( specialize && lhs == IT_Int && rhs == IT_Int )
+				instruction.opCode = IntOpCode(instruction.opCode);
+
+			// the exponent is loaded right before, in the same block
+			if( specialize && instruction.opCode == OpCode::OC_Power && (lhs == IT_Int || lhs == IT_Float) &&
+				i > start && mInstructions[i - 1].opCode == OpCode::OC_LoadConstant &&
+				ConstantType(mInstructions[i - 1].A) == IT_Int &&
+				mConstants[mInstructions[i - 1].A].integer >= 2 && mConstants[mInstructions[i - 1].A].integer <= 4 )
+			{
+				mPowers.emplace_back(i, lhs);
+			}
+
+			stack.push_back(BinaryType(instruction.opCode, lhs, rhs));
+			break;
+		}
+
+		case OpCode::OC_UnaryPlus:
+		case OpCode::OC_UnaryMinus:
+		case OpCode::OC_UnaryNot:
+		case OpCode::OC_UnaryConcatenate:
+		case OpCode::OC_UnarySizeOf:
+			stack.push_back(UnaryType(instruction.opCode, pop()));
+			break;
+
+		default: // what they leave on the stack isn't known
+			stack.clear();
+			break;
+		}
+
+		if( i + 1 >= size || mStarts[i + 1] )
+			return i;
+	}
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef _TYPE_INFERENCE_INCLUDED_
+#define _TYPE_INFERENCE_INCLUDED_
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "Constant.h"
+#include "DataTypes.h"
+
+namespace element
+{
+
+// Finds the types that the local variables and the values on the stack have on
+// every path to an instruction, starting from the constants and the results of
+// the operations on them, and puts the typed instructions in the place of the
+// binary operations that are done on two ints. The typed ones don't check the
+// types of their operands. The powers of a number with a literal exponent of
+// 2, 3 or 4 become its products, the ones of anything else stay powers, so
+// they fail as powers. Only the locals are followed through the jumps, the
+// values on the stack are known from the start of the straight stretch of code
+// they are in. The parameters and everything that comes from a global, a
+// member, an element or a call can be anything.
+class TypeInference
+{
+public:
+					TypeInference(CodeObject* codeObject, const std::deque<Constant>& constants);
+
+	bool			Specialize(); // true if a typed instruction was put in the code
+
+protected:
+	enum Type : char
+	{
+		IT_Nil,
+		IT_Int,
+		IT_Float,
+		IT_Bool,
+		IT_String,
+		IT_Array,
+		IT_Object,
+		IT_Any,		// it can be different on different paths
+	};
+
+	typedef std::vector<Type> Types; // one for each local
+
+	Type			ConstantType(int index) const;
+	static Type		BinaryType(OpCode opCode, Type lhs, Type rhs);
+	static Type		UnaryType(OpCode opCode, Type operand);
+
+	// goes through the block from 'start' with the types of the locals before
+	// it, puts the typed instructions in it if 'specialize' is true and
+	// returns the index of its last instruction
+	int				Run(int start, Types& locals, bool specialize);
+
+	// puts the products in the place of the powers Run found
+	void			LowerPowers();
+
+protected:
+	CodeObject*						mCodeObject;
+	std::vector<Instruction>&		mInstructions;
+	const std::deque<Constant>&		mConstants;
+	std::vector<bool>				mStarts; // the first instructions of the blocks
+	std::vector<std::pair<int, Type>>	mPowers; // the powers to lower and the type of their number
+};
+
+}
+
+#endif // _TYPE_INFERENCE_INCLUDED_
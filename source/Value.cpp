@@ -83,6 +83,12 @@ Value::Value(Error* error)
 {
 }
 
+Value::Value(Channel* channel)
+: type(VT_Channel)
+, channel(channel)
+{
+}
+
 Value::Value(const Value& o)
 : type(o.type)
 , function(o.function)
@@ -162,6 +168,11 @@ bool Value::IsError() const
 	return type == VT_Error;
 }
 
+bool Value::IsChannel() const
+{
+	return type == VT_Channel;
+}
+
 int Value::AsInt() const
 {
 	return type == VT_Int ? integer : int(floatingPoint);
@@ -208,6 +219,8 @@ std::string Value::AsString() const
 		return "<box>";
 	case VT_Iterator:
 		return "<iterator>";
+	case VT_Channel:
+		return "<channel>";
 	case VT_NativeFunction:
 		return "<native-function>";
 	case VT_Error:
@@ -15,6 +15,7 @@ struct Box;
 struct Iterator;
 struct GarbageCollected;
 struct Error;
+struct Channel;
 
 class VirtualMachine;
 
@@ -37,6 +38,7 @@ struct Value
 		VT_Box				= 10,
 		VT_Iterator			= 11,
 		VT_Error			= 12,
+		VT_Channel			= 13,
 	};
 
 	Type type;
@@ -57,6 +59,7 @@ struct Value
 		Iterator*		iterator;
 		NativeFunction	nativeFunction;
 		Error*			error;
+		Channel*		channel;
 
 		GarbageCollected* garbageCollected;
 	};
@@ -74,6 +77,7 @@ struct Value
 	Value(Iterator* iterator);
 	Value(NativeFunction nativeFunction);
 	Value(Error* error);
+	Value(Channel* channel);
 
 	Value(const Value& o);
 
@@ -91,6 +95,7 @@ struct Value
 	bool		IsBox() const;
 	bool		IsIterator() const;
 	bool		IsError() const;
+	bool		IsChannel() const;
 
 	int			AsInt() const;
 	float		AsFloat() const;
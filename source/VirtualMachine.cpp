@@ -5,6 +5,7 @@
 #include <iterator>
 #include <fstream>
 #include "AST.h"
+#include "CppEmitter.h"
 #include "Native.h"
 
 
@@ -18,12 +19,35 @@ VirtualMachine::VirtualMachine()
 , mCompiler(mLogger)
 , mFileManager()
 , mMemoryManager()
+, mAllocationProfiler(*this)
 , mExecutionContext(nullptr)
 , mStack(nullptr)
+, mSafePointRequested(false)
+, mInterruptRequested(false)
+, mPreemptionMode(PM_Abort)
+, mStepBudget(0)
+, mStepsLeft(0)
+, mTimeBudget(0)
+, mRunCodeDepth(0)
+, mSuspending(false)
+, mSuspendedContext(nullptr)
+, mSuspendedRootContext(nullptr)
+, mCurrentWorker(nullptr)
+, mNativeCanYield(false)
+, mNativeYielding(false)
+, mEventLoop(*this)
+, mJit(mConstants, mSafePointRequested)
+, mJitEnabled(true)
+, mRecordingProfile(false)
 {
 	RegisterStandardUtilities();
 }
 
+VirtualMachine::~VirtualMachine()
+{
+	StopWorkers();
+}
+
 void VirtualMachine::ResetState()
 {
 	mLogger.ClearErrorMessages();
@@ -34,6 +58,8 @@ void VirtualMachine::ResetState()
 
 	mFileManager.ResetState();
 
+	mEventLoop.ResetState(); // before the heap it refers to is gone
+
 	mMemoryManager.ResetState();
 	
 	mConstantStrings.clear();
@@ -41,6 +67,9 @@ void VirtualMachine::ResetState()
 	mConstantCodeObjects.clear();
 	mConstants.clear();
 	
+	mJit.ResetState();
+	mProfile.ClearRecording();
+	
 	mNativeFunctions.clear();
 	mSymbolNames.clear();
 	
@@ -49,6 +78,17 @@ void VirtualMachine::ResetState()
 	
 	mErrorMessage.clear();
 	
+	mInterruptRequested = false;
+	mRunCodeDepth = 0;
+	mSuspending = false;
+	mSuspendedContext = nullptr;
+	mSuspendedRootContext = nullptr;
+	mNativeCanYield = false;
+	mNativeYielding = false;
+	
+	StopWorkers();
+	mWorkers.clear();
+	
 	RegisterStandardUtilities();
 }
 
@@ -64,6 +104,8 @@ Value VirtualMachine::Interpret(std::istream& input)
 
 		if( !mLogger.HasErrorMessages() )
 		{
+			mOptimizer.Optimize(node.get());
+
 			std::unique_ptr<char[]> bytecode = mCompiler.Compile(node.get());
 
 			if( !mLogger.HasErrorMessages() )
@@ -112,6 +154,8 @@ Value VirtualMachine::Interpret(const std::string& filename)
 
 		if( !mLogger.HasErrorMessages() )
 		{
+			mOptimizer.Optimize(node.get());
+
 			bytecode = mCompiler.Compile(node.get());
 
 			if( !mLogger.HasErrorMessages() )
@@ -137,6 +181,71 @@ Value VirtualMachine::Interpret(const std::string& filename)
 	return result;
 }
 
+Value VirtualMachine::EmitCpp(const std::string& filename, std::ostream& output)
+{
+	std::ifstream input(filename);
+	
+	if( ! input.is_open() )
+		return mMemoryManager.NewError("file-not-found");
+	
+	Value result;
+
+	std::unique_ptr<ast::FunctionNode> node = mParser.Parse(input);
+
+	if( !mLogger.HasErrorMessages() )
+	{
+		mSemanticAnalyzer.Analyze(node.get());
+
+		if( !mLogger.HasErrorMessages() )
+		{
+			mOptimizer.Optimize(node.get());
+
+			std::unique_ptr<char[]> bytecode = mCompiler.Compile(node.get());
+
+			if( !mLogger.HasErrorMessages() )
+			{
+				size_t first = mConstantCodeObjects.size();
+
+				ParseBytecode(bytecode.get(), mMemoryManager.GetDefaultModule());
+
+				std::vector<const CodeObject*> codeObjects;
+
+				for( size_t i = first; i < mConstantCodeObjects.size(); ++i )
+					codeObjects.push_back( &mConstantCodeObjects[i] );
+
+				CppEmitter(mConstants).Emit(filename, codeObjects, output);
+			}
+		}
+	}
+
+	if( mLogger.HasErrorMessages() )
+	{
+		result = mMemoryManager.NewError( mLogger.GetCombinedErrorMessages() );
+		mLogger.ClearErrorMessages();
+	}
+
+	return result;
+}
+
+Value VirtualMachine::Interpret(const Value& function, const std::vector<Value>& args)
+{
+	Value result = CallFunction(function, args);
+
+	if( mLogger.HasErrorMessages() )
+	{
+		result = mMemoryManager.NewError( mLogger.GetCombinedErrorMessages() );
+		mLogger.ClearErrorMessages();
+	}
+	else if( HasError() ) // a native function called directly
+	{
+		result = mMemoryManager.NewError( mErrorMessage );
+	}
+
+	ClearError();
+
+	return result;
+}
+
 FileManager& VirtualMachine::GetFileManager()
 {
 	return mFileManager;
@@ -147,6 +256,11 @@ MemoryManager& VirtualMachine::GetMemoryManager()
 	return mMemoryManager;
 }
 
+AllocationProfiler& VirtualMachine::GetAllocationProfiler()
+{
+	return mAllocationProfiler;
+}
+
 void VirtualMachine::SetError(const std::string& errorMessage)
 {
 	mErrorMessage = errorMessage;
@@ -171,6 +285,128 @@ void VirtualMachine::RegisterNativeFunction(const std::string& name, Value::Nati
 	mSemanticAnalyzer.AddNativeFunction(name, index);
 }
 
+void VirtualMachine::SetStepBudget(long long steps)
+{
+	mStepBudget = steps;
+	mStepsLeft = steps;
+
+	UpdateSafePointRequest();
+}
+
+void VirtualMachine::SetTimeBudget(std::chrono::microseconds time)
+{
+	mTimeBudget = time;
+	mDeadline = std::chrono::steady_clock::now() + time;
+
+	UpdateSafePointRequest();
+}
+
+void VirtualMachine::SetPreemptionMode(PreemptionMode mode)
+{
+	mPreemptionMode = mode;
+}
+
+void VirtualMachine::SetHeapLimit(size_t bytes)
+{
+	mMemoryManager.SetHeapLimit(bytes);
+
+	UpdateSafePointRequest();
+}
+
+void VirtualMachine::RequestInterrupt()
+{
+	// in this order, see 'HandleSafePoint'
+	mInterruptRequested = true;
+	mSafePointRequested = true;
+}
+
+bool VirtualMachine::IsSuspended() const
+{
+	return mSuspendedContext != nullptr;
+}
+
+Value VirtualMachine::Resume()
+{
+	if( ! mSuspendedContext )
+		return mMemoryManager.NewError("nothing-to-resume");
+
+	ExecutionContext* returnContext = mExecutionContext;
+	ExecutionContext* rootContext = mSuspendedRootContext;
+
+	mExecutionContext = mSuspendedContext;
+	mStack = &mExecutionContext->stack;
+
+	// The host may have changed objects, the ones a loop loaded its members
+	// from before it started included. Those loads run again.
+	StackFrame* frame = &mExecutionContext->stackFrames.back();
+	const int index = int(frame->ip - frame->instructions);
+
+	for( const LoopReload& reload : frame->function->codeObject->loopReloads )
+		if( reload.jumpIndex == index )
+			frame->ip = frame->instructions + reload.loadsIndex;
+
+	mSuspendedContext = nullptr;
+	mSuspendedRootContext = nullptr;
+
+	Value result = RunRootContext(rootContext, returnContext);
+
+	ClearError();
+
+	return result;
+}
+
+int VirtualMachine::AddWorker(const std::shared_ptr<Worker>& worker)
+{
+	auto freeSlot = std::find(mWorkers.begin(), mWorkers.end(), nullptr);
+
+	if( freeSlot != mWorkers.end() )
+	{
+		*freeSlot = worker;
+		return int(freeSlot - mWorkers.begin()) + 1;
+	}
+
+	mWorkers.push_back(worker);
+
+	return int(mWorkers.size());
+}
+
+Worker* VirtualMachine::GetWorker(int handle) const
+{
+	if( handle < 1 || handle > int(mWorkers.size()) )
+		return nullptr;
+
+	return mWorkers[handle - 1].get();
+}
+
+void VirtualMachine::RemoveWorker(int handle)
+{
+	if( handle >= 1 && handle <= int(mWorkers.size()) )
+		mWorkers[handle - 1] = nullptr;
+}
+
+bool VirtualMachine::IsJoinedWorker(int handle) const
+{
+	return handle >= 1 && handle <= int(mWorkers.size()) && ! mWorkers[handle - 1];
+}
+
+Worker* VirtualMachine::GetCurrentWorker() const
+{
+	return mCurrentWorker;
+}
+
+void VirtualMachine::SetCurrentWorker(Worker* worker)
+{
+	mCurrentWorker = worker;
+}
+
+void VirtualMachine::StopWorkers()
+{
+	// workers that are still running have nobody to report to anymore
+	for( const std::shared_ptr<Worker>& worker : mWorkers )
+		if( worker )
+			worker->Stop();
+}
+
 std::string VirtualMachine::GetVersion() const
 {
 	return "element interpreter version 0.0.5";
@@ -354,6 +590,8 @@ int VirtualMachine::ParseBytecode(const char* bytecode, Module& forModule)
 
 	mSymbolNames.reserve(symbolsCount + symbolsOffset);
 
+	size_t firstCodeObject = mConstantCodeObjects.size();
+
 	Symbol currentSymbol;
 
 	while( symbolIt < symbolsEnd )
@@ -407,6 +645,10 @@ int VirtualMachine::ParseBytecode(const char* bytecode, Module& forModule)
 
 			codeObject->module = &forModule;
 
+			// it got hot in the run the profile is from, so it is compiled on its first call
+			if( mProfile.GetHotness(int(mConstants.size())) >= Jit::HotnessThreshold )
+				codeObject->hotness = Jit::HotnessThreshold - 1;
+
 			mConstantFunctions.emplace_back( codeObject );
 			mConstantFunctions.back().state = GarbageCollected::GC_Static;
 			
@@ -423,6 +665,11 @@ int VirtualMachine::ParseBytecode(const char* bytecode, Module& forModule)
 		}
 	}
 
+	// the ones built into the interpreter with --emit-cpp, they are not
+	// compiled at run time so they are used with the jit off as well
+	for( size_t i = firstCodeObject; i < mConstantCodeObjects.size(); ++i )
+		mJit.AttachTranslation(mConstantCodeObjects[i]);
+
 	return firstFunctionConstantIndex;
 }
 
@@ -430,13 +677,21 @@ Value VirtualMachine::CallFunction_Common(const Value& thisObject, const Value&
 {
 	if( function.type == Value::VT_NativeFunction )
 	{
-		return function.nativeFunction(*this, thisObject, args);
+		bool couldYield = mNativeCanYield;
+		mNativeCanYield = false;
+
+		Value result = CallNativeFunction(function.nativeFunction, thisObject, args);
+
+		mNativeCanYield = couldYield;
+
+		return result;
 	}
 	else // normal function
 	{
 		// switch context
 		ExecutionContext* oldContext = mExecutionContext;
-		mExecutionContext = mMemoryManager.NewRootExecutionContext();
+		ExecutionContext* rootContext = mMemoryManager.NewRootExecutionContext();
+		mExecutionContext = rootContext;
 		mStack = &mExecutionContext->stack;
 
 		mStack->reserve(args.size());
@@ -445,21 +700,44 @@ Value VirtualMachine::CallFunction_Common(const Value& thisObject, const Value&
 
 		mExecutionContext->lastObject = thisObject;
 
-		Call( int(args.size()) );
+		Call( int(args.size()), thisObject ); // switches to the context of a coroutine
 
-		Value result = RunCode();
+		return RunRootContext(rootContext, oldContext);
+	}
+}
 
-		mMemoryManager.DeleteRootExecutionContext(mExecutionContext);
-		mExecutionContext = oldContext;
-		mStack = &oldContext->stack;
+Value VirtualMachine::RunRootContext(ExecutionContext* rootContext, ExecutionContext* returnContext)
+{
+	Value result = RunCode();
 
-		return result;
+	if( mSuspending ) // keep everything as it is until 'Resume'
+	{
+		mSuspending = false;
+		mSuspendedContext = mExecutionContext;
+		mSuspendedRootContext = rootContext;
 	}
+	else
+	{
+		mMemoryManager.DeleteRootExecutionContext(rootContext);
+	}
+
+	mExecutionContext = returnContext;
+	mStack = returnContext ? &returnContext->stack : nullptr;
+
+	return result;
 }
 
 Value VirtualMachine::RunCode()
 {
+	// bytecode keeps its values on the stack, the collector can see them
+	bool calledFromNativeCode = mMemoryManager.IsInNativeCode();
+	mMemoryManager.SetInNativeCode(false);
+
+	if( mRunCodeDepth++ == 0 )
+		StartBudget();
+
 	StackFrame* frame = nullptr;
+	Value result;
 
 	// IMPORTANT: the current 'mExecutionContext' may change during 'RunCodeForFrame'
 	while( ! mExecutionContext->stackFrames.empty() )
@@ -472,24 +750,36 @@ Value VirtualMachine::RunCode()
 		{
 			LogStackTraceStartingFrom(frame);
 
-			return mMemoryManager.NewError("runtime-error");
+			result = mMemoryManager.NewError("runtime-error");
+			break;
 		}
+
+		if( mSuspending )
+			break;
 	}
 	
-	// result if any
-	Value result;
+	--mRunCodeDepth;
 
-	if( ! mStack->empty() )
+	// result if any
+	if( ! HasError() && ! mSuspending && ! mStack->empty() )
 	{
 		result = mStack->back();
 		mStack->pop_back();
 	}
 
+	// the native code we return to holds the result in a C++ variable
+	mMemoryManager.SetInNativeCode(calledFromNativeCode);
+
+	if( calledFromNativeCode )
+		mMemoryManager.AddTemporaryRoot(result);
+
 	return result;
 }
 
 void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 {
+	RunJitCode(frame);
+
 	while( true )
 	{
 		switch( frame->ip->opCode )
@@ -508,9 +798,9 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		case OC_Rotate2: // swap TOS and TOS1
 		{
 			int tos = int(mStack->size()) - 1;
-			Value value = mStack->at(tos - 1);
-			mStack->at(tos - 1) = mStack->at(tos);
-			mStack->at(tos) = value;
+			Value value = (*mStack)[tos - 1];
+			(*mStack)[tos - 1] = (*mStack)[tos];
+			(*mStack)[tos] = value;
 			++frame->ip;
 			break;
 		}
@@ -518,7 +808,7 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		case OC_MoveToTOS2: // copy TOS over TOS2 and pop TOS
 		{
 			int tos = int(mStack->size()) - 1;
-			mStack->at(tos - 2) = mStack->at(tos);
+			(*mStack)[tos - 2] = (*mStack)[tos];
 			mStack->pop_back();
 			++frame->ip;
 			break;
@@ -526,7 +816,7 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 
 		case OC_Duplicate: // make a copy of TOS and push it to the stack
 		{
-			mStack->push_back( mStack->back() );
+			mStack->push_back_reserved( mStack->back() );
 			++frame->ip;
 			break;
 		}
@@ -570,45 +860,47 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		}
 
 		case OC_LoadConstant: // A is the index in the constants vector
-			mStack->push_back( mConstants[ frame->ip->A ] );
+			mStack->push_back_reserved( mConstants[ frame->ip->A ] );
 			++frame->ip;
 			break;
 
 		case OC_LoadLocal: // A is the index in the function scope
-			mStack->push_back( frame->variables[ frame->ip->A ] );
+			mStack->push_back_reserved( frame->variables[ frame->ip->A ] );
 			++frame->ip;
 			break;
 
 		case OC_LoadGlobal: // A is the index in the global scope
 		{
 			unsigned index = unsigned(frame->ip->A);
-			mStack->push_back( index < frame->globals->size() ? frame->globals->at(index) : Value() );
+			mStack->push_back_reserved( index < frame->globals->size() ? (*frame->globals)[index] : Value() );
 			++frame->ip;
 			break;
 		}
 
 		case OC_LoadNative: // A is the index in the native functions
-			mStack->push_back( mNativeFunctions[ frame->ip->A ] );
+			mStack->push_back_reserved( mNativeFunctions[ frame->ip->A ] );
 			++frame->ip;
 			break;
 
 		case OC_LoadArgument: // A is the index in the arguments array
-			if( int(frame->anonymousParameters.elements.size()) > frame->ip->A )
-				mStack->push_back( frame->anonymousParameters.elements[ frame->ip->A ] );
+			if( frame->anonymousParameters && int(frame->anonymousParameters->elements.size()) > frame->ip->A )
+				mStack->push_back( frame->anonymousParameters->elements[ frame->ip->A ] );
 			else
 				mStack->emplace_back();
 			++frame->ip;
 			break;
 
 		case OC_LoadArgsArray: // load the current frame's arguments array
+			if( ! frame->anonymousParameters )
+				frame->anonymousParameters.reset( new Array() );
 			mStack->emplace_back();
 			mStack->back().type = Value::VT_Array;
-			mStack->back().array = &frame->anonymousParameters;
+			mStack->back().array = frame->anonymousParameters.get();
 			++frame->ip;
 			break;
 
 		case OC_LoadThis: // load the current frame's this object
-			mStack->emplace_back( frame->thisObject );
+			mStack->push_back_reserved( frame->thisObject );
 			++frame->ip;
 			break;
 
@@ -875,7 +1167,7 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		}
 
 		case OC_LoadHash: // H is the hash to load on the stack
-			mStack->emplace_back( frame->ip->H );
+			mStack->push_back_reserved( Value(frame->ip->H) );
 			++frame->ip;
 			break;
 
@@ -967,13 +1259,11 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 			{
 				IteratorImplementation* ii = mStack->back().iterator->implementation;
 				
-				mExecutionContext->lastObject = ii->thisObjectUsed;
-				
 				mStack->push_back( ii->hasNextFunction );
 				
 				if( mStack->back().type == Value::VT_NativeFunction )
 				{
-					CallNative(0);
+					CallNative(0, ii->thisObjectUsed);
 
 					if( HasError() )
 						return;
@@ -982,7 +1272,7 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 				}
 				else // normal function
 				{
-					Call(0);
+					Call(0, ii->thisObjectUsed);
 
 					++frame->ip;
 					return;
@@ -1002,13 +1292,11 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 			{
 				IteratorImplementation* ii = mStack->back().iterator->implementation;
 				
-				mExecutionContext->lastObject = ii->thisObjectUsed;
-				
 				mStack->push_back( ii->getNextFunction );
 				
 				if( mStack->back().type == Value::VT_NativeFunction )
 				{
-					CallNative(0);
+					CallNative(0, ii->thisObjectUsed);
 
 					if( HasError() )
 						return;
@@ -1017,7 +1305,7 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 				}
 				else // normal function
 				{
-					Call(0);
+					Call(0, ii->thisObjectUsed);
 
 					++frame->ip;
 					return;
@@ -1040,7 +1328,7 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		}
 
 		case OC_LoadFromBox: // load the value stored in the box at index A
-			mStack->emplace_back( frame->variables[ frame->ip->A ].box->value );
+			mStack->push_back_reserved( frame->variables[ frame->ip->A ].box->value );
 			++frame->ip;
 			break;
 
@@ -1077,14 +1365,14 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 
 			const std::vector<int>& closureMapping = newFunction->codeObject->closureMapping;
 
-			newFunction->freeVariables.reserve( closureMapping.size() );
+			Value* freeVariables = newFunction->FreeVariables();
 
 			for( int indexToBox : closureMapping )
 			{
 				if( indexToBox >= 0 )
-					newFunction->freeVariables.push_back( frame->variables[ indexToBox ].box );
+					*freeVariables++ = frame->variables[ indexToBox ];
 				else // from a free variable
-					newFunction->freeVariables.push_back( frame->function->freeVariables[ -indexToBox - 1 ] );
+					*freeVariables++ = frame->function->FreeVariables()[ -indexToBox - 1 ];
 			}
 
 			mStack->back() = Value(newFunction);
@@ -1094,13 +1382,18 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		}
 
 		case OC_LoadFromClosure: // load the value of the free variable inside the closure at index A
-			mStack->emplace_back( frame->function->freeVariables[ frame->ip->A ]->value );
+			mStack->push_back_reserved( frame->function->FreeVariables()[ frame->ip->A ].box->value );
+			++frame->ip;
+			break;
+
+		case OC_LoadCaptured: // load the free variable copied into the closure at index A
+			mStack->push_back_reserved( frame->function->FreeVariables()[ frame->ip->A ] );
 			++frame->ip;
 			break;
 
 		case OC_StoreToClosure: // A is the index of the free variable inside the closure
 		{
-			Box* box = frame->function->freeVariables[ frame->ip->A ];
+			Box* box = frame->function->FreeVariables()[ frame->ip->A ].box;
 			Value& newValue = mStack->back();
 
 			box->value = newValue;
@@ -1113,7 +1406,7 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 
 		case OC_PopStoreToClosure: // A is the index of the free variable inside the closure
 		{
-			Box* box = frame->function->freeVariables[ frame->ip->A ];
+			Box* box = frame->function->FreeVariables()[ frame->ip->A ].box;
 			Value& newValue = mStack->back();
 
 			box->value = newValue;
@@ -1126,8 +1419,30 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		}
 
 		case OC_Jump: // jump to A
-			frame->ip = &frame->instructions[ frame->ip->A ];
+		{
+			const Instruction* target = &frame->instructions[ frame->ip->A ];
+
+			// backward jumps close loops, they are safe points
+			if( target <= frame->ip )
+			{
+				if( ! SafePoint() )
+					return;
+
+				const int backEdge = int(frame->ip - frame->instructions);
+				frame->ip = target;
+
+				CountHotness(frame->function->codeObject);
+
+				if( mJitEnabled && Jit::IsTracing(*frame->function->codeObject, backEdge) )
+					mJit.RunLoop(*frame->function->codeObject, frame, backEdge, *mStack);
+
+				RunJitCode(frame);
+				break;
+			}
+
+			frame->ip = target;
 			break;
+		}
 
 		case OC_JumpIfFalse: // jump to A, if TOS is false
 			if( mStack->back().AsBool() )
@@ -1175,24 +1490,63 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 				return;
 			}
 
+			if( ! SafePoint() )
+				return;
+
 			if( mStack->back().type == Value::VT_NativeFunction )
 			{
-				CallNative( frame->ip->A );
+				ExecutionContext* context = mExecutionContext;
 
-				if( HasError() )
+				CallNative( frame->ip->A, mExecutionContext->lastObject );
+
+				if( HasError() || ! CheckHeapLimit() )
 					return;
 
 				++frame->ip;
+
+				if( mExecutionContext != context ) // the native suspended the coroutine
+					return;
+
+				RunJitCode(frame);
 			}
 			else // normal function
 			{
-				Call( frame->ip->A );
+				if( mRecordingProfile && frame->ip != frame->instructions && frame->ip[-1].opCode == OC_LoadGlobal )
+					mProfile.RecordCall(frame->function->codeObject, frame->ip[-1].A, mStack->back().function);
+
+				Call( frame->ip->A, mExecutionContext->lastObject );
 
 				++frame->ip;
 				return;
 			}
 			break;
 
+		case OC_CallMethod: // TOS is the object, the arguments are under it, A is the index of the call site
+		{
+			if( ! mStack->back().IsObject() )
+			{
+				SetError("Attempt to access a member of a non-object value");
+				return;
+			}
+
+			if( ! SafePoint() )
+				return;
+
+			ExecutionContext* context = mExecutionContext;
+
+			CallMethod( frame->function->codeObject->callSites[ frame->ip->A ] );
+
+			if( HasError() )
+				return;
+
+			++frame->ip;
+
+			// a normal function has a new frame, a native could have suspended the coroutine
+			if( mExecutionContext != context || &context->stackFrames.back() != frame )
+				return;
+			break;
+		}
+
 		case OC_Yield: // yield the value from TOS to the parent execution context
 		{
 			if( ! mExecutionContext->parent )
@@ -1215,6 +1569,9 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		}
 
 		case OC_EndFunction: // end function sentinel
+		{
+			Function* function = frame->function;
+
 			mExecutionContext->stackFrames.pop_back();
 
 			if( mExecutionContext->stackFrames.empty() )
@@ -1223,6 +1580,8 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 
 				if( mExecutionContext->parent )
 				{
+					ExecutionContext* finishedContext = mExecutionContext;
+
 					Value yieldValue = mStack->back();
 					mStack->pop_back();
 
@@ -1231,9 +1590,14 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 					mStack = &mExecutionContext->stack;
 
 					mStack->push_back(yieldValue);
+
+					// nothing can run in there anymore, let the next coroutine have it
+					if( function->executionContext == finishedContext )
+						mMemoryManager.FinishCoroutine(function);
 				}
 			}
 			return;
+		}
 
 		case OC_Add:
 		case OC_Subtract:
@@ -1250,6 +1614,12 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 		case OC_Greater:
 		case OC_LessEqual:
 		case OC_GreaterEqual:
+			if( mRecordingProfile && CheckedOpCode(frame->ip->opCode) != frame->ip->opCode )
+			{
+				const bool ints = (*mStack)[mStack->size() - 2].IsInt() && mStack->back().IsInt();
+				mProfile.RecordOperands(frame->function->codeObject, int(frame->ip - frame->instructions), ints);
+			}
+
 			if( ! DoBinaryOperation(frame->ip->opCode) )
 				return;
 
@@ -1330,6 +1700,97 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 			break;
 		}
 
+		// the compiler has made sure that both are ints
+		case OC_AddInt:
+		case OC_SubtractInt:
+		case OC_MultiplyInt:
+		{
+			const unsigned rhs = unsigned(mStack->back().integer);
+			mStack->pop_back();
+			const unsigned lhs = unsigned(mStack->back().integer);
+
+			if( frame->ip->opCode == OC_AddInt )
+				mStack->back().integer = int(lhs + rhs);
+			else if( frame->ip->opCode == OC_SubtractInt )
+				mStack->back().integer = int(lhs - rhs);
+			else
+				mStack->back().integer = int(lhs * rhs);
+
+			++frame->ip;
+			break;
+		}
+
+		case OC_EqualInt:
+		case OC_NotEqualInt:
+		case OC_LessInt:
+		case OC_GreaterInt:
+		case OC_LessEqualInt:
+		case OC_GreaterEqualInt:
+		{
+			const int rhs = mStack->back().integer;
+			mStack->pop_back();
+			const int lhs = mStack->back().integer;
+			bool result;
+
+			switch( frame->ip->opCode )
+			{
+			case OC_EqualInt:		result = lhs == rhs; break;
+			case OC_NotEqualInt:	result = lhs != rhs; break;
+			case OC_LessInt:		result = lhs <  rhs; break;
+			case OC_GreaterInt:		result = lhs >  rhs; break;
+			case OC_LessEqualInt:	result = lhs <= rhs; break;
+			default:				result = lhs >= rhs; break;
+			}
+
+			mStack->back() = Value(result);
+
+			++frame->ip;
+			break;
+		}
+
+		case OC_AddIntChecked:
+		case OC_SubtractIntChecked:
+		case OC_MultiplyIntChecked:
+		case OC_LessIntChecked:
+		case OC_GreaterIntChecked:
+		case OC_LessEqualIntChecked:
+		case OC_GreaterEqualIntChecked:
+		{
+			Value& lhs = (*mStack)[mStack->size() - 2];
+			const Value& rhs = mStack->back();
+
+			if( mRecordingProfile )
+				mProfile.RecordOperands(frame->function->codeObject, int(frame->ip - frame->instructions), lhs.IsInt() && rhs.IsInt());
+
+			if( ! lhs.IsInt() || ! rhs.IsInt() )
+			{
+				if( ! DoBinaryOperation(UntypedOpCode(frame->ip->opCode)) )
+					return;
+
+				++frame->ip;
+				break;
+			}
+
+			const int l = lhs.integer;
+			const int r = rhs.integer;
+
+			switch( frame->ip->opCode )
+			{
+			case OC_AddIntChecked:			lhs.integer = int(unsigned(l) + unsigned(r)); break;
+			case OC_SubtractIntChecked:		lhs.integer = int(unsigned(l) - unsigned(r)); break;
+			case OC_MultiplyIntChecked:		lhs.integer = int(unsigned(l) * unsigned(r)); break;
+			case OC_LessIntChecked:			lhs = Value(l <  r); break;
+			case OC_GreaterIntChecked:		lhs = Value(l >  r); break;
+			case OC_LessEqualIntChecked:	lhs = Value(l <= r); break;
+			default:						lhs = Value(l >= r); break;
+			}
+
+			mStack->pop_back();
+
+			++frame->ip;
+			break;
+		}
+
 		default:
 			SetError("Invalid OpCode!");
 			return;
@@ -1337,19 +1798,84 @@ void VirtualMachine::RunCodeForFrame(StackFrame* frame)
 	}
 }
 
-void VirtualMachine::Call(int argumentsCount)
+void VirtualMachine::CallMethod(const CallSite& callSite)
+{
+	Value object = mStack->back();
+	Object* receiver = object.object;
+
+	// most methods are in the proto of the receiver, where this
+	// call site found it the last time, unless the receiver has its own
+	Object::Member member(callSite.hash);
+
+	auto it = std::lower_bound(receiver->members.begin(), receiver->members.end(), member);
+
+	if( it != receiver->members.end() && it->hash == callSite.hash )
+	{
+		mStack->back() = it->value;
+	}
+	else
+	{
+		const Value& proto = receiver->members[0].value;
+
+		if( proto.type == Value::VT_Object &&
+			proto.object == callSite.holder &&
+			callSite.index < proto.object->members.size() &&
+			proto.object->members[callSite.index].hash == callSite.hash )
+		{
+			mStack->back() = proto.object->members[callSite.index].value;
+		}
+		else
+		{
+			mStack->back() = Value();
+			LoadMemberFromObject(receiver, callSite.hash, &mStack->back());
+
+			if( proto.type == Value::VT_Object && proto.object != receiver )
+			{
+				const std::vector<Object::Member>& members = proto.object->members;
+
+				auto found = std::lower_bound(members.begin(), members.end(), member);
+
+				if( found != members.end() && found->hash == callSite.hash )
+				{
+					callSite.holder	= proto.object;
+					callSite.index	= unsigned(found - members.begin());
+				}
+			}
+		}
+	}
+
+	if( ! mStack->back().IsFunction() )
+	{
+		SetError("Attempt to call a non-function value");
+		return;
+	}
+
+	if( mStack->back().type == Value::VT_NativeFunction )
+	{
+		CallNative( callSite.argumentsCount, object );
+
+		CheckHeapLimit();
+	}
+	else // normal function
+	{
+		Call( callSite.argumentsCount, object );
+	}
+}
+
+void VirtualMachine::Call(int argumentsCount, const Value& thisObject)
 {
 	Function* function = mStack->back().function;
 	mStack->pop_back();
 
-	std::vector<Value>* sourceStack = mStack;
+	ValueStack* sourceStack = mStack;
 
 	if( function->executionContext )
 	{
-		function->executionContext->parent = mExecutionContext;
-		
 		if( function->executionContext->state == ExecutionContext::CRS_Started )
 		{
+			function->executionContext->parent = mExecutionContext;
+
+
 			Value valueToSend;
 
 			if( argumentsCount == 1 )
@@ -1383,6 +1909,8 @@ void VirtualMachine::Call(int argumentsCount)
 		}
 		if( function->executionContext->state == ExecutionContext::CRS_NotStarted )
 		{
+			function->executionContext->parent = mExecutionContext;
+
 			// we will extract the arguments from the stack of the old context
 			sourceStack = mStack;
 
@@ -1395,6 +1923,8 @@ void VirtualMachine::Call(int argumentsCount)
 
 	const CodeObject* codeObject = function->codeObject;
 
+	CountHotness(codeObject);
+
 	// create a new stack frame ////////////////////////////////////////////////
 	mExecutionContext->stackFrames.emplace_back();
 	StackFrame* newFrame = &mExecutionContext->stackFrames.back();
@@ -1402,7 +1932,7 @@ void VirtualMachine::Call(int argumentsCount)
 	newFrame->function		= function;
 	newFrame->instructions	= codeObject->instructions.data();
 	newFrame->ip			= newFrame->instructions;
-	newFrame->thisObject	= mExecutionContext->lastObject;
+	newFrame->thisObject	= thisObject;
 	newFrame->globals		= &codeObject->module->globals;
 	
 	newFrame->variables.resize( codeObject->localVariablesCount );
@@ -1416,16 +1946,23 @@ void VirtualMachine::Call(int argumentsCount)
 	}
 	else // we have some anonymous arguments
 	{
-		newFrame->anonymousParameters.elements.resize( anonymousCount );
-
 		std::copy(sourceStack->end() - argumentsCount, sourceStack->end() - anonymousCount, newFrame->variables.begin());
-		std::copy(sourceStack->end() - anonymousCount, sourceStack->end(), newFrame->anonymousParameters.elements.begin());
+
+		// nothing can get to them otherwise
+		if( codeObject->usesArguments )
+		{
+			newFrame->anonymousParameters.reset( new Array() );
+			newFrame->anonymousParameters->elements.assign(sourceStack->end() - anonymousCount, sourceStack->end());
+		}
 	}
 
 	sourceStack->resize(sourceStack->size() - argumentsCount);
+
+	// the instructions that load values push them without checking for room
+	mStack->reserve(mStack->size() + codeObject->maxStackDepth);
 }
 
-void VirtualMachine::CallNative(int argumentsCount)
+void VirtualMachine::CallNative(int argumentsCount, const Value& thisObject)
 {
 	Value::NativeFunction function = mStack->back().nativeFunction;
 	mStack->pop_back();
@@ -1439,15 +1976,167 @@ void VirtualMachine::CallNative(int argumentsCount)
 		mStack->pop_back();
 	}
 	
-	Value result = function(*this, mExecutionContext->lastObject, arguments);
+	// only a native called right from the bytecode of a coroutine can suspend it
+	bool couldYield = mNativeCanYield;
+	mNativeCanYield = mExecutionContext->parent != nullptr;
+
+	Value result = CallNativeFunction(function, thisObject, arguments);
+
+	mNativeCanYield = couldYield;
+
+	if( mNativeYielding ) // the value sent on resume becomes the result
+	{
+		mNativeYielding = false;
+
+		// switch context
+		mExecutionContext = mExecutionContext->parent;
+		mStack = &mExecutionContext->stack;
+
+		mStack->emplace_back();
+		return;
+	}
 
 	mStack->push_back(result);
 }
 
+Value VirtualMachine::CallNativeFunction(Value::NativeFunction function, const Value& thisObject, const std::vector<Value>& args)
+{
+	// everything the native function gets or creates stays alive until it returns
+	size_t temporaryRoots = mMemoryManager.GetTemporaryRootsCount();
+	bool calledFromNativeCode = mMemoryManager.IsInNativeCode();
+
+	mMemoryManager.SetInNativeCode(true);
+	mMemoryManager.AddTemporaryRoot(thisObject);
+
+	for( const Value& argument : args )
+		mMemoryManager.AddTemporaryRoot(argument);
+
+	Value result = function(*this, thisObject, args);
+
+	mMemoryManager.RemoveTemporaryRoots(temporaryRoots);
+	mMemoryManager.SetInNativeCode(calledFromNativeCode);
+
+	// natives fill their containers directly, the new ones and the ones they
+	// were given, account for that before anything reads the peak
+	if( result.IsGarbageCollected() )
+		mMemoryManager.UpdateSize(result.garbageCollected);
+
+	for( const Value& argument : args )
+		if( argument.IsGarbageCollected() )
+			mMemoryManager.UpdateSize(argument.garbageCollected);
+
+	if( calledFromNativeCode )
+		mMemoryManager.AddTemporaryRoot(result);
+
+	return result;
+}
+
+void VirtualMachine::CountHotness(const CodeObject* codeObject)
+{
+	if( mRecordingProfile )
+		mProfile.CountHotness(codeObject);
+
+	// compiled when it gets hot, and again if the jit has dropped the code since
+	if( mJitEnabled && ! (codeObject->jitCode && codeObject->jitCode->memory) && ++codeObject->hotness == Jit::HotnessThreshold )
+		mJit.Compile(*codeObject);
+}
+
+void VirtualMachine::RunJitCode(StackFrame* frame)
+{
+	const JitCode* code = frame->function->codeObject->jitCode;
+
+	// it returns here at the first instruction it cannot do itself
+	if( code && (code->memory || code->translation) )
+		mJit.Run(*code, frame, *mStack);
+}
+
+bool VirtualMachine::SafePoint()
+{
+	// a single relaxed load when there are no budgets, limits or interrupts
+	return ! mSafePointRequested.load(std::memory_order_relaxed) || HandleSafePoint();
+}
+
+bool VirtualMachine::HandleSafePoint()
+{
+	// The request is cleared before the interrupt flag is consumed, so an
+	// interrupt that arrives in between raises the request again.
+	UpdateSafePointRequest();
+
+	if( ! CheckHeapLimit() )
+		return false;
+
+	const char* reason = nullptr;
+	bool interrupted = mInterruptRequested.exchange(false);
+
+	if( interrupted )
+		reason = "Execution interrupted";
+	else if( mStepBudget > 0 && --mStepsLeft < 0 )
+		reason = "Execution step budget exhausted";
+	else if( mTimeBudget.count() > 0 && std::chrono::steady_clock::now() >= mDeadline )
+		reason = "Execution time budget exhausted";
+
+	if( ! reason )
+		return true;
+
+	if( mPreemptionMode == PM_Abort )
+	{
+		SetError(reason);
+		return false;
+	}
+
+	if( mRunCodeDepth > 1 ) // a native function is running, try again later
+	{
+		if( interrupted )
+			RequestInterrupt();
+
+		return true;
+	}
+
+	mSuspending = true;
+	return false;
+}
+
+void VirtualMachine::StartBudget()
+{
+	mStepsLeft = mStepBudget;
+	mDeadline = std::chrono::steady_clock::now() + mTimeBudget;
+
+	UpdateSafePointRequest();
+}
+
+void VirtualMachine::UpdateSafePointRequest()
+{
+	// budgets and the heap limit need to see every safe point, and a pending
+	// interrupt must not be dropped when a budget is changed or restarted
+	mSafePointRequested = mStepBudget > 0 || mTimeBudget.count() > 0 || mMemoryManager.GetHeapLimit() > 0 ||
+						  mInterruptRequested.load();
+}
+
+bool VirtualMachine::CheckHeapLimit()
+{
+	if( ! mMemoryManager.IsOverHeapLimit() )
+		return true;
+
+	mMemoryManager.FullGarbageCollect();
+
+	if( mMemoryManager.IsOverHeapLimit() )
+	{
+		SetError("Out of memory: the heap limit of " + std::to_string(mMemoryManager.GetHeapLimit()) + " bytes was exceeded");
+		return false;
+	}
+
+	return true;
+}
+
 void VirtualMachine::PushElementToArray(Array* array, const Value& newValue)
 {
+	size_t capacity = array->elements.capacity();
+
 	array->elements.push_back(newValue);
 
+	if( array->elements.capacity() != capacity )
+		mMemoryManager.UpdateSize(array);
+
 	mMemoryManager.UpdateGcRelationship(array, newValue);
 }
 
@@ -1564,7 +2253,14 @@ void VirtualMachine::StoreMemberInObject(Object* object, unsigned hash, const Va
 		}
 
 		if( ! found ) // create a new one
+		{
+			size_t capacity = object->members.capacity();
+
 			object->members.insert(it, Object::Member(hash, newValue));
+
+			if( object->members.capacity() != capacity )
+				mMemoryManager.UpdateSize(object);
+		}
 	}
 	else // found the value corresponding to this hash
 	{
@@ -1577,8 +2273,8 @@ void VirtualMachine::StoreMemberInObject(Object* object, unsigned hash, const Va
 bool VirtualMachine::DoBinaryOperation(int opCode)
 {
 	unsigned last = mStack->size() - 1;
-	Value& lhs = mStack->at(last - 1);
-	Value& rhs = mStack->at(last);
+	Value& lhs = (*mStack)[last - 1];
+	Value& rhs = (*mStack)[last];
 	Value result;
 
 	switch( opCode )
@@ -1669,6 +2365,7 @@ bool VirtualMachine::DoBinaryOperation(int opCode)
 				if( rhs.AsFloat() == 0 )
 				{
 					SetError("Division by 0");
+					return false;
 				}
 				else if( lhs.IsFloat() || rhs.IsFloat() )
 					result = Value( lhs.AsFloat() / rhs.AsFloat() );
@@ -1882,14 +2579,19 @@ void VirtualMachine::LogStackTraceStartingFrom(const StackFrame* frame)
 	using namespace std::string_literals;
 	
 	int line = -1;
+	int calledFrom = 0;
 	std::string oldFilename;
 	std::string newFilename;
-	LocationFromFrame(frame, &line, &oldFilename);
+	LocationFromFrame(frame, &line, &oldFilename, &calledFrom);
 
 	mLogger.PushError(line, mErrorMessage);
 
 	mErrorMessage = "called from here";
 
+	// an inlined function has no frame, the call to it is in the same one
+	if( calledFrom != 0 )
+		mLogger.PushError(calledFrom, mErrorMessage);
+
 	if( mExecutionContext )
 	{
 		mExecutionContext->stackFrames.pop_back();
@@ -1898,7 +2600,7 @@ void VirtualMachine::LogStackTraceStartingFrom(const StackFrame* frame)
 
 		while( currentContext )
 		{
-			std::deque<StackFrame>& stackFrames = currentContext->stackFrames;
+			StackFrames& stackFrames = currentContext->stackFrames;
 
 			while( ! stackFrames.empty() )
 			{
@@ -1920,42 +2622,112 @@ void VirtualMachine::LogStackTraceStartingFrom(const StackFrame* frame)
 	}
 }
 
-void VirtualMachine::LocationFromFrame(const StackFrame* frame, int* currentLine, std::string* currentFile) const
+const StackFrame* VirtualMachine::GetCurrentFrame() const
+{
+	if( ! mExecutionContext || mExecutionContext->stackFrames.empty() )
+		return nullptr;
+
+	return &mExecutionContext->stackFrames.back();
+}
+
+void VirtualMachine::LocationFromFrame(const StackFrame* frame, int* currentLine, std::string* currentFile, int* calledFrom) const
 {
 	const CodeObject* codeObject = frame->function->codeObject;
 	
 	*currentLine = -1;
 	*currentFile = codeObject->module->filename;
 	
+	if( calledFrom )
+		*calledFrom = 0;
+	
 	const auto& lines = codeObject->instructionLines;
 
 	if( lines.empty() )
 		return;
 
-	if( lines.size() == 1 )
-	{
-		*currentLine = lines.back().line;
-		return;
-	}
-	
 	int instructionIndex = frame->ip - codeObject->instructions.data();
 
-	int lineIndex = -1;
+	// with one line, all of it is on that line
+	const SourceCodeLine* found = lines.size() == 1 ? &lines.back() : nullptr;
 
 	for( const SourceCodeLine& line : lines )
 	{
-		if( instructionIndex >= line.instructionIndex )
-		{
-			lineIndex = line.line;
-		}
-		else
-		{
-			*currentLine = lineIndex;
-			return;
-		}
+		if( found == &lines.back() || instructionIndex < line.instructionIndex )
+			break;
+
+		found = &line;
 	}
 
-	*currentLine = lineIndex;
+	if( ! found )
+		return;
+
+	*currentLine = found->line;
+
+	if( calledFrom )
+		*calledFrom = found->calledFrom;
+}
+
+Value VirtualMachine::GetConstant(int index) const
+{
+	if( index < 0 || index >= int(mConstants.size()) )
+		return Value();
+
+	return mConstants[index];
+}
+
+Value VirtualMachine::GetNativeFunction(int index) const
+{
+	if( index < 0 || index >= int(mNativeFunctions.size()) )
+		return Value();
+
+	return Value( mNativeFunctions[index] );
+}
+
+bool VirtualMachine::CanSuspendCoroutine(const Function* coroutine) const
+{
+	return mNativeCanYield && ! mNativeYielding && mExecutionContext == coroutine->executionContext;
+}
+
+void VirtualMachine::SuspendCoroutine()
+{
+	mNativeYielding = true;
+}
+
+EventLoop& VirtualMachine::GetEventLoop()
+{
+	return mEventLoop;
+}
+
+CodeObject* VirtualMachine::AddCodeObject(CodeObject&& codeObject)
+{
+	mConstantCodeObjects.emplace_back( std::move(codeObject) );
+
+	return &mConstantCodeObjects.back();
+}
+
+void VirtualMachine::SetJitEnabled(bool enabled)
+{
+	mJitEnabled = enabled;
+	mJit.SetTracing(enabled);
+}
+
+void VirtualMachine::RecordProfile(bool record)
+{
+	mRecordingProfile = record;
+}
+
+bool VirtualMachine::SaveProfile(const std::string& filename) const
+{
+	return mProfile.Save(filename, mConstants);
+}
+
+bool VirtualMachine::LoadProfile(const std::string& filename)
+{
+	if( ! mProfile.Load(filename) )
+		return false;
+
+	mCompiler.SetProfile(&mProfile);
+	return true;
 }
 
 }
@@ -1,30 +1,52 @@
 #ifndef _VIRTUAL_MACHINE_INCLUDED_
 #define _VIRTUAL_MACHINE_INCLUDED_
 
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <unordered_map>
 
 #include "Logger.h"
 #include "Parser.h"
 #include "SemanticAnalyzer.h"
+#include "Optimizer.h"
 #include "Compiler.h"
 #include "FileManager.h"
 #include "MemoryManager.h"
+#include "AllocationProfiler.h"
+#include "ExecutionProfile.h"
+#include "WorkerPool.h"
+#include "EventLoop.h"
+#include "Jit.h"
 
 namespace element
 {
 
 class VirtualMachine
 {
+public:
+	// what happens when a budget runs out or an interrupt is requested
+	enum PreemptionMode : char
+	{
+		PM_Abort	= 0, // stop with a runtime error
+		PM_Suspend	= 1, // keep the execution state so it can be resumed later
+	};
+
 public:				VirtualMachine();
+					~VirtualMachine();
 	
 	void			ResetState();
 
 	Value			Interpret(std::istream& input);
 	Value			Interpret(const std::string& filename);
+	Value			Interpret(const Value& function, const std::vector<Value>& args);
+	
+	// compiles the file without running it and writes its C++ translation
+	Value			EmitCpp(const std::string& filename, std::ostream& output);
 	
 	FileManager&	GetFileManager();
 	MemoryManager&	GetMemoryManager();
+	AllocationProfiler& GetAllocationProfiler();
 
 	void			SetError(const std::string& errorMessage);
 	bool			HasError() const;
@@ -53,6 +75,60 @@ public:				VirtualMachine();
 	Value			CallMemberFunction(const Value& object, unsigned functionHash, const std::vector<Value>& args);
 	Value			CallMemberFunction(const Value& object, const Value& function, const std::vector<Value>& args);
 
+	// preemption //////////////////////////////////////////////////////////////
+	// Budgets are checked at safe points (backward jumps and function calls)
+	// and apply to each call to Interpret or Resume separately. A step is one
+	// pass through a safe point, so a step budget bounds the loop iterations
+	// and calls a script can make. A suspension waits until no native function
+	// is running, since their C++ stack frames cannot be kept.
+	void			SetStepBudget(long long steps); // 0 means no budget
+	void			SetTimeBudget(std::chrono::microseconds time); // 0 means no budget
+	void			SetPreemptionMode(PreemptionMode mode);
+	void			SetHeapLimit(size_t bytes); // 0 means no limit, checked at safe points and after native calls
+	void			RequestInterrupt(); // can be called from any thread
+
+	// A suspended script can be resumed after the host changed its objects,
+	// the members a loop loads only once before it starts are loaded again.
+	bool			IsSuspended() const;
+	Value			Resume();
+
+	// workers /////////////////////////////////////////////////////////////////
+	int				AddWorker(const std::shared_ptr<Worker>& worker); // returns a handle
+	Worker*			GetWorker(int handle) const;
+	void			RemoveWorker(int handle); // once joined, the handle is reused
+	bool			IsJoinedWorker(int handle) const; // and not reused yet
+	Worker*			GetCurrentWorker() const; // the worker this virtual machine runs for
+	void			SetCurrentWorker(Worker* worker);
+	void			StopWorkers();
+
+	// coroutines //////////////////////////////////////////////////////////////
+	// A native function called by the bytecode of a coroutine can suspend it,
+	// as if it yielded nil. Whatever the coroutine is resumed with becomes the
+	// result of the native function call.
+	bool			CanSuspendCoroutine(const Function* coroutine) const;
+	void			SuspendCoroutine(); // takes effect when the native returns
+	EventLoop&		GetEventLoop();
+
+	// introspection ///////////////////////////////////////////////////////////
+	const StackFrame* GetCurrentFrame() const;
+	void			LocationFromFrame(const StackFrame* frame, int* currentLine, std::string* currentFile, int* calledFrom = nullptr) const;
+
+	// code ////////////////////////////////////////////////////////////////////
+	Value			GetConstant(int index) const;
+	Value			GetNativeFunction(int index) const;
+	CodeObject*		AddCodeObject(CodeObject&& codeObject); // lives as long as the virtual machine
+	void			SetJitEnabled(bool enabled); // hot code is compiled to machine code, where available
+
+	// profile-guided compilation //////////////////////////////////////////////
+	// A profile records how hot each function gets, which functions are
+	// called from each global and which binary operations get only ints.
+	// After one is loaded, the modules compiled by the virtual machine inline
+	// the calls that went to one small function, compile the functions that
+	// got hot on their first call and check for ints first in those operations.
+	void			RecordProfile(bool record);
+	bool			SaveProfile(const std::string& filename) const;
+	bool			LoadProfile(const std::string& filename);
+
 protected:
 	Value			ExecuteBytecode(const char* bytecode, Module& forModule);
 	int				ParseBytecode(const char* bytecode, Module& forModule);
@@ -60,10 +136,22 @@ protected:
 	Value			CallFunction_Common(const Value& thisObject, const Value& function, const std::vector<Value>& args);
 
 	Value			RunCode();
+	Value			RunRootContext(ExecutionContext* rootContext, ExecutionContext* returnContext);
 	void			RunCodeForFrame(StackFrame* frame);
+	void			CountHotness(const CodeObject* codeObject);
+	void			RunJitCode(StackFrame* frame);
 
-	void			Call(int argumentsCount);
-	void			CallNative(int argumentsCount);
+	bool			SafePoint();
+	bool			HandleSafePoint();
+	void			StartBudget();
+	void			UpdateSafePointRequest();
+
+	void			Call(int argumentsCount, const Value& thisObject);
+	void			CallNative(int argumentsCount, const Value& thisObject);
+	void			CallMethod(const CallSite& callSite);
+	Value			CallNativeFunction(Value::NativeFunction function, const Value& thisObject, const std::vector<Value>& args);
+
+	bool			CheckHeapLimit();
 
 	void			PushElementToArray(Array* array, const Value& newValue);
 	bool			PopElementFromArray(Array* array, Value* outValue);
@@ -78,15 +166,16 @@ protected:
 	void			RegisterStandardUtilities();
 	
 	void			LogStackTraceStartingFrom(const StackFrame* frame);
-	void			LocationFromFrame(const StackFrame* frame, int* currentLine, std::string* currentFile) const;
 
 private:
 	Logger										mLogger;
 	Parser										mParser;
 	SemanticAnalyzer							mSemanticAnalyzer;
+	Optimizer									mOptimizer;
 	Compiler									mCompiler;
 	FileManager									mFileManager;
 	MemoryManager								mMemoryManager;
+	AllocationProfiler							mAllocationProfiler;
 
 	std::vector<Value>							mConstants; // this is the common access point for the 3 deques below
 	std::deque<String>							mConstantStrings;
@@ -97,9 +186,34 @@ private:
 	std::unordered_map<unsigned, std::string>	mSymbolNames;
 
 	ExecutionContext*							mExecutionContext;
-	std::vector<Value>*							mStack;
+	ValueStack*									mStack;
 	
 	std::string									mErrorMessage;
+
+	std::atomic<bool>							mSafePointRequested;
+	std::atomic<bool>							mInterruptRequested;
+	PreemptionMode								mPreemptionMode;
+	long long									mStepBudget;
+	long long									mStepsLeft;
+	std::chrono::microseconds					mTimeBudget;
+	std::chrono::steady_clock::time_point		mDeadline;
+	unsigned									mRunCodeDepth;
+	bool										mSuspending;
+	ExecutionContext*							mSuspendedContext;
+	ExecutionContext*							mSuspendedRootContext;
+
+	std::vector<std::shared_ptr<Worker>>		mWorkers;
+	Worker*										mCurrentWorker;
+
+	bool										mNativeCanYield;
+	bool										mNativeYielding;
+	EventLoop									mEventLoop;
+
+	Jit											mJit;
+	bool										mJitEnabled;
+
+	ExecutionProfile							mProfile;
+	bool										mRecordingProfile;
 };
 
 }
@@ -0,0 +1,249 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+#include "VirtualMachine.h"
+
+namespace element
+{
+
+Worker::Worker(const std::string& module, const std::string& entry)
+: mModule(module)
+, mEntry(entry)
+, mHeapLimit(0)
+, mVirtualMachine(nullptr)
+, mStopRequested(false)
+, mFinished(false)
+{
+}
+
+Worker::Worker(Message&& function)
+: mFunction(std::move(function))
+, mHeapLimit(0)
+, mVirtualMachine(nullptr)
+, mStopRequested(false)
+, mFinished(false)
+{
+}
+
+void Worker::SetSearchPaths(const std::vector<std::string>& searchPaths)
+{
+	mSearchPaths = searchPaths;
+}
+
+void Worker::SetHeapLimit(size_t heapLimit)
+{
+	mHeapLimit = heapLimit;
+}
+
+void Worker::SetArguments(std::vector<Message>&& arguments)
+{
+	mArguments = std::move(arguments);
+}
+
+MessageQueue& Worker::GetInbox()
+{
+	return mInbox;
+}
+
+MessageQueue& Worker::GetOutbox()
+{
+	return mOutbox;
+}
+
+void Worker::Run()
+{
+	VirtualMachine vm;
+
+	for( const std::string& searchPath : mSearchPaths )
+		vm.GetFileManager().AddSearchPath(searchPath);
+
+	vm.GetMemoryManager().SetHeapLimit(mHeapLimit);
+	vm.SetCurrentWorker(this);
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mVirtualMachine = &vm;
+
+		if( mStopRequested )
+			vm.RequestInterrupt();
+	}
+
+	MemoryManager& memoryManager = vm.GetMemoryManager();
+
+	// keep the copied values alive until they are on the stack
+	memoryManager.SetInNativeCode(true);
+
+	Value function;
+	Value result;
+
+	if( mModule.empty() )
+	{
+		function = mFunction.ToValue(vm);
+	}
+	else
+	{
+		result = vm.Interpret(mModule);
+
+		if( ! result.IsError() )
+		{
+			function = result.IsObject() ? vm.GetMember(result, mEntry) : Value();
+
+			if( ! function.IsFunction() )
+				result = memoryManager.NewError("module '" + mModule + "' has no function '" + mEntry + "'");
+		}
+	}
+
+	if( function.IsFunction() )
+	{
+		std::vector<Value> arguments;
+
+		for( const Message& argument : mArguments )
+			arguments.push_back( argument.ToValue(vm) );
+
+		result = vm.Interpret(function, arguments);
+	}
+
+	memoryManager.RemoveTemporaryRoots(0);
+	memoryManager.SetInNativeCode(false);
+
+	Message resultMessage;
+	std::string error;
+
+	if( ! resultMessage.FromValue(vm, result, &error) )
+		resultMessage.FromValue(vm, vm.GetMemoryManager().NewError(error), &error);
+
+	mOutbox.Close();
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mVirtualMachine = nullptr;
+		mResult = std::move(resultMessage);
+		mFinished = true;
+	}
+
+	mFinishedCondition.notify_all();
+}
+
+void Worker::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mStopRequested = true;
+
+		if( mVirtualMachine )
+			mVirtualMachine->RequestInterrupt();
+	}
+
+	mInbox.Close();
+}
+
+Message Worker::Join()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	mFinishedCondition.wait(lock, [this] { return mFinished; });
+
+	return mResult;
+}
+
+
+WorkerPool& WorkerPool::GetInstance()
+{
+	static WorkerPool instance;
+	return instance;
+}
+
+WorkerPool::WorkerPool()
+: mStopping(false)
+{
+	unsigned threadsCount = std::max(1u, std::thread::hardware_concurrency());
+
+	mIdleThreadsCount = threadsCount;
+
+	for( unsigned i = 0; i < threadsCount; ++i )
+		mThreads.emplace_back(&WorkerPool::ThreadMain, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mStopping = true;
+
+		// nobody is left to wait for these, let them finish quickly
+		for( const std::shared_ptr<Worker>& worker : mQueue )
+			worker->Stop();
+	}
+
+	mCondition.notify_all();
+
+	for( std::thread& thread : mThreads )
+		thread.join();
+}
+
+void WorkerPool::Start(const std::shared_ptr<Worker>& worker)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQueue.push_back(worker);
+	}
+
+	mCondition.notify_one();
+}
+
+bool WorkerPool::TryStart(const std::shared_ptr<Worker>& worker)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		// the queued workers take the free threads first
+		if( mIdleThreadsCount <= mQueue.size() )
+			return false;
+
+		mQueue.push_back(worker);
+	}
+
+	mCondition.notify_one();
+	return true;
+}
+
+unsigned WorkerPool::GetThreadsCount() const
+{
+	return unsigned(mThreads.size());
+}
+
+void WorkerPool::ThreadMain()
+{
+	while( true )
+	{
+		std::shared_ptr<Worker> worker;
+
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+
+			mCondition.wait(lock, [this] { return ! mQueue.empty() || mStopping; });
+
+			if( mQueue.empty() ) // and stopping
+				return;
+
+			worker = std::move( mQueue.front() );
+			mQueue.pop_front();
+
+			--mIdleThreadsCount;
+		}
+
+		worker->Run();
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			++mIdleThreadsCount;
+		}
+	}
+}
+
+}
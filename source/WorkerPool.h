@@ -0,0 +1,89 @@
+#ifndef _WORKER_POOL_INCLUDED_
+#define _WORKER_POOL_INCLUDED_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Message.h"
+
+namespace element
+{
+
+class VirtualMachine;
+
+
+// A module function (or a copied function) running in a virtual machine of
+// its own on one of the threads of the worker pool. The parent and the worker
+// share nothing but this object, values go back and forth as copies.
+class Worker
+{
+public:
+	Worker(const std::string& module, const std::string& entry);
+	explicit Worker(Message&& function);
+
+	void		SetSearchPaths(const std::vector<std::string>& searchPaths);
+	void		SetHeapLimit(size_t heapLimit);
+	void		SetArguments(std::vector<Message>&& arguments);
+
+	MessageQueue&	GetInbox();		// parent to worker
+	MessageQueue&	GetOutbox();	// worker to parent
+
+	void		Run();
+	void		Stop(); // close the inbox and interrupt the script
+	Message		Join();
+
+private:
+	std::string					mModule;
+	std::string					mEntry;
+	Message						mFunction; // used when there is no module
+	std::vector<std::string>	mSearchPaths;
+	size_t						mHeapLimit;
+	std::vector<Message>		mArguments;
+
+	MessageQueue				mInbox;
+	MessageQueue				mOutbox;
+
+	std::mutex					mMutex;
+	std::condition_variable		mFinishedCondition;
+	VirtualMachine*				mVirtualMachine; // only while running
+	bool						mStopRequested;
+	bool						mFinished;
+	Message						mResult;
+};
+
+
+// A fixed number of threads, shared by every virtual machine in the process,
+// that run workers in the order they were started. A worker keeps its thread
+// until its entry function returns.
+class WorkerPool
+{
+public:
+	static WorkerPool&	GetInstance();
+
+	void		Start(const std::shared_ptr<Worker>& worker);
+	bool		TryStart(const std::shared_ptr<Worker>& worker); // only if a thread is free for it now
+	unsigned	GetThreadsCount() const;
+
+private:
+				WorkerPool();
+				~WorkerPool();
+
+	void		ThreadMain();
+
+private:
+	std::vector<std::thread>				mThreads;
+	std::mutex								mMutex;
+	std::condition_variable					mCondition;
+	std::deque<std::shared_ptr<Worker>>		mQueue;
+	size_t									mIdleThreadsCount;
+	bool									mStopping;
+};
+
+}
+
+#endif // _WORKER_POOL_INCLUDED_
@@ -2,35 +2,65 @@
 #include <fstream>
 #include <sstream>
 #include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <string>
 
 #include "VirtualMachine.h"
 #include "AST.h"
 #include "Native.h"
 
-int InterpretFile(const char* fileString);
-int InterpretREPL();
-int InterpretTests(const char* fileString);
-void DebugPrintFile(const char* fileString, bool ast, bool symbols, bool constants);
+struct Options
+{
+	unsigned allocationSampleInterval = 0; // zero leaves the allocation profiler off
+	size_t heapLimit = 0; // in bytes, zero means no limit
+	bool jit = true;
+	std::string recordProfile; // the file to write the profile of the run to
+	std::string useProfile; // the file of the profile of an earlier run
+};
+
+int InterpretFile(const char* fileString, const Options& options);
+int InterpretREPL(const Options& options);
+int InterpretTests(const char* fileString, const Options& options);
+int EmitCpp(const char* fileString);
+void DebugPrintFile(const char* fileString, bool ast, bool symbols, bool constants, const Options& options);
+void ConfigureVirtualMachine(element::VirtualMachine& virtualMachine, const Options& options);
+void PrintReports(element::VirtualMachine& virtualMachine, const Options& options);
+void InterruptOnSignal(int signal);
+
+element::VirtualMachine* interruptibleMachine = nullptr;
 
 
 int main(int argc, char** argv)
 {
 	const char* h0 = "usage: element [ OPTIONS ] ... [ FILE ]\n";
 	const char* h1 = "OPTIONS:\n";
-	const char* h2 = "-h -? --help  : print this help\n";
-	const char* h3 = "-v --version  : print the interpreter version\n";
-	const char* h4 = "-t --test     : run in testing mode to execute unit tests\n";
-	const char* h5 = "-da           : debug print the Abstract Syntax Tree\n";
-	const char* h6 = "-ds           : debug print the generated symbols\n";
-	const char* h7 = "-dc           : debug print the constants\n";
-	const char* h8 = "-dr           : run the file after debug printing\n";
+	const char* h2 = "-h -? --help               : print this help\n";
+	const char* h3 = "-v --version               : print the interpreter version\n";
+	const char* h4 = "-t --test                  : run in testing mode to execute unit tests\n";
+	const char* h5 = "-da                        : debug print the Abstract Syntax Tree\n";
+	const char* h6 = "-ds                        : debug print the generated symbols\n";
+	const char* h7 = "-dc                        : debug print the constants\n";
+	const char* h8 = "-dr                        : run the file after debug printing\n";
+	const char* h9 = "--profile-allocations[=N]  : report allocations by source line, sampling every N bytes\n";
+	const char* h10= "--heap-limit=N[k|m|g]      : fail with an out of memory error when the heap grows over N bytes,\n"
+					 "                             checked at safe points and after each native call, so one call\n"
+					 "                             that builds a large array or string can go past it\n";
+	const char* h11= "--no-jit                   : never compile hot code to machine code, only the translations\n"
+					 "                             built into the interpreter with --emit-cpp still run natively\n";
+	const char* h12= "--emit-cpp                 : print the C++ translation of the file, to build into the interpreter\n";
+	const char* h13= "--record-profile=FILE      : write what the run shows about the code to FILE, for --use-profile\n";
+	const char* h14= "--use-profile=FILE         : compile with the profile of an earlier run, recorded to FILE\n";
 
 	bool testMode = false;
+	bool emitCpp = false;
 	bool printAst = false;
 	bool printSymbols = false;
 	bool printConstants = false;
 	bool runAfterPrinting = false;
 	
+	Options options;
+	
 	const char* fileString = nullptr;
 
 	for( int i = 1; i < argc; ++i )
@@ -55,7 +85,7 @@ int main(int argc, char** argv)
 			}
 			else if( argv[i][1] == 'h' || argv[i][1] == '?' ) // -h -?
 			{
-				std::cout << h0 << h1 << h2 << h3 << h4 << h5 << h6 << h7 << h8;
+				std::cout << h0 << h1 << h2 << h3 << h4 << h5 << h6 << h7 << h8 << h9 << h10 << h11 << h12 << h13 << h14;
 				return 0;
 			}
 			else if( argv[i][1] == 't') // -t
@@ -64,14 +94,52 @@ int main(int argc, char** argv)
 			}
 			else if( argv[i][1] == '-' ) // --
 			{
-				if( strstr(argv[i], "version") != nullptr ) // --version
+				if( strncmp(argv[i], "--profile-allocations", 21) == 0 ) // --profile-allocations[=N]
+				{
+					const char* interval = strchr(argv[i], '=');
+					
+					options.allocationSampleInterval = interval ? unsigned(atoi(interval + 1)) : 4096;
+					
+					if( options.allocationSampleInterval == 0 )
+						options.allocationSampleInterval = 1;
+				}
+				else if( strncmp(argv[i], "--heap-limit=", 13) == 0 ) // --heap-limit=N[k|m|g]
+				{
+					char* suffix = nullptr;
+					
+					options.heapLimit = size_t(strtoull(argv[i] + 13, &suffix, 10));
+					
+					switch( *suffix )
+					{
+					case 'k': case 'K': options.heapLimit <<= 10; break;
+					case 'm': case 'M': options.heapLimit <<= 20; break;
+					case 'g': case 'G': options.heapLimit <<= 30; break;
+					}
+				}
+				else if( strcmp(argv[i], "--no-jit") == 0 ) // --no-jit
+				{
+					options.jit = false;
+				}
+				else if( strcmp(argv[i], "--emit-cpp") == 0 ) // --emit-cpp
+				{
+					emitCpp = true;
+				}
+				else if( strncmp(argv[i], "--record-profile=", 17) == 0 ) // --record-profile=FILE
+				{
+					options.recordProfile = argv[i] + 17;
+				}
+				else if( strncmp(argv[i], "--use-profile=", 14) == 0 ) // --use-profile=FILE
+				{
+					options.useProfile = argv[i] + 14;
+				}
+				else if( strstr(argv[i], "version") != nullptr ) // --version
 				{
 					std::cout << element::VirtualMachine().GetVersion() << '\n';
 					return 0;
 				}
 				else if( strstr(argv[i], "help") != nullptr ) // --help
 				{
-					std::cout << h0 << h1 << h2 << h3 << h4 << h5 << h6 << h7 << h8;
+					std::cout << h0 << h1 << h2 << h3 << h4 << h5 << h6 << h7 << h8 << h9 << h10 << h11 << h12 << h13 << h14;
 					return 0;
 				}
 				else if( strstr(argv[i], "test") != nullptr ) // --test
@@ -101,40 +169,91 @@ int main(int argc, char** argv)
 	{
 		if( printAst || printSymbols || printConstants )
 		{
-			DebugPrintFile(fileString, printAst, printSymbols, printConstants);
+			DebugPrintFile(fileString, printAst, printSymbols, printConstants, options);
 		
 			if( !runAfterPrinting )
 				return 0;
 		}
 		
+		if( emitCpp )
+			return EmitCpp(fileString);
+		
 		if( testMode )
-			return InterpretTests(fileString);
+			return InterpretTests(fileString, options);
 		
-		return InterpretFile(fileString);
+		return InterpretFile(fileString, options);
 	}
 	
-	return InterpretREPL();
+	return InterpretREPL(options);
+}
+
+void ConfigureVirtualMachine(element::VirtualMachine& virtualMachine, const Options& options)
+{
+	if( options.allocationSampleInterval > 0 )
+		virtualMachine.GetAllocationProfiler().Start(options.allocationSampleInterval);
+	
+	virtualMachine.SetHeapLimit(options.heapLimit);
+	virtualMachine.SetJitEnabled(options.jit);
+	
+	if( ! options.useProfile.empty() && ! virtualMachine.LoadProfile(options.useProfile) )
+		std::cerr << "Could not read the profile from " << options.useProfile << '\n';
+	
+	virtualMachine.RecordProfile(! options.recordProfile.empty());
+}
+
+void PrintReports(element::VirtualMachine& virtualMachine, const Options& options)
+{
+	if( options.allocationSampleInterval > 0 )
+		std::cerr << '\n' << virtualMachine.GetAllocationProfiler().GetReport();
+	
+	if( ! options.recordProfile.empty() && ! virtualMachine.SaveProfile(options.recordProfile) )
+		std::cerr << "Could not write the profile to " << options.recordProfile << '\n';
+}
+
+void InterruptOnSignal(int signal)
+{
+	// stop the script with a stack trace, a second signal terminates as usual
+	std::signal(signal, SIG_DFL);
+	
+	if( interruptibleMachine )
+		interruptibleMachine->RequestInterrupt();
 }
 
-int InterpretFile(const char* fileString)
+int InterpretFile(const char* fileString, const Options& options)
 {
 	element::VirtualMachine virtualMachine;
 	
+	ConfigureVirtualMachine(virtualMachine, options);
+	
+	interruptibleMachine = &virtualMachine;
+	std::signal(SIGINT, InterruptOnSignal);
+	
 	element::Value result = virtualMachine.Interpret(fileString);
 	
+	// there is nothing else to run, so a suspended script resumes right away
+	while( virtualMachine.IsSuspended() )
+		result = virtualMachine.Resume();
+	
+	std::signal(SIGINT, SIG_DFL);
+	interruptibleMachine = nullptr;
+	
 	std::cout << result.AsString();
 	
 	virtualMachine.GetMemoryManager().GarbageCollect();
 	
 	std::cout.flush();
 	
+	PrintReports(virtualMachine, options);
+	
 	return 0;
 }
 
-int InterpretREPL()
+int InterpretREPL(const Options& options)
 {
 	element::VirtualMachine virtualMachine;
 	
+	ConfigureVirtualMachine(virtualMachine, options);
+	
 	while( true )
 	{
 		char cstr[256];
@@ -149,6 +268,10 @@ int InterpretREPL()
 		ss << cstr;
 
 		element::Value result = virtualMachine.Interpret(ss);
+		
+		// there is nothing else to run, so a suspended script resumes right away
+		while( virtualMachine.IsSuspended() )
+			result = virtualMachine.Resume();
 
 		std::cout << result.AsString();
 
@@ -159,18 +282,23 @@ int InterpretREPL()
 	
 	std::cout.flush();
 	
+	PrintReports(virtualMachine, options);
+	
 	return 0;
 }
 
-int InterpretTests(const char* fileString)
+int InterpretTests(const char* fileString, const Options& options)
 {
 	element::VirtualMachine virtualMachine;
 	
+	ConfigureVirtualMachine(virtualMachine, options);
+	
 	std::ifstream file(fileString);
 	
 	std::string line;
 	std::string testCaseDescription;
 	std::stringstream testCaseSource;
+	std::string errorText; // the whole error it must give, if it is given
 	bool errorExpected = false;
 	
 	const auto doTestCase = [&]()
@@ -181,9 +309,13 @@ int InterpretTests(const char* fileString)
 			
 			element::Value result = virtualMachine.Interpret(testCaseSource);
 			
+			// there is nothing else to run, so a suspended script resumes right away
+			while( virtualMachine.IsSuspended() )
+				result = virtualMachine.Resume();
+			
 			if( result.IsError() )
 			{
-				if( errorExpected ) // the test passed
+				if( errorExpected && (errorText.empty() || result.AsString() == errorText) ) // the test passed
 					std::cout << ".";
 				else // the test failed, report it
 					std::cout << "\nFailed test case:" << testCaseDescription
@@ -220,9 +352,19 @@ int InterpretTests(const char* fileString)
 			}
 			
 			testCaseSource = std::stringstream();
+			errorText.clear();
 		}
 		else // add code to current test case
 		{
+			// a comment with ERROR_TEXT gives the next line of the error
+			auto pos = line.find("ERROR_TEXT");
+			if( pos != std::string::npos )
+			{
+				std::string text = line.substr(pos + 10);
+				text.erase(0, text.find_first_not_of(" \t"));
+				errorText += text + '\n';
+			}
+
 			testCaseSource << line << '\n';
 		}
 	}
@@ -231,10 +373,27 @@ int InterpretTests(const char* fileString)
 	
 	std::cout << std::endl; // flush
 	
+	PrintReports(virtualMachine, options);
+	
+	return 0;
+}
+
+int EmitCpp(const char* fileString)
+{
+	element::VirtualMachine virtualMachine;
+	
+	element::Value result = virtualMachine.EmitCpp(fileString, std::cout);
+	
+	if( result.IsError() )
+	{
+		std::cerr << result.AsString() << '\n';
+		return 1;
+	}
+	
 	return 0;
 }
 
-void DebugPrintFile(const char* fileString, bool ast, bool symbols, bool constants)
+void DebugPrintFile(const char* fileString, bool ast, bool symbols, bool constants, const Options& options)
 {
 	std::ifstream file(fileString);
 	
@@ -275,7 +434,16 @@ void DebugPrintFile(const char* fileString, bool ast, bool symbols, bool constan
 		return;
 	}
 	
+	element::Optimizer optimizer;
+	
+	optimizer.Optimize(node.get());
+	
 	element::Compiler compiler(logger);
+	element::ExecutionProfile profile;
+	
+	// to see what the profile changes
+	if( ! options.useProfile.empty() && profile.Load(options.useProfile) )
+		compiler.SetProfile(&profile);
 	
 	std::unique_ptr<char[]> bytecode = compiler.Compile(node.get());
 	
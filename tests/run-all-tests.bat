@@ -6,3 +6,14 @@ for %%f in (*.element) do (
 	echo tests from: %%f
 	%interpreter% --test %%f
 )
+
+rem each example runs as one test case, from its folder for the modules it imports,
+rem the interpreter is at the same place from there
+cd ..\examples
+
+for %%f in (*.element) do (
+	echo example: %%f
+	%interpreter% --test %%f
+)
+
+cd ..\tests
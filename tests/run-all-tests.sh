@@ -5,3 +5,13 @@ do
 	echo tests from: $file
 	$interpreter --test $file
 done
+
+# each example runs as one test case, from its folder for the modules it imports,
+# the interpreter is at the same place from there
+cd ../examples
+
+for file in $(ls *.element)
+do
+	echo example: $file
+	$interpreter --test $file
+done
@@ -0,0 +1,438 @@
+// Offline analyzer for heap snapshots written by 'heap_snapshot(path)'.
+// Builds the dominator tree of the object graph and reports the objects
+// that retain the most memory together with their dominator chains.
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+struct HeapObject
+{
+	std::string					type;
+	std::string					value;
+	unsigned long long			size = 0;
+	std::vector<unsigned>		edges;
+	std::vector<std::string>	roots;
+	bool						isStatic = false;
+};
+
+// A minimal reader for the subset of JSON that the snapshot writer produces.
+class SnapshotReader
+{
+public:
+	SnapshotReader(const std::string& text)
+	: mText(text)
+	, mPos(0)
+	{}
+
+	bool Read(std::vector<HeapObject>& objects, unsigned long long& heapBytes)
+	{
+		if( ! Expect('{') )
+			return false;
+
+		while( Peek() != '}' )
+		{
+			std::string key = ReadString();
+			if( ! Expect(':') )
+				return false;
+
+			if( key == "heap_bytes" )
+				heapBytes = ReadNumber();
+			else if( key == "objects" )
+			{
+				if( ! ReadObjects(objects) )
+					return false;
+			}
+			else
+				return Fail("unexpected key '" + key + "'");
+
+			if( Peek() == ',' )
+				++mPos;
+		}
+
+		return true;
+	}
+
+	const std::string& GetError() const { return mError; }
+
+private:
+	bool ReadObjects(std::vector<HeapObject>& objects)
+	{
+		if( ! Expect('[') )
+			return false;
+
+		while( Peek() != ']' )
+		{
+			HeapObject object;
+			unsigned id = 0;
+
+			if( ! Expect('{') )
+				return false;
+
+			while( Peek() != '}' )
+			{
+				std::string key = ReadString();
+				if( ! Expect(':') )
+					return false;
+
+				if( key == "id" )			id = unsigned(ReadNumber());
+				else if( key == "type" )	object.type = ReadString();
+				else if( key == "size" )	object.size = ReadNumber();
+				else if( key == "value" )	object.value = ReadString();
+				else if( key == "static" )	object.isStatic = ReadLiteral();
+				else if( key == "edges" )
+				{
+					if( ! Expect('[') )
+						return false;
+					while( Peek() != ']' )
+					{
+						object.edges.push_back(unsigned(ReadNumber()));
+						if( Peek() == ',' )
+							++mPos;
+					}
+					++mPos;
+				}
+				else if( key == "roots" )
+				{
+					if( ! Expect('[') )
+						return false;
+					while( Peek() != ']' )
+					{
+						object.roots.push_back(ReadString());
+						if( Peek() == ',' )
+							++mPos;
+					}
+					++mPos;
+				}
+				else
+					return Fail("unexpected key '" + key + "'");
+
+				if( Peek() == ',' )
+					++mPos;
+			}
+			++mPos;
+
+			if( id != objects.size() + 1 )
+				return Fail("object ids are not sequential");
+
+			objects.push_back(std::move(object));
+
+			if( Peek() == ',' )
+				++mPos;
+		}
+		++mPos;
+
+		return true;
+	}
+
+	char Peek()
+	{
+		while( mPos < mText.size() && isspace((unsigned char)mText[mPos]) )
+			++mPos;
+
+		return mPos < mText.size() ? mText[mPos] : '\0';
+	}
+
+	bool Expect(char c)
+	{
+		if( Peek() != c )
+			return Fail(std::string("expected '") + c + "'");
+
+		++mPos;
+		return true;
+	}
+
+	bool Fail(const std::string& error)
+	{
+		if( mError.empty() )
+			mError = error + " at offset " + std::to_string(mPos);
+
+		mPos = mText.size();
+		return false;
+	}
+
+	std::string ReadString()
+	{
+		std::string result;
+
+		if( ! Expect('"') )
+			return result;
+
+		while( mPos < mText.size() && mText[mPos] != '"' )
+		{
+			if( mText[mPos] == '\\' && mPos + 1 < mText.size() )
+				++mPos;
+
+			result += mText[mPos++];
+		}
+		++mPos;
+
+		return result;
+	}
+
+	unsigned long long ReadNumber()
+	{
+		Peek();
+
+		size_t start = mPos;
+		while( mPos < mText.size() && isdigit((unsigned char)mText[mPos]) )
+			++mPos;
+
+		if( start == mPos )
+		{
+			Fail("expected a number");
+			return 0;
+		}
+
+		return std::strtoull(mText.c_str() + start, nullptr, 10);
+	}
+
+	bool ReadLiteral()
+	{
+		Peek();
+
+		if( mText.compare(mPos, 4, "true") == 0 )
+		{
+			mPos += 4;
+			return true;
+		}
+
+		if( mText.compare(mPos, 5, "false") == 0 )
+		{
+			mPos += 5;
+			return false;
+		}
+
+		return Fail("expected true or false");
+	}
+
+private:
+	const std::string&	mText;
+	size_t				mPos;
+	std::string			mError;
+};
+
+
+// Dominators by the iterative algorithm of Cooper, Harvey and Kennedy.
+// Node 0 is a synthetic root that points to every object held by a root.
+std::vector<unsigned> CalculateDominators(const std::vector<std::vector<unsigned>>& successors,
+										  std::vector<unsigned>& reversePostorder)
+{
+	const unsigned count = unsigned(successors.size());
+	const unsigned Undefined = ~0u;
+
+	// reverse postorder with an explicit stack, the graph can be very deep
+	std::vector<unsigned> postorderIndex(count, Undefined);
+	std::vector<bool> visited(count, false);
+	std::vector<std::pair<unsigned, unsigned>> stack;
+
+	reversePostorder.clear();
+	stack.emplace_back(0, 0);
+	visited[0] = true;
+
+	while( ! stack.empty() )
+	{
+		unsigned node = stack.back().first;
+		unsigned& nextEdge = stack.back().second;
+
+		if( nextEdge < successors[node].size() )
+		{
+			unsigned successor = successors[node][nextEdge++];
+
+			if( ! visited[successor] )
+			{
+				visited[successor] = true;
+				stack.emplace_back(successor, 0);
+			}
+		}
+		else
+		{
+			postorderIndex[node] = unsigned(reversePostorder.size());
+			reversePostorder.push_back(node);
+			stack.pop_back();
+		}
+	}
+
+	std::reverse(reversePostorder.begin(), reversePostorder.end());
+
+	std::vector<std::vector<unsigned>> predecessors(count);
+	for( unsigned node = 0; node < count; ++node )
+		if( visited[node] )
+			for( unsigned successor : successors[node] )
+				predecessors[successor].push_back(node);
+
+	std::vector<unsigned> dominators(count, Undefined);
+	dominators[0] = 0;
+
+	auto intersect = [&](unsigned a, unsigned b)
+	{
+		while( a != b )
+		{
+			while( postorderIndex[a] < postorderIndex[b] )
+				a = dominators[a];
+			while( postorderIndex[b] < postorderIndex[a] )
+				b = dominators[b];
+		}
+		return a;
+	};
+
+	bool changed = true;
+	while( changed )
+	{
+		changed = false;
+
+		for( unsigned node : reversePostorder )
+		{
+			if( node == 0 )
+				continue;
+
+			unsigned newDominator = Undefined;
+
+			for( unsigned predecessor : predecessors[node] )
+			{
+				if( dominators[predecessor] == Undefined )
+					continue;
+
+				newDominator = newDominator == Undefined ?
+								predecessor :
+								intersect(predecessor, newDominator);
+			}
+
+			if( dominators[node] != newDominator )
+			{
+				dominators[node] = newDominator;
+				changed = true;
+			}
+		}
+	}
+
+	return dominators;
+}
+
+std::string Describe(const std::vector<HeapObject>& objects, unsigned node)
+{
+	if( node == 0 )
+		return "(roots)";
+
+	const HeapObject& object = objects[node - 1];
+
+	std::string description = object.type + "#" + std::to_string(node);
+
+	if( ! object.value.empty() )
+		description += " \"" + object.value + "\"";
+
+	return description;
+}
+
+} // namespace
+
+
+int main(int argc, char* argv[])
+{
+	if( argc < 2 )
+	{
+		std::cout << "usage: heap-analyzer <snapshot> [count]\n";
+		return 1;
+	}
+
+	unsigned reportCount = argc > 2 ? unsigned(std::atoi(argv[2])) : 20;
+
+	std::ifstream file(argv[1]);
+	if( ! file )
+	{
+		std::cerr << "cannot open " << argv[1] << "\n";
+		return 1;
+	}
+
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	std::string text = buffer.str();
+
+	std::vector<HeapObject> objects;
+	unsigned long long heapBytes = 0;
+
+	SnapshotReader reader(text);
+	if( ! reader.Read(objects, heapBytes) )
+	{
+		std::cerr << "malformed snapshot: " << reader.GetError() << "\n";
+		return 1;
+	}
+
+	const unsigned count = unsigned(objects.size() + 1);
+
+	std::vector<std::vector<unsigned>> successors(count);
+
+	for( unsigned i = 1; i < count; ++i )
+	{
+		const HeapObject& object = objects[i - 1];
+
+		for( const std::string& root : object.roots )
+			if( root.compare(0, 10, "coroutine ") != 0 ) // those are reached through their function
+			{
+				successors[0].push_back(i);
+				break;
+			}
+
+		for( unsigned edge : object.edges )
+			if( edge > 0 && edge < count )
+				successors[i].push_back(edge);
+	}
+
+	std::vector<unsigned> reversePostorder;
+	std::vector<unsigned> dominators = CalculateDominators(successors, reversePostorder);
+
+	// retained size is the size of the whole dominator subtree
+	std::vector<unsigned long long> retained(count, 0);
+	for( unsigned i = 1; i < count; ++i )
+		retained[i] = objects[i - 1].size;
+
+	for( auto it = reversePostorder.rbegin(); it != reversePostorder.rend(); ++it )
+		if( *it != 0 )
+			retained[dominators[*it]] += retained[*it];
+
+	unsigned long long reachableBytes = retained[0];
+
+	std::vector<unsigned> order;
+	for( unsigned node : reversePostorder )
+		if( node != 0 )
+			order.push_back(node);
+
+	std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b)
+	{
+		return retained[a] > retained[b];
+	});
+
+	std::cout << "objects:         " << objects.size() << "\n";
+	std::cout << "heap bytes:      " << heapBytes << "\n";
+	std::cout << "reachable bytes: " << reachableBytes << "\n\n";
+
+	std::cout << "largest retained subgraphs:\n";
+
+	for( unsigned i = 0; i < order.size() && i < reportCount; ++i )
+	{
+		unsigned node = order[i];
+		const HeapObject& object = objects[node - 1];
+
+		std::cout << "  " << retained[node] << " bytes retained by "
+				  << Describe(objects, node) << " (self " << object.size << ")\n";
+
+		std::string chain;
+		for( unsigned d = dominators[node]; d != 0; d = dominators[d] )
+			chain = " -> " + Describe(objects, d) + chain;
+
+		for( const std::string& root : object.roots )
+			std::cout << "      root: " << root << "\n";
+
+		if( ! chain.empty() )
+			std::cout << "      dominated by: (roots)" << chain << "\n";
+	}
+
+	return 0;
+}